@@ -0,0 +1,107 @@
+#include "arena.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// 每个线程的空闲块，线程退出时释放
+struct ArenaFreeList {
+    ArenaFreeList() : head(nullptr), count(0) {}
+    ~ArenaFreeList() {
+        while (head != nullptr) {
+            ArenaBlock* next = head->next;
+            free(head);
+            head = next;
+        }
+    }
+
+    ArenaBlock* head;
+    int count;
+};
+
+static thread_local ArenaFreeList free_blocks;
+
+static char* block_data(ArenaBlock* block) {
+    return reinterpret_cast<char*>(block) + sizeof(ArenaBlock);
+}
+
+Arena::Arena() : ptr_(inline_), end_(inline_ + ARENA_INLINE_SIZE), blocks_(nullptr),
+                 last_(nullptr), block_count_(0), large_(nullptr) {}
+
+Arena::~Arena() {
+    reset();
+}
+
+StringRef Arena::copy(const char* data, size_t length) {
+    char* p = static_cast<char*>(allocate(length + 1, 1));
+    memcpy(p, data, length);
+    p[length] = '\0';
+    return StringRef(p, length);
+}
+
+void Arena::reset() {
+    if (blocks_ != nullptr) {
+        // 块可能在别的线程上分配，归还到当前线程
+        ArenaFreeList& list = free_blocks;
+        if (list.count + block_count_ <= ARENA_FREE_BLOCKS) {
+            last_->next = list.head;
+            list.head = blocks_;
+            list.count += block_count_;
+        }
+        else {
+            while (blocks_ != nullptr) {
+                ArenaBlock* next = blocks_->next;
+                free(blocks_);
+                blocks_ = next;
+            }
+        }
+        blocks_ = nullptr;
+        last_ = nullptr;
+        block_count_ = 0;
+    }
+    while (large_ != nullptr) {
+        ArenaBlock* next = large_->next;
+        free(large_);
+        large_ = next;
+    }
+    ptr_ = inline_;
+    end_ = inline_ + ARENA_INLINE_SIZE;
+}
+
+void* Arena::allocate_slow(size_t size, size_t align) {
+    size_t payload = ARENA_BLOCK_SIZE - sizeof(ArenaBlock);
+    if (size + align > payload / 2) {
+        // 大块单独分配，不占用当前块的剩余空间
+        ArenaBlock* block = static_cast<ArenaBlock*>(malloc(sizeof(ArenaBlock) + size + align));
+        if (block == nullptr) {
+            throw std::bad_alloc();
+        }
+        block->size = size + align;
+        block->next = large_;
+        large_ = block;
+        uintptr_t p = reinterpret_cast<uintptr_t>(block_data(block));
+        return reinterpret_cast<void*>((p + align - 1) & ~(uintptr_t) (align - 1));
+    }
+    ArenaFreeList& list = free_blocks;
+    ArenaBlock* block = list.head;
+    if (block != nullptr) {
+        list.head = block->next;
+        --list.count;
+    }
+    else {
+        block = static_cast<ArenaBlock*>(malloc(ARENA_BLOCK_SIZE));
+        if (block == nullptr) {
+            throw std::bad_alloc();
+        }
+        block->size = payload;
+    }
+    block->next = blocks_;
+    if (blocks_ == nullptr) {
+        last_ = block;
+    }
+    blocks_ = block;
+    ++block_count_;
+    ptr_ = block_data(block);
+    end_ = ptr_ + payload;
+    return allocate(size, align);
+}
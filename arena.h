@@ -0,0 +1,99 @@
+#ifndef HTTP_SERVER_ARENA_H
+#define HTTP_SERVER_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// 连接内嵌的首块大小，典型请求的请求头表和响应元数据都能放下
+#define ARENA_INLINE_SIZE 1024
+// 首块用完后从空闲表取的块大小
+#define ARENA_BLOCK_SIZE 4096
+// 每个线程空闲表最多保留的块数，超出的直接释放
+#define ARENA_FREE_BLOCKS 64
+
+// 请求期间有效的字符串片段，指向读缓冲或arena，不拥有内存
+struct StringRef {
+    StringRef() : data(""), length(0) {}
+    StringRef(const char* _data, size_t _length) : data(_data), length(_length) {}
+
+    bool empty() const { return length == 0; }
+    std::string str() const { return std::string(data, length); }
+
+    const char* data;
+    size_t length;
+};
+
+struct ArenaBlock {
+    ArenaBlock* next;
+    size_t size;
+};
+
+// 请求级的线性分配器：指针递增分配，不单独释放；请求结束时reset()整体归还。
+// 首块内嵌在对象里，超出后的块挂成一条链，reset时整条接到当前线程的空闲表，
+// 与块数无关；超过块大小的分配单独向堆申请，reset时释放
+class Arena {
+public:
+    Arena();
+    ~Arena();
+
+    void* allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+        uintptr_t p = (reinterpret_cast<uintptr_t>(ptr_) + align - 1) & ~(uintptr_t) (align - 1);
+        if (p + size <= reinterpret_cast<uintptr_t>(end_)) {
+            ptr_ = reinterpret_cast<char*>(p + size);
+            return reinterpret_cast<void*>(p);
+        }
+        return allocate_slow(size, align);
+    }
+    template <typename T>
+    T* allocate_array(size_t n) {
+        return static_cast<T*>(allocate(n * sizeof(T), alignof(T)));
+    }
+    // 拷贝一份并以'\0'结尾
+    StringRef copy(const char* data, size_t length);
+    void reset();
+
+private:
+    void* allocate_slow(size_t size, size_t align);
+
+    char* ptr_;
+    char* end_;
+    ArenaBlock* blocks_;   // 最新的块在前
+    ArenaBlock* last_;     // 链上最早的块，reset时接到空闲表头
+    int block_count_;
+    ArenaBlock* large_;
+    alignas(std::max_align_t) char inline_[ARENA_INLINE_SIZE];
+
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+};
+
+// 供标准库容器和allocate_shared使用，deallocate为空操作
+template <typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(Arena* arena) : arena_(arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.arena()) {}
+
+    T* allocate(size_t n) { return arena_->allocate_array<T>(n); }
+    void deallocate(T*, size_t) {}
+    Arena* arena() const { return arena_; }
+
+private:
+    Arena* arena_;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena() == b.arena();
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena() != b.arena();
+}
+
+#endif
@@ -0,0 +1,131 @@
+#include "asset_pack.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+static std::shared_ptr<AssetPack> g_current_pack;
+
+std::shared_ptr<AssetPack> current_asset_pack() {
+    return std::atomic_load(&g_current_pack);
+}
+
+void set_current_asset_pack(const std::shared_ptr<AssetPack>& pack) {
+    std::atomic_store(&g_current_pack, pack);
+}
+
+AssetPack::~AssetPack() {
+    if (base_ != nullptr) {
+        munmap((void*) base_, size_);
+    }
+    if (fd_ != -1) {
+        ::close(fd_);
+    }
+}
+
+std::shared_ptr<AssetPack> AssetPack::open(const char* path, std::string* error) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        *error = std::string("open ") + path + ": " + strerror(errno);
+        return std::shared_ptr<AssetPack>();
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(PackHeader)) {
+        *error = "pack file too small";
+        ::close(fd);
+        return std::shared_ptr<AssetPack>();
+    }
+    void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        *error = std::string("mmap: ") + strerror(errno);
+        ::close(fd);
+        return std::shared_ptr<AssetPack>();
+    }
+    std::shared_ptr<AssetPack> pack(new AssetPack());
+    pack->path_ = path;
+    pack->fd_ = fd;
+    pack->base_ = (const char*) base;
+    pack->size_ = st.st_size;
+    pack->header_ = (const PackHeader*) base;
+    if (!pack->validate(error)) {
+        return std::shared_ptr<AssetPack>();
+    }
+    const PackHeader* h = pack->header_;
+    pack->entries_ = (const PackEntry*) (pack->base_ + h->entries_offset);
+    pack->slots_ = (const uint32_t*) (pack->base_ + h->slots_offset);
+    pack->displacements_ = (const uint32_t*) (pack->base_ + h->displacements_offset);
+    pack->strings_ = pack->base_ + h->strings_offset;
+    // 索引区常驻，文件内容按需缺页
+    madvise((void*) base, h->strings_offset, MADV_WILLNEED);
+    return pack;
+}
+
+static bool in_bounds(uint64_t offset, uint64_t length, uint64_t size) {
+    return offset <= size && length <= size - offset;
+}
+
+bool AssetPack::validate(std::string* error) const {
+    const PackHeader* h = header_;
+    if (memcmp(h->magic, PACK_MAGIC, 8) != 0 || h->version != PACK_VERSION) {
+        *error = "bad pack magic or version";
+        return false;
+    }
+    if (h->file_size != size_ ||
+        !in_bounds(h->entries_offset, (uint64_t) h->entry_count * sizeof(PackEntry), size_) ||
+        !in_bounds(h->slots_offset, (uint64_t) h->slot_count * 4, size_) ||
+        !in_bounds(h->displacements_offset, (uint64_t) h->bucket_count * 4, size_) ||
+        h->strings_offset > size_ || h->entries_offset % 8 != 0 || h->slots_offset % 4 != 0 ||
+        h->displacements_offset % 4 != 0 ||
+        (h->entry_count > 0 && (h->slot_count == 0 || h->bucket_count == 0))) {
+        *error = "pack header out of bounds";
+        return false;
+    }
+    // 逐条检查，保证运行时查找不需要再做边界判断
+    const PackEntry* entries = (const PackEntry*) (base_ + h->entries_offset);
+    uint64_t strings_size = size_ - h->strings_offset;
+    for (uint32_t i = 0; i < h->entry_count; ++i) {
+        const PackEntry& e = entries[i];
+        const PackVariant* variants[2] = {&e.identity, &e.gzip};
+        if (!in_bounds(e.path_offset, e.path_length, strings_size)) {
+            *error = "pack entry path out of bounds";
+            return false;
+        }
+        for (int v = 0; v < 2; ++v) {
+            if (!in_bounds(variants[v]->body_offset, variants[v]->body_length, size_) ||
+                !in_bounds(variants[v]->header_offset, variants[v]->header_length,
+                           strings_size)) {
+                *error = "pack entry body out of bounds";
+                return false;
+            }
+        }
+    }
+    const uint32_t* slots = (const uint32_t*) (base_ + h->slots_offset);
+    for (uint32_t i = 0; i < h->slot_count; ++i) {
+        if (slots[i] != PACK_EMPTY_SLOT && slots[i] >= h->entry_count) {
+            *error = "pack slot out of bounds";
+            return false;
+        }
+    }
+    return true;
+}
+
+const PackEntry* AssetPack::lookup(const char* path, size_t len) const {
+    if (header_->entry_count == 0) {
+        return nullptr;
+    }
+    uint32_t bucket = (uint32_t) (pack_hash(path, len, 0) % header_->bucket_count);
+    uint32_t slot = (uint32_t) (pack_hash(path, len, displacements_[bucket]) %
+                                header_->slot_count);
+    uint32_t index = slots_[slot];
+    if (index == PACK_EMPTY_SLOT) {
+        return nullptr;
+    }
+    const PackEntry* e = entries_ + index;
+    if (e->path_length != len || memcmp(strings_ + e->path_offset, path, len) != 0) {
+        return nullptr;
+    }
+    return e;
+}
@@ -0,0 +1,99 @@
+#ifndef HTTP_SERVER_ASSET_PACK_H
+#define HTTP_SERVER_ASSET_PACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// 静态资源包格式(小端)：
+//   PackHeader | PackEntry[entry_count] | uint32 slots[slot_count]
+//   | uint32 displacements[bucket_count] | 字符串区(路径与预生成的响应头) | 按页对齐的文件内容
+// 路径索引是hash-and-displace构造的完美哈希：
+//   bucket = pack_hash(path, 0) % bucket_count
+//   slot   = pack_hash(path, displacements[bucket]) % slot_count
+// slots[slot]为条目下标(空槽为PACK_EMPTY_SLOT)，命中后还要比较路径以排除不在包内的路径。
+#define PACK_MAGIC "HSPACK01"
+#define PACK_VERSION 1
+#define PACK_PAGE_SIZE 4096
+#define PACK_EMPTY_SLOT 0xffffffffu
+
+struct PackHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t slot_count;
+    uint32_t bucket_count;
+    uint64_t entries_offset;
+    uint64_t slots_offset;
+    uint64_t displacements_offset;
+    uint64_t strings_offset;
+    uint64_t file_size;
+};
+
+// 一个文件的一种编码
+struct PackVariant {
+    uint64_t body_offset;  // 按页对齐
+    uint64_t body_length;
+    uint32_t header_offset;// 相对字符串区，预生成的Content-Length/Content-Type/ETag等响应头
+    uint32_t header_length;
+};
+
+struct PackEntry {
+    uint32_t path_offset;  // 相对字符串区
+    uint32_t path_length;
+    PackVariant identity;
+    PackVariant gzip;      // body_length为0表示没有预压缩版本
+};
+
+// FNV-1a，seed参与初始状态，用于构造和查找完美哈希
+inline uint64_t pack_hash(const char* data, size_t len, uint32_t seed) {
+    uint64_t h = 0xcbf29ce484222325ull ^ ((uint64_t) seed * 0x9e3779b97f4a7c15ull);
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char) data[i];
+        h *= 0x100000001b3ull;
+    }
+    // 末尾再混合一次，改善低位分布
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 32;
+    return h;
+}
+
+// 只读映射的资源包，通过shared_ptr共享，热替换后旧包在最后一个使用者释放时解除映射
+class AssetPack {
+public:
+    ~AssetPack();
+
+    // 打开并校验资源包，失败返回空指针并在error中给出原因
+    static std::shared_ptr<AssetPack> open(const char* path, std::string* error);
+
+    const PackEntry* lookup(const char* path, size_t len) const;
+    const char* body(const PackVariant& v) const { return base_ + v.body_offset; }
+    const char* headers(const PackVariant& v) const { return strings_ + v.header_offset; }
+    uint32_t entry_count() const { return header_->entry_count; }
+    const std::string& path() const { return path_; }
+    // 映射保留的fd，供IO线程对冷数据做预读
+    int fd() const { return fd_; }
+
+private:
+    AssetPack() : fd_(-1), base_(nullptr), size_(0), header_(nullptr), entries_(nullptr),
+                  slots_(nullptr), displacements_(nullptr), strings_(nullptr) {}
+    bool validate(std::string* error) const;
+
+    std::string path_;
+    int fd_;
+    const char* base_;
+    size_t size_;
+    const PackHeader* header_;
+    const PackEntry* entries_;
+    const uint32_t* slots_;
+    const uint32_t* displacements_;
+    const char* strings_;
+};
+
+// 当前生效的资源包，SIGHUP时原子替换
+std::shared_ptr<AssetPack> current_asset_pack();
+void set_current_asset_pack(const std::shared_ptr<AssetPack>& pack);
+
+#endif
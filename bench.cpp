@@ -0,0 +1,856 @@
+// 组件级微基准：解析器、定时器链表、线程池、响应拼装，经过内存回环的完整请求，以及上传的接收。
+// 每个用例先预热并自动标定迭代次数，再重复测量若干轮，输出ns/op与allocs/op，
+// 可选JSON格式输出，便于跨提交对比。
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "busy_poll.h"
+#include "coroutine.h"
+#include "http_connection.h"
+#include "thread_pool.h"
+#include "timer.h"
+#include "trace.h"
+#include "transport.h"
+#include "upload.h"
+
+// 统计全局堆分配次数
+static std::atomic<uint64_t> g_alloc_count(0);
+
+void* operator new(size_t size) {
+    g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) {
+    g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+// 防止编译器把结果优化掉
+template <typename T>
+static inline void do_not_optimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+typedef void (*BenchFn)(uint64_t iterations);
+
+struct BenchCase {
+    const char* name;
+    BenchFn fn;
+};
+
+struct BenchResult {
+    std::string name;
+    uint64_t iterations;
+    std::vector<double> ns_per_op;
+    double allocs_per_op;
+};
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// 在临时目录中放一个index.html作为文档根目录，只建立一次
+static bool open_bench_root() {
+    static bool rooted = false;
+    if (!rooted) {
+        char dir[] = "/tmp/bench_root_XXXXXX";
+        if (mkdtemp(dir) == nullptr) {
+            return false;
+        }
+        std::string path = std::string(dir) + "/index.html";
+        FILE* f = fopen(path.c_str(), "w");
+        if (f == nullptr) {
+            return false;
+        }
+        fputs("<html>bench</html>\n", f);
+        fclose(f);
+        HTTPConnection::open_root(dir);
+        rooted = true;
+    }
+    return true;
+}
+
+// 可以访问HTTPConnection私有成员的基准用例集合
+class HTTPConnectionBench {
+public:
+    static const char* request() {
+        return "GET /index.html HTTP/1.1\r\n"
+               "Host: 127.0.0.1:8080\r\n"
+               "User-Agent: bench/1.0\r\n"
+               "Accept: */*\r\n"
+               "Connection: keep-alive\r\n"
+               "\r\n";
+    }
+
+    static HTTPConnection& connection() {
+        static HTTPConnection* conn = nullptr;
+        if (conn == nullptr) {
+            conn = new HTTPConnection();
+            conn->init();
+        }
+        return *conn;
+    }
+
+    // 逐行切分整个请求报文
+    static void parse_line(uint64_t iterations) {
+        HTTPConnection& c = connection();
+        const char* req = request();
+        int len = (int) strlen(req);
+        for (uint64_t i = 0; i < iterations; ++i) {
+            memcpy(c.read_buffer, req, len);
+            c.read_index = len;
+            c.check_index = 0;
+            int lines = 0;
+            while (c.parse_line() == HTTPConnection::LINE_OK) {
+                ++lines;
+            }
+            do_not_optimize(lines);
+        }
+    }
+
+    // 请求行在读缓冲中原地切分，每次操作先恢复原始内容
+    static void parse_request(uint64_t iterations) {
+        static const char line[] = "GET /static/%7Euser/./css/../index.html?v=3 HTTP/1.1";
+        HTTPConnection& c = connection();
+        for (uint64_t i = 0; i < iterations; ++i) {
+            memcpy(c.read_buffer, line, sizeof(line));
+            HTTPConnection::HttpCode ret = c.parse_request(c.read_buffer);
+            do_not_optimize(ret);
+        }
+    }
+
+    // 每次操作解析一组典型请求头(含结束空行)
+    static void parse_header(uint64_t iterations) {
+        static const char* headers[] = {"Host: 127.0.0.1:8080", "User-Agent: bench/1.0",
+                                        "Accept: */*", "Connection: keep-alive", ""};
+        HTTPConnection& c = connection();
+        for (uint64_t i = 0; i < iterations; ++i) {
+            for (size_t h = 0; h < sizeof(headers) / sizeof(headers[0]); ++h) {
+                HTTPConnection::HttpCode ret = c.parse_header(headers[h]);
+                do_not_optimize(ret);
+            }
+            // 请求头表在arena中，每组之后像请求结束一样释放
+            c.next_request(false);
+            c.release_arena();
+        }
+    }
+
+    // 完整的一个请求：解析、打开文件、排入响应、发完后回到等待下一个请求，
+    // allocs/op即每个请求的堆分配次数
+    static void full_request(uint64_t iterations) {
+        if (!open_bench_root()) {
+            return;
+        }
+        HTTPConnection& c = connection();
+        const char* req = request();
+        int len = (int) strlen(req);
+        for (uint64_t i = 0; i < iterations; ++i) {
+            memcpy(c.read_buffer, req, len);
+            c.read_index = len;
+            HTTPConnection::HttpCode ret = c.parse_process();
+            c.response_process(ret);
+            // 相当于队列在write()中发完
+            c.output_.consume(c.output_.bytes());
+            c.write_index = 0;
+            c.next_request(true);
+            c.release_arena();
+            do_not_optimize(ret);
+        }
+    }
+
+    // 状态行加全部响应头
+    static void add_response(uint64_t iterations) {
+        HTTPConnection& c = connection();
+        for (uint64_t i = 0; i < iterations; ++i) {
+            c.write_index = 0;
+            c.add_status(200, "OK");
+            c.add_headers(1024);
+            do_not_optimize(c.write_index);
+        }
+    }
+};
+
+static void timer_noop(ConnHandle) {}
+
+// 每次操作：向已有1024个定时器的链表插入一个新定时器并删除
+static void timer_add_del(uint64_t iterations) {
+    static SortTimerList* list = nullptr;
+    static time_t base = time(nullptr);
+    if (list == nullptr) {
+        list = new SortTimerList();
+        for (int i = 0; i < 1024; ++i) {
+            UtilTimer* t = new UtilTimer();
+            t->expire_ = base + i;
+            t->callback = timer_noop;
+            list->add_timer(t);
+        }
+    }
+    for (uint64_t i = 0; i < iterations; ++i) {
+        UtilTimer* t = new UtilTimer();
+        t->expire_ = base + (time_t) (i % 1024);
+        t->callback = timer_noop;
+        list->add_timer(t);
+        list->del_timer(t);
+    }
+}
+
+// 每次操作：把链表头部的定时器延后到尾部，模拟活跃连接刷新超时时间
+static void timer_adjust(uint64_t iterations) {
+    static SortTimerList* list = nullptr;
+    static std::vector<UtilTimer*> timers;
+    static time_t next = 0;
+    if (list == nullptr) {
+        list = new SortTimerList();
+        for (int i = 0; i < 1024; ++i) {
+            UtilTimer* t = new UtilTimer();
+            t->expire_ = next++;
+            t->callback = timer_noop;
+            list->add_timer(t);
+            timers.push_back(t);
+        }
+    }
+    for (uint64_t i = 0; i < iterations; ++i) {
+        UtilTimer* t = timers[i % timers.size()];
+        t->expire_ = next++;
+        list->adjust_timer(t);
+    }
+}
+
+struct BenchTask {
+    std::atomic<uint64_t>* done;
+    void process(uint64_t) { done->fetch_add(1, std::memory_order_release); }
+    bool shed(uint64_t) { return false; }
+};
+
+// 每次操作：投递一个空任务并等待全部执行完成，测量排队与唤醒开销
+static void thread_pool_append(uint64_t iterations) {
+    static ThreadPool<BenchTask>* pool = nullptr;
+    static std::atomic<uint64_t> done(0);
+    static std::vector<BenchTask> tasks(1024);
+    if (pool == nullptr) {
+        // 线程池的工作线程是分离的，基准进程结束前一直保留
+        pool = new ThreadPool<BenchTask>(4, 1024);
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            tasks[i].done = &done;
+        }
+    }
+    uint64_t start = done.load();
+    uint64_t submitted = 0;
+    while (submitted < iterations) {
+        if (pool->append(&tasks[submitted % tasks.size()])) {
+            ++submitted;
+        }
+    }
+    while (done.load(std::memory_order_acquire) - start < iterations) {
+        sched_yield();
+    }
+}
+
+// 每次操作：开启追踪时记录一个阶段(时间戳加写入本线程的环)
+static void trace_record_stage(uint64_t iterations) {
+    if (!trace_enabled) {
+        trace_enable();
+    }
+    for (uint64_t i = 0; i < iterations; ++i) {
+        trace_stage(TRACE_PARSED, i, (uint32_t) i);
+    }
+}
+
+static Task<int> coro_child(int value) {
+    co_return value + 1;
+}
+
+static Task<void> coro_chain(uint64_t iterations, uint64_t* sum) {
+    for (uint64_t i = 0; i < iterations; ++i) {
+        *sum += co_await coro_child((int) i);
+    }
+}
+
+// 每次操作：创建、等待并销毁一个子协程，帧来自线程缓存
+static void coro_task(uint64_t iterations) {
+    uint64_t sum = 0;
+    coro_chain(iterations, &sum).detach();
+    do_not_optimize(sum);
+}
+
+// 同时在途的慢处理数和每个处理的等待时间
+#define SLOW_HANDLERS 4096
+#define SLOW_HANDLER_MS 2
+
+struct SlowHandlers {
+    Reactor* reactor;
+    OffloadPool* offload;
+    int fd;
+    uint64_t remaining;
+    uint64_t done;
+};
+
+// 模拟慢处理：等一个定时器，再到阻塞线程上读一段文件，结束时启动下一个
+static Task<void> slow_handler(SlowHandlers* s) {
+    char buf[512];
+    co_await s->reactor->sleep_for(SLOW_HANDLER_MS);
+    ssize_t n = co_await read_file(s->offload, s->fd, buf, sizeof(buf), 0);
+    do_not_optimize(n);
+    ++s->done;
+    if (s->remaining > 0) {
+        --s->remaining;
+        slow_handler(s).detach();
+    }
+}
+
+// 每次操作：一个慢处理。SLOW_HANDLERS个同时在途，只有基准线程一个reactor
+// 和两个阻塞线程；ns/op远小于SLOW_HANDLER_MS说明等待期间不占用线程
+static void coro_slow_handlers(uint64_t iterations) {
+    static Reactor* reactor = nullptr;
+    static OffloadPool* offload = nullptr;
+    static int fd = -1;
+    if (reactor == nullptr) {
+        reactor = new Reactor();
+        offload = new OffloadPool(2, SLOW_HANDLERS);
+        fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+    }
+    SlowHandlers s{reactor, offload, fd, 0, 0};
+    uint64_t start = std::min<uint64_t>(iterations, SLOW_HANDLERS);
+    s.remaining = iterations - start;
+    for (uint64_t i = 0; i < start; ++i) {
+        slow_handler(&s).detach();
+    }
+    while (s.done < iterations) {
+        reactor->poll(-1);
+    }
+}
+
+// 回环乒乓中回显端的忙轮询预算
+#define PINGPONG_BUSY_US 50
+
+struct EchoLoop {
+    int fd;
+    int epoll_fd;
+    uint32_t budget_us;
+};
+
+// 回显端：事件循环等待方式与服务器主线程相同，对端关闭时退出
+static void* echo_loop(void* arg) {
+    EchoLoop* e = (EchoLoop*) arg;
+    BusyPoller poller(e->epoll_fd, e->budget_us);
+    epoll_event events[4];
+    char buf[64];
+    for (;;) {
+        int count = poller.wait(events, 4, -1);
+        for (int i = 0; i < count; ++i) {
+            ssize_t n = read(e->fd, buf, sizeof(buf));
+            if (n == 0 || (n < 0 && errno != EAGAIN)) {
+                return nullptr;
+            }
+            if (n > 0 && write(e->fd, buf, n) != n) {
+                return nullptr;
+            }
+        }
+    }
+}
+
+// 一条回环TCP连接：*client阻塞，返回非阻塞的服务端fd
+static int tcp_loopback(int* client) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(addr);
+    if (bind(listen_fd, (sockaddr*) &addr, sizeof(addr)) == -1 || listen(listen_fd, 1) == -1 ||
+        getsockname(listen_fd, (sockaddr*) &addr, &length) == -1) {
+        abort();
+    }
+    *client = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(*client, (sockaddr*) &addr, sizeof(addr)) == -1) {
+        abort();
+    }
+    int server = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+    close(listen_fd);
+    return server;
+}
+
+// 建立一条回环TCP连接，另一端交给回显线程，返回阻塞的客户端fd
+static int pingpong_connect(uint32_t budget_us) {
+    int fd;
+    EchoLoop* e = new EchoLoop{tcp_loopback(&fd), epoll_create1(0), budget_us};
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(e->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (budget_us > 0) {
+        BusyPoller::tune_socket(e->fd, budget_us);
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, e->fd, &event);
+    // 回显线程保留到进程结束
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, echo_loop, e) != 0) {
+        abort();
+    }
+    pthread_detach(thread);
+    return fd;
+}
+
+static void pingpong(int fd, uint64_t iterations) {
+    char c = 'x';
+    for (uint64_t i = 0; i < iterations; ++i) {
+        if (write(fd, &c, 1) != 1 || read(fd, &c, 1) != 1) {
+            abort();
+        }
+    }
+}
+
+// 每次操作：一个字节的往返，回显端阻塞在epoll_wait中
+static void loop_pingpong(uint64_t iterations) {
+    static int fd = pingpong_connect(0);
+    pingpong(fd, iterations);
+}
+
+// 同上，回显端先自旋PINGPONG_BUSY_US再睡；需要空闲的CPU核，单核上自旋只会和对端抢CPU
+static void loop_pingpong_busy(uint64_t iterations) {
+    static int fd = pingpong_connect(PINGPONG_BUSY_US);
+    pingpong(fd, iterations);
+}
+
+// 回环连接的fd只是标识
+#define LOOPBACK_FD 1000000
+// 流水线用例每批发送的请求数
+#define LOOPBACK_PIPELINE 16
+// 限流用例中令牌桶的容量，小于LOOPBACK_PIPELINE
+#define LOOPBACK_BURST 4
+
+// 内存回环上的一条连接：请求经过真实的read()、process()、write()，
+// 事件按回环记录的注册依次处理，结果与调度无关
+struct LoopbackConn {
+    LoopbackTransport transport;
+    HTTPConnection conn;
+    ConnHandle handle;
+    // 一个完整响应的字节数，用来校验每轮发出的响应数
+    size_t response_bytes;
+};
+
+// 单线程版的主线程加工作线程：取出注册的事件推进连接，直到等待新的输入；
+// 连接要求关闭时返回false
+static bool loopback_drive(LoopbackConn* lc) {
+    for (;;) {
+        uint32_t events = lc->transport.take_armed();
+        if (events & EPOLLOUT) {
+            if (!lc->conn.write()) {
+                return false;
+            }
+            if (lc->conn.pipelined()) {
+                // 发完后没有重新注册，流水线上的请求直接处理
+                lc->conn.process(lc->handle);
+            }
+            continue;
+        }
+        if ((events & EPOLLIN) && lc->transport.input_left() > 0) {
+            if (!lc->conn.read()) {
+                abort();
+            }
+            lc->conn.process(lc->handle);
+            continue;
+        }
+        // 读事件还没等到数据，留给下一次喂入
+        lc->transport.arm(LOOPBACK_FD, lc->handle, events);
+        return true;
+    }
+}
+
+static void loopback_pump(LoopbackConn* lc) {
+    if (!loopback_drive(lc)) {
+        abort();
+    }
+}
+
+// 建立回环连接，先完整捕获一个响应做校验，之后只计数
+static LoopbackConn* loopback_connect() {
+    if (!open_bench_root()) {
+        abort();
+    }
+    LoopbackConn* lc = new LoopbackConn();
+    lc->handle = ((ConnHandle) 1 << 32) | 1;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    lc->conn.init(LOOPBACK_FD, (sockaddr*) &addr, sizeof(addr), lc->handle, &lc->transport);
+    const char* req = HTTPConnectionBench::request();
+    lc->transport.feed(req, strlen(req));
+    loopback_pump(lc);
+    const std::string& out = lc->transport.output();
+    if (out.compare(0, 15, "HTTP/1.1 200 OK") != 0) {
+        fprintf(stderr, "unexpected loopback response:\n%s\n", out.c_str());
+        abort();
+    }
+    lc->response_bytes = out.size();
+    lc->transport.set_capture(false);
+    return lc;
+}
+
+// 本轮发出的字节数必须正好是requests个完整响应
+static void loopback_check(LoopbackConn* lc, uint64_t sent_before, uint64_t requests) {
+    if (lc->transport.sent_bytes() - sent_before != requests * lc->response_bytes) {
+        fprintf(stderr, "loopback: expected %llu responses\n", (unsigned long long) requests);
+        abort();
+    }
+}
+
+// 每次操作：一个keep-alive请求从读取、解析、打开文件到响应写出
+static void loopback_request(uint64_t iterations) {
+    static LoopbackConn* lc = loopback_connect();
+    const char* req = HTTPConnectionBench::request();
+    size_t len = strlen(req);
+    uint64_t sent = lc->transport.sent_bytes();
+    for (uint64_t i = 0; i < iterations; ++i) {
+        lc->transport.feed(req, len);
+        loopback_pump(lc);
+    }
+    loopback_check(lc, sent, iterations);
+}
+
+// 同上，LOOPBACK_PIPELINE个请求一次到达，响应合并写出；按请求计
+static void loopback_pipelined(uint64_t iterations) {
+    static LoopbackConn* lc = loopback_connect();
+    static std::string batch;
+    if (batch.empty()) {
+        for (int i = 0; i < LOOPBACK_PIPELINE; ++i) {
+            batch += HTTPConnectionBench::request();
+        }
+    }
+    uint64_t sent = lc->transport.sent_bytes();
+    for (uint64_t i = 0; i < iterations; i += LOOPBACK_PIPELINE) {
+        uint64_t n = std::min<uint64_t>(LOOPBACK_PIPELINE, iterations - i);
+        lc->transport.feed(batch.data(), n * (batch.size() / LOOPBACK_PIPELINE));
+        loopback_pump(lc);
+    }
+    loopback_check(lc, sent, iterations);
+}
+
+// 同上，请求分成三片先后到达(请求行中间、请求头中间)，每片之后推进一次；
+// 响应每次最多写出64字节，覆盖短写后的继续发送
+static void loopback_fragmented(uint64_t iterations) {
+    static LoopbackConn* lc = loopback_connect();
+    const char* req = HTTPConnectionBench::request();
+    size_t len = strlen(req);
+    size_t cuts[] = {0, 9, 40, len};
+    lc->transport.set_max_write(64);
+    uint64_t sent = lc->transport.sent_bytes();
+    for (uint64_t i = 0; i < iterations; ++i) {
+        for (int k = 0; k < 3; ++k) {
+            lc->transport.feed(req + cuts[k], cuts[k + 1] - cuts[k]);
+            loopback_pump(lc);
+        }
+    }
+    loopback_check(lc, sent, iterations);
+}
+
+// 每次操作：新连接上LOOPBACK_PIPELINE个请求一次到达，地址的令牌桶只够LOOPBACK_BURST个。
+// 校验流水线上的请求逐个扣令牌：前LOOPBACK_BURST个回复200，下一个回复429后关闭连接
+static void loopback_rate_limited(uint64_t iterations) {
+    if (!open_bench_root()) {
+        abort();
+    }
+    static std::string batch;
+    if (batch.empty()) {
+        for (int i = 0; i < LOOPBACK_PIPELINE; ++i) {
+            batch += HTTPConnectionBench::request();
+        }
+    }
+    IpLimiterConfig config = {0, 1, LOOPBACK_BURST, 32, 128, 64};
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (uint64_t i = 0; i < iterations; ++i) {
+        // 每次用新的限流表，令牌桶从满的开始
+        IpLimiter limiter(config);
+        HTTPConnection::ip_limiter = &limiter;
+        LoopbackConn* lc = new LoopbackConn();
+        lc->handle = ((ConnHandle) 1 << 32) | 2;
+        lc->conn.init(LOOPBACK_FD, (sockaddr*) &addr, sizeof(addr), lc->handle, &lc->transport);
+        lc->conn.set_ip_key(limiter.make_key((sockaddr*) &addr), false);
+        lc->transport.feed(batch.data(), batch.size());
+        bool open = loopback_drive(lc);
+        const std::string& out = lc->transport.output();
+        size_t ok = 0;
+        for (size_t pos = out.find("HTTP/1.1 200 OK"); pos != std::string::npos;
+             pos = out.find("HTTP/1.1 200 OK", pos + 1)) {
+            ++ok;
+        }
+        size_t limited = out.rfind("HTTP/1.1 429 ");
+        // 429只出现一次，而且是最后一个响应
+        if (open || ok != (size_t) LOOPBACK_BURST || limited == std::string::npos ||
+            out.find("HTTP/1.1 429 ") != limited ||
+            out.find("\r\n\r\n", limited) + 4 != out.size()) {
+            fprintf(stderr, "loopback: expected %d responses then 429 and close, got:\n%s\n",
+                    LOOPBACK_BURST, out.c_str());
+            abort();
+        }
+        lc->conn.close_connection();
+        delete lc;
+        HTTPConnection::ip_limiter = nullptr;
+    }
+}
+
+// 发送端：在回环TCP上不停地写请求体，对端不读时阻塞在写上
+static void* upload_sender(void* arg) {
+    int fd = (int) (intptr_t) arg;
+    static char chunk[1 << 20];
+    memset(chunk, 'u', sizeof(chunk));
+    for (;;) {
+        if (write(fd, chunk, sizeof(chunk)) <= 0) {
+            return nullptr;
+        }
+    }
+}
+
+// 接收端的socket，另一端交给发送线程
+static int upload_connect() {
+    int client;
+    int fd = tcp_loopback(&client);
+    pthread_t thread;
+    if (pthread_create(&thread, nullptr, upload_sender, (void*) (intptr_t) client) != 0) {
+        abort();
+    }
+    pthread_detach(thread);
+    return fd;
+}
+
+// 每轮作为一个PUT：在临时目录中按总长度预分配、接收、改名，之后删掉
+static void upload_receive(int sock_fd, uint64_t iterations, bool use_splice) {
+    static int root_fd = -1;
+    if (root_fd == -1) {
+        char dir[] = "/tmp/bench_upload_XXXXXX";
+        if (mkdtemp(dir) == nullptr) {
+            abort();
+        }
+        root_fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    Upload upload;
+    if (upload.begin(root_fd, "artifact.bin", iterations * UPLOAD_CHUNK) != Upload::UPLOAD_OK) {
+        abort();
+    }
+    static char buf[UPLOAD_CHUNK];
+    pollfd pfd = {sock_fd, POLLIN, 0};
+    while (upload.remaining() > 0) {
+        if (use_splice) {
+            Upload::Progress progress = upload.splice_from(sock_fd);
+            if (progress == Upload::UPLOAD_AGAIN) {
+                poll(&pfd, 1, -1);
+            }
+            else if (progress != Upload::UPLOAD_DONE) {
+                abort();
+            }
+            continue;
+        }
+        ssize_t n = recv(sock_fd, buf, std::min<uint64_t>(upload.remaining(), sizeof(buf)), 0);
+        if (n < 0 && errno == EAGAIN) {
+            poll(&pfd, 1, -1);
+        }
+        else if (n <= 0 || !upload.write(buf, n)) {
+            abort();
+        }
+    }
+    bool replaced;
+    if (upload.commit(&replaced) != Upload::UPLOAD_OK) {
+        abort();
+    }
+    unlinkat(root_fd, "artifact.bin", 0);
+}
+
+// 每次操作：UPLOAD_CHUNK字节的请求体从回环TCP经管道splice进文件
+static void upload_splice(uint64_t iterations) {
+    static int fd = upload_connect();
+    upload_receive(fd, iterations, true);
+}
+
+// 同上，recv到用户态缓冲再pwrite，即TLS连接上的路径
+static void upload_copy(uint64_t iterations) {
+    static int fd = upload_connect();
+    upload_receive(fd, iterations, false);
+}
+
+static const BenchCase kCases[] = {
+    {"http.parse_line", HTTPConnectionBench::parse_line},
+    {"http.parse_request", HTTPConnectionBench::parse_request},
+    {"http.parse_header", HTTPConnectionBench::parse_header},
+    {"http.request", HTTPConnectionBench::full_request},
+    {"http.add_response", HTTPConnectionBench::add_response},
+    {"loopback.request", loopback_request},
+    {"loopback.pipelined", loopback_pipelined},
+    {"loopback.fragmented", loopback_fragmented},
+    {"loopback.rate_limited", loopback_rate_limited},
+    {"timer.add_del", timer_add_del},
+    {"timer.adjust", timer_adjust},
+    {"thread_pool.append", thread_pool_append},
+    {"trace.record", trace_record_stage},
+    {"coro.task", coro_task},
+    {"coro.slow_handlers", coro_slow_handlers},
+    {"loop.pingpong", loop_pingpong},
+    {"loop.pingpong_busy", loop_pingpong_busy},
+    {"upload.splice", upload_splice},
+    {"upload.copy", upload_copy},
+};
+
+static BenchResult run_case(const BenchCase& bc, double min_time_ms, int reps) {
+    BenchResult r;
+    r.name = bc.name;
+    // 预热并标定迭代次数，使单轮耗时不少于min_time_ms
+    uint64_t n = 1;
+    while (true) {
+        uint64_t start = now_ns();
+        bc.fn(n);
+        double elapsed_ms = (now_ns() - start) / 1e6;
+        if (elapsed_ms >= min_time_ms || n >= (1ull << 40)) {
+            break;
+        }
+        double scale = elapsed_ms > 0 ? min_time_ms / elapsed_ms * 1.2 : 10;
+        n = (uint64_t) std::max<double>(n * 2.0, std::min<double>(n * scale, n * 100.0));
+    }
+    r.iterations = n;
+    uint64_t allocs = 0;
+    for (int i = 0; i < reps; ++i) {
+        uint64_t a0 = g_alloc_count.load();
+        uint64_t start = now_ns();
+        bc.fn(n);
+        uint64_t elapsed = now_ns() - start;
+        allocs += g_alloc_count.load() - a0;
+        r.ns_per_op.push_back((double) elapsed / n);
+    }
+    r.allocs_per_op = (double) allocs / ((double) n * reps);
+    return r;
+}
+
+static double median(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    size_t mid = v.size() / 2;
+    return v.size() % 2 ? v[mid] : (v[mid - 1] + v[mid]) / 2;
+}
+
+static void print_json(const std::vector<BenchResult>& results) {
+    printf("{\"benchmarks\":[");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        double mean = 0;
+        for (size_t k = 0; k < r.ns_per_op.size(); ++k) {
+            mean += r.ns_per_op[k];
+        }
+        mean /= r.ns_per_op.size();
+        double var = 0;
+        for (size_t k = 0; k < r.ns_per_op.size(); ++k) {
+            var += (r.ns_per_op[k] - mean) * (r.ns_per_op[k] - mean);
+        }
+        double stddev = std::sqrt(var / r.ns_per_op.size());
+        printf("%s\n  {\"name\":\"%s\",\"iterations\":%llu,\"repetitions\":%zu,"
+               "\"ns_per_op\":{\"min\":%.2f,\"median\":%.2f,\"mean\":%.2f,\"stddev\":%.2f},"
+               "\"allocs_per_op\":%.3f}",
+               i ? "," : "", r.name.c_str(), (unsigned long long) r.iterations,
+               r.ns_per_op.size(), *std::min_element(r.ns_per_op.begin(), r.ns_per_op.end()),
+               median(r.ns_per_op), mean, stddev, r.allocs_per_op);
+    }
+    printf("\n]}\n");
+}
+
+static void print_table(const std::vector<BenchResult>& results) {
+    printf("%-24s %14s %12s %12s %12s\n", "benchmark", "iterations", "min ns/op",
+           "median ns/op", "allocs/op");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        printf("%-24s %14llu %12.1f %12.1f %12.2f\n", r.name.c_str(),
+               (unsigned long long) r.iterations,
+               *std::min_element(r.ns_per_op.begin(), r.ns_per_op.end()),
+               median(r.ns_per_op), r.allocs_per_op);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const char* filter = nullptr;
+    double min_time_ms = 50;
+    int reps = 5;
+    bool json = false;
+    bool list = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:m:r:p:jlh")) != -1) {
+        switch (opt) {
+            case 'p': {
+                // 文件从资源包中响应，回环用例不再有打开和映射文件的系统调用
+                std::string error;
+                std::shared_ptr<AssetPack> pack = AssetPack::open(optarg, &error);
+                if (!pack) {
+                    fprintf(stderr, "load pack %s failed: %s\n", optarg, error.c_str());
+                    return -1;
+                }
+                set_current_asset_pack(pack);
+                break;
+            }
+            case 'f': filter = optarg; break;
+            case 'm': min_time_ms = atof(optarg); break;
+            case 'r': reps = std::max(1, atoi(optarg)); break;
+            case 'j': json = true; break;
+            case 'l': list = true; break;
+            default:
+                printf("Usage: %s [-f filter] [-m min_ms_per_rep] [-r reps] [-p pack] [-j] [-l]\n",
+                       basename(argv[0]));
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+    std::vector<BenchResult> results;
+    for (size_t i = 0; i < sizeof(kCases) / sizeof(kCases[0]); ++i) {
+        if (filter != nullptr && strstr(kCases[i].name, filter) == nullptr) {
+            continue;
+        }
+        if (list) {
+            printf("%s\n", kCases[i].name);
+            continue;
+        }
+        results.push_back(run_case(kCases[i], min_time_ms, reps));
+        if (!json) {
+            fprintf(stderr, "done %s\n", kCases[i].name);
+        }
+    }
+    if (list) {
+        return 0;
+    }
+    if (json) {
+        print_json(results);
+    }
+    else {
+        print_table(results);
+    }
+    return 0;
+}
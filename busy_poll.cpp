@@ -0,0 +1,104 @@
+#include "busy_poll.h"
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <algorithm>
+
+// 旧的头文件里没有epoll的忙轮询参数，按linux/eventpoll.h补上
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPOLL_IOC_TYPE 0x8A
+#define EPIOCSPARAMS _IOW(EPOLL_IOC_TYPE, 0x01, struct epoll_params)
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+static uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+BusyPoller::BusyPoller(int epoll_fd, uint32_t budget_us)
+    : epoll_fd_(epoll_fd), max_ns_((uint64_t) budget_us * 1000),
+      min_ns_(max_ns_ / BUSY_POLL_MIN_DIVISOR), current_ns_(max_ns_), last_return_ns_(0),
+      stats_() {}
+
+int BusyPoller::wait(epoll_event* events, int max_events, int timeout_ms) {
+    uint64_t start = now_ns();
+    if (last_return_ns_ != 0) {
+        stats_.work_ns += start - last_return_ns_;
+    }
+    uint64_t now = start;
+    if (current_ns_ > 0) {
+        uint64_t deadline = start + current_ns_;
+        for (;;) {
+            int count = epoll_wait(epoll_fd_, events, max_events, 0);
+            now = now_ns();
+            if (count != 0) {
+                // 自旋有收获，下一次多转一会儿
+                stats_.spin_ns += now - start;
+                ++stats_.spin_hits;
+                current_ns_ = std::min(max_ns_, current_ns_ * 2);
+                last_return_ns_ = now;
+                return count;
+            }
+            ++stats_.polls;
+            if (now >= deadline) {
+                break;
+            }
+            cpu_relax();
+        }
+        stats_.spin_ns += now - start;
+    }
+    int count = epoll_wait(epoll_fd_, events, max_events, timeout_ms);
+    uint64_t end = now_ns();
+    stats_.sleep_ns += end - now;
+    if (max_ns_ > 0) {
+        ++stats_.parks;
+        // 刚睡下事件就到了，说明预算偏小；睡了很久说明空闲，减半
+        if (count > 0 && end - now < max_ns_) {
+            current_ns_ = std::min(max_ns_, std::max(current_ns_, min_ns_) * 2);
+        }
+        else {
+            current_ns_ = std::max(min_ns_, current_ns_ / 2);
+        }
+    }
+    last_return_ns_ = end;
+    return count;
+}
+
+bool BusyPoller::set_epoll_busy_poll() {
+    if (max_ns_ == 0) {
+        return false;
+    }
+    epoll_params params{};
+    params.busy_poll_usecs = (uint32_t) (max_ns_ / 1000);
+    params.busy_poll_budget = 8;
+    params.prefer_busy_poll = 1;
+    return ioctl(epoll_fd_, EPIOCSPARAMS, &params) == 0;
+}
+
+void BusyPoller::tune_socket(int fd, uint32_t budget_us) {
+    int usecs = (int) budget_us;
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+    int prefer = 1;
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+}
@@ -0,0 +1,51 @@
+#ifndef HTTP_SERVER_BUSY_POLL_H
+#define HTTP_SERVER_BUSY_POLL_H
+
+#include <sys/epoll.h>
+
+#include <cstdint>
+
+// 自适应自旋的下限：预算退到最大值的1/BUSY_POLL_MIN_DIVISOR后不再减少，空闲时也偶尔试探
+#define BUSY_POLL_MIN_DIVISOR 64
+
+// 一个事件循环线程的时间分布，单位纳秒
+struct BusyPollStats {
+    uint64_t spin_ns;  // 以0超时轮询epoll的时间
+    uint64_t work_ns;  // 两次等待之间处理事件的时间
+    uint64_t sleep_ns; // 阻塞在epoll_wait中的时间
+    uint64_t polls;    // 没有取到事件的轮询次数
+    uint64_t spin_hits;// 自旋期间取到事件的次数
+    uint64_t parks;    // 自旋预算用完后转入阻塞等待的次数
+};
+
+// 事件循环的等待：先以0超时反复轮询epoll，预算内没有事件再阻塞。
+// 预算自适应：自旋期间或刚阻塞不久就来了事件时加倍，长时间空闲时减半，
+// 空闲的线程很快退回到阻塞等待，不白白占用CPU。每个事件循环线程一个，不是线程安全的
+class BusyPoller {
+public:
+    // budget_us为0时不自旋，直接阻塞，只统计时间
+    BusyPoller(int epoll_fd, uint32_t budget_us);
+
+    // 语义同epoll_wait，timeout_ms是自旋之后阻塞等待的超时
+    int wait(epoll_event* events, int max_events, int timeout_ms);
+
+    uint32_t budget_us() const { return max_ns_ / 1000; }
+    // 当前的自旋预算
+    uint32_t current_us() const { return current_ns_ / 1000; }
+    // 让内核在epoll_wait中忙轮询网卡队列(EPIOCSPARAMS，Linux 6.9起)，不支持时返回false
+    bool set_epoll_busy_poll();
+    const BusyPollStats& stats() const { return stats_; }
+
+    // 客户端socket的SO_BUSY_POLL与SO_PREFER_BUSY_POLL，失败时忽略(例如Unix域套接字)
+    static void tune_socket(int fd, uint32_t budget_us);
+
+private:
+    int epoll_fd_;
+    uint64_t max_ns_;
+    uint64_t min_ns_;
+    uint64_t current_ns_;
+    uint64_t last_return_ns_; // 上一次wait返回的时刻，0表示还没有返回过
+    BusyPollStats stats_;
+};
+
+#endif
@@ -0,0 +1,59 @@
+#include "codel.h"
+
+#include <time.h>
+
+#include <cmath>
+
+void CoDel::configure(uint64_t target_us, uint64_t interval_us) {
+    target_us_ = target_us;
+    interval_us_ = interval_us;
+}
+
+uint64_t CoDel::now_us() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t CoDel::control_law(uint64_t t) const {
+    return t + (uint64_t) (interval_us_ / std::sqrt((double) count_));
+}
+
+bool CoDel::should_drop(uint64_t sojourn_us, uint64_t now_us, size_t backlog) {
+    if (target_us_ == 0) {
+        return false;
+    }
+    // 取出后队列已空说明工作线程追上了，即使这个请求等得久也不算积压
+    bool ok_to_drop = false;
+    if (sojourn_us < target_us_ || backlog == 0) {
+        first_above_us_ = 0;
+    }
+    else if (first_above_us_ == 0) {
+        first_above_us_ = now_us + interval_us_;
+    }
+    else {
+        ok_to_drop = now_us >= first_above_us_;
+    }
+    if (dropping_) {
+        if (!ok_to_drop) {
+            dropping_ = false;
+            return false;
+        }
+        if (now_us >= drop_next_us_) {
+            ++count_;
+            drop_next_us_ = control_law(drop_next_us_);
+            return true;
+        }
+        return false;
+    }
+    if (!ok_to_drop) {
+        return false;
+    }
+    dropping_ = true;
+    // 刚退出丢弃状态不久又进入，从接近上次的丢弃频率开始
+    uint32_t delta = count_ - last_count_;
+    count_ = delta > 1 && now_us - drop_next_us_ < 16 * interval_us_ ? delta : 1;
+    last_count_ = count_;
+    drop_next_us_ = control_law(now_us);
+    return true;
+}
@@ -0,0 +1,35 @@
+#ifndef HTTP_SERVER_CODEL_H
+#define HTTP_SERVER_CODEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+// 按排队时延丢弃请求(CoDel)：出队时请求的排队时间持续一个interval都高于target，
+// 说明队列是积压而不是突发，进入丢弃状态；之后按interval/sqrt(count)的间隔逐次丢弃，
+// 排队时间回到target以下时退出。不是线程安全的，由调用者加锁
+class CoDel {
+public:
+    CoDel() : target_us_(0), interval_us_(0), first_above_us_(0), drop_next_us_(0), count_(0),
+              last_count_(0), dropping_(false) {}
+
+    // target为0时不丢弃
+    void configure(uint64_t target_us, uint64_t interval_us);
+    // 出队时调用，backlog为取出之后队列中剩余的请求数；返回true表示丢弃这个请求
+    bool should_drop(uint64_t sojourn_us, uint64_t now_us, size_t backlog);
+    bool dropping() const { return dropping_; }
+
+    static uint64_t now_us();
+
+private:
+    uint64_t control_law(uint64_t t) const;
+
+    uint64_t target_us_;
+    uint64_t interval_us_;
+    uint64_t first_above_us_; // 排队时间首次超过target后再过一个interval的时刻
+    uint64_t drop_next_us_;
+    uint32_t count_;          // 本轮丢弃状态中的丢弃数
+    uint32_t last_count_;
+    bool dropping_;
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include "connection_slab.h"
+
+#include <cstring>
+
+#include "http_connection.h"
+
+ConnectionSlab::ConnectionSlab(uint32_t max_connections)
+    : max_connections_(max_connections), chunk_count_(0), live_(0) {
+    max_chunks_ = (max_connections + SLAB_CHUNK_SIZE - 1) / SLAB_CHUNK_SIZE;
+    if (max_chunks_ == 0 || max_chunks_ > SLAB_MAX_CHUNKS) {
+        throw std::exception();
+    }
+    memset(chunks_, 0, sizeof(chunks_));
+    memset(nonfull_, 0, sizeof(nonfull_));
+}
+
+ConnectionSlab::~ConnectionSlab() {
+    for (uint32_t c = 0; c < chunk_count_; ++c) {
+        delete[] chunks_[c]->cold;
+        delete chunks_[c];
+    }
+}
+
+SlabChunk* ConnectionSlab::new_chunk() {
+    if (chunk_count_ >= max_chunks_) {
+        return nullptr;
+    }
+    SlabChunk* chunk = new SlabChunk();
+    for (uint32_t i = 0; i < SLAB_CHUNK_SIZE; ++i) {
+        chunk->hot[i].generation.store(0, std::memory_order_relaxed);
+        chunk->hot[i].fd = -1;
+        chunk->hot[i].next_free = (uint8_t) (i + 1);
+    }
+    chunk->cold = nullptr;
+    chunk->pins.store(0, std::memory_order_relaxed);
+    chunk->free_head = 0;
+    chunk->live = 0;
+    chunk->empty_since = 0;
+    chunks_[chunk_count_] = chunk;
+    mark_nonfull(chunk_count_, true);
+    ++chunk_count_;
+    return chunk;
+}
+
+void ConnectionSlab::mark_nonfull(uint32_t chunk, bool nonfull) {
+    if (nonfull) {
+        nonfull_[chunk / 64] |= 1ull << (chunk % 64);
+    }
+    else {
+        nonfull_[chunk / 64] &= ~(1ull << (chunk % 64));
+    }
+}
+
+int ConnectionSlab::find_nonfull() const {
+    for (uint32_t w = 0; w * 64 < chunk_count_; ++w) {
+        if (nonfull_[w] != 0) {
+            return (int) (w * 64 + __builtin_ctzll(nonfull_[w]));
+        }
+    }
+    return -1;
+}
+
+ConnHandle ConnectionSlab::alloc(int fd) {
+    if (live_ >= max_connections_) {
+        return 0;
+    }
+    int c = find_nonfull();
+    if (c == -1) {
+        if (new_chunk() == nullptr) {
+            return 0;
+        }
+        c = (int) chunk_count_ - 1;
+    }
+    SlabChunk* chunk = chunks_[c];
+    if (chunk->cold == nullptr) {
+        chunk->cold = new HTTPConnection[SLAB_CHUNK_SIZE];
+    }
+    uint32_t i = chunk->free_head;
+    ConnHot& hot = chunk->hot[i];
+    chunk->free_head = hot.next_free;
+    if (chunk->free_head == SLAB_CHUNK_SIZE) {
+        mark_nonfull(c, false);
+    }
+    ++chunk->live;
+    ++live_;
+    hot.fd = fd;
+    uint32_t gen = hot.generation.load(std::memory_order_relaxed) + 1;
+    hot.generation.store(gen, std::memory_order_release);
+    return ((ConnHandle) gen << 32) | ((uint32_t) c * SLAB_CHUNK_SIZE + i);
+}
+
+void ConnectionSlab::release(ConnHandle handle) {
+    if (!valid(handle)) {
+        return;
+    }
+    uint32_t index = handle_index(handle);
+    uint32_t c = index / SLAB_CHUNK_SIZE;
+    SlabChunk* chunk = chunks_[c];
+    ConnHot& hot = chunk->hot[index % SLAB_CHUNK_SIZE];
+    // 代数变为偶数，此后所有持有旧句柄的定时器和任务都会失效
+    hot.generation.store(handle_generation(handle) + 1, std::memory_order_release);
+    hot.fd = -1;
+    hot.next_free = chunk->free_head;
+    chunk->free_head = (uint8_t) (index % SLAB_CHUNK_SIZE);
+    mark_nonfull(c, true);
+    --live_;
+    if (--chunk->live == 0) {
+        chunk->empty_since = time(nullptr);
+    }
+}
+
+bool ConnectionSlab::valid(ConnHandle handle) const {
+    if (!is_connection_handle(handle)) {
+        return false;
+    }
+    uint32_t index = handle_index(handle);
+    uint32_t c = index / SLAB_CHUNK_SIZE;
+    if (c >= chunk_count_) {
+        return false;
+    }
+    return chunks_[c]->hot[index % SLAB_CHUNK_SIZE].generation.load(
+               std::memory_order_acquire) == handle_generation(handle);
+}
+
+HTTPConnection* ConnectionSlab::get(ConnHandle handle) const {
+    if (!valid(handle)) {
+        return nullptr;
+    }
+    uint32_t index = handle_index(handle);
+    return chunks_[index / SLAB_CHUNK_SIZE]->cold + index % SLAB_CHUNK_SIZE;
+}
+
+void ConnectionSlab::pin(ConnHandle handle) {
+    chunks_[handle_index(handle) / SLAB_CHUNK_SIZE]->pins.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ConnectionSlab::unpin(ConnHandle handle) {
+    // 与shrink中的acquire配对：工作线程对连接对象的访问都先于释放
+    chunks_[handle_index(handle) / SLAB_CHUNK_SIZE]->pins.fetch_sub(1, std::memory_order_release);
+}
+
+void ConnectionSlab::shrink(time_t now, time_t idle) {
+    for (uint32_t c = 0; c < chunk_count_; ++c) {
+        SlabChunk* chunk = chunks_[c];
+        if (chunk->live == 0 && chunk->cold != nullptr && now - chunk->empty_since >= idle &&
+            chunk->pins.load(std::memory_order_acquire) == 0) {
+            // 连接关闭后仍在队列中的任务会解引用冷字段，等它们全部出队再释放。
+            // 只释放冷字段，块头保留，过期句柄仍然可以安全校验
+            delete[] chunk->cold;
+            chunk->cold = nullptr;
+        }
+    }
+}
+
+size_t ConnectionSlab::memory_bytes() const {
+    size_t bytes = 0;
+    for (uint32_t c = 0; c < chunk_count_; ++c) {
+        bytes += sizeof(SlabChunk);
+        if (chunks_[c]->cold != nullptr) {
+            bytes += sizeof(HTTPConnection) * SLAB_CHUNK_SIZE;
+        }
+    }
+    return bytes;
+}
@@ -0,0 +1,105 @@
+#ifndef HTTP_SERVER_CONNECTION_SLAB_H
+#define HTTP_SERVER_CONNECTION_SLAB_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+// 每块容纳的连接数，连接对象按块懒分配
+#define SLAB_CHUNK_SIZE 64
+// 块索引表大小，决定连接数上限(SLAB_CHUNK_SIZE * SLAB_MAX_CHUNKS)
+#define SLAB_MAX_CHUNKS 16384
+
+class HTTPConnection;
+
+// 连接句柄：高32位为代数(generation)，低32位为槽位下标。
+// 槽位在用时代数为奇数，释放时加一，所以过期句柄只需比较一次代数即可识别。
+// 代数为0的值不是连接句柄，epoll中用来直接携带监听socket、信号管道等fd。
+typedef uint64_t ConnHandle;
+
+inline uint32_t handle_index(ConnHandle handle) {
+    return (uint32_t) handle;
+}
+
+inline uint32_t handle_generation(ConnHandle handle) {
+    return (uint32_t) (handle >> 32);
+}
+
+inline bool is_connection_handle(uint64_t tag) {
+    return (handle_generation(tag) & 1) != 0;
+}
+
+// 热字段：事件分发和句柄校验只访问这里，块头常驻内存
+struct ConnHot {
+    std::atomic<uint32_t> generation;
+    int fd;
+    uint8_t next_free;// 块内空闲链表
+};
+
+struct SlabChunk {
+    ConnHot hot[SLAB_CHUNK_SIZE];
+    // 冷字段：连接对象本身(读写缓冲等)，整块空闲一段时间后释放
+    HTTPConnection* cold;
+    // 排队中和处理中的任务数，这些任务持有冷字段的裸指针，不为0时不释放冷字段
+    std::atomic<int> pins;
+    uint8_t free_head;
+    int live;
+    time_t empty_since;
+};
+
+// 连接槽位分配器，只在主线程中分配和释放，工作线程可以并发校验句柄
+class ConnectionSlab {
+public:
+    explicit ConnectionSlab(uint32_t max_connections);
+    ~ConnectionSlab();
+
+    // 分配槽位，连接数达到上限时返回0
+    ConnHandle alloc(int fd);
+    void release(ConnHandle handle);
+    // 句柄过期时返回nullptr
+    HTTPConnection* get(ConnHandle handle) const;
+    bool valid(ConnHandle handle) const;
+    // 把连接交给工作线程前pin住所在块，工作线程用完后unpin(可在任意线程调用)
+    void pin(ConnHandle handle);
+    void unpin(ConnHandle handle);
+    // 释放空闲超过idle秒、且没有任务引用的整块连接对象
+    void shrink(time_t now, time_t idle);
+
+    uint32_t live() const { return live_; }
+    uint32_t capacity() const { return max_connections_; }
+    // 当前连接对象占用的内存
+    size_t memory_bytes() const;
+
+    // 遍历所有在用的连接
+    template <typename F>
+    void for_each(F f) const {
+        for (uint32_t c = 0; c < chunk_count_; ++c) {
+            SlabChunk* chunk = chunks_[c];
+            if (chunk->live == 0) {
+                continue;
+            }
+            for (uint32_t i = 0; i < SLAB_CHUNK_SIZE; ++i) {
+                uint32_t gen = chunk->hot[i].generation.load(std::memory_order_relaxed);
+                if (gen & 1) {
+                    f(((ConnHandle) gen << 32) | (c * SLAB_CHUNK_SIZE + i), chunk->cold + i);
+                }
+            }
+        }
+    }
+
+private:
+    SlabChunk* new_chunk();
+    void mark_nonfull(uint32_t chunk, bool nonfull);
+    int find_nonfull() const;
+
+    uint32_t max_connections_;
+    uint32_t max_chunks_;
+    SlabChunk* chunks_[SLAB_MAX_CHUNKS];
+    uint32_t chunk_count_;
+    // 还有空闲槽位的块的位图，总是从编号最小的块分配，让高编号块有机会整块空闲
+    uint64_t nonfull_[SLAB_MAX_CHUNKS / 64];
+    uint32_t live_;
+};
+
+#endif
@@ -0,0 +1,272 @@
+#include "coroutine.h"
+
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <new>
+
+// 每个线程按大小分级的空闲帧，线程退出时释放
+struct FramePool {
+    struct FreeFrame {
+        FreeFrame* next;
+    };
+
+    FramePool() {
+        for (int i = 0; i < FRAME_POOL_CLASSES; ++i) {
+            heads[i] = nullptr;
+            counts[i] = 0;
+        }
+    }
+    ~FramePool() {
+        for (int i = 0; i < FRAME_POOL_CLASSES; ++i) {
+            while (heads[i] != nullptr) {
+                FreeFrame* next = heads[i]->next;
+                free(heads[i]);
+                heads[i] = next;
+            }
+        }
+    }
+
+    FreeFrame* heads[FRAME_POOL_CLASSES];
+    int counts[FRAME_POOL_CLASSES];
+};
+
+static thread_local FramePool frame_pool;
+static thread_local Reactor* current_reactor = nullptr;
+
+// 大小对应的级别，超过最大一级返回-1
+static int frame_class(size_t size) {
+    size_t block = FRAME_POOL_MIN;
+    for (int i = 0; i < FRAME_POOL_CLASSES; ++i, block <<= 1) {
+        if (size <= block) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void* frame_allocate(size_t size) {
+    int cls = frame_class(size);
+    if (cls >= 0) {
+        FramePool& pool = frame_pool;
+        FramePool::FreeFrame* frame = pool.heads[cls];
+        if (frame != nullptr) {
+            pool.heads[cls] = frame->next;
+            --pool.counts[cls];
+            return frame;
+        }
+        size = (size_t) FRAME_POOL_MIN << cls;
+    }
+    void* p = malloc(size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void frame_free(void* p, size_t size) {
+    int cls = frame_class(size);
+    if (cls >= 0) {
+        FramePool& pool = frame_pool;
+        if (pool.counts[cls] < FRAME_POOL_BLOCKS) {
+            FramePool::FreeFrame* frame = static_cast<FramePool::FreeFrame*>(p);
+            frame->next = pool.heads[cls];
+            pool.heads[cls] = frame;
+            ++pool.counts[cls];
+            return;
+        }
+    }
+    free(p);
+}
+
+static uint64_t monotonic_us() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 自身的timerfd和eventfd的事件数据，协程等待者的事件数据是FdAwaiter的地址
+static const uint64_t TIMER_TAG = 1;
+static const uint64_t POST_TAG = 2;
+
+Reactor::Reactor()
+    : resumed(0), epoll_fd_(-1), timer_fd_(-1), event_fd_(-1), timer_seq_(0), armed_us_(0),
+      stop_(false) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd_ == -1 || timer_fd_ == -1 || event_fd_ == -1) {
+        close(epoll_fd_);
+        close(timer_fd_);
+        close(event_fd_);
+        throw std::exception();
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = TIMER_TAG;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &event);
+    event.data.u64 = POST_TAG;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &event);
+}
+
+Reactor::~Reactor() {
+    close(epoll_fd_);
+    close(timer_fd_);
+    close(event_fd_);
+}
+
+Reactor* Reactor::current() {
+    return current_reactor;
+}
+
+void Reactor::poll(int timeout_ms) {
+    epoll_event events[REACTOR_EVENTS];
+    int count = epoll_wait(epoll_fd_, events, REACTOR_EVENTS, timeout_ms);
+    Reactor* outer = current_reactor;
+    current_reactor = this;
+    for (int i = 0; i < count; ++i) {
+        uint64_t tag = events[i].data.u64;
+        if (tag == TIMER_TAG) {
+            uint64_t expirations;
+            read(timer_fd_, &expirations, sizeof(expirations));
+            armed_us_ = 0;
+            run_timers();
+        }
+        else if (tag == POST_TAG) {
+            run_posted();
+        }
+        else {
+            FdAwaiter* waiter = reinterpret_cast<FdAwaiter*>(tag);
+            waiter->revents = events[i].events;
+            ++resumed;
+            waiter->handle.resume();
+        }
+    }
+    current_reactor = outer;
+}
+
+void Reactor::run() {
+    while (!stop_.load(std::memory_order_acquire)) {
+        poll(-1);
+    }
+}
+
+void Reactor::stop() {
+    stop_.store(true, std::memory_order_release);
+    uint64_t one = 1;
+    write(event_fd_, &one, sizeof(one));
+}
+
+void Reactor::post(std::coroutine_handle<> h) {
+    posted_locker_.lock();
+    bool wake = posted_.empty();
+    posted_.push_back(h);
+    posted_locker_.unlock();
+    // 上一次的唤醒还没处理时不用再写
+    if (wake) {
+        uint64_t one = 1;
+        write(event_fd_, &one, sizeof(one));
+    }
+}
+
+void Reactor::run_posted() {
+    uint64_t value;
+    read(event_fd_, &value, sizeof(value));
+    posted_locker_.lock();
+    running_.swap(posted_);
+    posted_locker_.unlock();
+    for (size_t i = 0; i < running_.size(); ++i) {
+        ++resumed;
+        running_[i].resume();
+    }
+    running_.clear();
+}
+
+void Reactor::forget(int fd) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+bool FdAwaiter::await_suspend(std::coroutine_handle<> h) {
+    handle = h;
+    epoll_event event{};
+    event.events = events | EPOLLONESHOT;
+    event.data.u64 = reinterpret_cast<uint64_t>(this);
+    // 等待过的fd还在epoll中，只是一次性事件已经失效
+    if (epoll_ctl(reactor->epoll_fd_, EPOLL_CTL_MOD, fd, &event) == -1 &&
+        (errno != ENOENT || epoll_ctl(reactor->epoll_fd_, EPOLL_CTL_ADD, fd, &event) == -1)) {
+        // 无法等待(例如fd已关闭)，立即恢复并报告错误
+        revents = EPOLLERR;
+        return false;
+    }
+    return true;
+}
+
+void SleepAwaiter::await_suspend(std::coroutine_handle<> h) {
+    reactor->add_timer(delay_us, h);
+}
+
+void Reactor::add_timer(uint64_t delay_us, std::coroutine_handle<> h) {
+    timers_.push_back(Timer{monotonic_us() + delay_us, timer_seq_++, h});
+    std::push_heap(timers_.begin(), timers_.end(), std::greater<Timer>());
+    arm_timer();
+}
+
+void Reactor::arm_timer() {
+    if (timers_.empty()) {
+        return;
+    }
+    uint64_t deadline = timers_.front().deadline_us;
+    if (armed_us_ != 0 && armed_us_ <= deadline) {
+        return;
+    }
+    itimerspec spec{};
+    spec.it_value.tv_sec = deadline / 1000000;
+    spec.it_value.tv_nsec = (deadline % 1000000) * 1000;
+    timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr);
+    armed_us_ = deadline;
+}
+
+void Reactor::run_timers() {
+    uint64_t now = monotonic_us();
+    while (!timers_.empty() && timers_.front().deadline_us <= now) {
+        std::coroutine_handle<> h = timers_.front().handle;
+        std::pop_heap(timers_.begin(), timers_.end(), std::greater<Timer>());
+        timers_.pop_back();
+        ++resumed;
+        h.resume();
+    }
+    arm_timer();
+}
+
+void OffloadJob::process(uint64_t) {
+    run();
+    reactor_->post(handle_);
+}
+
+bool OffloadJob::submit(OffloadPool* pool, std::coroutine_handle<> h) {
+    reactor_ = Reactor::current();
+    handle_ = h;
+    if (reactor_ == nullptr || pool == nullptr || !pool->append(this)) {
+        run();
+        return false;
+    }
+    return true;
+}
+
+ssize_t FileRead::await_resume() const noexcept {
+    if (result_ < 0) {
+        errno = error_;
+    }
+    return result_;
+}
+
+void FileRead::run() {
+    result_ = pread(fd_, buf_, length_, offset_);
+    error_ = result_ < 0 ? errno : 0;
+}
@@ -0,0 +1,292 @@
+#ifndef HTTP_SERVER_COROUTINE_H
+#define HTTP_SERVER_COROUTINE_H
+
+#include <sys/epoll.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "locker.h"
+#include "thread_pool.h"
+
+// 协程帧按2的幂分级缓存，最小一级FRAME_POOL_MIN字节，超过最大一级的直接向堆申请
+#define FRAME_POOL_MIN 128
+#define FRAME_POOL_CLASSES 6
+// 每个线程每级最多缓存的帧数，超出的直接释放
+#define FRAME_POOL_BLOCKS 256
+// 一次epoll_wait最多取的事件数
+#define REACTOR_EVENTS 256
+
+// 协程帧的分配与释放；帧可能在别的线程上释放，归还到当前线程的缓存
+void* frame_allocate(size_t size);
+void frame_free(void* p, size_t size);
+
+class Reactor;
+
+// 所有Task的promise共用的部分：帧从缓存分配，创建后先挂起；分离(detach)的协程结束时
+// 自行释放帧。等待者先在自己的栈上恢复子协程，子协程同步结束就直接继续，
+// 挂起过的子协程结束时再恢复等待者，不依赖对称转移的尾调用(未优化的构建下会爆栈)。
+// 因此协程只能在同一个线程(所属reactor)上恢复
+struct TaskPromiseBase {
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        void await_suspend(std::coroutine_handle<Promise> h) noexcept {
+            TaskPromiseBase& promise = h.promise();
+            if (promise.detached) {
+                h.destroy();
+            }
+            else if (!promise.inline_run && promise.continuation) {
+                promise.continuation.resume();
+            }
+        }
+        void await_resume() noexcept {}
+    };
+
+    static void* operator new(size_t size) { return frame_allocate(size); }
+    static void operator delete(void* p, size_t size) { frame_free(p, size); }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    // 服务器不用异常传递错误，协程中逃出的异常直接终止
+    void unhandled_exception() { std::terminate(); }
+
+    std::coroutine_handle<> continuation;
+    bool detached = false;
+    // 等待者正在自己的栈上执行这个协程
+    bool inline_run = false;
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+    void return_value(T v) { value = std::move(v); }
+    T value{};
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    void return_void() {}
+};
+
+// 惰性启动的协程：被co_await时才开始执行，结束后恢复等待者并交出结果；
+// 不被等待的顶层协程用detach()或start_on()启动，帧在结束时释放
+template <typename T = void>
+class Task {
+public:
+    struct promise_type : TaskPromise<T> {
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+
+    Task() : handle_(nullptr) {}
+    Task(Task&& other) noexcept : handle_(other.handle_) { other.handle_ = nullptr; }
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle_) {
+                handle_.destroy();
+            }
+            handle_ = other.handle_;
+            other.handle_ = nullptr;
+        }
+        return *this;
+    }
+    ~Task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return !handle_ || handle_.done(); }
+    // 返回false表示子协程已同步结束，等待者直接继续
+    bool await_suspend(std::coroutine_handle<> awaiting) {
+        promise_type& promise = handle_.promise();
+        promise.continuation = awaiting;
+        promise.inline_run = true;
+        handle_.resume();
+        if (handle_.done()) {
+            return false;
+        }
+        promise.inline_run = false;
+        return true;
+    }
+    T await_resume() {
+        if constexpr (!std::is_void<T>::value) {
+            return std::move(handle_.promise().value);
+        }
+    }
+
+    // 在当前线程立即开始执行，不关心结果
+    void detach() {
+        std::coroutine_handle<promise_type> h = release();
+        h.resume();
+    }
+    // 交给reactor所在的线程开始执行，不关心结果；可以从任意线程调用
+    void start_on(Reactor* reactor);
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) : handle_(h) {}
+    std::coroutine_handle<promise_type> release() {
+        std::coroutine_handle<promise_type> h = handle_;
+        handle_ = nullptr;
+        h.promise().detached = true;
+        return h;
+    }
+
+    std::coroutine_handle<promise_type> handle_;
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+};
+
+// 等待fd就绪，恢复时返回epoll给出的事件
+struct FdAwaiter {
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h);
+    uint32_t await_resume() const noexcept { return revents; }
+
+    Reactor* reactor;
+    int fd;
+    uint32_t events;
+    uint32_t revents;
+    std::coroutine_handle<> handle;
+};
+
+// 等待一段时间，不能取消
+struct SleepAwaiter {
+    bool await_ready() const noexcept { return delay_us == 0; }
+    void await_suspend(std::coroutine_handle<> h);
+    void await_resume() const noexcept {}
+
+    Reactor* reactor;
+    uint64_t delay_us;
+};
+
+// 单线程的协程事件循环：fd就绪、定时器和其他线程投递回来的协程都在poll()的线程上恢复。
+// 自身的epoll fd可以注册到外层事件循环中(可读时调用poll(0))，也可以独立run()
+class Reactor {
+public:
+    Reactor();
+    ~Reactor();
+
+    int fd() const { return epoll_fd_; }
+    // 处理就绪的fd、到期的定时器和投递回来的协程，timeout_ms同epoll_wait
+    void poll(int timeout_ms);
+    // 独立运行直到stop()
+    void run();
+    // 任意线程调用
+    void stop();
+    // 任意线程：把协程交给这个reactor的线程恢复
+    void post(std::coroutine_handle<> h);
+
+    // 等待fd可读(EPOLLIN)或可写(EPOLLOUT)；fd以一次性方式注册，同一时刻只能有一个等待者
+    FdAwaiter wait_fd(int fd, uint32_t events) { return FdAwaiter{this, fd, events, 0, nullptr}; }
+    FdAwaiter readable(int fd) { return wait_fd(fd, EPOLLIN); }
+    FdAwaiter writable(int fd) { return wait_fd(fd, EPOLLOUT); }
+    // 关闭等待过的fd之前调用
+    void forget(int fd);
+    SleepAwaiter sleep_for(uint64_t ms) { return SleepAwaiter{this, ms * 1000}; }
+
+    // 当前线程正在poll的reactor，没有时为nullptr
+    static Reactor* current();
+
+    // 恢复协程的次数
+    std::atomic<uint64_t> resumed;
+
+private:
+    friend struct FdAwaiter;
+    friend struct SleepAwaiter;
+
+    struct Timer {
+        uint64_t deadline_us;
+        uint64_t seq;  // 同一时刻到期的按加入顺序恢复
+        std::coroutine_handle<> handle;
+        bool operator>(const Timer& other) const {
+            return deadline_us != other.deadline_us ? deadline_us > other.deadline_us
+                                                    : seq > other.seq;
+        }
+    };
+
+    void add_timer(uint64_t delay_us, std::coroutine_handle<> h);
+    void arm_timer();
+    void run_timers();
+    void run_posted();
+
+    int epoll_fd_;
+    int timer_fd_;
+    int event_fd_;
+    // 定时器小顶堆，只在reactor线程上访问
+    std::vector<Timer> timers_;
+    uint64_t timer_seq_;
+    uint64_t armed_us_;  // timerfd当前的到期时刻，0表示未设置
+    Locker posted_locker_;
+    std::vector<std::coroutine_handle<> > posted_;
+    std::vector<std::coroutine_handle<> > running_;
+    std::atomic<bool> stop_;
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+};
+
+template <typename T>
+void Task<T>::start_on(Reactor* reactor) {
+    reactor->post(release());
+}
+
+// 交给阻塞线程池执行的操作，完成后回到发起它的reactor恢复协程
+class OffloadJob {
+public:
+    virtual ~OffloadJob() {}
+    // 线程池接口
+    void process(uint64_t tag);
+    bool shed(uint64_t) { return false; }
+
+protected:
+    // 在阻塞线程上执行
+    virtual void run() = 0;
+    // 挂起并提交；队列满或不在reactor线程上时直接在当前线程执行、不挂起
+    bool submit(ThreadPool<OffloadJob>* pool, std::coroutine_handle<> h);
+
+private:
+    Reactor* reactor_;
+    std::coroutine_handle<> handle_;
+};
+
+typedef ThreadPool<OffloadJob> OffloadPool;
+
+// 在阻塞线程上pread，恢复时返回读到的字节数，出错返回-1并设置errno
+class FileRead : public OffloadJob {
+public:
+    FileRead(OffloadPool* pool, int fd, void* buf, size_t length, off_t offset)
+        : pool_(pool), fd_(fd), buf_(buf), length_(length), offset_(offset), result_(0),
+          error_(0) {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) { return submit(pool_, h); }
+    ssize_t await_resume() const noexcept;
+
+protected:
+    void run() override;
+
+private:
+    OffloadPool* pool_;
+    int fd_;
+    void* buf_;
+    size_t length_;
+    off_t offset_;
+    ssize_t result_;
+    int error_;
+};
+
+inline FileRead read_file(OffloadPool* pool, int fd, void* buf, size_t length, off_t offset) {
+    return FileRead(pool, fd, buf, length, offset);
+}
+
+#endif
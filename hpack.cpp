@@ -0,0 +1,485 @@
+#include "hpack.h"
+
+#include <cstring>
+
+struct HpackStaticEntry {
+    const char* name;
+    const char* value;
+};
+
+// 以下三张表摘自RFC 7541附录A与附录B
+static const uint32_t HUFFMAN_CODES[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const uint8_t HUFFMAN_CODE_LEN[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+static const HpackStaticEntry STATIC_TABLE[HPACK_STATIC_COUNT] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+#define HUFFMAN_EOS 256
+
+// 霍夫曼解码树，首次使用时按码表构造，之后只读
+struct HuffmanTree {
+    struct Node {
+        int16_t child[2];
+        int16_t symbol; // 叶子的符号，内部节点为-1
+    };
+    Node nodes[2 * 257];
+    int count;
+
+    HuffmanTree() : count(1) {
+        nodes[0] = Node{{-1, -1}, -1};
+        for (int sym = 0; sym < 256; ++sym) {
+            insert(HUFFMAN_CODES[sym], HUFFMAN_CODE_LEN[sym], sym);
+        }
+        insert(0x3fffffff, 30, HUFFMAN_EOS);
+    }
+
+    void insert(uint32_t code, int length, int symbol) {
+        int node = 0;
+        for (int i = length - 1; i >= 0; --i) {
+            int bit = (code >> i) & 1;
+            if (nodes[node].child[bit] == -1) {
+                nodes[count] = Node{{-1, -1}, -1};
+                nodes[node].child[bit] = (int16_t) count++;
+            }
+            node = nodes[node].child[bit];
+        }
+        nodes[node].symbol = (int16_t) symbol;
+    }
+};
+
+static const HuffmanTree& huffman_tree() {
+    static const HuffmanTree tree;
+    return tree;
+}
+
+bool huffman_decode(const uint8_t* data, size_t length, std::string* out) {
+    const HuffmanTree& tree = huffman_tree();
+    int node = 0;
+    // 自上一个符号以来读过的位数，以及这些位是否全为1
+    int pending_bits = 0;
+    bool all_ones = true;
+    for (size_t i = 0; i < length; ++i) {
+        for (int shift = 7; shift >= 0; --shift) {
+            int bit = (data[i] >> shift) & 1;
+            node = tree.nodes[node].child[bit];
+            if (node < 0) {
+                return false;
+            }
+            ++pending_bits;
+            all_ones = all_ones && bit == 1;
+            int symbol = tree.nodes[node].symbol;
+            if (symbol >= 0) {
+                if (symbol == HUFFMAN_EOS) {
+                    return false;
+                }
+                out->push_back((char) symbol);
+                node = 0;
+                pending_bits = 0;
+                all_ones = true;
+            }
+        }
+    }
+    // 结尾的填充必须是不超过7位的EOS前缀(全1)
+    return pending_bits <= 7 && all_ones;
+}
+
+size_t huffman_encoded_length(const std::string& text) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        bits += HUFFMAN_CODE_LEN[(uint8_t) text[i]];
+    }
+    return (bits + 7) / 8;
+}
+
+void huffman_encode(const std::string& text, std::string* out) {
+    uint64_t acc = 0;
+    int bits = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        uint8_t c = (uint8_t) text[i];
+        acc = (acc << HUFFMAN_CODE_LEN[c]) | HUFFMAN_CODES[c];
+        bits += HUFFMAN_CODE_LEN[c];
+        while (bits >= 8) {
+            bits -= 8;
+            out->push_back((char) (acc >> bits));
+        }
+    }
+    if (bits > 0) {
+        // 用EOS的高位(全1)补齐最后一个字节
+        out->push_back((char) ((acc << (8 - bits)) | (0xff >> bits)));
+    }
+}
+
+bool hpack_decode_integer(const uint8_t*& p, const uint8_t* end, int prefix_bits, uint32_t* value) {
+    if (p >= end) {
+        return false;
+    }
+    uint32_t max_prefix = (1u << prefix_bits) - 1;
+    uint32_t v = *p++ & max_prefix;
+    if (v < max_prefix) {
+        *value = v;
+        return true;
+    }
+    // 后续字节每个贡献7位，限制在28位以内防止溢出
+    for (int shift = 0; shift <= 21; shift += 7) {
+        if (p >= end) {
+            return false;
+        }
+        uint8_t b = *p++;
+        v += (uint32_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+void hpack_encode_integer(uint32_t value, int prefix_bits, uint8_t first, std::string* out) {
+    uint32_t max_prefix = (1u << prefix_bits) - 1;
+    if (value < max_prefix) {
+        out->push_back((char) (first | value));
+        return;
+    }
+    out->push_back((char) (first | max_prefix));
+    value -= max_prefix;
+    while (value >= 0x80) {
+        out->push_back((char) ((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out->push_back((char) value);
+}
+
+HpackTable::HpackTable(uint32_t max_size) : size_(0), max_size_(max_size) {}
+
+void HpackTable::evict(uint32_t limit) {
+    while (size_ > limit && !entries_.empty()) {
+        const HpackHeader& h = entries_.back();
+        size_ -= h.name.size() + h.value.size() + HPACK_ENTRY_OVERHEAD;
+        entries_.pop_back();
+    }
+}
+
+void HpackTable::set_max_size(uint32_t max_size) {
+    max_size_ = max_size;
+    evict(max_size_);
+}
+
+void HpackTable::add(const std::string& name, const std::string& value) {
+    uint32_t entry_size = name.size() + value.size() + HPACK_ENTRY_OVERHEAD;
+    if (entry_size > max_size_) {
+        // 比整张表还大的项会清空动态表，本身也不插入
+        evict(0);
+        return;
+    }
+    evict(max_size_ - entry_size);
+    entries_.push_front(HpackHeader{name, value});
+    size_ += entry_size;
+}
+
+bool HpackTable::get(uint32_t index, const std::string** name, const std::string** value) const {
+    static std::string static_names[HPACK_STATIC_COUNT];
+    static std::string static_values[HPACK_STATIC_COUNT];
+    static bool initialized = [] {
+        for (int i = 0; i < HPACK_STATIC_COUNT; ++i) {
+            static_names[i] = STATIC_TABLE[i].name;
+            static_values[i] = STATIC_TABLE[i].value;
+        }
+        return true;
+    }();
+    (void) initialized;
+    if (index == 0) {
+        return false;
+    }
+    if (index <= HPACK_STATIC_COUNT) {
+        *name = &static_names[index - 1];
+        *value = &static_values[index - 1];
+        return true;
+    }
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= entries_.size()) {
+        return false;
+    }
+    *name = &entries_[index].name;
+    *value = &entries_[index].value;
+    return true;
+}
+
+uint32_t HpackTable::find(const std::string& name, const std::string& value,
+                          uint32_t* name_index) const {
+    *name_index = 0;
+    for (uint32_t i = 0; i < HPACK_STATIC_COUNT; ++i) {
+        if (name == STATIC_TABLE[i].name) {
+            if (value == STATIC_TABLE[i].value) {
+                return i + 1;
+            }
+            if (*name_index == 0) {
+                *name_index = i + 1;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < entries_.size(); ++i) {
+        if (entries_[i].name == name) {
+            if (entries_[i].value == value) {
+                return i + HPACK_STATIC_COUNT + 1;
+            }
+            if (*name_index == 0) {
+                *name_index = i + HPACK_STATIC_COUNT + 1;
+            }
+        }
+    }
+    return 0;
+}
+
+HpackDecoder::HpackDecoder(uint32_t max_header_list)
+    : table_(HPACK_DEFAULT_TABLE_SIZE), settings_table_size_(HPACK_DEFAULT_TABLE_SIZE),
+      max_header_list_(max_header_list) {}
+
+bool HpackDecoder::read_string(const uint8_t*& p, const uint8_t* end, std::string* out) {
+    if (p >= end) {
+        return false;
+    }
+    bool huffman = (*p & 0x80) != 0;
+    uint32_t length;
+    if (!hpack_decode_integer(p, end, 7, &length) || length > (size_t) (end - p)) {
+        return false;
+    }
+    out->clear();
+    if (huffman) {
+        if (!huffman_decode(p, length, out)) {
+            return false;
+        }
+    }
+    else {
+        out->assign((const char*) p, length);
+    }
+    p += length;
+    return true;
+}
+
+bool HpackDecoder::decode(const uint8_t* data, size_t length, std::vector<HpackHeader>* headers) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + length;
+    uint32_t list_size = 0;
+    while (p < end) {
+        uint8_t b = *p;
+        HpackHeader header;
+        if (b & 0x80) {
+            // 索引表示
+            uint32_t index;
+            const std::string* name;
+            const std::string* value;
+            if (!hpack_decode_integer(p, end, 7, &index) || !table_.get(index, &name, &value)) {
+                return false;
+            }
+            header.name = *name;
+            header.value = *value;
+        }
+        else if ((b & 0xe0) == 0x20) {
+            // 动态表容量更新，只能出现在头部块开头
+            uint32_t size;
+            if (!headers->empty() || !hpack_decode_integer(p, end, 5, &size) ||
+                size > settings_table_size_) {
+                return false;
+            }
+            table_.set_max_size(size);
+            continue;
+        }
+        else {
+            // 字面量：0x40带增量索引，0x00不索引，0x10永不索引
+            bool indexing = (b & 0xc0) == 0x40;
+            uint32_t name_index;
+            if (!hpack_decode_integer(p, end, indexing ? 6 : 4, &name_index)) {
+                return false;
+            }
+            if (name_index == 0) {
+                if (!read_string(p, end, &header.name)) {
+                    return false;
+                }
+            }
+            else {
+                const std::string* name;
+                const std::string* value;
+                if (!table_.get(name_index, &name, &value)) {
+                    return false;
+                }
+                header.name = *name;
+            }
+            if (!read_string(p, end, &header.value)) {
+                return false;
+            }
+            if (indexing) {
+                table_.add(header.name, header.value);
+            }
+        }
+        list_size += header.name.size() + header.value.size() + HPACK_ENTRY_OVERHEAD;
+        if (list_size > max_header_list_) {
+            return false;
+        }
+        headers->push_back(header);
+    }
+    return true;
+}
+
+HpackEncoder::HpackEncoder() : table_(HPACK_DEFAULT_TABLE_SIZE), size_update_pending_(false) {}
+
+void HpackEncoder::set_max_table_size(uint32_t size) {
+    // 本端最多使用默认容量，对端给得更大也不用
+    if (size > HPACK_DEFAULT_TABLE_SIZE) {
+        size = HPACK_DEFAULT_TABLE_SIZE;
+    }
+    if (size != table_.max_size()) {
+        table_.set_max_size(size);
+        size_update_pending_ = true;
+    }
+}
+
+static void encode_string(const std::string& text, std::string* out) {
+    size_t huffman_length = huffman_encoded_length(text);
+    if (huffman_length < text.size()) {
+        hpack_encode_integer(huffman_length, 7, 0x80, out);
+        huffman_encode(text, out);
+    }
+    else {
+        hpack_encode_integer(text.size(), 7, 0x00, out);
+        out->append(text);
+    }
+}
+
+void HpackEncoder::encode(const std::string& name, const std::string& value, bool indexing,
+                          std::string* out) {
+    if (size_update_pending_) {
+        hpack_encode_integer(table_.max_size(), 5, 0x20, out);
+        size_update_pending_ = false;
+    }
+    uint32_t name_index;
+    uint32_t index = table_.find(name, value, &name_index);
+    if (index != 0) {
+        hpack_encode_integer(index, 7, 0x80, out);
+        return;
+    }
+    if (indexing) {
+        hpack_encode_integer(name_index, 6, 0x40, out);
+    }
+    else {
+        hpack_encode_integer(name_index, 4, 0x00, out);
+    }
+    if (name_index == 0) {
+        encode_string(name, out);
+    }
+    encode_string(value, out);
+    if (indexing) {
+        table_.add(name, value);
+    }
+}
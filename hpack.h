@@ -0,0 +1,82 @@
+#ifndef HTTP_SERVER_HPACK_H
+#define HTTP_SERVER_HPACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+// HPACK(RFC 7541)：静态表61项，动态表索引从62开始，最新插入的项索引最小
+#define HPACK_STATIC_COUNT 61
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+// 每项在动态表中占用的额外开销
+#define HPACK_ENTRY_OVERHEAD 32
+
+struct HpackHeader {
+    std::string name;
+    std::string value;
+};
+
+// 动态表，编码端和解码端各维护一份
+class HpackTable {
+public:
+    explicit HpackTable(uint32_t max_size = HPACK_DEFAULT_TABLE_SIZE);
+
+    // 调整容量，超出部分从最旧的项开始淘汰
+    void set_max_size(uint32_t max_size);
+    uint32_t max_size() const { return max_size_; }
+    void add(const std::string& name, const std::string& value);
+    // index为静态表与动态表合并后的下标(从1开始)
+    bool get(uint32_t index, const std::string** name, const std::string** value) const;
+    // 返回名字和值都匹配的下标，没有则返回0，name_index给出只有名字匹配的下标
+    uint32_t find(const std::string& name, const std::string& value, uint32_t* name_index) const;
+
+private:
+    void evict(uint32_t limit);
+
+    std::deque<HpackHeader> entries_;
+    uint32_t size_;
+    uint32_t max_size_;
+};
+
+class HpackDecoder {
+public:
+    // max_header_list为解码后头部列表的上限(按RFC 7540的计算方式)
+    explicit HpackDecoder(uint32_t max_header_list = 65536);
+
+    // 解码一个完整的头部块，失败说明压缩状态已不可信，只能关闭连接
+    bool decode(const uint8_t* data, size_t length, std::vector<HpackHeader>* headers);
+
+private:
+    bool read_string(const uint8_t*& p, const uint8_t* end, std::string* out);
+
+    HpackTable table_;
+    // 本端SETTINGS_HEADER_TABLE_SIZE，对端的容量更新不能超过它
+    uint32_t settings_table_size_;
+    uint32_t max_header_list_;
+};
+
+class HpackEncoder {
+public:
+    HpackEncoder();
+
+    // 对端SETTINGS_HEADER_TABLE_SIZE变化，下一个头部块开头通告新容量
+    void set_max_table_size(uint32_t size);
+    // indexing为false时用不索引的字面量，适合每次都不同的值(如content-length)
+    void encode(const std::string& name, const std::string& value, bool indexing,
+                std::string* out);
+
+private:
+    HpackTable table_;
+    bool size_update_pending_;
+};
+
+// 整数与霍夫曼编码，解码失败(溢出、非法填充、出现EOS)返回false
+bool hpack_decode_integer(const uint8_t*& p, const uint8_t* end, int prefix_bits, uint32_t* value);
+void hpack_encode_integer(uint32_t value, int prefix_bits, uint8_t first, std::string* out);
+bool huffman_decode(const uint8_t* data, size_t length, std::string* out);
+size_t huffman_encoded_length(const std::string& text);
+void huffman_encode(const std::string& text, std::string* out);
+
+#endif
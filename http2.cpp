@@ -0,0 +1,736 @@
+#include "http2.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <vector>
+
+#include "http_connection.h"
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+#define SETTINGS_HEADER_TABLE_SIZE 0x1
+#define SETTINGS_ENABLE_PUSH 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+
+static const char switching_protocols_101[] =
+    "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+std::atomic<uint64_t> Http2Session::sessions(0);
+std::atomic<uint64_t> Http2Session::streams(0);
+
+static uint32_t read_u32(const uint8_t* p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void write_u32(char* p, uint32_t v) {
+    p[0] = (char) (v >> 24);
+    p[1] = (char) (v >> 16);
+    p[2] = (char) (v >> 8);
+    p[3] = (char) v;
+}
+
+static void frame_header(char* p, uint32_t length, uint8_t type, uint8_t flags,
+                         uint32_t stream_id) {
+    p[0] = (char) (length >> 16);
+    p[1] = (char) (length >> 8);
+    p[2] = (char) length;
+    p[3] = (char) type;
+    p[4] = (char) flags;
+    write_u32(p + 5, stream_id & 0x7fffffff);
+}
+
+// HTTP2-Settings是不带填充的base64url，也容忍标准base64与填充
+static bool base64url_decode(const std::string& text, std::string* out) {
+    uint32_t acc = 0;
+    int bits = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        char c = text[i];
+        int v;
+        if (c >= 'A' && c <= 'Z') {
+            v = c - 'A';
+        }
+        else if (c >= 'a' && c <= 'z') {
+            v = c - 'a' + 26;
+        }
+        else if (c >= '0' && c <= '9') {
+            v = c - '0' + 52;
+        }
+        else if (c == '-' || c == '+') {
+            v = 62;
+        }
+        else if (c == '_' || c == '/') {
+            v = 63;
+        }
+        else if (c == '=') {
+            break;
+        }
+        else {
+            return false;
+        }
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out->push_back((char) (acc >> bits));
+        }
+    }
+    return true;
+}
+
+Http2Session::Http2Session(const IpKey& ip_key)
+    : ip_key_(ip_key), preface_received_(false), settings_received_(false), last_stream_id_(0),
+      header_stream_(0), header_end_stream_(false), conn_send_window_(H2_DEFAULT_WINDOW),
+      initial_window_(H2_DEFAULT_WINDOW), peer_max_frame_(H2_DEFAULT_FRAME_SIZE), out_bytes_(0),
+      next_stream_(0), goaway_sent_(false), goaway_received_(false) {
+    ++sessions;
+}
+
+void Http2Session::start() {
+    // 服务端前言：只通告并发流上限，其余取默认值
+    char settings[6];
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    write_u32(settings + 2, H2_MAX_CONCURRENT_STREAMS);
+    queue_frame(FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+}
+
+bool Http2Session::start_upgrade(const std::string& settings, const char* url, bool head,
+                                 bool accept_gzip) {
+    std::string payload;
+    if (!base64url_decode(settings, &payload) || payload.size() % 6 != 0 ||
+        !apply_settings((const uint8_t*) payload.data(), payload.size())) {
+        return false;
+    }
+    queue_bytes(switching_protocols_101, sizeof(switching_protocols_101) - 1);
+    start();
+    // 升级请求隐式成为流1，请求方向已经结束
+    last_stream_id_ = 1;
+    H2Stream& stream = streams_[1];
+    stream.id = 1;
+    stream.send_window = initial_window_;
+    stream.remote_closed = true;
+    stream.data = nullptr;
+    stream.remaining = 0;
+    ++streams;
+    respond(1, head ? "HEAD" : "GET", url, accept_gzip);
+    return true;
+}
+
+bool Http2Session::append_input(const char* data, size_t length) {
+    if (in_.size() + length > H2_MAX_INPUT) {
+        return false;
+    }
+    in_.append(data, length);
+    return true;
+}
+
+bool Http2Session::process_input() {
+    if (goaway_sent_) {
+        in_.clear();
+        return false;
+    }
+    const uint8_t* p = (const uint8_t*) in_.data();
+    size_t avail = in_.size();
+    size_t consumed = 0;
+    bool ok = true;
+    if (!preface_received_) {
+        size_t n = avail < H2_PREFACE_LENGTH ? avail : H2_PREFACE_LENGTH;
+        if (memcmp(p, H2_PREFACE, n) != 0) {
+            in_.clear();
+            return connection_error(PROTOCOL_ERROR);
+        }
+        if (n < H2_PREFACE_LENGTH) {
+            return true;
+        }
+        preface_received_ = true;
+        consumed = H2_PREFACE_LENGTH;
+    }
+    while (avail - consumed >= H2_FRAME_HEADER_LENGTH) {
+        const uint8_t* f = p + consumed;
+        uint32_t length = (uint32_t) f[0] << 16 | (uint32_t) f[1] << 8 | f[2];
+        uint8_t type = f[3];
+        uint8_t flags = f[4];
+        uint32_t stream_id = read_u32(f + 5) & 0x7fffffff;
+        if (length > H2_DEFAULT_FRAME_SIZE) {
+            ok = connection_error(FRAME_SIZE_ERROR);
+            break;
+        }
+        if (avail - consumed < H2_FRAME_HEADER_LENGTH + length) {
+            break;
+        }
+        // 前言之后的第一帧必须是SETTINGS；头部块未结束时只能跟同一流的CONTINUATION
+        if ((!settings_received_ && type != FRAME_SETTINGS) ||
+            (header_stream_ != 0 && (type != FRAME_CONTINUATION || stream_id != header_stream_))) {
+            ok = connection_error(PROTOCOL_ERROR);
+            break;
+        }
+        if (!handle_frame(type, flags, stream_id, f + H2_FRAME_HEADER_LENGTH, length)) {
+            ok = false;
+            break;
+        }
+        consumed += H2_FRAME_HEADER_LENGTH + length;
+    }
+    if (!ok) {
+        in_.clear();
+        return false;
+    }
+    in_.erase(0, consumed);
+    return true;
+}
+
+bool Http2Session::handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id,
+                                const uint8_t* payload, uint32_t length) {
+    switch (type) {
+        case FRAME_DATA: {
+            return handle_data(flags, stream_id, payload, length);
+        }
+        case FRAME_HEADERS: {
+            return handle_headers(flags, stream_id, payload, length);
+        }
+        case FRAME_PRIORITY: {
+            // 不按优先级调度，只检查格式
+            if (stream_id == 0) {
+                return connection_error(PROTOCOL_ERROR);
+            }
+            if (length != 5) {
+                queue_rst_stream(stream_id, FRAME_SIZE_ERROR);
+            }
+            return true;
+        }
+        case FRAME_RST_STREAM: {
+            if (stream_id == 0 || stream_id > last_stream_id_) {
+                return connection_error(PROTOCOL_ERROR);
+            }
+            if (length != 4) {
+                return connection_error(FRAME_SIZE_ERROR);
+            }
+            // 已排队的DATA帧持有响应体引用，删除流是安全的
+            streams_.erase(stream_id);
+            return true;
+        }
+        case FRAME_SETTINGS: {
+            if (stream_id != 0) {
+                return connection_error(PROTOCOL_ERROR);
+            }
+            if (flags & FLAG_ACK) {
+                return length == 0 ? true : connection_error(FRAME_SIZE_ERROR);
+            }
+            if (length % 6 != 0) {
+                return connection_error(FRAME_SIZE_ERROR);
+            }
+            if (!apply_settings(payload, length)) {
+                return false;
+            }
+            settings_received_ = true;
+            queue_frame(FRAME_SETTINGS, FLAG_ACK, 0, nullptr, 0);
+            return true;
+        }
+        case FRAME_PUSH_PROMISE: {
+            // 客户端不能推送
+            return connection_error(PROTOCOL_ERROR);
+        }
+        case FRAME_PING: {
+            if (stream_id != 0) {
+                return connection_error(PROTOCOL_ERROR);
+            }
+            if (length != 8) {
+                return connection_error(FRAME_SIZE_ERROR);
+            }
+            if (!(flags & FLAG_ACK)) {
+                queue_frame(FRAME_PING, FLAG_ACK, 0, (const char*) payload, 8);
+            }
+            return true;
+        }
+        case FRAME_GOAWAY: {
+            if (stream_id != 0) {
+                return connection_error(PROTOCOL_ERROR);
+            }
+            if (length < 8) {
+                return connection_error(FRAME_SIZE_ERROR);
+            }
+            // 发完已接受的流之后关闭
+            goaway_received_ = true;
+            return true;
+        }
+        case FRAME_WINDOW_UPDATE: {
+            return handle_window_update(stream_id, payload, length);
+        }
+        case FRAME_CONTINUATION: {
+            if (header_stream_ == 0) {
+                return connection_error(PROTOCOL_ERROR);
+            }
+            if (header_block_.size() + length > H2_MAX_HEADER_BLOCK) {
+                return connection_error(ENHANCE_YOUR_CALM);
+            }
+            header_block_.append((const char*) payload, length);
+            if (flags & FLAG_END_HEADERS) {
+                return finish_header_block();
+            }
+            return true;
+        }
+        default: {
+            // 未知类型的帧必须忽略
+            return true;
+        }
+    }
+}
+
+bool Http2Session::handle_data(uint8_t flags, uint32_t stream_id, const uint8_t* payload,
+                               uint32_t length) {
+    if (stream_id == 0 || stream_id > last_stream_id_) {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    if ((flags & FLAG_PADDED) && (length == 0 || payload[0] >= length)) {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    std::map<uint32_t, H2Stream>::iterator it = streams_.find(stream_id);
+    if (it != streams_.end() && it->second.remote_closed) {
+        queue_rst_stream(stream_id, STREAM_CLOSED);
+        streams_.erase(it);
+        it = streams_.end();
+    }
+    // 请求体不需要，收到多少立即归还多少窗口(含填充)
+    if (length > 0) {
+        char increment[4];
+        write_u32(increment, length);
+        queue_frame(FRAME_WINDOW_UPDATE, 0, 0, increment, 4);
+        if (it != streams_.end() && !(flags & FLAG_END_STREAM)) {
+            queue_frame(FRAME_WINDOW_UPDATE, 0, stream_id, increment, 4);
+        }
+    }
+    if (it != streams_.end() && (flags & FLAG_END_STREAM)) {
+        it->second.remote_closed = true;
+    }
+    return true;
+}
+
+bool Http2Session::handle_headers(uint8_t flags, uint32_t stream_id, const uint8_t* payload,
+                                  uint32_t length) {
+    if (stream_id == 0 || stream_id % 2 == 0) {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    uint32_t offset = 0;
+    uint32_t padding = 0;
+    if (flags & FLAG_PADDED) {
+        if (length < 1) {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        padding = payload[0];
+        offset = 1;
+    }
+    if (flags & FLAG_PRIORITY) {
+        offset += 5;
+    }
+    if (offset + padding > length) {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    header_block_.assign((const char*) payload + offset, length - offset - padding);
+    header_stream_ = stream_id;
+    header_end_stream_ = (flags & FLAG_END_STREAM) != 0;
+    if (flags & FLAG_END_HEADERS) {
+        return finish_header_block();
+    }
+    return true;
+}
+
+bool Http2Session::finish_header_block() {
+    uint32_t stream_id = header_stream_;
+    header_stream_ = 0;
+    std::vector<HpackHeader> headers;
+    // 即使流随后被拒绝也必须解码，否则动态表会和对端不一致
+    bool decoded = decoder_.decode((const uint8_t*) header_block_.data(), header_block_.size(),
+                                   &headers);
+    header_block_.clear();
+    if (!decoded) {
+        return connection_error(COMPRESSION_ERROR);
+    }
+    if (stream_id <= last_stream_id_) {
+        // 已有流上的trailer，或已经响应完的流，内容不关心
+        std::map<uint32_t, H2Stream>::iterator it = streams_.find(stream_id);
+        if (it != streams_.end() && header_end_stream_) {
+            it->second.remote_closed = true;
+        }
+        return true;
+    }
+    last_stream_id_ = stream_id;
+    if (streams_.size() >= H2_MAX_CONCURRENT_STREAMS) {
+        queue_rst_stream(stream_id, REFUSED_STREAM);
+        return true;
+    }
+    std::string method;
+    std::string path;
+    bool accept_gzip = false;
+    bool regular_seen = false;
+    for (size_t i = 0; i < headers.size(); ++i) {
+        const HpackHeader& h = headers[i];
+        bool pseudo = !h.name.empty() && h.name[0] == ':';
+        bool lower = true;
+        for (size_t c = 0; c < h.name.size(); ++c) {
+            lower = lower && !isupper((unsigned char) h.name[c]);
+        }
+        // 伪头部必须在普通头部之前，名字必须小写
+        if ((pseudo && regular_seen) || !lower) {
+            queue_rst_stream(stream_id, PROTOCOL_ERROR);
+            return true;
+        }
+        if (h.name == ":method") {
+            method = h.value;
+        }
+        else if (h.name == ":path") {
+            path = h.value;
+        }
+        else if (h.name == "accept-encoding") {
+            accept_gzip = h.value.find("gzip") != std::string::npos;
+        }
+        regular_seen = regular_seen || !pseudo;
+    }
+    if (method.empty() || path.empty()) {
+        queue_rst_stream(stream_id, PROTOCOL_ERROR);
+        return true;
+    }
+    H2Stream& stream = streams_[stream_id];
+    stream.id = stream_id;
+    stream.send_window = initial_window_;
+    stream.remote_closed = header_end_stream_;
+    stream.data = nullptr;
+    stream.remaining = 0;
+    ++streams;
+    respond(stream_id, method, path, accept_gzip);
+    return true;
+}
+
+void Http2Session::respond(uint32_t stream_id, const std::string& method, std::string path,
+                           bool accept_gzip) {
+    bool head = method == "HEAD";
+    if (HTTPConnection::ip_limiter != nullptr &&
+        !HTTPConnection::ip_limiter->allow_request(ip_key_, monotonic_ms())) {
+        // 按地址限流，和HTTP/1.1一样回复429
+        std::string block;
+        encoder_.encode(":status", "429", true, &block);
+        encoder_.encode("retry-after", "1", true, &block);
+        encoder_.encode("content-length", "0", true, &block);
+        send_headers(stream_id, block, true);
+        streams_.erase(stream_id);
+        return;
+    }
+    if (method != "GET" && !head) {
+        const char* title;
+        const char* form;
+        int status = HTTPConnection::error_page(HTTPConnection::BAD_REQUEST, &title, &form);
+        send_error_page(stream_id, status, form, head);
+        return;
+    }
+    // 规范化和HTTP/1.1共用，原地修改
+    std::vector<char> url(path.begin(), path.end());
+    url.push_back('\0');
+    std::shared_ptr<StaticFile> file(new StaticFile());
+    HTTPConnection::HttpCode code = HTTPConnection::BAD_REQUEST;
+    if (HTTPConnection::normalize_target(&url[0])) {
+        code = HTTPConnection::open_file(&url[0], accept_gzip, file.get());
+    }
+    if (code != HTTPConnection::FILE_REQUEST) {
+        const char* title;
+        const char* form;
+        int status = HTTPConnection::error_page(code, &title, &form);
+        send_error_page(stream_id, status, form, head);
+        return;
+    }
+    std::string block;
+    encoder_.encode(":status", "200", true, &block);
+    if (file->pack) {
+        // 资源包里预生成的是HTTP/1.1格式的头部行，转成小写的名字
+        const char* p = file->pack_headers;
+        const char* end = p + file->pack_headers_length;
+        while (p < end) {
+            const char* line_end = (const char*) memchr(p, '\r', end - p);
+            if (line_end == nullptr) {
+                line_end = end;
+            }
+            const char* colon = (const char*) memchr(p, ':', line_end - p);
+            if (colon != nullptr) {
+                std::string name(p, colon);
+                for (size_t i = 0; i < name.size(); ++i) {
+                    name[i] = (char) tolower((unsigned char) name[i]);
+                }
+                const char* value = colon + 1;
+                while (value < line_end && *value == ' ') {
+                    ++value;
+                }
+                bool indexing = name != "content-length" && name != "etag";
+                encoder_.encode(name, std::string(value, line_end), indexing, &block);
+            }
+            p = line_end + 2;
+        }
+    }
+    else {
+        encoder_.encode("content-length", std::to_string(file->length), false, &block);
+        encoder_.encode("content-type", "text/html", true, &block);
+    }
+    if (head || file->length == 0) {
+        send_headers(stream_id, block, true);
+        streams_.erase(stream_id);
+        return;
+    }
+    send_headers(stream_id, block, false);
+    H2Stream& stream = streams_[stream_id];
+    stream.data = file->address;
+    stream.remaining = file->length;
+    stream.body = file;
+}
+
+void Http2Session::send_error_page(uint32_t stream_id, int status, const char* body, bool head) {
+    size_t length = strlen(body);
+    std::string block;
+    encoder_.encode(":status", std::to_string(status), true, &block);
+    encoder_.encode("content-length", std::to_string(length), false, &block);
+    encoder_.encode("content-type", "text/html", true, &block);
+    if (head) {
+        send_headers(stream_id, block, true);
+        streams_.erase(stream_id);
+        return;
+    }
+    send_headers(stream_id, block, false);
+    // 错误页是静态字符串，不需要持有引用
+    H2Stream& stream = streams_[stream_id];
+    stream.data = body;
+    stream.remaining = length;
+}
+
+void Http2Session::send_headers(uint32_t stream_id, const std::string& block, bool end_stream) {
+    // 超过对端帧长上限的头部块拆成HEADERS加若干CONTINUATION
+    size_t offset = 0;
+    bool first = true;
+    do {
+        size_t n = block.size() - offset;
+        if (n > peer_max_frame_) {
+            n = peer_max_frame_;
+        }
+        bool last = offset + n == block.size();
+        uint8_t flags = last ? FLAG_END_HEADERS : 0;
+        if (first && end_stream) {
+            flags |= FLAG_END_STREAM;
+        }
+        queue_frame(first ? FRAME_HEADERS : FRAME_CONTINUATION, flags, stream_id,
+                    block.data() + offset, n);
+        offset += n;
+        first = false;
+    } while (offset < block.size());
+}
+
+bool Http2Session::apply_settings(const uint8_t* payload, uint32_t length) {
+    for (uint32_t i = 0; i + 6 <= length; i += 6) {
+        uint16_t id = (uint16_t) (payload[i] << 8 | payload[i + 1]);
+        uint32_t value = read_u32(payload + i + 2);
+        switch (id) {
+            case SETTINGS_HEADER_TABLE_SIZE: {
+                encoder_.set_max_table_size(value);
+                break;
+            }
+            case SETTINGS_ENABLE_PUSH: {
+                if (value > 1) {
+                    return connection_error(PROTOCOL_ERROR);
+                }
+                break;
+            }
+            case SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > H2_MAX_WINDOW) {
+                    return connection_error(FLOW_CONTROL_ERROR);
+                }
+                // 新初始窗口按差值作用到所有已打开的流
+                int64_t delta = (int64_t) value - initial_window_;
+                for (std::map<uint32_t, H2Stream>::iterator it = streams_.begin();
+                     it != streams_.end(); ++it) {
+                    it->second.send_window += delta;
+                    if (it->second.send_window > H2_MAX_WINDOW) {
+                        return connection_error(FLOW_CONTROL_ERROR);
+                    }
+                }
+                initial_window_ = value;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE: {
+                if (value < H2_DEFAULT_FRAME_SIZE || value > 16777215) {
+                    return connection_error(PROTOCOL_ERROR);
+                }
+                peer_max_frame_ = value;
+                break;
+            }
+            default: {
+                // 未知设置必须忽略
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+bool Http2Session::handle_window_update(uint32_t stream_id, const uint8_t* payload,
+                                        uint32_t length) {
+    if (length != 4) {
+        return connection_error(FRAME_SIZE_ERROR);
+    }
+    uint32_t increment = read_u32(payload) & 0x7fffffff;
+    if (stream_id == 0) {
+        if (increment == 0) {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        conn_send_window_ += increment;
+        if (conn_send_window_ > H2_MAX_WINDOW) {
+            return connection_error(FLOW_CONTROL_ERROR);
+        }
+        return true;
+    }
+    std::map<uint32_t, H2Stream>::iterator it = streams_.find(stream_id);
+    if (increment == 0) {
+        queue_rst_stream(stream_id, PROTOCOL_ERROR);
+        if (it != streams_.end()) {
+            streams_.erase(it);
+        }
+        return true;
+    }
+    if (it != streams_.end()) {
+        it->second.send_window += increment;
+        if (it->second.send_window > H2_MAX_WINDOW) {
+            queue_rst_stream(stream_id, FLOW_CONTROL_ERROR);
+            streams_.erase(it);
+        }
+    }
+    return true;
+}
+
+void Http2Session::schedule() {
+    // 升级时先只发101、SETTINGS和响应头，收到对端前言后再发响应体，
+    // 有的客户端在101之后只能缓存有限的数据
+    if (goaway_sent_ || !preface_received_) {
+        return;
+    }
+    // 每轮给每个可发送的流一个DATA帧，直到窗口用完或输出队列够长
+    bool progress = true;
+    while (progress && !streams_.empty() && conn_send_window_ > 0 &&
+           out_bytes_ < H2_OUTPUT_HIGH_WATER) {
+        progress = false;
+        std::map<uint32_t, H2Stream>::iterator it = streams_.lower_bound(next_stream_);
+        size_t count = streams_.size();
+        for (size_t i = 0; i < count && conn_send_window_ > 0 &&
+                           out_bytes_ < H2_OUTPUT_HIGH_WATER; ++i) {
+            if (it == streams_.end()) {
+                it = streams_.begin();
+            }
+            H2Stream& stream = it->second;
+            int64_t n = (int64_t) stream.remaining;
+            n = std::min(n, (int64_t) peer_max_frame_);
+            n = std::min(n, stream.send_window);
+            n = std::min(n, conn_send_window_);
+            if (stream.data == nullptr || n <= 0) {
+                ++it;
+                continue;
+            }
+            bool end_stream = (size_t) n == stream.remaining;
+            char header[H2_FRAME_HEADER_LENGTH];
+            frame_header(header, n, FRAME_DATA, end_stream ? FLAG_END_STREAM : 0, stream.id);
+            queue_bytes(header, sizeof(header));
+            // 负载直接引用映射，不拷贝
+            H2Chunk chunk;
+            chunk.data = stream.data;
+            chunk.length = n;
+            chunk.sent = 0;
+            chunk.body = stream.body;
+            out_.push_back(chunk);
+            out_bytes_ += n;
+            stream.data += n;
+            stream.remaining -= n;
+            stream.send_window -= n;
+            conn_send_window_ -= n;
+            progress = true;
+            if (end_stream) {
+                it = streams_.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        next_stream_ = it == streams_.end() ? 0 : it->first;
+    }
+}
+
+int Http2Session::gather(struct iovec* iov, int max) const {
+    int count = 0;
+    for (std::deque<H2Chunk>::const_iterator it = out_.begin(); it != out_.end() && count < max;
+         ++it) {
+        const char* base = it->data != nullptr ? it->data : it->bytes.data();
+        iov[count].iov_base = (void*) (base + it->sent);
+        iov[count].iov_len = it->length - it->sent;
+        ++count;
+    }
+    return count;
+}
+
+void Http2Session::consume(size_t n) {
+    out_bytes_ -= n;
+    while (n > 0 && !out_.empty()) {
+        H2Chunk& chunk = out_.front();
+        size_t left = chunk.length - chunk.sent;
+        if (n < left) {
+            chunk.sent += n;
+            return;
+        }
+        n -= left;
+        out_.pop_front();
+    }
+}
+
+bool Http2Session::finished() const {
+    if (goaway_sent_) {
+        return out_.empty();
+    }
+    return goaway_received_ && streams_.empty() && out_.empty();
+}
+
+void Http2Session::queue_bytes(const char* data, size_t length) {
+    // 连续的小帧合并到同一段，减少writev的分段数
+    if (out_.empty() || out_.back().data != nullptr) {
+        H2Chunk chunk;
+        chunk.data = nullptr;
+        chunk.length = 0;
+        chunk.sent = 0;
+        out_.push_back(chunk);
+    }
+    H2Chunk& chunk = out_.back();
+    chunk.bytes.append(data, length);
+    chunk.length = chunk.bytes.size();
+    out_bytes_ += length;
+}
+
+void Http2Session::queue_frame(uint8_t type, uint8_t flags, uint32_t stream_id,
+                               const char* payload, uint32_t length) {
+    char header[H2_FRAME_HEADER_LENGTH];
+    frame_header(header, length, type, flags, stream_id);
+    queue_bytes(header, sizeof(header));
+    if (length > 0) {
+        queue_bytes(payload, length);
+    }
+}
+
+void Http2Session::queue_rst_stream(uint32_t stream_id, ErrorCode code) {
+    char payload[4];
+    write_u32(payload, code);
+    queue_frame(FRAME_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+bool Http2Session::connection_error(ErrorCode code) {
+    if (!goaway_sent_) {
+        char payload[8];
+        write_u32(payload, last_stream_id_);
+        write_u32(payload + 4, code);
+        queue_frame(FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+        goaway_sent_ = true;
+    }
+    return false;
+}
@@ -0,0 +1,159 @@
+#ifndef HTTP_SERVER_HTTP2_H
+#define HTTP_SERVER_HTTP2_H
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "hpack.h"
+#include "ip_limiter.h"
+
+struct StaticFile;
+
+// 客户端连接前言，先验知识(prior knowledge)方式直接以它开头
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LENGTH 24
+#define H2_FRAME_HEADER_LENGTH 9
+#define H2_DEFAULT_FRAME_SIZE 16384
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+// 本端通告的并发流上限
+#define H2_MAX_CONCURRENT_STREAMS 100
+// 未处理输入的上限，超过说明对端不读我们的响应或在灌数据
+#define H2_MAX_INPUT (1 << 20)
+// 输出队列超过它之后暂停切分DATA帧，等发出去再继续
+#define H2_OUTPUT_HIGH_WATER (256 * 1024)
+// 头部块(HEADERS+CONTINUATION)的上限
+#define H2_MAX_HEADER_BLOCK 65536
+// 一次writev最多聚集的分段数
+#define H2_IOV_MAX 64
+
+// 一条HTTP/2流，只记录响应需要的状态
+struct H2Stream {
+    uint32_t id;
+    int64_t send_window;
+    bool remote_closed; // 收到了END_STREAM
+    // 尚未切成DATA帧的响应体
+    std::shared_ptr<StaticFile> body;
+    const char* data;
+    size_t remaining;
+};
+
+// 输出队列中的一段：自有的帧字节，或直接引用响应体映射的DATA负载
+struct H2Chunk {
+    std::string bytes;
+    const char* data; // 为nullptr时发送bytes
+    size_t length;
+    size_t sent;
+    // 引用映射期间保持它有效
+    std::shared_ptr<StaticFile> body;
+};
+
+// 一个HTTP/2连接(h2c)的协议状态：帧解析、HPACK、流控与多路复用。
+// 输入由主线程读入、工作线程处理，输出由主线程聚集写；EPOLLONESHOT保证同一时刻只有一个线程访问。
+class Http2Session {
+public:
+    explicit Http2Session(const IpKey& ip_key);
+
+    // 先验知识：对端的前言随后在输入中到达
+    void start();
+    // 从HTTP/1.1升级：settings为HTTP2-Settings头的值，url为升级请求的目标，作为流1响应
+    bool start_upgrade(const std::string& settings, const char* url, bool head,
+                       bool accept_gzip);
+
+    // 主线程读到的字节，超过输入上限返回false
+    bool append_input(const char* data, size_t length);
+    // 工作线程：处理所有完整的帧，协议错误时排入GOAWAY并返回false
+    bool process_input();
+    // 按流控窗口把响应体切成DATA帧放入输出队列
+    void schedule();
+    // 聚集待发送的分段，返回iovec个数
+    int gather(struct iovec* iov, int max) const;
+    // 已发送n字节
+    void consume(size_t n);
+    bool has_output() const { return !out_.empty(); }
+    // 连接可以关闭：出错或双方GOAWAY后，所有输出都已发出
+    bool finished() const;
+
+    static std::atomic<uint64_t> sessions;
+    static std::atomic<uint64_t> streams;
+
+private:
+    enum FrameType {
+        FRAME_DATA = 0,
+        FRAME_HEADERS,
+        FRAME_PRIORITY,
+        FRAME_RST_STREAM,
+        FRAME_SETTINGS,
+        FRAME_PUSH_PROMISE,
+        FRAME_PING,
+        FRAME_GOAWAY,
+        FRAME_WINDOW_UPDATE,
+        FRAME_CONTINUATION
+    };
+    enum ErrorCode {
+        NO_ERROR = 0,
+        PROTOCOL_ERROR,
+        INTERNAL_ERROR,
+        FLOW_CONTROL_ERROR,
+        SETTINGS_TIMEOUT,
+        STREAM_CLOSED,
+        FRAME_SIZE_ERROR,
+        REFUSED_STREAM,
+        CANCEL,
+        COMPRESSION_ERROR,
+        CONNECT_ERROR,
+        ENHANCE_YOUR_CALM
+    };
+
+    bool handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload,
+                      uint32_t length);
+    bool handle_data(uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t length);
+    bool handle_headers(uint8_t flags, uint32_t stream_id, const uint8_t* payload,
+                        uint32_t length);
+    bool apply_settings(const uint8_t* payload, uint32_t length);
+    bool handle_window_update(uint32_t stream_id, const uint8_t* payload, uint32_t length);
+    bool finish_header_block();
+    // 处理一个完整的请求
+    void respond(uint32_t stream_id, const std::string& method, std::string path,
+                 bool accept_gzip);
+    void send_error_page(uint32_t stream_id, int status, const char* body, bool head);
+    void send_headers(uint32_t stream_id, const std::string& block, bool end_stream);
+
+    void queue_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const char* payload,
+                     uint32_t length);
+    void queue_bytes(const char* data, size_t length);
+    void queue_rst_stream(uint32_t stream_id, ErrorCode code);
+    // 连接错误：发送GOAWAY后不再处理输入
+    bool connection_error(ErrorCode code);
+
+    IpKey ip_key_;
+    HpackDecoder decoder_;
+    HpackEncoder encoder_;
+    std::string in_;
+    bool preface_received_;
+    bool settings_received_;
+    std::map<uint32_t, H2Stream> streams_;
+    uint32_t last_stream_id_;
+    // 正在接收的头部块(等待CONTINUATION)
+    uint32_t header_stream_;
+    bool header_end_stream_;
+    std::string header_block_;
+    // 对端的设置
+    int64_t conn_send_window_;
+    int64_t initial_window_;
+    uint32_t peer_max_frame_;
+    std::deque<H2Chunk> out_;
+    size_t out_bytes_;
+    // 轮转调度的起点，避免大响应饿死其他流
+    uint32_t next_stream_;
+    bool goaway_sent_;
+    bool goaway_received_;
+};
+
+#endif
@@ -1,15 +1,24 @@
 
 #include "http_connection.h"
 
+#include "http2.h"
+#include "websocket.h"
+
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
 #include <unistd.h>
 
+#include <linux/openat2.h>
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <strings.h>
+#include <sys/syscall.h>
+
 #include <cstdio>
-#include <regex>
+#include <algorithm>
+#include <cstring>
 
-const char* RootPath = "/home/llz/CPP";
 
 // 定义HTTP响应的一些状态信息
 const char* ok_200_title = "OK";
@@ -19,25 +28,134 @@ const char* error_400_form =
 const char* error_403_title = "Forbidden";
 const char* error_403_form =
     "You do not have permission to get file from this server.\n";
+const char* error_401_title = "Unauthorized";
+const char* error_401_form =
+    "A valid upload token is required.\n";
 const char* error_404_title = "Not Found";
 const char* error_404_form =
     "The requested file was not found on this server.\n";
+const char* error_405_title = "Method Not Allowed";
+const char* error_405_form =
+    "Only GET is allowed on this path.\n";
+const char* error_411_title = "Length Required";
+const char* error_411_form =
+    "Uploads must carry a Content-Length.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form =
     "There was an unusual problem serving the requested file.\n";
+const char* error_507_title = "Insufficient Storage";
+const char* error_507_form =
+    "There is not enough space to store the upload.\n";
+const char* continue_100 = "HTTP/1.1 100 Continue\r\n\r\n";
+const char HTTPConnection::too_many_requests_429[] =
+    "HTTP/1.1 429 Too Many Requests\r\nContent-Length: 0\r\nRetry-After: 1\r\n"
+    "Connection: close\r\n\r\n";
+const char HTTPConnection::service_unavailable_503[] =
+    "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nRetry-After: 1\r\n"
+    "Connection: close\r\n\r\n";
 
 int HTTPConnection::epoll_fd = -1;
+int HTTPConnection::root_fd = -1;
 int HTTPConnection::user_count = 0;
+SlowClientPolicy HTTPConnection::slow_policy = {10000, 128, 1024, 1024, 2000};
+std::atomic<uint64_t> HTTPConnection::evictions[EVICT_REASON_COUNT];
+IpLimiter* HTTPConnection::ip_limiter = nullptr;
+BlockingIoPool* HTTPConnection::io_pool = nullptr;
+TlsContext* HTTPConnection::tls = nullptr;
+std::string HTTPConnection::ws_prefix;
+std::string HTTPConnection::trace_path;
+std::vector<std::string> HTTPConnection::control_paths;
+size_t HTTPConnection::large_body_bytes = 256 << 10;
+ReverseProxy* HTTPConnection::proxy = nullptr;
+std::vector<AsyncRoute> HTTPConnection::async_routes;
+Reactor* HTTPConnection::reactor = nullptr;
+OffloadPool* HTTPConnection::offload = nullptr;
+ResponseCache* HTTPConnection::cache = nullptr;
+std::atomic<uint64_t> HTTPConnection::io_deferrals(0);
+int HTTPConnection::max_requests = 0;
+std::atomic<uint64_t> HTTPConnection::max_requests_closes(0);
+size_t HTTPConnection::zerocopy_min_bytes = 0;
+std::vector<std::string> HTTPConnection::upload_prefixes;
+std::string HTTPConnection::upload_token;
+
+// 文件系统上的响应体大小只有打开后才知道，工作线程按路径哈希记下是否是大文件，
+// 主线程分类时查看；有损，冲突或未命中时当作小文件
+static std::atomic<uint64_t> size_hints[SIZE_HINT_SLOTS];
 
-bool ignore_case_compare(const std::string& str1, const std::string& str2) {
-    if (str1.size() == str2.size()) {
-        return std::equal(
-            str1.begin(), str1.end(), str2.begin(),
-            [](char a, char b) { return tolower(a) == tolower(b); });
+static void note_body_size(const char* url, size_t length) {
+    uint64_t h = pack_hash(url, strlen(url), 0);
+    uint64_t hint = (h & ~1ull) | (length >= HTTPConnection::large_body_bytes ? 1 : 0);
+    std::atomic<uint64_t>& slot = size_hints[h & (SIZE_HINT_SLOTS - 1)];
+    if (slot.load(std::memory_order_relaxed) != hint) {
+        slot.store(hint, std::memory_order_relaxed);
     }
-    else {
+}
+
+static bool large_body_hint(const char* url) {
+    uint64_t h = pack_hash(url, strlen(url), 0);
+    uint64_t hint = size_hints[h & (SIZE_HINT_SLOTS - 1)].load(std::memory_order_relaxed);
+    return hint == (h | 1);
+}
+
+uint64_t monotonic_ms() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool HTTPConnection::open_root(const char* path) {
+    int fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
         return false;
     }
+    if (root_fd != -1) {
+        close(root_fd);
+    }
+    root_fd = fd;
+    return true;
+}
+
+int HTTPConnection::open_beneath_root(const char* relative) {
+    static std::atomic<bool> has_openat2(true);
+    if (has_openat2.load(std::memory_order_relaxed)) {
+        open_how how{};
+        how.flags = O_RDONLY | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS;
+        int fd = (int) syscall(SYS_openat2, root_fd, relative, &how, sizeof(how));
+        if (fd != -1 || errno != ENOSYS) {
+            return fd;
+        }
+        has_openat2.store(false, std::memory_order_relaxed);
+    }
+    // 内核不支持openat2(5.6之前)：路径已规范化不含..，这里只能拒绝最后一段是符号链接
+    return openat(root_fd, relative, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// 不转发给上游的请求头：逐跳头部，以及由代理重新生成的Host和请求体相关头部
+static bool hop_by_hop_header(const StringRef& name) {
+    static const char* names[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE",
+                                  "Upgrade", "Host", "Content-Length", "Transfer-Encoding",
+                                  "Expect", "HTTP2-Settings"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (strlen(names[i]) == name.length &&
+            strncasecmp(name.data, names[i], name.length) == 0) {
+            return true;
+        }
+    }
+    return false;
 }
 
 void set_no_blocking(int fd) {
@@ -46,9 +164,10 @@ void set_no_blocking(int fd) {
     fcntl(fd, F_SETFL, flags);
 }
 
-void addfd(int epoll_fd, int fd, bool one_shot, bool ET = true) {
+// data为epoll事件携带的数据：连接句柄，或代数为0的原始fd
+void addfd(int epoll_fd, int fd, uint64_t data, bool one_shot, bool ET = true) {
     epoll_event event{};
-    event.data.fd = fd;
+    event.data.u64 = data;
     // 监听读和异常断开
     if (ET) {
         event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
@@ -70,156 +189,1132 @@ void delfd(int epoll_fd, int fd) {
     close(fd);
 }
 
-void modfd(int epoll_fd, int fd, uint32_t ev) {
+void modfd(int epoll_fd, int fd, uint64_t data, uint32_t ev) {
     epoll_event event{};
-    event.data.fd = fd;
+    event.data.u64 = data;
     event.events = ev | EPOLLONESHOT | EPOLLRDHUP;
     epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
 }
 
-HTTPConnection::HTTPConnection()  = default;
+HTTPConnection::HTTPConnection()
+    : timer(nullptr), sock_fd(-1), transport_(SocketTransport::instance()), handle_(0),
+      ssl_(nullptr), tls_handshaking_(false), ktls_send_(false), content_length_(0),
+      has_content_length_(false), headers_(nullptr), header_count_(0), header_capacity_(0),
+      expect_continue_(false), h2_(nullptr), upgrade_h2c_(false), ws_(nullptr),
+      upgrade_websocket_(false), proxy_route_(-1), proxying_(false), async_route_(-1),
+      async_(false), connection_upgrade_(false), ws_version_(0),
+      io_pending_(false), io_wait_start_ms_(0), write_index(0), close_after_send_(false),
+      upload_(nullptr), upload_created_(false), pending_(NO_REQUEST),
+      ip_key_(), ip_tracked_(false), rate_limited_(false), request_charged_(false),
+      request_seq_(0), response_seq_(0), request_class_(CLASS_SMALL_STATIC) {}
 
-HTTPConnection::~HTTPConnection() = default;
+HTTPConnection::~HTTPConnection() {
+    delete upload_;
+}
 
-void HTTPConnection::init(int _fd, sockaddr_in& _addr) {
+void HTTPConnection::init(int _fd, const sockaddr* _addr, socklen_t _addr_len, ConnHandle _handle,
+                          Transport* transport) {
     sock_fd = _fd;
-    addr = _addr;
-    // 端口复用
-    int reuse = 1;
-    setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    transport_ = transport != nullptr ? transport : SocketTransport::instance();
+    memset(&addr, 0, sizeof(addr));
+    memcpy(&addr, _addr, std::min<size_t>(_addr_len, sizeof(addr)));
+    handle_ = _handle;
+    ip_tracked_ = false;
+    ssl_ = nullptr;
+    tls_handshaking_ = false;
+    ktls_send_ = false;
+    // 新socket的零拷贝序号从0开始
+    zerocopy_ = ZeroCopySender();
     // 添加到epoll_fd中
-    addfd(epoll_fd, sock_fd, true);
+    transport_->attach(sock_fd, handle_);
     ++user_count;
     init();
+    request_seq_ = 0;
+    response_seq_ = 0;
 }
 
 void HTTPConnection::init() {
+    next_request(false);
+    proxying_ = false;
+    async_ = false;
+    io_pending_ = false;
+    io_wait_start_ms_ = 0;
+    write_index = 0;
+    output_.clear();
+    arena_.reset();
+    close_after_send_ = false;
+    pending_ = NO_REQUEST;
+    phase_ = PHASE_IDLE;
+    request_start_ms_ = 0;
+    phase_start_ms_ = 0;
+    phase_bytes_ = 0;
+    bzero(read_buffer, READ_BUFFER_SIZE);
+}
+
+void HTTPConnection::next_request(bool keep_pipelined) {
+    // 带请求体的请求不支持流水线，剩余字节连同请求体一起丢弃
+    int leftover = keep_pipelined && content_length_ == 0 ? read_index - check_index : 0;
+    if (leftover > 0) {
+        memmove(read_buffer, read_buffer + check_index, leftover);
+    }
+    read_index = leftover;
     check_state = CHECK_STATE_REQUESTLINE;
     line_start = 0;
     check_index = 0;
+    ++request_seq_;
+    request_class_ = CLASS_SMALL_STATIC;
     method = GET;
-    url = "";
-    version = "";
+    url = nullptr;
+    version = nullptr;
     keep_alive_ = false;
     content_length_ = 0;
-    host_ = "";
-    real_file_ = "";
-    file_address_ = nullptr;
+    has_content_length_ = false;
+    authorization_ = StringRef();
+    expect_continue_ = false;
+    // 上一个请求的头表留在arena中，等队列发完后一起释放
+    headers_ = nullptr;
+    header_count_ = 0;
+    header_capacity_ = 0;
+    host_ = StringRef();
+    upgrade_h2c_ = false;
+    h2_settings_ = StringRef();
+    upgrade_websocket_ = false;
+    connection_upgrade_ = false;
+    ws_key_ = StringRef();
+    ws_version_ = 0;
+    proxy_route_ = -1;
+    raw_target_ = StringRef();
+    async_route_ = -1;
+    file_.reset();
+    accept_gzip_ = false;
+    rate_limited_ = false;
+    request_charged_ = false;
+}
+
+void HTTPConnection::release_arena() {
+    // 队列中的文件段还引用着arena中的元数据
+    if (output_.empty() && pending_ == NO_REQUEST && check_index == 0 && !proxying_ && !async_) {
+        file_.reset();
+        arena_.reset();
+    }
+}
+
+void HTTPConnection::close_connection() {
+    if (proxying_) {
+        proxy->abort(handle_);
+        proxying_ = false;
+    }
+    // 协程处理继续运行，结束时发现句柄已失效，丢弃结果
+    async_ = false;
+    unmap();
+    zerocopy_.abandon();
+    // 没有收齐的上传删除临时文件
+    delete upload_;
+    upload_ = nullptr;
+    delete h2_;
+    h2_ = nullptr;
+    // 先退出广播频道，之后不会再有其他线程修改该fd的事件
+    delete ws_;
+    ws_ = nullptr;
+    if (ssl_ != nullptr) {
+        // 尽力发送close_notify，不等待对端回应
+        if (!tls_handshaking_) {
+            ERR_clear_error();
+            SSL_shutdown(ssl_);
+        }
+        SSL_free(ssl_);
+        ssl_ = nullptr;
+        ERR_clear_error();
+    }
+    if (sock_fd != -1) {
+        transport_->detach(sock_fd);
+        sock_fd = -1;
+        --user_count;
+        if (ip_tracked_) {
+            ip_limiter->release_connection(ip_key_, monotonic_ms());
+            ip_tracked_ = false;
+        }
+    }
+}
+
+void HTTPConnection::set_ip_key(const IpKey& key, bool tracked) {
+    ip_key_ = key;
+    ip_tracked_ = tracked;
+}
+
+void HTTPConnection::reject_request() {
+    send_canned(too_many_requests_429, sizeof(too_many_requests_429) - 1);
+}
+
+bool HTTPConnection::reject_overloaded() {
+    if (tls_handshaking_ || h2_ != nullptr || ws_ != nullptr) {
+        return false;
+    }
+    send_canned(service_unavailable_503, sizeof(service_unavailable_503) - 1);
+    return true;
+}
+
+bool HTTPConnection::shed(uint64_t tag) {
+    // 句柄失效的交给process丢弃；HTTP/2等连接上的任务是推进整个会话，不能只丢一个请求
+    if (tag != handle_ || tls_handshaking_ || h2_ != nullptr || ws_ != nullptr || proxying_ ||
+        async_) {
+        return false;
+    }
+    send_canned(service_unavailable_503, sizeof(service_unavailable_503) - 1);
+    transport_->arm(sock_fd, handle_, EPOLLOUT);
+    return true;
+}
+
+void HTTPConnection::send_canned(const char* response, size_t length) {
+    // 之前排队的响应作废，预先序列化的响应是静态字节，直接借用
+    output_.clear();
     write_index = 0;
+    output_.append_borrowed(response, length);
+    response_seq_ = request_seq_;
+    keep_alive_ = false;
+    close_after_send_ = true;
+}
+
+bool HTTPConnection::start_tls() {
+    ssl_ = tls->create(sock_fd);
+    if (ssl_ == nullptr) {
+        return false;
+    }
+    tls_handshaking_ = true;
+    return true;
+}
+
+bool HTTPConnection::tls_handshake() {
+    ERR_clear_error();
+    int ret = SSL_do_handshake(ssl_);
+    if (ret != 1) {
+        int err = SSL_get_error(ssl_, ret);
+        if (err == SSL_ERROR_WANT_READ) {
+            transport_->arm(sock_fd, handle_, EPOLLIN);
+            return true;
+        }
+        if (err == SSL_ERROR_WANT_WRITE) {
+            transport_->arm(sock_fd, handle_, EPOLLOUT);
+            return true;
+        }
+        ++tls->handshake_failures;
+        ERR_clear_error();
+        return false;
+    }
+    tls_handshaking_ = false;
+    ++tls->handshakes;
+    // OpenSSL在握手结束时已尝试设置TCP_ULP "tls"，这里只查询结果
+    ktls_send_ = BIO_get_ktls_send(SSL_get_wbio(ssl_)) != 0;
+    if (ktls_send_) {
+        ++tls->ktls_send;
+    }
+    if (BIO_get_ktls_recv(SSL_get_rbio(ssl_))) {
+        ++tls->ktls_recv;
+    }
+    const unsigned char* protocol = nullptr;
+    unsigned int protocol_length = 0;
+    SSL_get0_alpn_selected(ssl_, &protocol, &protocol_length);
+    if (protocol_length == 2 && memcmp(protocol, "h2", 2) == 0) {
+        // ALPN协商出h2，客户端接着发送连接前言
+        h2_ = new Http2Session(ip_key_);
+        h2_->start();
+    }
+    return true;
+}
+
+ssize_t HTTPConnection::recv_bytes(char* buf, size_t length) {
+    if (ssl_ == nullptr) {
+        return transport_->recv(sock_fd, buf, length);
+    }
+    ERR_clear_error();
+    int n = SSL_read(ssl_, buf, (int) length);
+    if (n > 0) {
+        return n;
+    }
+    int err = SSL_get_error(ssl_, n);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (err == SSL_ERROR_ZERO_RETURN) {
+        return 0;
+    }
+    errno = EIO;
+    return -1;
+}
+
+ssize_t HTTPConnection::send_iov(const struct iovec* iov, int count) {
+    if (ssl_ == nullptr || ktls_send_) {
+        // kTLS：明文直接交给内核，映射文件的发送路径不变
+        return transport_->send(sock_fd, iov, count, 0);
+    }
+    // 用户态加密：逐段SSL_write，被阻塞时返回已写的字节数，重试时第一段与上次相同
+    ssize_t total = 0;
+    for (int i = 0; i < count; ++i) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+        ERR_clear_error();
+        int n = SSL_write(ssl_, iov[i].iov_base, (int) std::min(iov[i].iov_len, (size_t) INT32_MAX));
+        if (n <= 0) {
+            int err = SSL_get_error(ssl_, n);
+            if (total > 0) {
+                return total;
+            }
+            errno = (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) ? EAGAIN : EPIPE;
+            return -1;
+        }
+        total += n;
+        if ((size_t) n < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+
+bool HTTPConnection::read() {
+    if (h2_ != nullptr) {
+        return read_h2();
+    }
+    if (ws_ != nullptr) {
+        return read_ws();
+    }
+    if (upload_ != nullptr) {
+        return read_upload();
+    }
+    // printf("一次性睇完数据\n");
+    // 缓冲区大小不够
+    if (read_index >= READ_BUFFER_SIZE) {
+        return false;
+    }
+    // 读取到的字节
+    int read_bytes;
+    int old_index = read_index;
+    while (read_index < READ_BUFFER_SIZE) {
+        // 循环读取；缓冲满时(流水线上的请求较多)剩下的留在套接字里，重新注册后再读
+        read_bytes = recv_bytes(read_buffer + read_index, READ_BUFFER_SIZE - read_index);
+        if (read_bytes == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // 没有数据
+                break;
+            }
+            return false;
+        }
+        else if (read_bytes == 0) {
+            // 对方关闭连接
+            return false;
+        }
+        else {
+            read_index += read_bytes;
+        }
+    }
+    on_bytes_read(old_index);
+    LOG_DEBUG("读取到了数据: %s\n", read_buffer);
+    return true;
+}
+
+void HTTPConnection::on_bytes_read(int old_index) {
+    if (read_index == old_index) {
+        return;
+    }
+    uint64_t now = monotonic_ms();
+    if (phase_ == PHASE_IDLE) {
+        trace_stage(TRACE_FIRST_BYTE, handle_, request_seq_);
+        phase_ = PHASE_HEADER;
+        request_start_ms_ = now;
+        phase_start_ms_ = now;
+        phase_bytes_ = 0;
+        // 新请求开始，按地址扣除一个令牌
+        if (!charge_request(now)) {
+            rate_limited_ = true;
+        }
+    }
+    else if (phase_ == PHASE_PROCESSING) {
+        // 请求头之后又来了数据，说明工作线程在等请求体
+        phase_ = PHASE_BODY;
+        phase_start_ms_ = now;
+        phase_bytes_ = 0;
+    }
+    phase_bytes_ += read_index - old_index;
+    if (phase_ == PHASE_HEADER) {
+        // 只扫描新读入的数据(向前多看3个字节以防\r\n\r\n被拆开)
+        int from = old_index > 3 ? old_index - 3 : 0;
+        for (int i = from; i + 3 < read_index; ++i) {
+            if (memcmp(read_buffer + i, "\r\n\r\n", 4) == 0) {
+                phase_ = PHASE_PROCESSING;
+                break;
+            }
+        }
+    }
+}
+
+HTTPConnection::EvictReason HTTPConnection::check_slow(uint64_t now_ms) const {
+    const SlowClientPolicy& policy = slow_policy;
+    int min_rate = 0;
+    EvictReason reason = EVICT_NONE;
+    switch (phase_) {
+        case PHASE_HEADER: {
+            if (policy.header_timeout_ms > 0 &&
+                now_ms - request_start_ms_ > (uint64_t) policy.header_timeout_ms) {
+                return EVICT_HEADER_TIMEOUT;
+            }
+            min_rate = policy.min_header_rate;
+            reason = EVICT_HEADER_RATE;
+            break;
+        }
+        case PHASE_BODY: {
+            min_rate = policy.min_body_rate;
+            reason = EVICT_BODY_RATE;
+            break;
+        }
+        case PHASE_WRITE: {
+            min_rate = policy.min_write_rate;
+            reason = EVICT_WRITE_RATE;
+            break;
+        }
+        default: {
+            return EVICT_NONE;
+        }
+    }
+    if (io_pending_) {
+        // 等待磁盘期间不计入客户端的速率
+        return EVICT_NONE;
+    }
+    uint64_t elapsed = now_ms - phase_start_ms_;
+    if (min_rate <= 0 || elapsed < (uint64_t) policy.grace_ms) {
+        return EVICT_NONE;
+    }
+    // bytes / (elapsed / 1000) < min_rate
+    if (phase_bytes_ * 1000 < (uint64_t) min_rate * elapsed) {
+        return reason;
+    }
+    return EVICT_NONE;
+}
+
+const char* HTTPConnection::evict_reason_name(EvictReason reason) {
+    switch (reason) {
+        case EVICT_HEADER_TIMEOUT: return "header_timeout";
+        case EVICT_HEADER_RATE: return "header_rate";
+        case EVICT_BODY_RATE: return "body_rate";
+        case EVICT_WRITE_RATE: return "write_rate";
+        default: return "none";
+    }
+}
+
+// 映射中的窗口有页不在页缓存中
+static bool window_cold(const char* window_start, size_t window) {
+    // mincore要求按页对齐，窗口向前扩展到页边界
+    static const uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) window_start;
+    uintptr_t aligned = start & ~(page - 1);
+    size_t length = window + (start - aligned);
+    unsigned char resident[IO_RESIDENCY_WINDOW / 4096 + 2];
+    size_t pages = (length + page - 1) / page;
+    if (pages > sizeof(resident) || mincore((void*) aligned, length, resident) == -1) {
+        return false;
+    }
+    for (size_t i = 0; i < pages; ++i) {
+        if (!(resident[i] & 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool HTTPConnection::defer_cold_file(const StaticFile& file, const char* window_start,
+                                     size_t window) {
+    if (io_pool == nullptr || file.fd == -1 || window == 0 || !window_cold(window_start, window)) {
+        return false;
+    }
+    int fd = dup(file.fd);
+    if (fd == -1) {
+        return false;
+    }
+    IoJob job;
+    job.handle = handle_;
+    job.fd = fd;
+    job.offset = file.offset + (window_start - file.address);
+    job.length = window;
+    if (!io_pool->submit(job)) {
+        // 队列满了只能退回到主线程缺页
+        close(fd);
+        return false;
+    }
+    ++io_deferrals;
+    io_pending_ = true;
+    io_wait_start_ms_ = monotonic_ms();
+    return true;
+}
+
+void HTTPConnection::io_complete() {
+    io_pending_ = false;
+    // 等待磁盘的时间不算在发送阶段内
+    phase_start_ms_ += monotonic_ms() - io_wait_start_ms_;
+}
+
+bool HTTPConnection::write() {
+    if (proxying_) {
+        // 转发中的连接可写，由反向代理继续发送
+        proxy->client_writable(handle_);
+        return true;
+    }
+    if (h2_ != nullptr) {
+        return write_h2();
+    }
+    if (ws_ != nullptr) {
+        return write_ws();
+    }
+    if (phase_ != PHASE_WRITE) {
+        trace_stage(TRACE_FIRST_WRITE, handle_, response_seq_);
+        phase_ = PHASE_WRITE;
+        phase_start_ms_ = monotonic_ms();
+        phase_bytes_ = 0;
+    }
+    if (zerocopy_.pending() && !zerocopy_.reap(sock_fd)) {
+        unmap();
+        return false;
+    }
+    while (!output_.empty()) {
+        struct iovec iov[OUTPUT_IOV_MAX];
+        const OutputSegment* segments[OUTPUT_IOV_MAX];
+        int count = output_.gather(iov, segments, OUTPUT_IOV_MAX, IO_RESIDENCY_WINDOW);
+        // 文件段每次最多发送一个窗口，窗口内的页不驻留时先交给IO线程，
+        // 避免主线程在writev里因缺页阻塞在磁盘上；冷窗口之前的段先发出去
+        for (int i = 0; io_pool != nullptr && i < count; ++i) {
+            if (!segments[i]->file || segments[i]->file->fd == -1) {
+                continue;
+            }
+            if (i > 0) {
+                if (window_cold((const char*) iov[i].iov_base, iov[i].iov_len)) {
+                    count = i;
+                    break;
+                }
+                continue;
+            }
+            if (defer_cold_file(*segments[i]->file, (const char*) iov[i].iov_base,
+                                iov[i].iov_len)) {
+                // 不重新注册事件，预读完成后主线程再调用write()
+                return true;
+            }
+        }
+        int copy_count = count;
+        int zerocopy_count = zerocopy_prefix(iov, segments, count, &copy_count);
+        ssize_t n;
+        if (zerocopy_count > 0) {
+            n = zerocopy_.send(sock_fd, iov, segments, zerocopy_count);
+        }
+        else if (copy_count < count) {
+            // 响应头拷贝发送，后面紧跟零拷贝的响应体，先不单独成包
+            n = transport_->send(sock_fd, iov, copy_count, MSG_MORE);
+        }
+        else {
+            n = send_iov(iov, count);
+        }
+        if (n < 0) {
+            // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
+            // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
+            if (errno == EAGAIN) {
+                transport_->arm(sock_fd, handle_, EPOLLOUT);
+                return true;
+            }
+            unmap();
+            return false;
+        }
+        output_.consume(n);
+        phase_bytes_ += n;
+    }
+    // 队列发完，写缓冲中的响应头不再被引用
+    trace_stage(TRACE_LAST_WRITE, handle_, response_seq_);
+    write_index = 0;
+    io_pending_ = false;
+    phase_ = PHASE_IDLE;
+    request_start_ms_ = 0;
+    phase_start_ms_ = 0;
+    phase_bytes_ = 0;
+    if (close_after_send_) {
+        return false;
+    }
+    release_arena();
+    if (!pipelined()) {
+        transport_->arm(sock_fd, handle_, EPOLLIN);
+    }
+    return true;
+}
+
+int HTTPConnection::zerocopy_prefix(const struct iovec* iov, const OutputSegment* const* segments,
+                                    int count, int* copy_count) {
+    *copy_count = count;
+    if (zerocopy_min_bytes == 0 || ssl_ != nullptr || transport_ != SocketTransport::instance()) {
+        return 0;
+    }
+    // 只有带引用计数的段(缓存条目、文件映射)能钉住到完成通知为止，
+    // 写缓冲里的响应头发完就会被改写，必须拷贝
+    int first = -1;
+    for (int i = 0; i < count; ++i) {
+        if ((segments[i]->cached || segments[i]->file) && iov[i].iov_len >= zerocopy_min_bytes) {
+            first = i;
+            break;
+        }
+    }
+    if (first == -1 || !zerocopy_.usable(sock_fd)) {
+        return 0;
+    }
+    if (first > 0) {
+        *copy_count = first;
+        return 0;
+    }
+    int run = 1;
+    while (run < count && (segments[run]->cached || segments[run]->file)) {
+        ++run;
+    }
+    return run;
+}
+
+bool HTTPConnection::reap_zerocopy() {
+    return zerocopy_.reap(sock_fd);
+}
+
+void HTTPConnection::rearm() {
+    if (proxying_) {
+        // 转发重复收到可写事件没有副作用
+        transport_->arm(sock_fd, handle_, EPOLLOUT);
+    }
+    else if (h2_ != nullptr || ws_ != nullptr) {
+        transport_->arm(sock_fd, handle_, EPOLLIN | EPOLLOUT);
+    }
+    else {
+        transport_->arm(sock_fd, handle_, output_.empty() ? EPOLLIN : EPOLLOUT);
+    }
+}
+
+bool HTTPConnection::keepalive_idle() const {
+    return request_seq_ > 0 && phase_ == PHASE_IDLE && output_.empty() && read_index == 0 &&
+           pending_ == NO_REQUEST && !proxying_ && !async_ && !io_pending_ &&
+           !tls_handshaking_ && h2_ == nullptr && ws_ == nullptr;
+}
+
+bool HTTPConnection::pipelined() const {
+    // 已解析好的待处理请求，或者缓冲中还没有开始解析的字节
+    return output_.empty() && !proxying_ && !async_ && h2_ == nullptr && ws_ == nullptr &&
+           (pending_ != NO_REQUEST || (check_index == 0 && read_index > 0));
+}
+
+void HTTPConnection::process(uint64_t tag) {
+    if (tag != handle_) {
+        // 排队期间连接已关闭，槽位可能已分配给新客户端
+        return;
+    }
+    trace_stage(TRACE_DEQUEUE, handle_, request_seq_);
+    if (tls_handshaking_) {
+        if (!tls_handshake()) {
+            close_connection();
+            return;
+        }
+        if (tls_handshaking_) {
+            return;
+        }
+        // 握手完成，和客户端Finished一起到达的请求可能已经在SSL的缓冲中
+        if (!read()) {
+            close_connection();
+            return;
+        }
+    }
+    if (ws_ != nullptr) {
+        process_ws();
+        return;
+    }
+    if (h2_ != nullptr) {
+        process_h2();
+        return;
+    }
+    // 以连接前言开头的是先验知识方式的HTTP/2
+    if (check_state == CHECK_STATE_REQUESTLINE && check_index == 0 && read_index > 0 &&
+        memcmp(read_buffer, H2_PREFACE, std::min(read_index, H2_PREFACE_LENGTH)) == 0) {
+        if (read_index < H2_PREFACE_LENGTH || !start_h2_prior_knowledge()) {
+            transport_->arm(sock_fd, handle_, EPOLLIN);
+            return;
+        }
+        process_h2();
+        return;
+    }
+    // 交给线程池处理HTTP请求
+    // 解析HTTP请求；前面的响应发完后，先处理流水线上已经解析好的请求
+    HttpCode read_ret = pending_;
+    pending_ = NO_REQUEST;
+    if (upload_ != nullptr) {
+        if (upload_->remaining() > 0) {
+            transport_->arm(sock_fd, handle_, EPOLLIN);
+            return;
+        }
+        // 主线程收齐了请求体
+        read_ret = finish_upload();
+    }
+    else if (read_ret == NO_REQUEST) {
+        read_ret = parse_process();
+    }
+    while (read_ret != NO_REQUEST) {
+        bool local = read_ret != PROXY_REQUEST && read_ret != ASYNC_REQUEST &&
+                     read_ret != UPLOAD_REQUEST &&
+                     !(upgrade_h2c_ && content_length_ == 0) && !upgrade_websocket_;
+        if (!local && !output_.empty()) {
+            // 转发和协议升级直接接管连接的输出，要等队列中前面的响应发完
+            pending_ = read_ret;
+            break;
+        }
+        if (read_ret == PROXY_REQUEST) {
+            start_proxy();
+            return;
+        }
+        if (read_ret == ASYNC_REQUEST) {
+            start_async();
+            return;
+        }
+        if (read_ret == UPLOAD_REQUEST) {
+            read_ret = start_upload();
+            if (read_ret == UPLOAD_REQUEST) {
+                // 剩下的请求体由主线程在read()中接收
+                transport_->arm(sock_fd, handle_, EPOLLIN);
+                return;
+            }
+        }
+        // 没有请求体的升级请求切换到h2c，请求本身作为流1在HTTP/2上响应
+        if (upgrade_h2c_ && content_length_ == 0 && start_h2_upgrade()) {
+            process_h2();
+            return;
+        }
+        if (upgrade_websocket_ && start_ws_upgrade()) {
+            process_ws();
+            return;
+        }
+        // 生成HTTP相应
+        if (!response_process(read_ret)) {
+            close_connection();
+            return;
+        }
+        if (close_after_send_) {
+            break;
+        }
+        // 完整解析过的请求之后，缓冲中紧跟着的请求接着处理，响应排在同一个队列里一起发出
+        bool complete = read_ret == FILE_REQUEST || read_ret == NO_RESOURCE ||
+                        read_ret == FORBIDDEN_REQUEST || read_ret == TRACE_REQUEST ||
+                        read_ret == STORED_REQUEST || read_ret == UNAUTHORIZED_REQUEST ||
+                        read_ret == METHOD_NOT_ALLOWED;
+        next_request(complete);
+        if (read_index == 0 || WRITE_BUFFER_SIZE - write_index < PIPELINE_HEADER_ROOM) {
+            break;
+        }
+        read_ret = parse_process();
+    }
+    transport_->arm(sock_fd, handle_, output_.empty() ? EPOLLIN : EPOLLOUT);
+}
+
+bool HTTPConnection::start_h2_prior_knowledge() {
+    h2_ = new Http2Session(ip_key_);
+    h2_->start();
+    h2_->append_input(read_buffer, read_index);
     read_index = 0;
-    bytes_to_send = 0;
-    bytes_have_send = 0;
-    io_vec_count = 0;
-    bzero(io_vec_, sizeof(*io_vec_) * 2);
-    bzero(read_buffer, READ_BUFFER_SIZE);
-    bzero(write_buffer, WRITE_BUFFER_SIZE);
+    // HTTP/2连接上的请求不再按HTTP/1.1的阶段检测慢速客户端
+    phase_ = PHASE_IDLE;
+    return true;
+}
+
+bool HTTPConnection::start_h2_upgrade() {
+    Http2Session* session = new Http2Session(ip_key_);
+    if (!session->start_upgrade(h2_settings_.str(), url, method == HEAD, accept_gzip_)) {
+        // HTTP2-Settings无效，按HTTP/1.1继续处理
+        delete session;
+        return false;
+    }
+    h2_ = session;
+    // 升级请求之后已经到达的字节(通常是连接前言)交给会话
+    h2_->append_input(read_buffer + check_index, read_index - check_index);
+    file_.reset();
+    read_index = 0;
+    phase_ = PHASE_IDLE;
+    return true;
+}
+
+void HTTPConnection::process_h2() {
+    h2_->process_input();
+    h2_->schedule();
+    if (h2_->finished()) {
+        close_connection();
+        return;
+    }
+    // 有待发送的帧时同时监听可写，流控窗口耗尽时只等对端的WINDOW_UPDATE
+    transport_->arm(sock_fd, handle_, h2_->has_output() ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+bool HTTPConnection::read_h2() {
+    while (true) {
+        int read_bytes = recv_bytes(read_buffer, READ_BUFFER_SIZE);
+        if (read_bytes == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+        else if (read_bytes == 0) {
+            return false;
+        }
+        if (!h2_->append_input(read_buffer, read_bytes)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool HTTPConnection::write_h2() {
+    while (true) {
+        h2_->schedule();
+        struct iovec iov[H2_IOV_MAX];
+        int count = h2_->gather(iov, H2_IOV_MAX);
+        if (count == 0) {
+            if (h2_->finished()) {
+                return false;
+            }
+            transport_->arm(sock_fd, handle_, EPOLLIN);
+            return true;
+        }
+        ssize_t n = send_iov(iov, count);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                // 等待可写的同时继续接收对端的帧(WINDOW_UPDATE等)
+                transport_->arm(sock_fd, handle_, EPOLLIN | EPOLLOUT);
+                return true;
+            }
+            return false;
+        }
+        h2_->consume(n);
+    }
 }
 
-void HTTPConnection::close_connection() {
-    if (sock_fd != -1) {
-        delfd(epoll_fd, sock_fd);
-        sock_fd = -1;
-        --user_count;
+bool HTTPConnection::start_ws_upgrade() {
+    std::string accept;
+    if (ws_prefix.empty() || method != GET || !connection_upgrade_ || ws_version_ != 13 ||
+        content_length_ != 0 || strncmp(url, ws_prefix.c_str(), ws_prefix.size()) != 0 ||
+        !WebSocketSession::accept_key(ws_key_.str(), &accept)) {
+        return false;
     }
+    // 目标路径作为广播频道
+    ws_ = new WebSocketSession(url, epoll_fd, sock_fd, handle_);
+    ws_->start(accept);
+    ws_->append_input(read_buffer + check_index, read_index - check_index);
+    file_.reset();
+    read_index = 0;
+    phase_ = PHASE_IDLE;
+    return true;
 }
 
-bool HTTPConnection::read() {
-    // printf("一次性睇完数据\n");
-    // 缓冲区大小不够
-    if (read_index >= READ_BUFFER_SIZE) {
-        return false;
+void HTTPConnection::process_ws() {
+    // 协议错误时已排入关闭帧，发完后关闭
+    ws_->process_input();
+    if (ws_->finished()) {
+        close_connection();
+        return;
     }
-    // 读取到的字节
-    int read_bytes;
+    ws_->park();
+}
+
+bool HTTPConnection::read_ws() {
     while (true) {
-        // 循环读取
-        read_bytes = recv(sock_fd, read_buffer + read_index,
-                          READ_BUFFER_SIZE - read_index, 0);
+        int read_bytes = recv_bytes(read_buffer, READ_BUFFER_SIZE);
         if (read_bytes == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // 没有数据
                 break;
             }
             return false;
         }
         else if (read_bytes == 0) {
-            // 对方关闭连接
             return false;
         }
-        else {
-            read_index += read_bytes;
+        if (!ws_->append_input(read_buffer, read_bytes)) {
+            return false;
         }
     }
-    printf("读取到了数据: %s\n", read_buffer);
     return true;
 }
 
-bool HTTPConnection::write() {
-    int temp = 0;
-    if (bytes_to_send == 0) {
-        // 响应结束
-        modfd(epoll_fd, sock_fd, EPOLLIN);
-        init();
-        return true;
-    }
+bool HTTPConnection::write_ws() {
     while (true) {
-        // 聚集写
-        temp = writev(sock_fd, io_vec_, io_vec_count);
-        if (temp <= -1) {
-            // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
-            // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
+        if (ws_->finished()) {
+            return false;
+        }
+        struct iovec iov[WS_IOV_MAX];
+        int count = ws_->gather(iov, WS_IOV_MAX);
+        if (count == 0) {
+            ws_->park();
+            return true;
+        }
+        ssize_t n = send_iov(iov, count);
+        if (n < 0) {
             if (errno == EAGAIN) {
-                modfd(epoll_fd, sock_fd, EPOLLOUT);
+                ws_->park();
                 return true;
             }
-            unmap();
             return false;
         }
-        else {
-            bytes_have_send += temp;
-            // 判断响应头有没有发送完
-            if (bytes_have_send >= io_vec_[0].iov_len) {
-                io_vec_[0].iov_len = 0;
-                // write_index表示减去响应头的长度
-                io_vec_[1].iov_base = file_address_ + (bytes_have_send - write_index);
-                io_vec_[1].iov_len = bytes_to_send - bytes_have_send;
-            }
-            else {
-                io_vec_[0].iov_base = write_buffer + bytes_have_send;
-                io_vec_[0].iov_len = write_index - bytes_have_send;
-            }
-            if (bytes_have_send >= bytes_to_send) {
-                // 响应成功
-                unmap();
-                modfd(epoll_fd, sock_fd, EPOLLIN);
-                if (keep_alive_) {
-                    init();
-                    return true;
-                }
-                else {
-                    return false;
+        ws_->consume(n);
+    }
+}
+
+void HTTPConnection::start_proxy() {
+    ProxyJob job;
+    job.client = handle_;
+    job.client_fd = sock_fd;
+    job.route = proxy_route_;
+    job.target = raw_target_.str();
+    job.host = host_.str();
+    for (int i = 0; i < header_count_; ++i) {
+        if (!hop_by_hop_header(headers_[i].name)) {
+            job.headers.append(headers_[i].line.data, headers_[i].line.length);
+            job.headers += "\r\n";
+        }
+    }
+    job.client_ip = peer_address((const sockaddr*) &addr);
+    job.keep_alive = keep_alive_;
+    job.background = false;
+    if (cache != nullptr && cache->request_key(job.host, job.target, job.headers, &job.cache_key)) {
+        CachedResponsePtr entry;
+        bool stale = false;
+        if (cache->get(job.cache_key, monotonic_ms(), &entry, &stale)) {
+            if (stale && !entry->revalidating.exchange(true)) {
+                // 先用旧响应回复，同时交给主线程在后台刷新
+                job.client = 0;
+                job.client_fd = -1;
+                job.keep_alive = false;
+                job.background = true;
+                job.stale = entry;
+                if (!proxy->submit(job)) {
+                    entry->revalidating = false;
                 }
             }
+            serve_cached(entry, stale);
+            next_request(true);
+            transport_->arm(sock_fd, handle_, EPOLLOUT);
+            return;
         }
     }
+    // 提交之后主线程随时可能开始转发，不能再访问连接
+    proxying_ = true;
+    if (!proxy->submit(job)) {
+        proxying_ = false;
+        send_canned(service_unavailable_503, strlen(service_unavailable_503));
+        transport_->arm(sock_fd, handle_, EPOLLOUT);
+    }
 }
 
-void HTTPConnection::process() {
-    // 交给线程池处理HTTP请求
-    // 解析HTTP请求
-    HttpCode read_ret = parse_process();
-    if (read_ret == NO_REQUEST) {
-        modfd(epoll_fd, sock_fd, EPOLLIN);
+void HTTPConnection::proxy_done(const CachedResponsePtr& cached) {
+    proxying_ = false;
+    if (cached) {
+        serve_cached(cached, false);
+        next_request(true);
+        transport_->arm(sock_fd, handle_, EPOLLOUT);
         return;
     }
-    // 生成HTTP相应
-    bool write_ret = response_process(read_ret);
-    if (!write_ret) {
-        close_connection();
+    next_request(true);
+    phase_ = PHASE_IDLE;
+    request_start_ms_ = 0;
+    phase_start_ms_ = 0;
+    phase_bytes_ = 0;
+    release_arena();
+    if (!pipelined()) {
+        transport_->arm(sock_fd, handle_, EPOLLIN);
+    }
+}
+
+// 协程结束的结果，只在主线程(reactor所在线程)上访问
+static std::vector<AsyncResult> async_results;
+
+static Task<void> run_async(AsyncHandler handler, AsyncRequest request) {
+    ConnHandle handle = request.handle;
+    AsyncResponse response = co_await handler(std::move(request));
+    async_results.push_back(AsyncResult{handle, std::move(response)});
+}
+
+void HTTPConnection::take_async_results(std::vector<AsyncResult>& results) {
+    results.swap(async_results);
+}
+
+void HTTPConnection::start_async() {
+    AsyncRequest request;
+    request.handle = handle_;
+    request.target = raw_target_.str();
+    request.host = host_.str();
+    request.reactor = reactor;
+    request.offload = offload;
+    // 投递之后主线程随时可能结束处理，不能再访问连接
+    async_ = true;
+    run_async(async_routes[async_route_].handler, std::move(request)).start_on(reactor);
+}
+
+HTTPConnection::HttpCode HTTPConnection::check_upload() {
+    bool matched = false;
+    for (size_t i = 0; i < upload_prefixes.size() && !matched; ++i) {
+        matched = strncmp(url, upload_prefixes[i].data(), upload_prefixes[i].size()) == 0;
+    }
+    if (!matched) {
+        return METHOD_NOT_ALLOWED;
+    }
+    if (!upload_authorized()) {
+        return UNAUTHORIZED_REQUEST;
+    }
+    // 目标必须是文件路径
+    if (url[strlen(url) - 1] == '/') {
+        return FORBIDDEN_REQUEST;
+    }
+    if (method == DELETE) {
+        bool missing;
+        if (Upload::remove(root_fd, url + 1, &missing) != Upload::UPLOAD_OK) {
+            return FORBIDDEN_REQUEST;
+        }
+        if (missing) {
+            return NO_RESOURCE;
+        }
+        upload_created_ = false;
+        return STORED_REQUEST;
+    }
+    if (!has_content_length_) {
+        return LENGTH_REQUIRED;
+    }
+    return UPLOAD_REQUEST;
+}
+
+bool HTTPConnection::upload_authorized() const {
+    // 常量时间比较，只泄露长度是否相同
+    return !upload_token.empty() && authorization_.length == upload_token.size() &&
+           CRYPTO_memcmp(authorization_.data, upload_token.data(), upload_token.size()) == 0;
+}
+
+HTTPConnection::HttpCode HTTPConnection::start_upload() {
+    upload_ = new Upload();
+    Upload::Status status = upload_->begin(root_fd, url + 1, (uint64_t) content_length_);
+    if (status != Upload::UPLOAD_OK) {
+        delete upload_;
+        upload_ = nullptr;
+        keep_alive_ = false;
+        if (status == Upload::UPLOAD_NO_SPACE) {
+            return INSUFFICIENT_STORAGE;
+        }
+        return status == Upload::UPLOAD_FORBIDDEN ? FORBIDDEN_REQUEST : INTERNAL_ERROR;
+    }
+    // 和请求头一起读进来的那部分请求体，之后紧跟的字节属于流水线上的下一个请求
+    int buffered = (int) std::min<int64_t>(read_index - check_index, content_length_);
+    if (!upload_->write(read_buffer + check_index, buffered)) {
+        delete upload_;
+        upload_ = nullptr;
+        keep_alive_ = false;
+        return INTERNAL_ERROR;
+    }
+    check_index += buffered;
+    // 请求体已交给Upload，next_request按没有请求体保留后面的字节
+    content_length_ = 0;
+    if (upload_->remaining() == 0) {
+        return finish_upload();
+    }
+    if (expect_continue_ && buffered == 0) {
+        // 客户端在等这个中间响应才开始发送请求体；此前的响应都已发完，socket可写
+        struct iovec iov = {(void*) continue_100, strlen(continue_100)};
+        if (send_iov(&iov, 1) != (ssize_t) iov.iov_len) {
+            delete upload_;
+            upload_ = nullptr;
+            keep_alive_ = false;
+            return INTERNAL_ERROR;
+        }
+    }
+    return UPLOAD_REQUEST;
+}
+
+HTTPConnection::HttpCode HTTPConnection::finish_upload() {
+    bool replaced = false;
+    Upload::Status status = upload_->commit(&replaced);
+    delete upload_;
+    upload_ = nullptr;
+    if (status != Upload::UPLOAD_OK) {
+        return status == Upload::UPLOAD_FORBIDDEN ? FORBIDDEN_REQUEST : INTERNAL_ERROR;
+    }
+    upload_created_ = !replaced;
+    return STORED_REQUEST;
+}
+
+bool HTTPConnection::read_upload() {
+    uint64_t before = upload_->remaining();
+    Upload::Progress progress;
+    if (ssl_ == nullptr && transport_ == SocketTransport::instance()) {
+        // socket → 管道 → 文件，数据不经过用户态
+        progress = upload_->splice_from(sock_fd);
     }
     else {
-        modfd(epoll_fd, sock_fd, EPOLLOUT);
+        // 用户态TLS解密后的明文，或内存回环，只能拷贝
+        char buf[UPLOAD_CHUNK];
+        progress = Upload::UPLOAD_DONE;
+        while (upload_->remaining() > 0) {
+            ssize_t n = recv_bytes(buf, std::min<uint64_t>(upload_->remaining(), sizeof(buf)));
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                progress = Upload::UPLOAD_AGAIN;
+                break;
+            }
+            if (n <= 0) {
+                progress = n == 0 ? Upload::UPLOAD_CLOSED : Upload::UPLOAD_FAILED;
+                break;
+            }
+            if (!upload_->write(buf, n)) {
+                progress = Upload::UPLOAD_FAILED;
+                break;
+            }
+        }
+    }
+    uint64_t received = before - upload_->remaining();
+    if (received > 0) {
+        // 请求体按读请求体阶段的最低速率检查
+        if (phase_ != PHASE_BODY) {
+            phase_ = PHASE_BODY;
+            phase_start_ms_ = monotonic_ms();
+            phase_bytes_ = 0;
+        }
+        phase_bytes_ += received;
+    }
+    return progress == Upload::UPLOAD_AGAIN || progress == Upload::UPLOAD_DONE;
+}
+
+void HTTPConnection::async_done(AsyncResponse& response) {
+    async_ = false;
+    int start = write_index;
+    add_status(response.status, response.title);
+    add_content_length(response.body.size());
+    add_response("Content-Type: %s\r\n", response.content_type);
+    add_connection();
+    if (!add_blank_line()) {
+        // 写缓冲放不下响应头
+        send_canned(service_unavailable_503, strlen(service_unavailable_503));
+        return;
     }
+    output_.append_borrowed(write_buffer + start, write_index - start);
+    output_.append_owned(&response.body);
+    response_seq_ = request_seq_;
+    close_after_send_ = !keep_alive_;
+    next_request(true);
+}
+
+void HTTPConnection::serve_cached(const CachedResponsePtr& entry, bool stale) {
+    int start = write_index;
+    uint64_t age = (monotonic_ms() - entry->stored_ms) / 1000;
+    add_response("%.*s", (int) entry->status_length, entry->data.data());
+    add_response("Age: %llu\r\nX-Cache: %s\r\n", (unsigned long long) age,
+                 stale ? "STALE" : "HIT");
+    add_connection();
+    output_.append_borrowed(write_buffer + start, write_index - start);
+    output_.append_cached(entry, entry->status_length);
+    response_seq_ = request_seq_;
+    close_after_send_ = !keep_alive_;
+}
+
+bool HTTPConnection::claim_events() {
+    return ws_ == nullptr || ws_->claim();
+}
+
+bool HTTPConnection::keepalive_ping() {
+    return ws_ != nullptr && ws_->keepalive_ping();
 }
 
 HTTPConnection::HttpCode HTTPConnection::parse_process() {
@@ -231,7 +1326,7 @@ HTTPConnection::HttpCode HTTPConnection::parse_process() {
            (check_state == CHECK_STATE_CONTENT && line_status == LINE_OK)) {
         text = get_line();
         line_start = check_index;
-        printf("got one http line: %s\n", text);
+        LOG_DEBUG("got one http line: %s\n", text);
         switch (check_state) {
             case CHECK_STATE_REQUESTLINE: {
                 ret = parse_request(text);
@@ -246,14 +1341,14 @@ HTTPConnection::HttpCode HTTPConnection::parse_process() {
                     return BAD_REQUEST;
                 }
                 else if (ret == GET_REQUEST) {
-                    return do_request();
+                    return handle_request();
                 }
                 break;
             }
             case CHECK_STATE_CONTENT: {
                 ret = parse_content(text);
                 if (ret == GET_REQUEST) {
-                    return do_request();
+                    return handle_request();
                 }
                 line_status = LINE_OPEN;
                 break;
@@ -270,29 +1365,215 @@ char* HTTPConnection::get_line() {
     return read_buffer + line_start;
 }
 
+bool HTTPConnection::charge_request(uint64_t now_ms) {
+    request_charged_ = true;
+    return ip_limiter == nullptr || addr.ss_family == AF_UNIX ||
+           ip_limiter->allow_request(ip_key_, now_ms);
+}
+
+HTTPConnection::HttpCode HTTPConnection::handle_request() {
+    trace_stage(TRACE_PARSED, handle_, request_seq_);
+    // 同一次读入的流水线请求只有第一个在主线程扣过令牌，其余的在这里逐个扣
+    if (!request_charged_ && !charge_request(monotonic_ms())) {
+        keep_alive_ = false;
+        return TOO_MANY_REQUESTS;
+    }
+    // 连接上的请求数到了上限：这个响应通知客户端关闭，发完后关闭，之后的请求换新连接
+    if (keep_alive_ && max_requests > 0 && request_seq_ + 1 >= (uint32_t) max_requests) {
+        keep_alive_ = false;
+        ++max_requests_closes;
+    }
+    HttpCode ret = do_request();
+    if (method != GET && ret != UPLOAD_REQUEST && (content_length_ > 0 || ret == LENGTH_REQUIRED)) {
+        // 没有接收的请求体还留在socket里，回复后关闭
+        keep_alive_ = false;
+    }
+    trace_stage(TRACE_HANDLED, handle_, request_seq_);
+    return ret;
+}
+
 HTTPConnection::HttpCode HTTPConnection::do_request() {
-    printf("do request\n");
-    real_file_ = RootPath + url;
-    std::cout << real_file_ << std::endl;
-    // 获取文件相关状态信息
-    if (stat(real_file_.c_str(), &file_stat_) == -1) {
+    LOG_DEBUG("do request\n");
+    // 导出只对本机开放，其他地址按普通路径处理
+    if (trace_enabled && !trace_path.empty() && strcmp(url, trace_path.c_str()) == 0 &&
+        peer_is_local((const sockaddr*) &addr)) {
+        return TRACE_REQUEST;
+    }
+    if (method != GET) {
+        return check_upload();
+    }
+    if (proxy_route_ >= 0) {
+        return PROXY_REQUEST;
+    }
+    for (size_t i = 0; i < async_routes.size(); ++i) {
+        const std::string& prefix = async_routes[i].prefix;
+        if (strncmp(url, prefix.data(), prefix.size()) == 0) {
+            async_route_ = (int) i;
+            return ASYNC_REQUEST;
+        }
+    }
+    if (zerocopy_min_bytes > 0) {
+        // 零拷贝发送钉住的文件可能活过这个请求甚至这条连接，不能放在arena里
+        file_ = std::make_shared<StaticFile>();
+    }
+    else {
+        file_ = std::allocate_shared<StaticFile>(ArenaAllocator<StaticFile>(&arena_));
+    }
+    HttpCode ret = open_file(url, accept_gzip_, file_.get());
+    if (ret == FILE_REQUEST && !file_->pack) {
+        note_body_size(url, file_->length);
+    }
+    return ret;
+}
+
+HTTPConnection::RequestClass HTTPConnection::classify() {
+    if (tls_handshaking_ || h2_ != nullptr || ws_ != nullptr) {
+        return CLASS_DYNAMIC;
+    }
+    if (check_state != CHECK_STATE_REQUESTLINE) {
+        return request_class_;
+    }
+    // 请求行还没解析过，缓冲中是原样的字节
+    const char* line = read_buffer + line_start;
+    const char* end = (const char*) memchr(line, '\n', read_index - line_start);
+    if (end == nullptr) {
+        return CLASS_SMALL_STATIC;
+    }
+    const char* p = line;
+    while (p < end && *p != ' ' && *p != '\t') {
+        ++p;
+    }
+    size_t method_len = p - line;
+    if (!(method_len == 3 && strncasecmp(line, "GET", 3) == 0) &&
+        !(method_len == 4 && strncasecmp(line, "HEAD", 4) == 0)) {
+        request_class_ = CLASS_DYNAMIC;
+        return request_class_;
+    }
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        ++p;
+    }
+    const char* target = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r') {
+        ++p;
+    }
+    size_t len = p - target;
+    if (len > 7 && strncasecmp(target, "http://", 7) == 0) {
+        const char* path = (const char*) memchr(target + 7, '/', len - 7);
+        len = path == nullptr ? 0 : target + len - path;
+        target = path;
+    }
+    // 与解析时一样规范化之后再匹配，畸形的目标留给解析回复400
+    char path[READ_BUFFER_SIZE];
+    request_class_ = CLASS_SMALL_STATIC;
+    if (len == 0 || len >= sizeof(path)) {
+        return request_class_;
+    }
+    memcpy(path, target, len);
+    path[len] = '\0';
+    if (!normalize_target(path)) {
+        return request_class_;
+    }
+    if (!trace_path.empty() && strcmp(path, trace_path.c_str()) == 0) {
+        request_class_ = CLASS_CONTROL;
+        return request_class_;
+    }
+    for (size_t i = 0; i < control_paths.size(); ++i) {
+        if (strncmp(path, control_paths[i].data(), control_paths[i].size()) == 0) {
+            request_class_ = CLASS_CONTROL;
+            return request_class_;
+        }
+    }
+    if (proxy != nullptr && proxy->match(path) >= 0) {
+        request_class_ = CLASS_DYNAMIC;
+        return request_class_;
+    }
+    std::shared_ptr<AssetPack> pack = current_asset_pack();
+    bool large;
+    if (pack) {
+        const PackEntry* entry = pack->lookup(path, strlen(path));
+        large = entry != nullptr && entry->identity.body_length >= large_body_bytes;
+    }
+    else {
+        large = large_body_hint(path);
+    }
+    if (large) {
+        request_class_ = CLASS_LARGE_STATIC;
+    }
+    return request_class_;
+}
+
+HTTPConnection::HttpCode HTTPConnection::open_file(const char* url, bool accept_gzip,
+                                                   StaticFile* file) {
+    std::shared_ptr<AssetPack> pack = current_asset_pack();
+    if (pack) {
+        // 配置了资源包时只从包中查找，不访问文件系统
+        return open_pack_file(pack, url, accept_gzip, file);
+    }
+    // url已经规范化，去掉开头的/后相对文档根目录打开；根路径本身是目录
+    const char* relative = url[1] != '\0' ? url + 1 : ".";
+    LOG_DEBUG("%s\n", relative);
+    // 上传过程中的具名临时文件不对外可见
+    if (Upload::is_temp_name(relative)) {
         return NO_RESOURCE;
     }
+    int fd = open_beneath_root(relative);
+    if (fd == -1) {
+        if (errno == ENOENT || errno == ENOTDIR || errno == ENAMETOOLONG) {
+            return NO_RESOURCE;
+        }
+        // EXDEV/ELOOP：试图越出根目录或经过符号链接
+        return FORBIDDEN_REQUEST;
+    }
+    // 获取文件相关状态信息
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        close(fd);
+        return INTERNAL_ERROR;
+    }
     // 判断访问权限
-    if (!(file_stat_.st_mode & S_IROTH)) {
+    if (!(file_stat.st_mode & S_IROTH)) {
+        close(fd);
         return FORBIDDEN_REQUEST;
     }
 
     // 判断是否是目录
-    if (S_ISDIR(file_stat_.st_mode)) {
+    if (S_ISDIR(file_stat.st_mode)) {
+        close(fd);
         return BAD_REQUEST;
     }
-    //以只读方式打开文件
-    int fd = open(real_file_.c_str(), O_RDONLY);
-    //创建内存映射
-    file_address_ =
-        (char*) mmap(0, file_stat_.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
+    //创建内存映射，fd留到发送完毕，冷数据由IO线程通过它预读
+    if (file_stat.st_size > 0) {
+        void* address = mmap(0, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED) {
+            close(fd);
+            return INTERNAL_ERROR;
+        }
+        file->address = (char*) address;
+    }
+    file->length = file_stat.st_size;
+    file->fd = fd;
+    file->fd_owned = true;
+    file->offset = 0;
+    return FILE_REQUEST;
+}
+
+HTTPConnection::HttpCode HTTPConnection::open_pack_file(
+    const std::shared_ptr<AssetPack>& pack, const char* url, bool accept_gzip,
+    StaticFile* file) {
+    const PackEntry* entry = pack->lookup(url, strlen(url));
+    if (entry == nullptr) {
+        return NO_RESOURCE;
+    }
+    const PackVariant& variant =
+        (accept_gzip && entry->gzip.body_length > 0) ? entry->gzip : entry->identity;
+    file->pack = pack;
+    file->address = (char*) pack->body(variant);
+    file->length = variant.body_length;
+    file->fd = pack->fd();
+    file->fd_owned = false;
+    file->offset = variant.body_offset;
+    file->pack_headers = pack->headers(variant);
+    file->pack_headers_length = (int) variant.header_length;
     return FILE_REQUEST;
 }
 
@@ -326,53 +1607,147 @@ HTTPConnection::LineStatus HTTPConnection::parse_line() {
     return LINE_OPEN;
 }
 
-HTTPConnection::HttpCode HTTPConnection::parse_request(
-    const std::string& text) {
-    // GET /index.html HTTP/1.1
-    std::regex reg("^([^\\s])*\\s([^\\s])*\\sHTTP/([^\\s])*");
-    if (!std::regex_match(text, reg)) {
-        return BAD_REQUEST;
+// 原地百分号解码，遇到非法编码或解码出NUL返回false
+static bool percent_decode(char* path) {
+    char* out = path;
+    for (const char* in = path; *in != '\0'; ++in) {
+        if (*in != '%') {
+            *out++ = *in;
+            continue;
+        }
+        int hi = hex_value(in[1]);
+        int lo = hi < 0 ? -1 : hex_value(in[2]);
+        if (lo < 0 || (hi == 0 && lo == 0)) {
+            return false;
+        }
+        *out++ = (char) (hi << 4 | lo);
+        in += 2;
     }
-    // 判断开头方法是否为GET
-    std::smatch result;
-    if (std::regex_search(text, result, std::regex("^([^\\s])*"))) {
-        if (!ignore_case_compare(result.str(), "GET")) {
-            return BAD_REQUEST;
+    *out = '\0';
+    return true;
+}
+
+// 原地规范化路径：合并重复的/，去掉.段并回退..段，越过根目录返回false
+static bool normalize_path(char* path) {
+    char* out = path + 1;
+    const char* in = path + 1;
+    while (*in != '\0') {
+        const char* seg_end = in;
+        while (*seg_end != '\0' && *seg_end != '/') {
+            ++seg_end;
+        }
+        size_t seg_len = seg_end - in;
+        bool has_slash = *seg_end == '/';
+        if (seg_len == 0 || (seg_len == 1 && in[0] == '.')) {
+            // 空段或当前目录
+        }
+        else if (seg_len == 2 && in[0] == '.' && in[1] == '.') {
+            if (out == path + 1) {
+                return false;
+            }
+            // 回退到上一段的开头
+            --out;
+            while (out[-1] != '/') {
+                --out;
+            }
         }
         else {
-            method = GET;
+            memmove(out, in, seg_len);
+            out += seg_len;
+            if (has_slash) {
+                *out++ = '/';
+            }
         }
+        in = has_slash ? seg_end + 1 : seg_end;
     }
-    else {
+    *out = '\0';
+    return true;
+}
+
+bool HTTPConnection::normalize_target(char* url) {
+    if (url[0] != '/') {
+        return false;
+    }
+    // 查询串不参与文件查找
+    char* query = strchr(url, '?');
+    if (query != nullptr) {
+        *query = '\0';
+    }
+    return percent_decode(url) && normalize_path(url);
+}
+
+HTTPConnection::HttpCode HTTPConnection::parse_request(char* text) {
+    // GET /index.html HTTP/1.1，各字段直接在读缓冲中切分
+    char* p = strpbrk(text, " \t");
+    if (p == nullptr) {
         return BAD_REQUEST;
     }
-    std::cout << method << std::endl;
-    // 获取url，条件是以/开始的后面紧跟空格的字符串，排除了版本号
-    if (std::regex_search(text, result, std::regex("/([^\\s]*(?=\\s|\t))"))) {
-        url = result[0];
+    *p++ = '\0';
+    // 判断开头方法是否为GET；配置了上传路径时还接受PUT和DELETE
+    if (strcasecmp(text, "GET") == 0) {
+        method = GET;
+    }
+    else if (!upload_prefixes.empty() && strcasecmp(text, "PUT") == 0) {
+        method = PUT;
+    }
+    else if (!upload_prefixes.empty() && strcasecmp(text, "DELETE") == 0) {
+        method = DELETE;
     }
     else {
         return BAD_REQUEST;
     }
-    std::cout << url << std::endl;
-    // 获取版本号，条件是以HTTP/开头的1.0或1.1
-    if (std::regex_search(text, result, std::regex("HTTP/1\\.[0|1]$"))) {
-        version = result[0];
+    LOG_DEBUG("%d\n", method);
+    p += strspn(p, " \t");
+    url = p;
+    p = strpbrk(p, " \t");
+    if (p == nullptr) {
+        return BAD_REQUEST;
+    }
+    *p++ = '\0';
+    p += strspn(p, " \t");
+    // 版本号只接受HTTP/1.0和HTTP/1.1
+    if (strcmp(p, "HTTP/1.1") != 0 && strcmp(p, "HTTP/1.0") != 0) {
+        return BAD_REQUEST;
     }
-    else {
+    version = p;
+    LOG_DEBUG("%s\n", version);
+    // 绝对形式http://host/path只保留路径
+    if (strncasecmp(url, "http://", 7) == 0) {
+        url = strchr(url + 7, '/');
+        if (url == nullptr) {
+            return BAD_REQUEST;
+        }
+    }
+    if (url[0] != '/') {
+        return BAD_REQUEST;
+    }
+    // 转发原始目标(含查询串)，路由按规范化后的路径匹配；
+    // 用户态加密的TLS连接不能splice，只由本地处理
+    bool proxy_eligible = proxy != nullptr && (ssl_ == nullptr || ktls_send_);
+    if (proxy_eligible || !async_routes.empty()) {
+        raw_target_ = arena_.copy(url, strlen(url));
+    }
+    if (!normalize_target(url)) {
         return BAD_REQUEST;
     }
-    std::cout << version << std::endl;
+    if (proxy_eligible && method == GET) {
+        proxy_route_ = proxy->match(url);
+    }
+    LOG_DEBUG("%s\n", url);
     check_state = CHECK_STATE_HEADER;
     return NO_REQUEST;
 }
 
-HTTPConnection::HttpCode HTTPConnection::parse_header(const std::string& text) {
-    // std::cout << text.size() << std::endl;
-    if (text.size() == 0) {
+// 请求头字段名比较，不区分大小写
+static bool field_is(const StringRef& name, const char* expected) {
+    return name.length == strlen(expected) && strncasecmp(name.data, expected, name.length) == 0;
+}
+
+HTTPConnection::HttpCode HTTPConnection::parse_header(const char* text) {
+    if (text[0] == '\0') {
         // 空行，请求头结束
-        // 如果存在消息体可以读
-        if (content_length_ > 0) {
+        // 如果存在消息体可以读；上传的请求体不经过读缓冲，由Upload接收
+        if (content_length_ > 0 && method == GET) {
             check_state = CHECK_STATE_CONTENT;
             return NO_REQUEST;
         }
@@ -381,107 +1756,162 @@ HTTPConnection::HttpCode HTTPConnection::parse_header(const std::string& text) {
             return GET_REQUEST;
         }
     }
-    else {
-        std::smatch key;
-        if (std::regex_search(text, key, std::regex("^[^\\s]*(?=:)"))) {
-            std::smatch value;
-            if (key[0] == "Connection") {
-                if (std::regex_search(text, value, std::regex("([^\\s])*$"))) {
-                    if (value.str() == "keep-alive") {
-                        keep_alive_ = true;
-                        // std::cout << text << std::endl;
-                    }
-                }
-                else {
-                    return BAD_REQUEST;
-                }
-            }
-            else if (key[0] == "Content-Length") {
-                if (std::regex_search(text, value, std::regex("([^\\s])*$"))) {
-                    content_length_ = atol(value.str().c_str());
-                    // std::cout << text << std::endl;
-                }
-                else {
-                    return BAD_REQUEST;
-                }
-            }
-            else if (key.str() == "Host") {
-                if (std::regex_search(text, value, std::regex("([^\\s])*$"))) {
-                    host_ = value.str();
-                    // std::cout << text << std::endl;
-                }
-                else {
-                    return BAD_REQUEST;
-                }
-            }
-//            else {
-//                printf("Oops! Unknown header: %s\n", text.c_str());
-//            }
+    // 字段名为行首连续非空白字符中最后一个':'之前的部分，值为其后行尾连续的非空白字符
+    size_t length = strlen(text);
+    size_t colon = length;
+    for (size_t i = 0; i < length && !isspace((unsigned char) text[i]); ++i) {
+        if (text[i] == ':') {
+            colon = i;
         }
-        else {
+    }
+    if (colon == length) {
+        return BAD_REQUEST;
+    }
+    size_t value_start = length;
+    while (value_start > colon + 1 && !isspace((unsigned char) text[value_start - 1])) {
+        --value_start;
+    }
+    if (header_count_ == header_capacity_) {
+        int capacity = header_capacity_ > 0 ? header_capacity_ * 2 : HEADER_TABLE_INITIAL;
+        HeaderField* table = arena_.allocate_array<HeaderField>(capacity);
+        if (header_count_ > 0) {
+            memcpy(table, headers_, header_count_ * sizeof(HeaderField));
+        }
+        headers_ = table;
+        header_capacity_ = capacity;
+    }
+    HeaderField& field = headers_[header_count_++];
+    field.line = StringRef(text, length);
+    field.name = StringRef(text, colon);
+    field.value = StringRef(text + value_start, length - value_start);
+    // 值在行尾，以'\0'结尾
+    const StringRef& value = field.value;
+    if (field_is(field.name, "Connection")) {
+        connection_upgrade_ = strcasestr(text, "upgrade") != nullptr;
+        if (strcasecmp(value.data, "keep-alive") == 0) {
+            keep_alive_ = true;
+        }
+    }
+    else if (field_is(field.name, "Content-Length")) {
+        char* end;
+        content_length_ = strtoll(value.data, &end, 10);
+        if (end == value.data || *end != '\0' || content_length_ < 0) {
             return BAD_REQUEST;
         }
+        has_content_length_ = true;
+    }
+    else if (field_is(field.name, "Authorization")) {
+        // Authorization: Bearer <token>
+        const char* p = text + colon + 1;
+        p += strspn(p, " \t");
+        if (strncasecmp(p, "Bearer", 6) == 0 && (p[6] == ' ' || p[6] == '\t')) {
+            p += 6;
+            p += strspn(p, " \t");
+            authorization_ = StringRef(p, text + length - p);
+        }
     }
+    else if (field_is(field.name, "Expect")) {
+        expect_continue_ = strcasecmp(value.data, "100-continue") == 0;
+    }
+    else if (field_is(field.name, "Upgrade")) {
+        upgrade_h2c_ = strstr(text, "h2c") != nullptr;
+        upgrade_websocket_ = strcasestr(text, "websocket") != nullptr;
+    }
+    else if (field_is(field.name, "Sec-WebSocket-Key")) {
+        ws_key_ = value;
+    }
+    else if (field_is(field.name, "Sec-WebSocket-Version")) {
+        ws_version_ = atoi(value.data);
+    }
+    else if (field_is(field.name, "HTTP2-Settings")) {
+        h2_settings_ = value;
+    }
+    else if (field_is(field.name, "Accept-Encoding")) {
+        accept_gzip_ = strstr(text, "gzip") != nullptr;
+    }
+    else if (field_is(field.name, "Host")) {
+        host_ = value;
+    }
+    return NO_REQUEST;
 }
-
-HTTPConnection::HttpCode HTTPConnection::parse_content(
-    const std::string& text) {
+HTTPConnection::HttpCode HTTPConnection::parse_content(const char* text) {
     return GET_REQUEST;
 }
 
 bool HTTPConnection::response_process(HttpCode ret) {
-    switch (ret) {
-        case INTERNAL_ERROR: {
-            add_status(500, error_500_title);
-            add_headers(strlen(error_500_form));
-            if (!add_content(error_500_form)) {
+    // 响应头格式化在写缓冲中已有内容之后，队列借用这一段
+    int start = write_index;
+    if (ret == FILE_REQUEST) {
+        add_status(200, ok_200_title);
+        if (file_->pack) {
+            // 资源包中已经预生成了长度、类型和ETag
+            add_response("%.*s", file_->pack_headers_length, file_->pack_headers);
+            add_connection();
+            if (!add_blank_line()) {
                 return false;
             }
-            break;
         }
-        case BAD_REQUEST: {
-            add_status(400, error_400_title);
-            add_headers(strlen(error_400_form));
-            if (!add_content(error_400_form)) {
-                return false;
-            }
-            break ;
+        else if (!add_headers(file_->length)) {
+            return false;
         }
-        case NO_RESOURCE: {
-            add_status(404, error_404_title);
-            add_headers(strlen(error_404_form));
-            if (!add_content(error_404_form)) {
-                return false;
-            }
-            break ;
+        output_.append_borrowed(write_buffer + start, write_index - start);
+        output_.append_file(file_, file_->address, file_->length);
+    }
+    else if (ret == INTERNAL_ERROR || ret == BAD_REQUEST || ret == NO_RESOURCE ||
+             ret == FORBIDDEN_REQUEST || ret == UNAUTHORIZED_REQUEST ||
+             ret == METHOD_NOT_ALLOWED || ret == LENGTH_REQUIRED || ret == INSUFFICIENT_STORAGE) {
+        const char* title = nullptr;
+        const char* form = nullptr;
+        int status = error_page(ret, &title, &form);
+        add_status(status, title);
+        if (ret == UNAUTHORIZED_REQUEST) {
+            add_response("WWW-Authenticate: Bearer\r\n");
         }
-        case FORBIDDEN_REQUEST: {
-            add_status(403, error_403_title);
-            add_headers(strlen(error_403_form));
-            if (!add_content(error_403_form)) {
-                return false;
-            }
-            break ;
-        }
-        case FILE_REQUEST: {
-            add_status(200, ok_200_title);
-            add_headers(file_stat_.st_size);
-            io_vec_[0].iov_base = write_buffer;
-            io_vec_[0].iov_len = write_index;
-            io_vec_[1].iov_base = file_address_;
-            io_vec_[1].iov_len = file_stat_.st_size;
-            io_vec_count = 2;
-            bytes_to_send = io_vec_[0].iov_len + io_vec_[1].iov_len;
-            return true;
+        else if (ret == METHOD_NOT_ALLOWED) {
+            add_response("Allow: GET\r\n");
         }
-        default: {
+        if (!add_headers(strlen(form))) {
+            return false;
+        }
+        // 错误页面是静态字符串，不再拷贝到写缓冲
+        output_.append_borrowed(write_buffer + start, write_index - start);
+        output_.append_borrowed(form, strlen(form));
+    }
+    else if (ret == STORED_REQUEST) {
+        // 新建的回复201；覆盖或删除回复204，不能带Content-Length
+        if (upload_created_) {
+            add_status(201, "Created");
+            add_content_length(0);
+        }
+        else {
+            add_status(204, "No Content");
+        }
+        if (!add_connection() || !add_blank_line()) {
+            return false;
+        }
+        output_.append_borrowed(write_buffer + start, write_index - start);
+    }
+    else if (ret == TOO_MANY_REQUESTS) {
+        // 与主线程直接回复的429相同，发完后关闭连接
+        output_.append_borrowed(too_many_requests_429, sizeof(too_many_requests_429) - 1);
+    }
+    else if (ret == TRACE_REQUEST) {
+        std::string dump;
+        trace_dump(&dump);
+        add_status(200, ok_200_title);
+        if (!add_content_length(dump.size()) ||
+            !add_response("Content-Type: application/octet-stream\r\n") || !add_connection() ||
+            !add_blank_line()) {
             return false;
         }
+        output_.append_borrowed(write_buffer + start, write_index - start);
+        output_.append_owned(&dump);
+    }
+    else {
+        return false;
     }
-    io_vec_[0].iov_base = write_buffer;
-    io_vec_[1].iov_len = write_index;
-    io_vec_count = 1;
-    bytes_to_send = io_vec_[0].iov_len;
+    response_seq_ = request_seq_;
+    close_after_send_ = !keep_alive_;
     return true;
 }
 
@@ -506,15 +1936,16 @@ bool HTTPConnection::add_status(int status, const char* title) {
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
-bool HTTPConnection::add_headers(int content_length) {
+bool HTTPConnection::add_headers(uint64_t content_length) {
     add_content_length(content_length);
     add_content_type();
     add_connection();
-    add_blank_line();
+    return add_blank_line();
 }
 
-bool HTTPConnection::add_content_length(int content_length) {
-    return add_response("Content-Length: %d\r\n", content_length);
+bool HTTPConnection::add_content_length(uint64_t content_length) {
+    // 上传的文件可以超过2GB
+    return add_response("Content-Length: %llu\r\n", (unsigned long long) content_length);
 }
 
 bool HTTPConnection::add_content_type() {
@@ -530,15 +1961,42 @@ bool HTTPConnection::add_blank_line() {
     return add_response("%s", "\r\n");
 }
 
-bool HTTPConnection::add_content(const char* content) {
-    return add_response("%s", content);
+void HTTPConnection::unmap() {
+    // 丢弃未发完的响应，队列中的段释放各自持有的映射和缓存引用
+    output_.clear();
+    file_.reset();
 }
 
-void HTTPConnection::unmap() {
-    if (file_address_) {
-        munmap(file_address_, file_stat_.st_size);
-        // 空指针的地址为0
-        file_address_ = 0;
+void StaticFile::release() {
+    if (pack) {
+        // 资源包的映射由包自己管理
+        pack.reset();
+    }
+    else if (address) {
+        munmap(address, length);
+    }
+    if (fd_owned) {
+        close(fd);
+    }
+    address = nullptr;
+    length = 0;
+    fd = -1;
+    fd_owned = false;
+    offset = 0;
+    pack_headers = nullptr;
+    pack_headers_length = 0;
+}
+
+int HTTPConnection::error_page(HttpCode code, const char** title, const char** form) {
+    switch (code) {
+        case BAD_REQUEST: *title = error_400_title; *form = error_400_form; return 400;
+        case FORBIDDEN_REQUEST: *title = error_403_title; *form = error_403_form; return 403;
+        case NO_RESOURCE: *title = error_404_title; *form = error_404_form; return 404;
+        case UNAUTHORIZED_REQUEST: *title = error_401_title; *form = error_401_form; return 401;
+        case METHOD_NOT_ALLOWED: *title = error_405_title; *form = error_405_form; return 405;
+        case LENGTH_REQUIRED: *title = error_411_title; *form = error_411_form; return 411;
+        case INSUFFICIENT_STORAGE: *title = error_507_title; *form = error_507_form; return 507;
+        default: *title = error_500_title; *form = error_500_form; return 500;
     }
 }
 
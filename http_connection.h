@@ -11,26 +11,129 @@
 #include <stdarg.h>
 #include <sys/uio.h>
 #include <cstdio>
+#include <atomic>
+#include <vector>
+
+#include "arena.h"
+#include "asset_pack.h"
+#include "connection_slab.h"
+#include "coroutine.h"
+#include "idle_list.h"
+#include "io_pool.h"
+#include "ip_limiter.h"
+#include "listener.h"
+#include "log.h"
+#include "output_queue.h"
+#include "proxy.h"
+#include "response_cache.h"
+#include "tls.h"
+#include "trace.h"
+#include "transport.h"
+#include "upload.h"
+#include "zerocopy.h"
 
 #define TIMESLOT 5
+// 每次发送前检查驻留的文件窗口，不在页缓存中就先交给IO线程预读
+#define IO_RESIDENCY_WINDOW (1 << 20)
+// 写缓冲剩余空间不足以再格式化一个响应头时，流水线上后面的请求留到队列发完再处理
+#define PIPELINE_HEADER_ROOM 384
+// 请求头表的初始容量，不够时在arena中翻倍
+#define HEADER_TABLE_INITIAL 16
+// 按路径记住响应体大小的槽位数(2的幂)，冲突时后来的覆盖
+#define SIZE_HINT_SLOTS 4096
 
 class HTTPConnection;
+class Http2Session;
+class WebSocketSession;
+
+// 慢速客户端(slowloris)防护策略，速率单位bytes/s，0表示不检查
+struct SlowClientPolicy {
+    int header_timeout_ms; // 从请求首字节到请求头完整的绝对期限
+    int min_header_rate;   // 读请求头阶段的最低速率
+    int min_body_rate;     // 读请求体阶段的最低速率
+    int min_write_rate;    // 发送响应阶段的最低速率
+    int grace_ms;          // 每个阶段开始后多久才检查速率，避免误伤刚开始传输的连接
+};
 // 定时器类
 class UtilTimer {
 public:
-    UtilTimer() : next(nullptr), prev(nullptr), expire_(0), http_connection_(nullptr) {};
+    UtilTimer() : expire_(0), callback(nullptr), handle_(0), next(nullptr), prev(nullptr) {};
     void init();
 
 public:
     time_t expire_;// 任务超时时间
     // 任务回调函数，处理客户数据，有定时器的执行者传递给回调函数
-    void (*callback)(HTTPConnection*);
-    HTTPConnection* http_connection_;
+    void (*callback)(ConnHandle);
+    // 只保存连接句柄，连接关闭并复用后定时器触发也不会误伤新连接
+    ConnHandle handle_;
     UtilTimer* next;
     UtilTimer* prev;
 };
 
+// 一个响应体：文件的只读映射或资源包中的一段，HTTP/1.1连接和HTTP/2的流共用
+struct StaticFile {
+    StaticFile() : address(nullptr), length(0), fd(-1), fd_owned(false), offset(0),
+                   pack_headers(nullptr), pack_headers_length(0) {}
+    ~StaticFile() { release(); }
+    // 解除映射并关闭自己打开的fd
+    void release();
+
+    char* address;
+    size_t length;
+    // 映射对应的fd与偏移，预读时dup给IO线程；资源包的fd由包持有
+    int fd;
+    bool fd_owned;
+    off_t offset;
+    // 从资源包发送时持有包的引用，热替换期间保证映射有效
+    std::shared_ptr<AssetPack> pack;
+    const char* pack_headers;
+    int pack_headers_length;
+
+private:
+    StaticFile(const StaticFile&);
+    StaticFile& operator=(const StaticFile&);
+};
+
+// 交给协程处理的请求，处理期间连接归主线程，不会再有其他线程访问
+struct AsyncRequest {
+    ConnHandle handle;
+    std::string target;  // 原始请求目标，含查询串
+    std::string host;
+    // 协程在reactor上运行，阻塞的文件IO交给offload
+    Reactor* reactor;
+    OffloadPool* offload;
+};
+
+struct AsyncResponse {
+    int status;
+    const char* title;
+    const char* content_type;
+    std::string body;
+};
+
+// 协程处理函数，可以co_await fd就绪、定时器和阻塞线程上的文件读
+typedef Task<AsyncResponse> (*AsyncHandler)(AsyncRequest request);
+
+struct AsyncRoute {
+    std::string prefix;
+    AsyncHandler handler;
+};
+
+struct AsyncResult {
+    ConnHandle handle;
+    AsyncResponse response;
+};
+
+// 请求头表中的一项，都指向读缓冲中已切分好的行
+struct HeaderField {
+    StringRef line;
+    StringRef name;
+    StringRef value;
+};
+
 class HTTPConnection {
+    // 基准测试需要直接调用解析与响应的内部函数
+    friend class HTTPConnectionBench;
 public:
     enum Method { GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT };
     enum CheckState {
@@ -39,6 +142,22 @@ public:
         CHECK_STATE_CONTENT
     };
     enum LineStatus { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+    // 慢速客户端检测所处的传输阶段，只由主线程更新
+    enum TransferPhase {
+        PHASE_IDLE = 0,   // 等待下一个请求(keep-alive空闲)
+        PHASE_HEADER,     // 已收到请求首字节，请求头尚不完整
+        PHASE_PROCESSING, // 请求头完整，交给工作线程处理
+        PHASE_BODY,       // 工作线程需要更多请求体数据
+        PHASE_WRITE       // 正在发送响应
+    };
+    enum EvictReason {
+        EVICT_NONE = 0,
+        EVICT_HEADER_TIMEOUT,// 请求头超过绝对期限仍不完整
+        EVICT_HEADER_RATE,   // 请求头速率过低
+        EVICT_BODY_RATE,     // 请求体速率过低
+        EVICT_WRITE_RATE,    // 客户端接收响应速率过低
+        EVICT_REASON_COUNT
+    };
     enum HttpCode {
         NO_REQUEST = 0,   // 还没解析完，需要继续解析客户端数据
         GET_REQUEST,      // 获得了一个完整的客户端请求
@@ -47,79 +166,309 @@ public:
         FORBIDDEN_REQUEST,// 客户对资源没有足够的访问权限
         FILE_REQUEST,     // 文件请求并获取成功
         INTERNAL_ERROR,   // 服务器内部错误
-        CLOSED_CONNECTION // 客户端已经关闭连接
+        CLOSED_CONNECTION,// 客户端已经关闭连接
+        PROXY_REQUEST,    // 匹配反向代理路由，交给主线程转发
+        TRACE_REQUEST,    // 导出阶段追踪记录
+        ASYNC_REQUEST,    // 匹配协程处理函数，交给主线程的reactor
+        UPLOAD_REQUEST,   // PUT通过校验，接着把请求体写入临时文件
+        STORED_REQUEST,   // PUT写入完成或DELETE删除成功
+        UNAUTHORIZED_REQUEST,// 上传路径上缺少或错误的令牌
+        METHOD_NOT_ALLOWED,  // 上传路径之外的PUT、DELETE
+        LENGTH_REQUIRED,  // PUT没有Content-Length
+        INSUFFICIENT_STORAGE,// 按长度预分配空间失败
+        TOO_MANY_REQUESTS // 流水线上的请求超过地址的请求速率
+    };
+    // 线程池中的调度类，主线程在请求行到齐后分类
+    enum RequestClass {
+        CLASS_CONTROL = 0, // 控制面：追踪导出、健康检查等配置的路径
+        CLASS_SMALL_STATIC,
+        CLASS_LARGE_STATIC,// 响应体不小于large_body_bytes的静态文件
+        CLASS_DYNAMIC,     // 转发、HTTP/2、WebSocket、TLS握手以及GET/HEAD以外的方法
+        CLASS_COUNT
     };
     // 所有的socket事件注册到同一个epoll_fd
     static int epoll_fd;
+    // 文档根目录，启动时打开一次，所有文件都相对它解析
+    static int root_fd;
     static int user_count;
     static const int READ_BUFFER_SIZE = 2048;
     static const int WRITE_BUFFER_SIZE = 1024;
+    static SlowClientPolicy slow_policy;
+    // 各类慢速连接被踢掉的次数
+    static std::atomic<uint64_t> evictions[EVICT_REASON_COUNT];
+    // 按客户端地址限流，nullptr表示不限
+    static IpLimiter* ip_limiter;
+    // 预先序列化好的拒绝响应
+    static const char too_many_requests_429[];
+    static const char service_unavailable_503[];
+    // TLS监听端口的配置与统计
+    static TlsContext* tls;
+    // 允许升级为WebSocket的路径前缀，为空时不接受升级
+    static std::string ws_prefix;
+    // 开启追踪时，来自回环地址的这个路径返回二进制导出，为空时不提供
+    static std::string trace_path;
+    // 以这些前缀开头的路径归入控制面
+    static std::vector<std::string> control_paths;
+    // 大文件的分界
+    static size_t large_body_bytes;
+    // 反向代理，nullptr表示没有配置路由
+    static ReverseProxy* proxy;
+    // 按前缀匹配的协程处理函数，在主线程的reactor上运行
+    static std::vector<AsyncRoute> async_routes;
+    static Reactor* reactor;
+    static OffloadPool* offload;
+    // 转发响应的微缓存，nullptr表示不缓存
+    static ResponseCache* cache;
+    // 冷数据预读线程池，nullptr表示直接在主线程缺页
+    static BlockingIoPool* io_pool;
+    // 发送前发现文件不在页缓存而转交IO线程的次数
+    static std::atomic<uint64_t> io_deferrals;
+    // 一个连接上最多处理的请求数，到达时响应带Connection: close，0表示不限
+    static int max_requests;
+    static std::atomic<uint64_t> max_requests_closes;
+    // 明文连接上不小于这个长度的缓存或文件段以MSG_ZEROCOPY发送，0表示关闭
+    static size_t zerocopy_min_bytes;
+    // 接受PUT、DELETE的路径前缀，为空时只接受GET；请求须带Authorization: Bearer upload_token
+    static std::vector<std::string> upload_prefixes;
+    static std::string upload_token;
     // 定时器类
     UtilTimer* timer;
+    // 空闲keep-alive连接链表中的节点，由主线程维护
+    IdleNode idle_node;
 
 public:
     HTTPConnection();
     ~HTTPConnection();
 
-    // 处理客户端请求
-    void process();
+    // 处理客户端请求，tag为入队时的句柄，连接已被复用则直接丢弃
+    void process(uint64_t tag);
     // 初始化
-    void init(int _fd, sockaddr_in& _addr);
+    // transport为nullptr时使用socket，基准测试传入内存回环
+    void init(int _fd, const sockaddr* _addr, socklen_t _addr_len, ConnHandle _handle,
+              Transport* transport = nullptr);
     void close_connection();
+    ConnHandle handle() const { return handle_; }
+    // 连接上当前请求的序号，追踪记录用它区分同一连接上的请求
+    uint32_t request_seq() const { return request_seq_; }
+    // 主线程读完数据、交给线程池之前调用：只查看原始请求行，不改动读缓冲。
+    // 请求行不完整时归入小文件类，这一轮只是解析
+    RequestClass classify();
+    // 从TLS端口接入的连接，先完成握手再处理请求
+    bool start_tls();
+    // 握手期间的读写事件都交给工作线程继续握手
+    bool tls_handshaking() const { return tls_handshaking_; }
+    // 主线程取到事件时调用，WebSocket连接上因广播唤醒产生的重复事件返回false
+    bool claim_events();
+    // 空闲超时：WebSocket连接先发ping再给一个周期，返回false时应关闭
+    bool keepalive_ping();
+    // 处理过请求的HTTP/1.1连接正在等待下一个请求，没有任何未完成的工作，
+    // 可以随时关闭；主线程在注册EPOLLIN之后调用
+    bool keepalive_idle() const;
+    // 按慢速客户端策略检查当前阶段，返回需要踢掉连接的原因
+    EvictReason check_slow(uint64_t now_ms) const;
+    static const char* evict_reason_name(EvictReason reason);
+    static bool open_root(const char* path);
+    // 请求目标去掉查询串、百分号解码并规范化，非法时返回false
+    static bool normalize_target(char* url);
+    // 按规范化后的url打开文件(或在资源包中查找)，成功返回FILE_REQUEST
+    static HttpCode open_file(const char* url, bool accept_gzip, StaticFile* file);
+    // 错误码对应的状态码、原因短语和默认页面
+    static int error_page(HttpCode code, const char** title, const char** form);
+    // 记录客户端地址前缀，tracked表示建立连接时计入了限流表
+    void set_ip_key(const IpKey& key, bool tracked);
+    // 当前请求超过了地址的请求速率
+    bool rate_limited() const { return rate_limited_; }
+    // 直接回复429并在发送完后关闭连接，不经过工作线程
+    void reject_request();
+    // 线程池队列满：主线程直接回复503，随后由主线程write()；
+    // 握手中、HTTP/2和WebSocket连接无法插入HTTP/1.1响应，返回false，应直接关闭
+    bool reject_overloaded();
+    // 工作线程：请求排队过久被丢弃，回复503并关闭；返回false表示不能丢弃，照常process
+    bool shed(uint64_t tag);
+    // 转发结束且客户端连接保持时，回到等待下一个请求的状态；
+    // cached非空表示合并到了别的请求，用它存入缓存的响应回复
+    void proxy_done(const CachedResponsePtr& cached);
+    // 主线程：取出已经结束的协程处理的结果
+    static void take_async_results(std::vector<AsyncResult>& results);
+    // 协程处理结束且连接还在时，把响应(响应体交给发送队列)排入队列，随后由主线程write()
+    void async_done(AsyncResponse& response);
+    // 发送队列发完后，流水线上还有等待处理的请求，需要再交给工作线程
+    bool pipelined() const;
     bool read();
     bool write();
+    // IO线程预读完成，主线程随后继续write()
+    void io_complete();
+    // 有零拷贝发送在等完成通知；通知以EPOLLERR报告
+    bool zerocopy_pending() const { return zerocopy_.pending(); }
+    // 主线程收到EPOLLERR时调用，放开已完成发送的引用；socket真的出错时返回false
+    bool reap_zerocopy();
+    // 事件只是完成通知时，按连接当前等待的方向重新注册
+    void rearm();
+    // 上传的请求体还没收完：read()已把数据搬进文件，主线程重新注册读事件即可，不交给工作线程
+    bool upload_receiving() const { return upload_ != nullptr && upload_->remaining() > 0; }
 
 private:
     // http通信套接字
     int sock_fd;
-    // http通信地址
-    sockaddr_in addr{};
+    // 明文读写和事件注册经过它，TLS握手与用户态加密仍直接使用sock_fd
+    Transport* transport_;
+    // 连接在槽位表中的句柄，同时作为epoll事件数据
+    std::atomic<ConnHandle> handle_;
+    // 对端地址：IPv4、IPv6或Unix域套接字
+    sockaddr_storage addr{};
+    // TLS连接的状态；启用kTLS发送后直接writev明文，由内核加密
+    SSL* ssl_;
+    bool tls_handshaking_;
+    bool ktls_send_;
     // 缓冲
     char read_buffer[READ_BUFFER_SIZE];
     char write_buffer[WRITE_BUFFER_SIZE];
+    // 请求期间的分配(请求头表、请求目标副本、响应的文件元数据)，
+    // 连接上没有未完成的请求且发送队列发完后整体重置
+    Arena arena_;
     // 标识读缓冲区以及读入的客户端数据最后一个字节的下一个位置
     int read_index;
     CheckState check_state;
     int line_start; // 正在解析的行的起始位置
     int check_index; // 正在分析的字符在缓冲中的位置
     Method method;
-    std::string url;
-    std::string version;
-    int content_length_;
+    // 指向读缓冲，已百分号解码并规范化
+    char* url;
+    char* version;
+    int64_t content_length_;
+    bool has_content_length_;
     bool keep_alive_;
-    std::string host_;
-    std::string real_file_;
-    struct stat file_stat_;
-    // 内存映射首地址
-    char* file_address_;
-    // 读缓冲区当前位置
+    HeaderField* headers_;
+    int header_count_;
+    int header_capacity_;
+    // 以下片段指向读缓冲或arena，只在当前请求期间有效
+    StringRef host_;
+    // Authorization: Bearer后的令牌
+    StringRef authorization_;
+    bool expect_continue_;
+    // 升级或先验知识协商出HTTP/2之后，连接上的所有请求都交给它
+    Http2Session* h2_;
+    bool upgrade_h2c_;
+    StringRef h2_settings_;
+    // 升级为WebSocket之后帧的收发都交给它
+    WebSocketSession* ws_;
+    bool upgrade_websocket_;
+    // 原始请求目标(规范化之前的副本)，转发和协程处理时使用
+    StringRef raw_target_;
+    // 反向代理：匹配的路由；转发期间连接归主线程
+    int proxy_route_;
+    bool proxying_;
+    // 协程处理：匹配的处理函数；处理期间连接归主线程
+    int async_route_;
+    bool async_;
+    bool connection_upgrade_;
+    StringRef ws_key_;
+    int ws_version_;
+    // 正在响应的文件，响应排入发送队列后由队列持有
+    std::shared_ptr<StaticFile> file_;
+    bool io_pending_;
+    uint64_t io_wait_start_ms_;
+    bool accept_gzip_;
+    // 写缓冲中已格式化的响应头长度；流水线上的多个响应头依次排列，队列发完后清零
     int write_index;
-    int bytes_to_send;
-    int bytes_have_send;
-    struct iovec io_vec_[2];
-    int io_vec_count;
+    OutputQueue output_;
+    // 队列中最后一个响应要求发完后关闭连接
+    bool close_after_send_;
+    ZeroCopySender zerocopy_;
+    // 正在接收的PUT请求体，接收期间由主线程在read()中推进
+    Upload* upload_;
+    // 上传的目标原来不存在，回复201，否则204
+    bool upload_created_;
+    // 流水线上已解析、要等前面的响应发完才能处理的请求(转发或协议升级)
+    HttpCode pending_;
+    // 客户端地址限流
+    IpKey ip_key_;
+    bool ip_tracked_;
+    bool rate_limited_;
+    // 当前请求已经扣过令牌：首个请求在主线程读到首字节时扣，流水线上紧跟着的在解析完时扣
+    bool request_charged_;
+    // 慢速客户端检测
+    TransferPhase phase_;
+    uint64_t request_start_ms_;// 当前请求首字节到达时间
+    uint64_t phase_start_ms_;
+    uint64_t phase_bytes_;     // 当前阶段已传输的字节数
+    // 追踪：当前请求的序号，以及发送队列中最后一个响应所属的请求
+    uint32_t request_seq_;
+    uint32_t response_seq_;
+    // 请求行到齐时的分类，之后的几轮解析沿用
+    RequestClass request_class_;
 private:
     void init();
+    // 一个请求的响应已排入队列：重置解析状态，keep_pipelined时把缓冲中紧跟着的字节移到开头
+    void next_request(bool keep_pipelined);
+    // 没有已解析一半或等待处理的请求、发送队列也发完时，整体释放请求期间的分配
+    void release_arena();
     void unmap();
+    void on_bytes_read(int old_index);
+    // 待发送的文件窗口不在页缓存中时提交预读，返回true表示需要等待
+    bool defer_cold_file(const StaticFile& file, const char* start, size_t window);
+    // 推进TLS握手，失败返回false
+    bool tls_handshake();
+    // 明文或TLS上的收发，语义同recv/writev(暂时不可读写时返回-1且errno为EAGAIN)
+    ssize_t recv_bytes(char* buf, size_t length);
+    ssize_t send_iov(const struct iovec* iov, int count);
+    // 从队首起以零拷贝发送的段数，0表示这一次普通发送；*copy_count为普通发送的段数
+    int zerocopy_prefix(const struct iovec* iov, const OutputSegment* const* segments, int count,
+                        int* copy_count);
+    // HTTP/2：收到完整的连接前言，或升级请求已解析完
+    bool start_h2_prior_knowledge();
+    bool start_h2_upgrade();
+    void process_h2();
+    bool read_h2();
+    bool write_h2();
+    // WebSocket：校验升级请求并切换，不满足条件时按普通请求响应
+    bool start_ws_upgrade();
+    void process_ws();
+    bool read_ws();
+    bool write_ws();
+    void start_proxy();
+    void start_async();
+    // PUT、DELETE：检查路径前缀与令牌，DELETE直接删除
+    HttpCode check_upload();
+    bool upload_authorized() const;
+    // 创建临时文件并写入已在读缓冲中的请求体，需要继续接收时返回UPLOAD_REQUEST
+    HttpCode start_upload();
+    // 请求体收齐，改名到目标
+    HttpCode finish_upload();
+    bool read_upload();
+    // 用缓存的响应回复：写缓冲放状态行和本次的Age、X-Cache、Connection，
+    // 其余部分直接引用缓存条目，一起排入发送队列
+    void serve_cached(const CachedResponsePtr& entry, bool stale);
+    // 发送预先序列化的静态响应，发完后关闭连接
+    void send_canned(const char* response, size_t length);
     // 解析请求相关函数
     HttpCode parse_process(); // 解析请求
-    HttpCode parse_request(const std::string& text); // 解析请求首行
-    HttpCode parse_header(const std::string& text); // 解析请求头
-    HttpCode parse_content(const std::string& text); // 解析请求体
+    HttpCode parse_request(char* text); // 解析请求首行，原地切分
+    HttpCode parse_header(const char* text); // 解析请求头
+    HttpCode parse_content(const char* text); // 解析请求体
     
     LineStatus parse_line(); // 获取一行的数据选择交给请求行、请求头还是请求体
     inline char* get_line();
+    // 按地址扣除一个令牌，不足时返回false；Unix域套接字的对端在本机，不限速
+    bool charge_request(uint64_t now_ms);
+    // 请求解析完整之后调用do_request，前后各记一次追踪
+    HttpCode handle_request();
     HttpCode do_request();
+    static HttpCode open_pack_file(const std::shared_ptr<AssetPack>& pack, const char* url,
+                                   bool accept_gzip, StaticFile* file);
+    static int open_beneath_root(const char* relative);
     // 响应请求相关函数
     bool response_process(HttpCode ret);
     bool add_response(const char* format, ...);
     bool add_status(int status, const char* title);
-    bool add_headers(int content_length);
-    bool add_content_length(int content_length);
+    bool add_headers(uint64_t content_length);
+    bool add_content_length(uint64_t content_length);
     bool add_content_type();
     bool add_connection();
     bool add_blank_line();
-    bool add_content(const char* content);
 };
 
+// 单调时钟毫秒数，精度满足超时判断即可
+uint64_t monotonic_ms();
+
 #endif
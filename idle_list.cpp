@@ -0,0 +1,39 @@
+#include "idle_list.h"
+
+void IdleList::push(IdleNode* node, ConnHandle handle, uint64_t now_ms) {
+    remove(node);
+    node->handle = handle;
+    node->since_ms = now_ms;
+    node->prev = tail_;
+    node->next = nullptr;
+    if (tail_ != nullptr) {
+        tail_->next = node;
+    }
+    else {
+        head_ = node;
+    }
+    tail_ = node;
+    ++size_;
+}
+
+void IdleList::remove(IdleNode* node) {
+    if (node->handle == 0) {
+        return;
+    }
+    if (node->prev != nullptr) {
+        node->prev->next = node->next;
+    }
+    else {
+        head_ = node->next;
+    }
+    if (node->next != nullptr) {
+        node->next->prev = node->prev;
+    }
+    else {
+        tail_ = node->prev;
+    }
+    node->prev = nullptr;
+    node->next = nullptr;
+    node->handle = 0;
+    --size_;
+}
@@ -0,0 +1,42 @@
+#ifndef HTTP_SERVER_IDLE_LIST_H
+#define HTTP_SERVER_IDLE_LIST_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "connection_slab.h"
+
+// 链表节点，嵌在连接对象中；handle为0表示不在链表中
+struct IdleNode {
+    IdleNode() : prev(nullptr), next(nullptr), handle(0), since_ms(0) {}
+
+    IdleNode* prev;
+    IdleNode* next;
+    ConnHandle handle;
+    uint64_t since_ms;// 进入空闲的时刻
+};
+
+// 等待下一个请求的keep-alive连接，按进入空闲的先后排列(LRU)，
+// 描述符紧张时从最早空闲的开始关闭。只在主线程访问
+class IdleList {
+public:
+    IdleList() : head_(nullptr), tail_(nullptr), size_(0) {}
+
+    // 放到队尾，已在链表中的先移除
+    void push(IdleNode* node, ConnHandle handle, uint64_t now_ms);
+    // 不在链表中时什么也不做
+    void remove(IdleNode* node);
+    // 最早空闲的连接，没有时返回nullptr
+    IdleNode* oldest() const { return head_; }
+    size_t size() const { return size_; }
+
+private:
+    IdleNode* head_;
+    IdleNode* tail_;
+    size_t size_;
+
+    IdleList(const IdleList&) = delete;
+    IdleList& operator=(const IdleList&) = delete;
+};
+
+#endif
@@ -0,0 +1,119 @@
+#include "io_pool.h"
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <exception>
+
+#include "log.h"
+
+BlockingIoPool::BlockingIoPool(int thread_num, int max_jobs)
+    : jobs(0), bytes(0), thread_num_(thread_num), max_jobs_(max_jobs), threads_(nullptr),
+      event_fd_(-1), stop_(false) {
+    if (thread_num <= 0 || max_jobs <= 0) {
+        throw std::exception();
+    }
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd_ == -1) {
+        throw std::exception();
+    }
+    threads_ = new pthread_t[thread_num_];
+    for (int i = 0; i < thread_num_; ++i) {
+        LOG_DEBUG("create the %dth io thread\n", i);
+        if (pthread_create(&threads_[i], nullptr, worker, this) != 0) {
+            delete[] threads_;
+            close(event_fd_);
+            throw std::exception();
+        }
+    }
+}
+
+BlockingIoPool::~BlockingIoPool() {
+    stop_ = true;
+    for (int i = 0; i < thread_num_; ++i) {
+        queue_stat_.post();
+    }
+    for (int i = 0; i < thread_num_; ++i) {
+        pthread_join(threads_[i], nullptr);
+    }
+    delete[] threads_;
+    for (size_t i = 0; i < queue_.size(); ++i) {
+        close(queue_[i].fd);
+    }
+    close(event_fd_);
+}
+
+bool BlockingIoPool::submit(const IoJob& job) {
+    queue_locker_.lock();
+    if ((int) queue_.size() >= max_jobs_) {
+        queue_locker_.unlock();
+        return false;
+    }
+    queue_.push_back(job);
+    queue_locker_.unlock();
+    queue_stat_.post();
+    return true;
+}
+
+void BlockingIoPool::drain(std::vector<ConnHandle>& done) {
+    uint64_t value;
+    // 清空eventfd计数，之后再到达的完成会重新触发可读
+    ssize_t ret = read(event_fd_, &value, sizeof(value));
+    (void) ret;
+    completed_locker_.lock();
+    done.swap(completed_);
+    completed_.clear();
+    completed_locker_.unlock();
+}
+
+void* BlockingIoPool::worker(void* arg) {
+    ((BlockingIoPool*) arg)->run();
+    return nullptr;
+}
+
+void BlockingIoPool::run() {
+    while (true) {
+        queue_stat_.wait();
+        if (stop_) {
+            break;
+        }
+        queue_locker_.lock();
+        if (queue_.empty()) {
+            queue_locker_.unlock();
+            continue;
+        }
+        IoJob job = queue_.front();
+        queue_.pop_front();
+        queue_locker_.unlock();
+
+        warm(job);
+        close(job.fd);
+        ++jobs;
+        bytes += job.length;
+
+        completed_locker_.lock();
+        completed_.push_back(job.handle);
+        completed_locker_.unlock();
+        uint64_t one = 1;
+        ssize_t ret = write(event_fd_, &one, sizeof(one));
+        (void) ret;
+    }
+}
+
+void BlockingIoPool::warm(const IoJob& job) {
+    // 先让内核对整段发起预读，再同步读一遍，返回时数据一定已在页缓存中
+    posix_fadvise(job.fd, job.offset, job.length, POSIX_FADV_WILLNEED);
+    static const size_t CHUNK = 128 * 1024;
+    static thread_local char scratch[CHUNK];
+    size_t done = 0;
+    while (done < job.length) {
+        size_t want = std::min(CHUNK, job.length - done);
+        ssize_t n = pread(job.fd, scratch, want, job.offset + done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+}
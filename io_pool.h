@@ -0,0 +1,57 @@
+#ifndef HTTP_SERVER_IO_POOL_H
+#define HTTP_SERVER_IO_POOL_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+#include "connection_slab.h"
+#include "locker.h"
+
+// 预读任务：把文件的一段读入页缓存，完成后通知主线程恢复该连接的发送
+struct IoJob {
+    ConnHandle handle;
+    int fd;       // 任务独占的fd(dup得到)，完成后由IO线程关闭
+    off_t offset;
+    size_t length;
+};
+
+// 专门执行可能阻塞的磁盘IO的线程池，和处理请求的ThreadPool分开，
+// 冷数据的读取不会占用工作线程，更不会阻塞主线程的事件循环
+class BlockingIoPool {
+public:
+    BlockingIoPool(int thread_num, int max_jobs);
+    ~BlockingIoPool();
+
+    // 提交任务，fd的所有权转移给线程池；队列满时返回false，fd仍归调用者
+    bool submit(const IoJob& job);
+    // 完成通知的eventfd，注册到主线程的epoll中
+    int event_fd() const { return event_fd_; }
+    // 主线程：取出所有已完成任务的连接句柄
+    void drain(std::vector<ConnHandle>& done);
+
+    std::atomic<uint64_t> jobs;
+    std::atomic<uint64_t> bytes;
+
+private:
+    static void* worker(void* arg);
+    void run();
+    void warm(const IoJob& job);
+
+    int thread_num_;
+    int max_jobs_;
+    pthread_t* threads_;
+    std::deque<IoJob> queue_;
+    Locker queue_locker_;
+    Sema queue_stat_;
+    std::vector<ConnHandle> completed_;
+    Locker completed_locker_;
+    int event_fd_;
+    std::atomic<bool> stop_;
+};
+
+#endif
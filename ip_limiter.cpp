@@ -0,0 +1,212 @@
+#include "ip_limiter.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <cstring>
+#include <exception>
+
+IpLimiter::IpLimiter(const IpLimiterConfig& config)
+    : rejected_connections(0), rejected_requests(0), untracked(0), config_(config) {
+    // 每个分片的槽位数取2的幂
+    uint32_t per_shard = 1;
+    while (per_shard * IP_LIMITER_SHARDS < config_.capacity) {
+        per_shard <<= 1;
+    }
+    if (per_shard < IP_LIMITER_PROBES) {
+        per_shard = IP_LIMITER_PROBES;
+    }
+    shard_mask_ = per_shard - 1;
+    if (config_.burst < config_.requests_per_sec) {
+        config_.burst = config_.requests_per_sec;
+    }
+    shards_ = new Shard[IP_LIMITER_SHARDS];
+    for (int i = 0; i < IP_LIMITER_SHARDS; ++i) {
+        shards_[i].entries = new Entry[per_shard];
+        memset(shards_[i].entries, 0, sizeof(Entry) * per_shard);
+    }
+}
+
+IpLimiter::~IpLimiter() {
+    for (int i = 0; i < IP_LIMITER_SHARDS; ++i) {
+        delete[] shards_[i].entries;
+    }
+    delete[] shards_;
+}
+
+static void mask_prefix(uint64_t& hi, uint64_t& lo, int prefix) {
+    if (prefix <= 0) {
+        hi = 0;
+        lo = 0;
+    }
+    else if (prefix < 64) {
+        hi &= ~0ull << (64 - prefix);
+        lo = 0;
+    }
+    else if (prefix == 64) {
+        lo = 0;
+    }
+    else if (prefix < 128) {
+        lo &= ~0ull << (128 - prefix);
+    }
+}
+
+static uint64_t load_be64(const uint8_t* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+IpKey IpLimiter::make_key(const sockaddr* addr) const {
+    IpKey key{0, 0};
+    if (addr->sa_family == AF_INET) {
+        const sockaddr_in* in = (const sockaddr_in*) addr;
+        key.hi = 0;
+        key.lo = 0x0000ffff00000000ull | ntohl(in->sin_addr.s_addr);
+        mask_prefix(key.hi, key.lo, 96 + config_.v4_prefix);
+    }
+    else if (addr->sa_family == AF_INET6) {
+        const sockaddr_in6* in6 = (const sockaddr_in6*) addr;
+        key.hi = load_be64(in6->sin6_addr.s6_addr);
+        key.lo = load_be64(in6->sin6_addr.s6_addr + 8);
+        bool v4_mapped = key.hi == 0 && (key.lo >> 32) == 0xffff;
+        mask_prefix(key.hi, key.lo, v4_mapped ? 96 + config_.v4_prefix : config_.v6_prefix);
+    }
+    return key;
+}
+
+uint64_t IpLimiter::hash(const IpKey& key) {
+    // murmur3 finalizer
+    uint64_t h = key.hi * 0x9e3779b97f4a7c15ull ^ key.lo;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+void IpLimiter::refill(Entry& e, uint64_t now_ms) const {
+    if (config_.requests_per_sec <= 0) {
+        return;
+    }
+    int64_t full = (int64_t) config_.burst * 1000;
+    if (now_ms > e.refill_ms) {
+        // 每毫秒补充requests_per_sec个千分之一令牌
+        e.tokens += (int64_t) (now_ms - e.refill_ms) * config_.requests_per_sec;
+        if (e.tokens > full) {
+            e.tokens = full;
+        }
+    }
+    e.refill_ms = now_ms;
+}
+
+bool IpLimiter::reclaimable(const Entry& e, uint64_t now_ms) const {
+    if (e.refill_ms == 0) {
+        return true;
+    }
+    if (e.conns != 0) {
+        return false;
+    }
+    if (config_.requests_per_sec <= 0) {
+        return true;
+    }
+    int64_t missing = (int64_t) config_.burst * 1000 - e.tokens;
+    return missing <= 0 ||
+           now_ms >= e.refill_ms + (uint64_t) (missing / config_.requests_per_sec);
+}
+
+IpLimiter::Entry* IpLimiter::find(Shard& shard, uint64_t h, const IpKey& key, uint64_t now_ms,
+                                  bool create) {
+    uint32_t start = (uint32_t) h & shard_mask_;
+    Entry* reuse = nullptr;
+    for (uint32_t i = 0; i < IP_LIMITER_PROBES; ++i) {
+        Entry& e = shard.entries[(start + i) & shard_mask_];
+        if (e.refill_ms != 0 && e.hi == key.hi && e.lo == key.lo) {
+            return &e;
+        }
+        if (reuse == nullptr && reclaimable(e, now_ms)) {
+            reuse = &e;
+        }
+    }
+    if (!create || reuse == nullptr) {
+        return nullptr;
+    }
+    reuse->hi = key.hi;
+    reuse->lo = key.lo;
+    reuse->refill_ms = now_ms ? now_ms : 1;
+    reuse->tokens = (int64_t) config_.burst * 1000;
+    reuse->conns = 0;
+    return reuse;
+}
+
+bool IpLimiter::acquire_connection(const IpKey& key, uint64_t now_ms, bool* tracked) {
+    *tracked = false;
+    if (config_.max_conns_per_ip <= 0) {
+        return true;
+    }
+    uint64_t h = hash(key);
+    Shard& shard = shards_[h >> 58];
+    shard.lock.lock();
+    Entry* e = find(shard, h, key, now_ms, true);
+    bool ok = true;
+    if (e == nullptr) {
+        ++untracked;
+    }
+    else if (e->conns >= (uint32_t) config_.max_conns_per_ip) {
+        ok = false;
+    }
+    else {
+        ++e->conns;
+        *tracked = true;
+    }
+    shard.lock.unlock();
+    if (!ok) {
+        ++rejected_connections;
+    }
+    return ok;
+}
+
+void IpLimiter::release_connection(const IpKey& key, uint64_t now_ms) {
+    if (config_.max_conns_per_ip <= 0) {
+        return;
+    }
+    uint64_t h = hash(key);
+    Shard& shard = shards_[h >> 58];
+    shard.lock.lock();
+    Entry* e = find(shard, h, key, now_ms, false);
+    if (e != nullptr && e->conns > 0) {
+        --e->conns;
+    }
+    shard.lock.unlock();
+}
+
+bool IpLimiter::allow_request(const IpKey& key, uint64_t now_ms) {
+    if (config_.requests_per_sec <= 0) {
+        return true;
+    }
+    uint64_t h = hash(key);
+    Shard& shard = shards_[h >> 58];
+    shard.lock.lock();
+    Entry* e = find(shard, h, key, now_ms, true);
+    bool ok = true;
+    if (e == nullptr) {
+        ++untracked;
+    }
+    else {
+        refill(*e, now_ms);
+        if (e->tokens >= 1000) {
+            e->tokens -= 1000;
+        }
+        else {
+            ok = false;
+        }
+    }
+    shard.lock.unlock();
+    if (!ok) {
+        ++rejected_requests;
+    }
+    return ok;
+}
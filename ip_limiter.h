@@ -0,0 +1,79 @@
+#ifndef HTTP_SERVER_IP_LIMITER_H
+#define HTTP_SERVER_IP_LIMITER_H
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <cstdint>
+
+#include "locker.h"
+
+// 分片数量，每个分片一把锁
+#define IP_LIMITER_SHARDS 64
+// 每次查找最多探测的槽位数，保证查找O(1)
+#define IP_LIMITER_PROBES 8
+
+// 客户端地址前缀，IPv4映射为::ffff:a.b.c.d后按前缀长度截断
+struct IpKey {
+    uint64_t hi;
+    uint64_t lo;
+
+    bool operator==(const IpKey& other) const { return hi == other.hi && lo == other.lo; }
+};
+
+struct IpLimiterConfig {
+    int max_conns_per_ip;   // 每个地址前缀的最大并发连接数，0不限制
+    int requests_per_sec;   // 令牌桶速率，0不限制
+    int burst;              // 令牌桶容量
+    int v4_prefix;          // IPv4按多长的前缀聚合
+    int v6_prefix;          // IPv6按多长的前缀聚合
+    uint32_t capacity;      // 表项总数，启动时一次性分配
+};
+
+// 按客户端地址前缀限制并发连接数和请求速率。
+// 表在启动时按固定容量分配，运行期间不再分配内存；表项不主动过期，
+// 当连接数为0且令牌桶已回满(状态与新表项等价)时即可被其他地址复用。
+class IpLimiter {
+public:
+    explicit IpLimiter(const IpLimiterConfig& config);
+    ~IpLimiter();
+
+    IpKey make_key(const sockaddr* addr) const;
+    // 新连接到达，超过并发上限返回false；tracked表示是否计入了表项，
+    // 只有计入的连接关闭时才需要release_connection
+    bool acquire_connection(const IpKey& key, uint64_t now_ms, bool* tracked);
+    void release_connection(const IpKey& key, uint64_t now_ms);
+    // 新请求到达，令牌不足返回false
+    bool allow_request(const IpKey& key, uint64_t now_ms);
+
+    std::atomic<uint64_t> rejected_connections;
+    std::atomic<uint64_t> rejected_requests;
+    // 探测窗口内没有可用槽位，未能计数而直接放行的次数
+    std::atomic<uint64_t> untracked;
+
+private:
+    struct Entry {
+        uint64_t hi;
+        uint64_t lo;
+        uint64_t refill_ms;// 上次补充令牌的时间，0表示空槽
+        int64_t tokens;    // 千分之一令牌为单位
+        uint32_t conns;
+    };
+
+    struct Shard {
+        Locker lock;
+        Entry* entries;
+    };
+
+    static uint64_t hash(const IpKey& key);
+    // 在分片内查找或占用表项，调用者持有分片锁
+    Entry* find(Shard& shard, uint64_t h, const IpKey& key, uint64_t now_ms, bool create);
+    bool reclaimable(const Entry& e, uint64_t now_ms) const;
+    void refill(Entry& e, uint64_t now_ms) const;
+
+    IpLimiterConfig config_;
+    uint32_t shard_mask_;// 每个分片的槽位数减一
+    Shard* shards_;
+};
+
+#endif
@@ -0,0 +1,184 @@
+#include "listener.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+static bool parse_port(const char* text, int* port) {
+    char* end;
+    long v = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || v <= 0 || v > 65535) {
+        return false;
+    }
+    *port = (int) v;
+    return true;
+}
+
+bool parse_listener(const char* text, bool tls, ListenerSpec* spec, std::string* error) {
+    spec->tls = tls;
+    spec->port = 0;
+    if (strncmp(text, "unix:", 5) == 0) {
+        spec->family = AF_UNIX;
+        spec->address = text + 5;
+        // 抽象命名空间的名字不以NUL结尾，长度同样受sun_path限制
+        if (spec->address.empty() || spec->address.size() >= sizeof(sockaddr_un::sun_path)) {
+            *error = "bad unix socket path";
+            return false;
+        }
+        return true;
+    }
+    const char* port;
+    if (text[0] == '[') {
+        const char* close = strchr(text, ']');
+        if (close == nullptr || close[1] != ':') {
+            *error = "expected [address]:port";
+            return false;
+        }
+        spec->family = AF_INET6;
+        spec->address.assign(text + 1, close - text - 1);
+        port = close + 2;
+    }
+    else {
+        const char* colon = strrchr(text, ':');
+        spec->family = AF_INET;
+        spec->address = colon == nullptr ? "0.0.0.0" : std::string(text, colon - text);
+        port = colon == nullptr ? text : colon + 1;
+    }
+    if (!parse_port(port, &spec->port)) {
+        *error = "bad port";
+        return false;
+    }
+    unsigned char buf[sizeof(in6_addr)];
+    if (inet_pton(spec->family, spec->address.c_str(), buf) != 1) {
+        *error = "bad address";
+        return false;
+    }
+    return true;
+}
+
+// 构造地址，返回地址长度
+static socklen_t make_address(const ListenerSpec& spec, sockaddr_storage* storage) {
+    memset(storage, 0, sizeof(*storage));
+    if (spec.family == AF_UNIX) {
+        sockaddr_un* un = (sockaddr_un*) storage;
+        un->sun_family = AF_UNIX;
+        if (spec.address[0] == '@') {
+            // 抽象命名空间：sun_path以NUL开头，长度只算到名字结尾
+            memcpy(un->sun_path + 1, spec.address.data() + 1, spec.address.size() - 1);
+            return (socklen_t) (offsetof(sockaddr_un, sun_path) + spec.address.size());
+        }
+        memcpy(un->sun_path, spec.address.data(), spec.address.size());
+        return (socklen_t) sizeof(sockaddr_un);
+    }
+    if (spec.family == AF_INET6) {
+        sockaddr_in6* in6 = (sockaddr_in6*) storage;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(spec.port);
+        inet_pton(AF_INET6, spec.address.c_str(), &in6->sin6_addr);
+        return (socklen_t) sizeof(sockaddr_in6);
+    }
+    sockaddr_in* in = (sockaddr_in*) storage;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(spec.port);
+    inet_pton(AF_INET, spec.address.c_str(), &in->sin_addr);
+    return (socklen_t) sizeof(sockaddr_in);
+}
+
+static bool filesystem_socket(const ListenerSpec& spec) {
+    return spec.family == AF_UNIX && spec.address[0] != '@';
+}
+
+int open_listener(const ListenerSpec& spec, int backlog, std::string* error) {
+    int fd = socket(spec.family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        *error = strerror(errno);
+        return -1;
+    }
+    if (spec.family != AF_UNIX) {
+        // 设置端口复用
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    }
+    if (spec.family == AF_INET6) {
+        // 通配地址同时接受IPv4(以映射地址出现)，具体地址只接受IPv6
+        in6_addr any = IN6ADDR_ANY_INIT;
+        sockaddr_storage storage;
+        make_address(spec, &storage);
+        int v6only = memcmp(&((sockaddr_in6*) &storage)->sin6_addr, &any, sizeof(any)) != 0;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    }
+    if (filesystem_socket(spec)) {
+        // 上次退出时没有删掉的套接字文件，其他类型的文件不动
+        struct stat st;
+        if (lstat(spec.address.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(spec.address.c_str());
+        }
+    }
+    sockaddr_storage storage;
+    socklen_t length = make_address(spec, &storage);
+    if (bind(fd, (sockaddr*) &storage, length) == -1 || listen(fd, backlog) == -1) {
+        *error = strerror(errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void close_listener(Listener& listener) {
+    if (listener.fd == -1) {
+        return;
+    }
+    close(listener.fd);
+    listener.fd = -1;
+    if (filesystem_socket(listener.spec)) {
+        unlink(listener.spec.address.c_str());
+    }
+}
+
+std::string listener_name(const ListenerSpec& spec) {
+    std::string name = spec.tls ? "tls " : "";
+    if (spec.family == AF_UNIX) {
+        return name + "unix:" + spec.address;
+    }
+    if (spec.family == AF_INET6) {
+        return name + "[" + spec.address + "]:" + std::to_string(spec.port);
+    }
+    return name + spec.address + ":" + std::to_string(spec.port);
+}
+
+std::string peer_address(const sockaddr* addr) {
+    char text[INET6_ADDRSTRLEN];
+    if (addr->sa_family == AF_INET) {
+        inet_ntop(AF_INET, &((const sockaddr_in*) addr)->sin_addr, text, sizeof(text));
+        return text;
+    }
+    if (addr->sa_family == AF_INET6) {
+        const in6_addr& a = ((const sockaddr_in6*) addr)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&a)) {
+            inet_ntop(AF_INET, a.s6_addr + 12, text, sizeof(text));
+        }
+        else {
+            inet_ntop(AF_INET6, &a, text, sizeof(text));
+        }
+        return text;
+    }
+    return "unix:";
+}
+
+bool peer_is_local(const sockaddr* addr) {
+    if (addr->sa_family == AF_INET) {
+        return (ntohl(((const sockaddr_in*) addr)->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (addr->sa_family == AF_INET6) {
+        const in6_addr& a = ((const sockaddr_in6*) addr)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(&a) || (IN6_IS_ADDR_V4MAPPED(&a) && a.s6_addr[12] == 127);
+    }
+    return addr->sa_family == AF_UNIX;
+}
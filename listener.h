@@ -0,0 +1,40 @@
+#ifndef HTTP_SERVER_LISTENER_H
+#define HTTP_SERVER_LISTENER_H
+
+#include <sys/socket.h>
+
+#include <string>
+
+// 一个监听地址：
+//   8080、0.0.0.0:8080、127.0.0.1:8080    IPv4
+//   [::]:8080                             IPv6，同时接受IPv4(双栈)
+//   [::1]:8080                            只接受IPv6
+//   unix:/run/http.sock                   文件系统中的Unix域套接字
+//   unix:@http                            抽象命名空间的Unix域套接字，不占用文件
+struct ListenerSpec {
+    int family;            // AF_INET、AF_INET6或AF_UNIX
+    std::string address;   // IP地址，或Unix域套接字路径(抽象命名空间以@开头)
+    int port;
+    bool tls;              // 连接先进行TLS握手
+};
+
+struct Listener {
+    ListenerSpec spec;
+    int fd;
+};
+
+// 解析失败返回false，原因写入error
+bool parse_listener(const char* text, bool tls, ListenerSpec* spec, std::string* error);
+// 创建、绑定并监听，失败返回-1；文件系统路径上残留的套接字文件先删除
+int open_listener(const ListenerSpec& spec, int backlog, std::string* error);
+// 关闭监听，删除文件系统中的套接字文件
+void close_listener(Listener& listener);
+// 用于日志的监听地址，如[::]:8080、unix:@http
+std::string listener_name(const ListenerSpec& spec);
+
+// 对端地址的文本形式，IPv4映射的IPv6地址按IPv4输出，Unix域套接字为"unix:"
+std::string peer_address(const sockaddr* addr);
+// 对端在本机：回环地址或Unix域套接字
+bool peer_is_local(const sockaddr* addr);
+
+#endif
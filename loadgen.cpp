@@ -0,0 +1,910 @@
+// HTTP压测客户端：多线程 + epoll，每个线程独立维护一组连接。
+// 支持keep-alive、流水线深度、连接轮换(churn)、慢读客户端、按权重混合URL，
+// 固定速率模式下按"计划发送时间"统计延迟以修正协同遗漏(coordinated omission)。
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+#define LOADGEN_MAX_EVENTS 1024
+#define LOADGEN_READ_CHUNK 65536
+
+static uint64_t now_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 对数线性直方图(单位us)，相对误差约1/32，可合并
+class LatencyHistogram {
+public:
+    static const int SUB_BITS = 5;
+    static const int SUB_COUNT = 1 << SUB_BITS;// 32
+    static const int BUCKETS = 2 * SUB_COUNT + 40 * SUB_COUNT;
+
+    LatencyHistogram() : counts_(BUCKETS, 0), total_(0), max_(0), sum_(0) {}
+
+    void record(uint64_t value, uint64_t count = 1) {
+        counts_[index_of(value)] += count;
+        total_ += count;
+        sum_ += (double) value * count;
+        if (value > max_) {
+            max_ = value;
+        }
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (int i = 0; i < BUCKETS; ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    uint64_t percentile(double p) const {
+        if (total_ == 0) {
+            return 0;
+        }
+        uint64_t target = (uint64_t) std::ceil(p / 100.0 * total_);
+        if (target == 0) {
+            target = 1;
+        }
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts_[i];
+            if (seen >= target) {
+                return std::min(value_of(i), max_);
+            }
+        }
+        return max_;
+    }
+
+    uint64_t total() const { return total_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return total_ ? sum_ / total_ : 0; }
+
+    // 以mean为期望间隔复制出修正后的直方图
+    LatencyHistogram corrected(uint64_t expected_interval) const {
+        LatencyHistogram out;
+        for (int i = 0; i < BUCKETS; ++i) {
+            if (counts_[i] == 0) {
+                continue;
+            }
+            uint64_t v = value_of(i);
+            out.record(v, counts_[i]);
+            if (expected_interval == 0) {
+                continue;
+            }
+            for (uint64_t missing = v > expected_interval ? v - expected_interval : 0;
+                 missing >= expected_interval; missing -= expected_interval) {
+                out.record(missing, counts_[i]);
+            }
+        }
+        out.max_ = max_;
+        return out;
+    }
+
+private:
+    static int index_of(uint64_t v) {
+        if (v < (uint64_t) 2 * SUB_COUNT) {
+            return (int) v;
+        }
+        int msb = 63 - __builtin_clzll(v);
+        int shift = msb - SUB_BITS;
+        int idx = 2 * SUB_COUNT + (shift - 1) * SUB_COUNT +
+                  (int) ((v >> shift) - SUB_COUNT);
+        return std::min(idx, BUCKETS - 1);
+    }
+
+    static uint64_t value_of(int idx) {
+        if (idx < 2 * SUB_COUNT) {
+            return idx;
+        }
+        int shift = (idx - 2 * SUB_COUNT) / SUB_COUNT + 1;
+        uint64_t sub = (idx - 2 * SUB_COUNT) % SUB_COUNT + SUB_COUNT;
+        // 取桶的上界，保证报告值不低于真实值
+        return ((sub + 1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t total_;
+    uint64_t max_;
+    double sum_;
+};
+
+struct UrlEntry {
+    std::string path;
+    double weight;
+};
+
+struct Config {
+    std::string name;
+    std::string host;
+    int port;
+    std::string unix_path;  // 非空时连接Unix域套接字，@开头为抽象命名空间
+    int threads;
+    int connections;
+    double duration;        // 秒
+    double warmup;          // 预热时间，期间的样本丢弃
+    double rate;            // 总请求速率，0表示闭环模式
+    int pipeline;           // 每个连接同时在途的请求数
+    bool keep_alive;
+    int requests_per_conn;  // 每个连接发送多少请求后主动断开重连，0不限制
+    double slow_fraction;   // 慢读连接占比
+    int slow_rate;          // 慢读连接的读取速率(bytes/s)
+    double timeout;         // 单个请求超时(秒)
+    double zipf;            // 未指定权重时按zipf分布给URL分配权重
+    std::vector<UrlEntry> urls;
+    bool json;
+
+    Config()
+        : host("127.0.0.1"), port(8080), threads(2), connections(64),
+          duration(10), warmup(1), rate(0), pipeline(1), keep_alive(true),
+          requests_per_conn(0), slow_fraction(0), slow_rate(4096), timeout(5),
+          zipf(0), json(false) {}
+};
+
+struct Stats {
+    uint64_t requests;
+    uint64_t responses;
+    uint64_t status[6];// 1xx..5xx，下标0为无法解析
+    uint64_t connects;
+    uint64_t connect_errors;
+    uint64_t read_errors;
+    uint64_t write_errors;
+    uint64_t timeouts;
+    uint64_t bytes_read;
+    LatencyHistogram latency;     // 按计划发送时间统计(固定速率时已修正)
+    LatencyHistogram service;     // 按实际发送时间统计
+
+    Stats()
+        : requests(0), responses(0), status(), connects(0), connect_errors(0),
+          read_errors(0), write_errors(0), timeouts(0), bytes_read(0) {}
+
+    void merge(const Stats& o) {
+        requests += o.requests;
+        responses += o.responses;
+        for (int i = 0; i < 6; ++i) {
+            status[i] += o.status[i];
+        }
+        connects += o.connects;
+        connect_errors += o.connect_errors;
+        read_errors += o.read_errors;
+        write_errors += o.write_errors;
+        timeouts += o.timeouts;
+        bytes_read += o.bytes_read;
+        latency.merge(o.latency);
+        service.merge(o.service);
+    }
+};
+
+struct InFlight {
+    uint64_t intended_ns;// 计划发送时间
+    uint64_t sent_ns;    // 实际发送时间
+};
+
+enum ConnState { CONN_IDLE = 0, CONN_CONNECTING, CONN_OPEN };
+
+struct Connection {
+    int fd;
+    ConnState state;
+    bool slow;
+    bool closing;           // 服务器要求关闭或到达请求上限，等待在途请求结束
+    int served;             // 本连接已发送的请求数
+    uint64_t next_send_ns;  // 固定速率模式下一个请求的计划时间
+    std::deque<InFlight> inflight;
+    std::string out;        // 待发送数据
+    size_t out_offset;
+    std::string in;         // 未解析的响应数据
+    bool in_body;
+    int64_t body_remaining;
+    bool close_after;
+    int status_code;
+    int64_t read_budget;    // 慢读连接当前可读字节数
+    uint32_t events;        // 当前在epoll中注册的事件
+
+    Connection()
+        : fd(-1), state(CONN_IDLE), slow(false), closing(false), served(0),
+          next_send_ns(0), out_offset(0), in_body(false), body_remaining(0),
+          close_after(false), status_code(0), read_budget(0), events(0) {}
+};
+
+class Worker {
+public:
+    Worker(const Config& cfg, int id, int conn_count, const std::vector<std::string>& requests,
+           const std::vector<double>& cumulative)
+        : cfg_(cfg), conns_(conn_count), requests_(requests),
+          cumulative_(cumulative), rng_(0x9e3779b9u * (id + 1)), epoll_fd_(-1),
+          record_from_(0), stop_at_(0), interval_ns_(0) {}
+
+    void run(uint64_t start_ns) {
+        epoll_fd_ = epoll_create1(0);
+        record_from_ = start_ns + (uint64_t) (cfg_.warmup * 1e9);
+        stop_at_ = record_from_ + (uint64_t) (cfg_.duration * 1e9);
+        if (cfg_.rate > 0) {
+            double per_conn = cfg_.rate / (cfg_.threads * (double) conns_.size());
+            interval_ns_ = (uint64_t) (1e9 / per_conn);
+        }
+        size_t slow_count = (size_t) (cfg_.slow_fraction * conns_.size() + 0.5);
+        for (size_t i = 0; i < conns_.size(); ++i) {
+            conns_[i].slow = i < slow_count;
+            // 错开各连接的首个发送时间，避免同一时刻突发
+            conns_[i].next_send_ns =
+                start_ns + (interval_ns_ ? interval_ns_ * i / conns_.size() : 0);
+            open_connection(conns_[i]);
+        }
+
+        epoll_event events[LOADGEN_MAX_EVENTS];
+        uint64_t last_refill = start_ns;
+        while (true) {
+            uint64_t now = now_ns();
+            if (now >= stop_at_) {
+                break;
+            }
+            if (now - last_refill >= 10000000ull) {
+                refill_budgets(now - last_refill);
+                last_refill = now;
+            }
+            for (size_t i = 0; i < conns_.size(); ++i) {
+                Connection& c = conns_[i];
+                if (c.state == CONN_IDLE) {
+                    open_connection(c);
+                }
+                else if (c.state == CONN_OPEN) {
+                    check_timeout(c, now);
+                    if (c.state == CONN_OPEN) {
+                        fill_pipeline(c, now);
+                    }
+                }
+            }
+            int timeout_ms = 1;
+            int n = epoll_wait(epoll_fd_, events, LOADGEN_MAX_EVENTS, timeout_ms);
+            for (int i = 0; i < n; ++i) {
+                Connection& c = conns_[events[i].data.u32];
+                handle_event(c, events[i].events);
+            }
+        }
+        for (size_t i = 0; i < conns_.size(); ++i) {
+            close_connection(conns_[i]);
+        }
+        close(epoll_fd_);
+    }
+
+    Stats stats;
+
+private:
+    void set_events(Connection& c, uint32_t ev) {
+        if (c.events == ev) {
+            return;
+        }
+        epoll_event event{};
+        event.events = ev;
+        event.data.u32 = (uint32_t) (&c - &conns_[0]);
+        epoll_ctl(epoll_fd_, c.events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c.fd, &event);
+        c.events = ev;
+    }
+
+    // 目标地址，IPv4、IPv6或Unix域套接字
+    socklen_t make_address(sockaddr_storage* storage) const {
+        memset(storage, 0, sizeof(*storage));
+        if (!cfg_.unix_path.empty()) {
+            sockaddr_un* un = (sockaddr_un*) storage;
+            un->sun_family = AF_UNIX;
+            size_t length = std::min(cfg_.unix_path.size(), sizeof(un->sun_path) - 1);
+            memcpy(un->sun_path, cfg_.unix_path.data(), length);
+            if (un->sun_path[0] == '@') {
+                un->sun_path[0] = '\0';
+                return (socklen_t) (offsetof(sockaddr_un, sun_path) + length);
+            }
+            return (socklen_t) sizeof(sockaddr_un);
+        }
+        sockaddr_in6* in6 = (sockaddr_in6*) storage;
+        if (inet_pton(AF_INET6, cfg_.host.c_str(), &in6->sin6_addr) == 1) {
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port = htons(cfg_.port);
+            return (socklen_t) sizeof(sockaddr_in6);
+        }
+        sockaddr_in* in = (sockaddr_in*) storage;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(cfg_.port);
+        inet_pton(AF_INET, cfg_.host.c_str(), &in->sin_addr);
+        return (socklen_t) sizeof(sockaddr_in);
+    }
+
+    void open_connection(Connection& c) {
+        sockaddr_storage addr;
+        socklen_t addr_len = make_address(&addr);
+        c.fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (c.fd == -1) {
+            ++stats.connect_errors;
+            return;
+        }
+        if (addr.ss_family != AF_UNIX) {
+            int one = 1;
+            setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (c.slow) {
+            // 慢读客户端使用较小的接收缓冲，让服务器尽快感受到背压
+            int rcvbuf = 4096;
+            setsockopt(c.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        }
+        int ret = connect(c.fd, (sockaddr*) &addr, addr_len);
+        if (ret == -1 && errno != EINPROGRESS) {
+            ++stats.connect_errors;
+            ::close(c.fd);
+            c.fd = -1;
+            return;
+        }
+        c.state = CONN_CONNECTING;
+        c.events = 0;
+        c.served = 0;
+        c.closing = false;
+        c.in.clear();
+        c.in_body = false;
+        c.out.clear();
+        c.out_offset = 0;
+        c.read_budget = cfg_.slow_rate / 100;
+        set_events(c, EPOLLOUT);
+    }
+
+    void close_connection(Connection& c) {
+        if (c.fd != -1) {
+            ::close(c.fd);
+        }
+        c.fd = -1;
+        c.state = CONN_IDLE;
+        c.events = 0;
+        c.inflight.clear();
+    }
+
+    void refill_budgets(uint64_t elapsed_ns) {
+        int64_t add = (int64_t) (cfg_.slow_rate * (elapsed_ns / 1e9));
+        for (size_t i = 0; i < conns_.size(); ++i) {
+            Connection& c = conns_[i];
+            if (!c.slow || c.state != CONN_OPEN) {
+                continue;
+            }
+            c.read_budget = std::min<int64_t>(c.read_budget + add, cfg_.slow_rate);
+            if (c.read_budget > 0) {
+                set_events(c, c.events | EPOLLIN);
+            }
+        }
+    }
+
+    const std::string& pick_request() {
+        if (requests_.size() == 1) {
+            return requests_[0];
+        }
+        double r = std::uniform_real_distribution<double>(0, cumulative_.back())(rng_);
+        size_t idx = std::lower_bound(cumulative_.begin(), cumulative_.end(), r) -
+                     cumulative_.begin();
+        return requests_[std::min(idx, requests_.size() - 1)];
+    }
+
+    void fill_pipeline(Connection& c, uint64_t now) {
+        while (!c.closing && (int) c.inflight.size() < cfg_.pipeline) {
+            if (cfg_.requests_per_conn > 0 && c.served >= cfg_.requests_per_conn) {
+                c.closing = true;
+                break;
+            }
+            InFlight f{};
+            if (interval_ns_ > 0) {
+                if (now < c.next_send_ns) {
+                    break;
+                }
+                f.intended_ns = c.next_send_ns;
+                c.next_send_ns += interval_ns_;
+            }
+            else {
+                f.intended_ns = now;
+            }
+            f.sent_ns = now;
+            c.inflight.push_back(f);
+            c.out += pick_request();
+            ++c.served;
+            if (now >= record_from_) {
+                ++stats.requests;
+            }
+        }
+        flush(c);
+        if (c.closing && c.inflight.empty()) {
+            close_connection(c);
+        }
+    }
+
+    void flush(Connection& c) {
+        while (c.out_offset < c.out.size()) {
+            ssize_t n = send(c.fd, c.out.data() + c.out_offset,
+                             c.out.size() - c.out_offset, MSG_NOSIGNAL);
+            if (n == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    set_events(c, c.events | EPOLLOUT);
+                    return;
+                }
+                ++stats.write_errors;
+                close_connection(c);
+                return;
+            }
+            c.out_offset += n;
+        }
+        c.out.clear();
+        c.out_offset = 0;
+        set_events(c, c.events & ~EPOLLOUT);
+    }
+
+    void check_timeout(Connection& c, uint64_t now) {
+        if (c.inflight.empty()) {
+            return;
+        }
+        if (now - c.inflight.front().sent_ns > (uint64_t) (cfg_.timeout * 1e9)) {
+            if (now >= record_from_) {
+                stats.timeouts += c.inflight.size();
+            }
+            close_connection(c);
+        }
+    }
+
+    void handle_event(Connection& c, uint32_t ev) {
+        if (c.fd == -1) {
+            return;
+        }
+        if (c.state == CONN_CONNECTING) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err != 0 || (ev & (EPOLLERR | EPOLLHUP))) {
+                ++stats.connect_errors;
+                close_connection(c);
+                return;
+            }
+            c.state = CONN_OPEN;
+            ++stats.connects;
+            set_events(c, EPOLLIN);
+            fill_pipeline(c, now_ns());
+            return;
+        }
+        if (ev & EPOLLOUT) {
+            flush(c);
+            if (c.fd == -1) {
+                return;
+            }
+        }
+        if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            on_readable(c);
+        }
+    }
+
+    void on_readable(Connection& c) {
+        char buf[LOADGEN_READ_CHUNK];
+        while (c.fd != -1) {
+            size_t want = sizeof(buf);
+            if (c.slow) {
+                if (c.read_budget <= 0) {
+                    // 预算耗尽，暂停读直到下一次补充
+                    set_events(c, c.events & ~EPOLLIN);
+                    return;
+                }
+                want = std::min<size_t>(want, (size_t) c.read_budget);
+            }
+            ssize_t n = recv(c.fd, buf, want, 0);
+            if (n == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return;
+                }
+                ++stats.read_errors;
+                close_connection(c);
+                return;
+            }
+            if (n == 0) {
+                // 对端关闭时仍有在途请求视为错误
+                if (!c.inflight.empty()) {
+                    ++stats.read_errors;
+                }
+                close_connection(c);
+                return;
+            }
+            if (c.slow) {
+                c.read_budget -= n;
+            }
+            if (now_ns() >= record_from_) {
+                stats.bytes_read += n;
+            }
+            if (!consume(c, buf, (size_t) n)) {
+                ++stats.read_errors;
+                close_connection(c);
+                return;
+            }
+            if (c.slow) {
+                // 慢读客户端每次只读一小块
+                return;
+            }
+        }
+    }
+
+    // 解析响应，返回false表示协议错误
+    bool consume(Connection& c, const char* data, size_t len) {
+        while (len > 0) {
+            if (c.in_body) {
+                size_t take = (size_t) std::min<int64_t>(c.body_remaining, (int64_t) len);
+                c.body_remaining -= take;
+                data += take;
+                len -= take;
+                if (c.body_remaining == 0) {
+                    complete_response(c);
+                    if (c.fd == -1) {
+                        return true;
+                    }
+                }
+                continue;
+            }
+            c.in.append(data, len);
+            len = 0;
+            size_t end = c.in.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                return c.in.size() < 65536;
+            }
+            if (!parse_head(c, end)) {
+                return false;
+            }
+            std::string rest = c.in.substr(end + 4);
+            c.in.clear();
+            c.in_body = true;
+            if (c.body_remaining == 0) {
+                complete_response(c);
+                if (c.fd == -1) {
+                    return true;
+                }
+            }
+            if (!rest.empty()) {
+                // 剩余数据可能包含本响应体以及下一个流水线响应
+                return consume(c, rest.data(), rest.size());
+            }
+        }
+        return true;
+    }
+
+    bool parse_head(Connection& c, size_t end) {
+        int major = 0, minor = 0, code = 0;
+        if (sscanf(c.in.c_str(), "HTTP/%d.%d %d", &major, &minor, &code) != 3) {
+            return false;
+        }
+        c.status_code = code;
+        c.body_remaining = 0;
+        c.close_after = !cfg_.keep_alive;
+        size_t pos = c.in.find("\r\n");
+        while (pos != std::string::npos && pos < end) {
+            size_t line_start = pos + 2;
+            size_t line_end = c.in.find("\r\n", line_start);
+            std::string line = c.in.substr(line_start, line_end - line_start);
+            size_t colon = line.find(':');
+            if (colon != std::string::npos) {
+                std::string key = line.substr(0, colon);
+                std::string value = line.substr(colon + 1);
+                value.erase(0, value.find_first_not_of(" \t"));
+                std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+                if (key == "content-length") {
+                    c.body_remaining = atoll(value.c_str());
+                }
+                else if (key == "connection") {
+                    std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+                    if (value.find("close") != std::string::npos) {
+                        c.close_after = true;
+                    }
+                }
+            }
+            pos = line_end;
+        }
+        return true;
+    }
+
+    void complete_response(Connection& c) {
+        c.in_body = false;
+        if (c.inflight.empty()) {
+            return;
+        }
+        InFlight f = c.inflight.front();
+        c.inflight.pop_front();
+        uint64_t now = now_ns();
+        if (f.sent_ns >= record_from_) {
+            ++stats.responses;
+            int cls = c.status_code / 100;
+            ++stats.status[(cls >= 1 && cls <= 5) ? cls : 0];
+            stats.latency.record((now - f.intended_ns) / 1000);
+            stats.service.record((now - f.sent_ns) / 1000);
+        }
+        if (c.close_after) {
+            // 服务器会关闭连接，剩余在途请求作废
+            c.closing = true;
+            c.inflight.clear();
+        }
+        if (c.closing && c.inflight.empty()) {
+            close_connection(c);
+            return;
+        }
+        fill_pipeline(c, now);
+    }
+
+    const Config& cfg_;
+    std::vector<Connection> conns_;
+    const std::vector<std::string>& requests_;
+    const std::vector<double>& cumulative_;
+    std::mt19937 rng_;
+    int epoll_fd_;
+    uint64_t record_from_;
+    uint64_t stop_at_;
+    uint64_t interval_ns_;
+};
+
+struct WorkerArg {
+    Worker* worker;
+    uint64_t start_ns;
+};
+
+static void* worker_main(void* arg) {
+    WorkerArg* a = (WorkerArg*) arg;
+    a->worker->run(a->start_ns);
+    return nullptr;
+}
+
+struct Result {
+    Config cfg;
+    Stats stats;
+    double elapsed;
+};
+
+static Result run_load(const Config& cfg) {
+    // 预先序列化所有请求
+    std::vector<std::string> requests;
+    std::vector<double> cumulative;
+    double acc = 0;
+    // IPv6字面地址在Host中要加方括号
+    std::string host = cfg.host.find(':') == std::string::npos ? cfg.host : "[" + cfg.host + "]";
+    for (size_t i = 0; i < cfg.urls.size(); ++i) {
+        std::string req = "GET " + cfg.urls[i].path + " HTTP/1.1\r\nHost: " + host +
+                          "\r\nConnection: " + (cfg.keep_alive ? "keep-alive" : "close") +
+                          "\r\n\r\n";
+        requests.push_back(req);
+        double w = cfg.urls[i].weight;
+        if (w <= 0) {
+            w = cfg.zipf > 0 ? 1.0 / std::pow((double) (i + 1), cfg.zipf) : 1.0;
+        }
+        acc += w;
+        cumulative.push_back(acc);
+    }
+
+    std::vector<Worker*> workers;
+    std::vector<pthread_t> tids(cfg.threads);
+    std::vector<WorkerArg> args(cfg.threads);
+    uint64_t start = now_ns();
+    for (int i = 0; i < cfg.threads; ++i) {
+        int conns = cfg.connections / cfg.threads + (i < cfg.connections % cfg.threads ? 1 : 0);
+        workers.push_back(new Worker(cfg, i, std::max(conns, 1), requests, cumulative));
+        args[i].worker = workers[i];
+        args[i].start_ns = start;
+        pthread_create(&tids[i], nullptr, worker_main, &args[i]);
+    }
+    Result result;
+    result.cfg = cfg;
+    for (int i = 0; i < cfg.threads; ++i) {
+        pthread_join(tids[i], nullptr);
+        result.stats.merge(workers[i]->stats);
+        delete workers[i];
+    }
+    result.elapsed = cfg.duration;
+    return result;
+}
+
+static void print_result(const Result& r) {
+    const Stats& s = r.stats;
+    const Config& cfg = r.cfg;
+    // 固定速率模式的latency已经按计划时间修正；闭环模式以平均延迟为期望间隔修正
+    LatencyHistogram corrected =
+        cfg.rate > 0 ? s.latency : s.service.corrected((uint64_t) s.service.mean());
+    double rps = s.responses / r.elapsed;
+    double mbps = s.bytes_read / r.elapsed / (1024.0 * 1024.0);
+    static const double pcts[] = {50, 75, 90, 99, 99.9, 99.99};
+    if (cfg.json) {
+        printf("{\"scenario\":\"%s\",\"threads\":%d,\"connections\":%d,\"pipeline\":%d,"
+               "\"rate\":%.0f,\"duration\":%.2f,\"requests\":%llu,\"responses\":%llu,"
+               "\"rps\":%.1f,\"mb_per_sec\":%.2f,\"status\":[%llu,%llu,%llu,%llu,%llu,%llu],"
+               "\"errors\":{\"connect\":%llu,\"read\":%llu,\"write\":%llu,\"timeout\":%llu},"
+               "\"latency_us\":{",
+               cfg.name.c_str(), cfg.threads, cfg.connections, cfg.pipeline, cfg.rate,
+               r.elapsed, (unsigned long long) s.requests, (unsigned long long) s.responses,
+               rps, mbps, (unsigned long long) s.status[0], (unsigned long long) s.status[1],
+               (unsigned long long) s.status[2], (unsigned long long) s.status[3],
+               (unsigned long long) s.status[4], (unsigned long long) s.status[5],
+               (unsigned long long) s.connect_errors, (unsigned long long) s.read_errors,
+               (unsigned long long) s.write_errors, (unsigned long long) s.timeouts);
+        for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); ++i) {
+            printf("\"p%g\":%llu,", pcts[i], (unsigned long long) corrected.percentile(pcts[i]));
+        }
+        printf("\"max\":%llu,\"mean\":%.1f,\"uncorrected_p99\":%llu}}\n",
+               (unsigned long long) corrected.max(), corrected.mean(),
+               (unsigned long long) s.service.percentile(99));
+        return;
+    }
+    printf("== %s ==\n", cfg.name.empty() ? "load" : cfg.name.c_str());
+    printf("  %d threads, %d connections, pipeline %d, %s, %s\n", cfg.threads,
+           cfg.connections, cfg.pipeline, cfg.keep_alive ? "keep-alive" : "close",
+           cfg.rate > 0 ? "fixed rate" : "closed loop");
+    printf("  requests %llu, responses %llu, %.1f req/s, %.2f MB/s\n",
+           (unsigned long long) s.requests, (unsigned long long) s.responses, rps, mbps);
+    printf("  status 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n",
+           (unsigned long long) s.status[2], (unsigned long long) s.status[3],
+           (unsigned long long) s.status[4], (unsigned long long) s.status[5],
+           (unsigned long long) (s.status[0] + s.status[1]));
+    printf("  errors connect %llu, read %llu, write %llu, timeout %llu\n",
+           (unsigned long long) s.connect_errors, (unsigned long long) s.read_errors,
+           (unsigned long long) s.write_errors, (unsigned long long) s.timeouts);
+    printf("  latency (us, CO-corrected)   uncorrected\n");
+    for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); ++i) {
+        printf("    p%-6g %12llu %12llu\n", pcts[i],
+               (unsigned long long) corrected.percentile(pcts[i]),
+               (unsigned long long) s.service.percentile(pcts[i]));
+    }
+    printf("    max     %12llu %12llu\n", (unsigned long long) corrected.max(),
+           (unsigned long long) s.service.max());
+}
+
+// 内置场景，全部针对同一目标地址，保证不同机器上结果可复现
+static std::vector<Config> build_suite(const Config& base) {
+    std::vector<Config> suite;
+    Config c = base;
+
+    c.name = "keepalive";
+    suite.push_back(c);
+
+    c = base;
+    c.name = "pipeline-8";
+    c.pipeline = 8;
+    suite.push_back(c);
+
+    c = base;
+    c.name = "churn";
+    c.keep_alive = false;
+    c.requests_per_conn = 1;
+    suite.push_back(c);
+
+    c = base;
+    c.name = "churn-16";
+    c.requests_per_conn = 16;
+    suite.push_back(c);
+
+    c = base;
+    c.name = "slow-readers";
+    c.slow_fraction = 0.25;
+    suite.push_back(c);
+
+    c = base;
+    c.name = "mixed-zipf";
+    if (c.zipf <= 0) {
+        c.zipf = 1.0;
+    }
+    suite.push_back(c);
+
+    c = base;
+    c.name = "fixed-rate";
+    if (c.rate <= 0) {
+        c.rate = 5000;
+    }
+    suite.push_back(c);
+    return suite;
+}
+
+static void usage(const char* prog) {
+    printf("Usage: %s [options]\n"
+           "  -H host        target IPv4 or IPv6 address (default 127.0.0.1)\n"
+           "  -p port        target port (default 8080)\n"
+           "  -U path        connect to a Unix domain socket instead, @name = abstract\n"
+           "  -t threads     worker threads (default 2)\n"
+           "  -c conns       total connections (default 64)\n"
+           "  -d seconds     measured duration (default 10)\n"
+           "  -w seconds     warm-up, samples discarded (default 1)\n"
+           "  -R rate        total requests/s; enables CO-corrected fixed-rate mode\n"
+           "  -P depth       pipeline depth per connection (default 1)\n"
+           "  -n count       requests per connection before reconnect (churn)\n"
+           "  -C             send Connection: close (one request per connection)\n"
+           "  -s fraction    fraction of slow-reading connections\n"
+           "  -S bytes/s     read rate of slow connections (default 4096)\n"
+           "  -T seconds     per-request timeout (default 5)\n"
+           "  -u path[:w]    URL with optional weight, repeatable (default /index.html)\n"
+           "  -z exponent    zipf weights over URLs without explicit weights\n"
+           "  -j             print results as JSON lines\n"
+           "  --suite        run the built-in scenario suite\n",
+           prog);
+}
+
+int main(int argc, char* argv[]) {
+    Config cfg;
+    bool suite = false;
+    static option long_opts[] = {{"suite", no_argument, nullptr, 'X'},
+                                 {"help", no_argument, nullptr, 'h'},
+                                 {nullptr, 0, nullptr, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:U:t:c:d:w:R:P:n:Cs:S:T:u:z:jh", long_opts,
+                              nullptr)) != -1) {
+        switch (opt) {
+            case 'H': cfg.host = optarg; break;
+            case 'p': cfg.port = atoi(optarg); break;
+            case 'U': cfg.unix_path = optarg; break;
+            case 't': cfg.threads = std::max(1, atoi(optarg)); break;
+            case 'c': cfg.connections = std::max(1, atoi(optarg)); break;
+            case 'd': cfg.duration = atof(optarg); break;
+            case 'w': cfg.warmup = atof(optarg); break;
+            case 'R': cfg.rate = atof(optarg); break;
+            case 'P': cfg.pipeline = std::max(1, atoi(optarg)); break;
+            case 'n': cfg.requests_per_conn = atoi(optarg); break;
+            case 'C': cfg.keep_alive = false; break;
+            case 's': cfg.slow_fraction = atof(optarg); break;
+            case 'S': cfg.slow_rate = std::max(1, atoi(optarg)); break;
+            case 'T': cfg.timeout = atof(optarg); break;
+            case 'u': {
+                UrlEntry e;
+                std::string arg = optarg;
+                // 只有末尾':'之后全是数字时才视为权重，否则整个参数都是路径
+                size_t colon = arg.rfind(':');
+                e.weight = 0;
+                if (colon != std::string::npos && colon + 1 < arg.size() &&
+                    arg.find_first_not_of("0123456789.", colon + 1) == std::string::npos) {
+                    e.weight = atof(arg.c_str() + colon + 1);
+                    arg = arg.substr(0, colon);
+                }
+                e.path = arg;
+                cfg.urls.push_back(e);
+                break;
+            }
+            case 'z': cfg.zipf = atof(optarg); break;
+            case 'j': cfg.json = true; break;
+            case 'X': suite = true; break;
+            default: usage(basename(argv[0])); return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (cfg.urls.empty()) {
+        UrlEntry e;
+        e.path = "/index.html";
+        e.weight = 1;
+        cfg.urls.push_back(e);
+    }
+    if (cfg.connections < cfg.threads) {
+        cfg.threads = cfg.connections;
+    }
+    if (cfg.duration <= 0) {
+        usage(basename(argv[0]));
+        return -1;
+    }
+
+    std::vector<Config> runs;
+    if (suite) {
+        runs = build_suite(cfg);
+    }
+    else {
+        runs.push_back(cfg);
+    }
+    for (size_t i = 0; i < runs.size(); ++i) {
+        print_result(run_load(runs[i]));
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -23,6 +23,28 @@ bool Locker::unlock() {
     return pthread_mutex_unlock(&m_mutex) == 0;
 }
 
+RwLocker::RwLocker() {
+    if (pthread_rwlock_init(&m_rwlock, nullptr) != 0) {
+        throw std::exception();
+    }
+}
+
+RwLocker::~RwLocker() {
+    pthread_rwlock_destroy(&m_rwlock);
+}
+
+bool RwLocker::rdlock() {
+    return pthread_rwlock_rdlock(&m_rwlock) == 0;
+}
+
+bool RwLocker::wrlock() {
+    return pthread_rwlock_wrlock(&m_rwlock) == 0;
+}
+
+bool RwLocker::unlock() {
+    return pthread_rwlock_unlock(&m_rwlock) == 0;
+}
+
 Condition::Condition() {
     if (pthread_cond_init(&m_cond, nullptr) != 0) {
         throw std::exception();
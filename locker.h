@@ -18,6 +18,20 @@ public:
     pthread_mutex_t* get();
 };
 
+// 读写锁
+class RwLocker {
+private:
+    pthread_rwlock_t m_rwlock;
+
+public:
+    RwLocker();
+    ~RwLocker();
+
+    bool rdlock();
+    bool wrlock();
+    bool unlock();
+};
+
 // 条件信号
 class Condition {
 private:
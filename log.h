@@ -0,0 +1,13 @@
+#ifndef HTTP_SERVER_LOG_H
+#define HTTP_SERVER_LOG_H
+
+#include <cstdio>
+
+// 调试输出，只在定义HTTP_DEBUG时编译进来，避免热路径上的stdout写入
+#ifdef HTTP_DEBUG
+#define LOG_DEBUG(...) printf(__VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void) 0)
+#endif
+
+#endif
@@ -1,29 +1,77 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <csignal>
 #include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
+#include <vector>
 
+#include "asset_pack.h"
+#include "busy_poll.h"
+#include "connection_slab.h"
+#include "http2.h"
 #include "http_connection.h"
+#include "io_pool.h"
+#include "ip_limiter.h"
+#include "listener.h"
+#include "proxy.h"
 #include "thread_pool.h"
 #include "timer.h"
+#include "tls.h"
+#include "trace.h"
+#include "websocket.h"
 
 #define THREAD_NUM 8
 #define MAX_REQUEST_NUM 1024
-#define MAX_FD 65535
+// 最大并发连接数，连接对象按需分配，不再按fd预先分配
+#define MAX_CONNECTIONS 1000000
+// 描述符上限中留给监听、上游连接、打开的文件等的部分，其余用于客户端连接
+#define FD_RESERVE 256
+// accept因描述符耗尽失败时，一次关闭的空闲连接数
+#define IDLE_EVICT_BATCH 16
 #define MAX_EVENTS 10000
+// 预读队列长度，满了之后退回到主线程缺页
+#define MAX_IO_JOBS 4096
+// 等待主线程开始转发的请求数
+#define MAX_PROXY_JOBS 4096
+// 监听队列长度；暂停accept期间新连接在这里等待
+#define LISTEN_BACKLOG 1024
+// 协程处理函数阻塞文件IO的线程数与队列长度
+#define OFFLOAD_THREADS 2
+#define MAX_OFFLOAD_JOBS 4096
+// --delay-path最长的等待
+#define DELAY_MAX_MS 10000
 
 static int pipefd[2];
 static SortTimerList timer_list;
+static ConnectionSlab* slab = nullptr;
+static ReverseProxy* reverse_proxy = nullptr;
+static ThreadPool<HTTPConnection>* pool = nullptr;
+static ResponseCache* response_cache = nullptr;
+// 协程处理函数的reactor，嵌在主线程的事件循环中
+static Reactor* reactor = nullptr;
+static OffloadPool* offload = nullptr;
+// 过载：队列满时直接回复503的请求数，暂停accept的次数
+static uint64_t overload_rejected = 0;
+static uint64_t accept_pauses = 0;
+// 空闲的keep-alive连接(LRU)；连接数到达高水位后，每接受一个新连接关闭一个最早空闲的
+static IdleList idle_list;
+static uint32_t idle_high_water = 0;
+static uint64_t idle_evictions = 0;
+static uint64_t accept_emfile = 0;
+// 忙轮询预算(微秒)，0表示关闭
+static uint32_t busy_poll_us = 0;
 
-extern void addfd(int epoll_fd, int fd, bool one_shot, bool ET);
+extern void addfd(int epoll_fd, int fd, uint64_t data, bool one_shot, bool ET);
 extern void delfd(int epoll_fd, int fd);
 
 void add_sig(int sig, void (*handler)(int), int restart) {
@@ -49,18 +97,598 @@ void sig_handler(int sig) {
     errno = saved_errno;
 }
 
+void close_client(ConnHandle handle);
+
+// 读取上传令牌：放在文件里，不出现在命令行和进程列表中
+bool load_upload_token(const char* path) {
+    if (path == nullptr) {
+        printf("--upload requires --upload-token-file\n");
+        return false;
+    }
+    FILE* f = fopen(path, "r");
+    char line[256];
+    if (f == nullptr || fgets(line, sizeof(line), f) == nullptr) {
+        printf("read upload token %s failed\n", path);
+        if (f != nullptr) {
+            fclose(f);
+        }
+        return false;
+    }
+    fclose(f);
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0') {
+        printf("upload token %s is empty\n", path);
+        return false;
+    }
+    HTTPConnection::upload_token = line;
+    return true;
+}
+
+// 打开并校验资源包，成功后原子替换当前包；正在发送旧包内容的连接持有旧包引用
+bool reload_pack(const char* path) {
+    std::string error;
+    std::shared_ptr<AssetPack> pack = AssetPack::open(path, &error);
+    if (!pack) {
+        printf("load pack %s failed: %s\n", path, error.c_str());
+        return false;
+    }
+    set_current_asset_pack(pack);
+    printf("loaded pack %s: %u paths\n", path, pack->entry_count());
+    return true;
+}
+
+// 连接建立时就拒绝：尽力发送预先序列化的503后关闭
+void reject_client(int client_fd) {
+    send(client_fd, HTTPConnection::service_unavailable_503,
+         strlen(HTTPConnection::service_unavailable_503), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_fd);
+}
+
+// 踢掉慢速连接并计数
+void evict_client(ConnHandle handle, HTTPConnection::EvictReason reason) {
+    ++HTTPConnection::evictions[reason];
+    LOG_DEBUG("evict slow client: %s\n", HTTPConnection::evict_reason_name(reason));
+    close_client(handle);
+}
+
+// 定时扫描所有连接，处理一直没有新数据到达(也就没有事件触发)的慢速连接
+void sweep_slow_clients() {
+    uint64_t now = monotonic_ms();
+    std::vector<std::pair<ConnHandle, HTTPConnection::EvictReason> > victims;
+    slab->for_each([&](ConnHandle handle, HTTPConnection* user) {
+        HTTPConnection::EvictReason reason = user->check_slow(now);
+        if (reason != HTTPConnection::EVICT_NONE) {
+            victims.push_back(std::make_pair(handle, reason));
+        }
+    });
+    for (size_t i = 0; i < victims.size(); ++i) {
+        evict_client(victims[i].first, victims[i].second);
+    }
+}
+
 void timer_handler() {
     timer_list.tick();
+    sweep_slow_clients();
+    // 整块空闲超过一个周期的连接对象归还给系统
+    slab->shrink(time(nullptr), TIMESLOT);
+    ZeroCopySender::release_abandoned(monotonic_ms());
+    if (reverse_proxy != nullptr) {
+        reverse_proxy->health_check();
+    }
     alarm(TIMESLOT);
 }
 
-void callback(HTTPConnection* user) {
+// 定时器到期回调，定时器本身由tick负责释放
+void callback(ConnHandle handle) {
+    HTTPConnection* user = slab->get(handle);
+    if (user == nullptr) {
+        // 连接早已关闭，槽位可能已被新连接复用
+        return;
+    }
+    user->timer = nullptr;
+    if (user->keepalive_ping()) {
+        // 空闲的WebSocket连接：发出ping后再等一个周期，期间没有任何帧到达才关闭
+        UtilTimer* timer = new UtilTimer();
+        timer->init();
+        timer->handle_ = handle;
+        timer->callback = callback;
+        user->timer = timer;
+        timer_list.add_timer(timer);
+        return;
+    }
+    idle_list.remove(&user->idle_node);
     user->close_connection();
+    slab->release(handle);
+}
+
+// 主线程关闭连接：删除定时器并回收槽位
+void close_client(ConnHandle handle) {
+    HTTPConnection* user = slab->get(handle);
+    if (user == nullptr) {
+        return;
+    }
+    idle_list.remove(&user->idle_node);
+    if (user->timer != nullptr) {
+        timer_list.del_timer(user->timer);
+        user->timer = nullptr;
+    }
+    user->close_connection();
+    slab->release(handle);
+}
+
+// 关闭最早空闲的至多count个keep-alive连接，返回关闭的个数
+size_t evict_idle(size_t count) {
+    size_t evicted = 0;
+    while (evicted < count && idle_list.oldest() != nullptr) {
+        IdleNode* node = idle_list.oldest();
+        close_client(node->handle);
+        idle_list.remove(node);
+        ++evicted;
+    }
+    idle_evictions += evicted;
+    return evicted;
+}
+
+// 响应发完、重新等待请求的连接进入空闲链表
+void mark_idle(ConnHandle handle, HTTPConnection* user) {
+    if (user->keepalive_idle()) {
+        idle_list.push(&user->idle_node, handle, monotonic_ms());
+    }
+}
+
+// 工作线程处理完一个任务，归还dispatch时的pin
+void work_done(uint64_t tag) {
+    slab->unpin(tag);
+}
+
+// 交给工作线程处理；入队之后工作线程随时会改动连接，先记录追踪。
+// 队列满时主线程直接回复503，返回false表示连接已关闭
+bool dispatch(HTTPConnection* user, ConnHandle handle) {
+    trace_stage(TRACE_ENQUEUE, handle, user->request_seq());
+    // 任务持有连接对象的裸指针，处理完之前所在块的冷字段不能释放
+    slab->pin(handle);
+    if (pool->append(user, handle, user->classify())) {
+        return true;
+    }
+    slab->unpin(handle);
+    ++overload_rejected;
+    if (!user->reject_overloaded() || !user->write()) {
+        close_client(handle);
+        return false;
+    }
+    return true;
+}
+
+// 工作线程跟不上时暂停accept，新连接留在内核的监听队列里；追上后恢复
+void throttle_accept(int epoll_fd, const std::vector<Listener>& listeners, bool* paused) {
+    bool pause = *paused ? !pool->caught_up() : pool->behind();
+    if (pause == *paused) {
+        return;
+    }
+    *paused = pause;
+    if (pause) {
+        ++accept_pauses;
+    }
+    for (size_t i = 0; i < listeners.size(); ++i) {
+        epoll_event event{};
+        event.data.u64 = listeners[i].fd;
+        event.events = pause ? 0u : (uint32_t) EPOLLIN;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listeners[i].fd, &event);
+    }
+}
+
+// 发送响应，写完、需要等待或出错后分别处理
+void write_client(ConnHandle handle, HTTPConnection* user) {
+    if (user->write()) {
+        HTTPConnection::EvictReason reason = user->check_slow(monotonic_ms());
+        if (reason != HTTPConnection::EVICT_NONE) {
+            evict_client(handle, reason);
+            return;
+        }
+        if (user->pipelined() && !dispatch(user, handle)) {
+            // 流水线上还有请求，发完之后没有重新注册事件，直接交给工作线程
+            return;
+        }
+        // 一次性写完
+        time_t cur_time = time(nullptr);
+        user->timer->expire_ = cur_time + 3 * TIMESLOT;
+        LOG_DEBUG("adjust time\n");
+        timer_list.adjust_timer(user->timer);
+        mark_idle(handle, user);
+    }
+    else {
+        close_client(handle);
+    }
+}
+
+// 预读完成的连接继续发送，等待期间已关闭的连接句柄失效，直接跳过
+void resume_io_clients(BlockingIoPool* io_pool) {
+    static std::vector<ConnHandle> done;
+    io_pool->drain(done);
+    for (size_t i = 0; i < done.size(); ++i) {
+        HTTPConnection* user = slab->get(done[i]);
+        if (user == nullptr) {
+            continue;
+        }
+        user->io_complete();
+        write_client(done[i], user);
+    }
+    done.clear();
+}
+
+// 接受一个新连接，TLS监听上的连接先进行TLS握手
+void accept_client(const Listener& listener) {
+    bool tls = listener.spec.tls;
+    sockaddr_storage client_addr{};
+    socklen_t client_addr_len = sizeof(client_addr);
+    int client_fd = accept(listener.fd, (struct sockaddr*) &client_addr, &client_addr_len);
+    if (client_fd == -1 && (errno == EMFILE || errno == ENFILE)) {
+        // 描述符耗尽：关掉一批最早空闲的连接再试一次
+        ++accept_emfile;
+        if (evict_idle(IDLE_EVICT_BATCH) > 0) {
+            client_addr_len = sizeof(client_addr);
+            client_fd = accept(listener.fd, (struct sockaddr*) &client_addr, &client_addr_len);
+        }
+    }
+    if (client_fd == -1) {
+        perror("accept error");
+        return;
+    }
+    if (busy_poll_us > 0) {
+        BusyPoller::tune_socket(client_fd, busy_poll_us);
+    }
+    if (slab->live() >= idle_high_water) {
+        // 连接数在高水位以上：新连接换掉最早空闲的连接，描述符留给有请求的客户端
+        evict_idle(1);
+    }
+
+    // Unix域套接字的对端都在本机，不按地址限制
+    IpLimiter* ip_limiter = listener.spec.family == AF_UNIX ? nullptr : HTTPConnection::ip_limiter;
+    IpKey ip_key{0, 0};
+    bool ip_tracked = false;
+    if (ip_limiter != nullptr) {
+        ip_key = ip_limiter->make_key((sockaddr*) &client_addr);
+        if (!ip_limiter->acquire_connection(ip_key, monotonic_ms(), &ip_tracked)) {
+            // 该地址连接数超限
+            if (tls) {
+                close(client_fd);
+            }
+            else {
+                reject_client(client_fd);
+            }
+            return;
+        }
+    }
+    ConnHandle handle = slab->alloc(client_fd);
+    if (handle == 0) {
+        // 目前连接数满了
+        // 回复相应的报文(TLS连接无法发送明文，直接关闭)
+        if (ip_tracked) {
+            ip_limiter->release_connection(ip_key, monotonic_ms());
+        }
+        if (tls) {
+            close(client_fd);
+        }
+        else {
+            reject_client(client_fd);
+        }
+        return;
+    }
+    // 新的客户初始化，放到槽位表中
+    HTTPConnection* user = slab->get(handle);
+    UtilTimer* timer = new UtilTimer();
+    user->init(client_fd, (sockaddr*) &client_addr, client_addr_len, handle);
+    user->set_ip_key(ip_key, ip_tracked);
+    trace_stage(TRACE_ACCEPT, handle, user->request_seq());
+    user->timer = timer;
+    timer->init();
+    timer->handle_ = handle;
+    timer->callback = callback;
+    timer_list.add_timer(timer);
+    if (tls && !user->start_tls()) {
+        close_client(handle);
+    }
+}
+
+// 反向代理有进展的客户端刷新定时器，结束的转发恢复keep-alive或关闭连接
+void settle_proxy_clients() {
+    static std::vector<ProxyResult> finished;
+    static std::vector<ConnHandle> progressed;
+    reverse_proxy->take_results(finished, progressed);
+    time_t expire = time(nullptr) + 3 * TIMESLOT;
+    for (size_t i = 0; i < progressed.size(); ++i) {
+        HTTPConnection* user = slab->get(progressed[i]);
+        if (user != nullptr && user->timer != nullptr && user->timer->expire_ < expire) {
+            user->timer->expire_ = expire;
+            timer_list.adjust_timer(user->timer);
+        }
+    }
+    for (size_t i = 0; i < finished.size(); ++i) {
+        HTTPConnection* user = slab->get(finished[i].client);
+        if (user == nullptr) {
+            continue;
+        }
+        if (!finished[i].keep_alive) {
+            close_client(finished[i].client);
+            continue;
+        }
+        user->proxy_done(finished[i].cached);
+        if (user->pipelined() && !dispatch(user, finished[i].client)) {
+            continue;
+        }
+        if (user->timer != nullptr) {
+            user->timer->expire_ = expire;
+            timer_list.adjust_timer(user->timer);
+        }
+        mark_idle(finished[i].client, user);
+    }
+    finished.clear();
+    progressed.clear();
+}
+
+// WebSocket消息转发给同一路径上的所有连接(包括发送者)，帧只序列化一次
+void on_ws_message(WebSocketSession* session, bool binary, const char* data, size_t length) {
+    WsFrame frame = WebSocketSession::make_frame(binary ? WS_BINARY : WS_TEXT, data, length);
+    WebSocketSession::broadcast(session->channel(), frame);
+}
+
+// 逗号分隔的每个调度类一个值
+bool parse_class_values(const char* arg, int* values) {
+    char* end;
+    for (int i = 0; i < HTTPConnection::CLASS_COUNT; ++i) {
+        long v = strtol(arg, &end, 10);
+        if (end == arg || v < 0 || *end != (i + 1 < HTTPConnection::CLASS_COUNT ? ',' : '\0')) {
+            return false;
+        }
+        values[i] = (int) v;
+        arg = end + 1;
+    }
+    return true;
+}
+
+// 协程处理结束的连接发送响应，处理期间已关闭的连接句柄失效，直接跳过
+void settle_async_clients() {
+    static std::vector<AsyncResult> finished;
+    HTTPConnection::take_async_results(finished);
+    for (size_t i = 0; i < finished.size(); ++i) {
+        HTTPConnection* user = slab->get(finished[i].handle);
+        if (user == nullptr) {
+            continue;
+        }
+        user->async_done(finished[i].response);
+        write_client(finished[i].handle, user);
+    }
+    finished.clear();
+}
+
+// --delay-path：等待查询串中ms=N毫秒后回复，等待期间只占用一个协程帧，不占用工作线程
+Task<AsyncResponse> delay_handler(AsyncRequest request) {
+    uint64_t ms = 0;
+    size_t query = request.target.find('?');
+    if (query != std::string::npos) {
+        size_t pos = request.target.find("ms=", query);
+        if (pos != std::string::npos &&
+            (request.target[pos - 1] == '?' || request.target[pos - 1] == '&')) {
+            ms = strtoull(request.target.c_str() + pos + 3, nullptr, 10);
+        }
+    }
+    co_await request.reactor->sleep_for(std::min<uint64_t>(ms, DELAY_MAX_MS));
+    co_return AsyncResponse{200, "OK", "text/plain", "ok\n"};
+}
+
+void usage(const char* prog) {
+    printf("Usage: %s [options] [Port]\n"
+           "  --listen spec         accept HTTP on spec (repeatable; replaces Port): 8080,\n"
+           "                        127.0.0.1:8080, [::]:8080 (IPv6 and IPv4), [::1]:8080,\n"
+           "                        unix:/path or unix:@name (abstract namespace)\n"
+           "  --tls-listen spec     accept TLS on spec (repeatable)\n"
+           "  --header-timeout ms   deadline for a complete request header (default %d)\n"
+           "  --min-header-rate B/s minimum header upload rate (default %d)\n"
+           "  --min-body-rate B/s   minimum body upload rate (default %d)\n"
+           "  --min-write-rate B/s  minimum response download rate (default %d)\n"
+           "  --rate-grace ms       time before rates are enforced (default %d)\n"
+           "  --max-conns-per-ip n  concurrent connections per client prefix (default off)\n"
+           "  --rate-per-ip n       requests/s per client prefix (default off)\n"
+           "  --burst-per-ip n      token bucket size per client prefix (default = rate)\n"
+           "  --ip-v4-prefix bits   IPv4 aggregation prefix (default 32)\n"
+           "  --ip-v6-prefix bits   IPv6 aggregation prefix (default 64)\n"
+           "  --ip-table-size n     tracked client prefixes (default 262144)\n"
+           "  --io-threads n        threads that read cold files into page cache, 0 = off (default 4)\n"
+           "  --pack file           serve only from a packtool asset pack, reloaded on SIGHUP\n"
+           "  --root dir            document root (default /home/llz/CPP)\n"
+           "  --tls-port port       same as --tls-listen port; TLS speaks HTTP/1.1 or h2 via ALPN\n"
+           "  --tls-cert file       PEM certificate chain (default cert.pem)\n"
+           "  --tls-key file        PEM private key (default key.pem)\n"
+           "  --ws-prefix path      accept WebSocket upgrades under this path; messages are\n"
+           "                        broadcast to every connection on the same path (default off)\n"
+           "  --proxy prefix=host:port[,host:port...]\n"
+           "                        forward GETs under prefix to upstream HTTP/1.1 servers (repeatable)\n"
+           "  --proxy-health path   upstream health check path (default: TCP connect only)\n"
+           "  --cache-size MB       cache proxied responses in memory, 0 = off (default 0)\n"
+           "  --cache-ttl ms        freshness when the upstream sends no max-age (default 1000)\n"
+           "  --cache-swr ms        serve stale while revalidating for this long (default 10000)\n"
+           "  --cache-vary header   request header that is part of the cache key (repeatable)\n"
+           "  --trace               record per-request stage timestamps into per-thread rings\n"
+           "  --trace-file file     where SIGUSR1 dumps the trace (default trace.bin)\n"
+           "  --trace-path path     loopback clients GET this path to download the trace\n"
+           "  --codel-target ms     shed requests that keep waiting longer than this in the\n"
+           "                        worker queue, 0 = off (default 20)\n"
+           "  --codel-interval ms   how long the delay must persist before shedding (default 100)\n"
+           "  --sched-weights c,s,l,d\n"
+           "                        dequeue weights of the control, small static, large static and\n"
+           "                        dynamic classes (default 8,4,1,2)\n"
+           "  --sched-caps c,s,l,d  workers each class may occupy at once, 0 = all (default 0,0,%d,%d)\n"
+           "  --large-body KB       static responses at least this large are large (default 256)\n"
+           "  --control-path prefix requests under prefix are control plane (repeatable)\n"
+           "  --delay-path prefix   answer requests under prefix after ?ms=N milliseconds, waiting\n"
+           "                        in a coroutine instead of a worker (default off)\n"
+           "  --max-conns n         client connections (default: open file limit - %d)\n"
+           "  --idle-high-water pct above this share of --max-conns, each new connection closes\n"
+           "                        the longest idle keep-alive connection (default 90)\n"
+           "  --max-requests n      requests per connection, the last one gets Connection: close\n"
+           "                        (default 0 = unlimited)\n"
+           "  --busy-poll us        spin on the event loop for up to this long before sleeping,\n"
+           "                        trading CPU for wakeup latency; sets SO_BUSY_POLL (default 0)\n"
+           "  --zerocopy-min KB     send cached and file bodies at least this large with\n"
+           "                        MSG_ZEROCOPY on plain connections, 0 = off (default 0)\n"
+           "  --upload prefix       accept authenticated PUT and DELETE under prefix (repeatable)\n"
+           "  --upload-token-file f bearer token for uploads, first line of f (required with --upload)\n",
+           prog, HTTPConnection::slow_policy.header_timeout_ms,
+           HTTPConnection::slow_policy.min_header_rate, HTTPConnection::slow_policy.min_body_rate,
+           HTTPConnection::slow_policy.min_write_rate, HTTPConnection::slow_policy.grace_ms,
+           THREAD_NUM / 2, THREAD_NUM - 2, FD_RESERVE);
 }
 
 int main(int argc, char* argv[]) {
-    if (argc <= 1) {
-        printf("Usage: %s Port\n", basename(argv[0]));
+    static option long_opts[] = {
+        {"header-timeout", required_argument, nullptr, 't'},
+        {"min-header-rate", required_argument, nullptr, 'h'},
+        {"min-body-rate", required_argument, nullptr, 'b'},
+        {"min-write-rate", required_argument, nullptr, 'w'},
+        {"rate-grace", required_argument, nullptr, 'g'},
+        {"max-conns-per-ip", required_argument, nullptr, 'c'},
+        {"rate-per-ip", required_argument, nullptr, 'r'},
+        {"burst-per-ip", required_argument, nullptr, 'B'},
+        {"ip-v4-prefix", required_argument, nullptr, '4'},
+        {"ip-v6-prefix", required_argument, nullptr, '6'},
+        {"ip-table-size", required_argument, nullptr, 'T'},
+        {"io-threads", required_argument, nullptr, 'i'},
+        {"pack", required_argument, nullptr, 'p'},
+        {"root", required_argument, nullptr, 'R'},
+        {"tls-port", required_argument, nullptr, 'S'},
+        {"tls-cert", required_argument, nullptr, 'C'},
+        {"tls-key", required_argument, nullptr, 'K'},
+        {"ws-prefix", required_argument, nullptr, 'W'},
+        {"proxy", required_argument, nullptr, 'P'},
+        {"proxy-health", required_argument, nullptr, 'H'},
+        {"cache-size", required_argument, nullptr, 'M'},
+        {"cache-ttl", required_argument, nullptr, 'L'},
+        {"cache-swr", required_argument, nullptr, 's'},
+        {"cache-vary", required_argument, nullptr, 'V'},
+        {"trace", no_argument, nullptr, 'X'},
+        {"trace-file", required_argument, nullptr, 'F'},
+        {"trace-path", required_argument, nullptr, 'A'},
+        {"codel-target", required_argument, nullptr, 'D'},
+        {"codel-interval", required_argument, nullptr, 'I'},
+        {"sched-weights", required_argument, nullptr, 'Q'},
+        {"sched-caps", required_argument, nullptr, 'U'},
+        {"large-body", required_argument, nullptr, 'G'},
+        {"control-path", required_argument, nullptr, 'O'},
+        {"delay-path", required_argument, nullptr, 'Y'},
+        {"listen", required_argument, nullptr, 'l'},
+        {"tls-listen", required_argument, nullptr, 'E'},
+        {"max-conns", required_argument, nullptr, 'N'},
+        {"idle-high-water", required_argument, nullptr, 'e'},
+        {"max-requests", required_argument, nullptr, 'm'},
+        {"busy-poll", required_argument, nullptr, 'z'},
+        {"zerocopy-min", required_argument, nullptr, 'Z'},
+        {"upload", required_argument, nullptr, 'u'},
+        {"upload-token-file", required_argument, nullptr, 'k'},
+        {nullptr, 0, nullptr, 0}};
+    IpLimiterConfig ip_config = {0, 0, 0, 32, 64, 1 << 18};
+    const char* pack_path = nullptr;
+    const char* upload_token_file = nullptr;
+    int io_threads = 4;
+    long max_conns = 0;
+    int idle_high_water_pct = 90;
+    const char* root_path = "/home/llz/CPP";
+    std::vector<const char*> proxy_routes;
+    const char* proxy_health = "";
+    CachePolicy cache_policy = {0, 1000, 10000, std::vector<std::string>()};
+    // 监听地址，TLS的在后
+    std::vector<ListenerSpec> listen_specs;
+    std::vector<ListenerSpec> tls_specs;
+    bool trace = false;
+    const char* trace_file = "trace.bin";
+    uint64_t codel_target_ms = 20;
+    uint64_t codel_interval_ms = 100;
+    // 大文件和动态请求不能占满所有工作线程，也不能占满整个队列
+    int sched_weights[HTTPConnection::CLASS_COUNT] = {8, 4, 1, 2};
+    int sched_caps[HTTPConnection::CLASS_COUNT] = {0, 0, THREAD_NUM / 2, THREAD_NUM - 2};
+    int sched_queued[HTTPConnection::CLASS_COUNT] = {0, 0, MAX_REQUEST_NUM / 2,
+                                                     MAX_REQUEST_NUM / 2};
+    const char* tls_cert = "cert.pem";
+    const char* tls_key = "key.pem";
+    SlowClientPolicy& policy = HTTPConnection::slow_policy;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_opts, nullptr)) != -1) {
+        switch (opt) {
+            case 't': policy.header_timeout_ms = atoi(optarg); break;
+            case 'h': policy.min_header_rate = atoi(optarg); break;
+            case 'b': policy.min_body_rate = atoi(optarg); break;
+            case 'w': policy.min_write_rate = atoi(optarg); break;
+            case 'g': policy.grace_ms = atoi(optarg); break;
+            case 'c': ip_config.max_conns_per_ip = atoi(optarg); break;
+            case 'r': ip_config.requests_per_sec = atoi(optarg); break;
+            case 'B': ip_config.burst = atoi(optarg); break;
+            case '4': ip_config.v4_prefix = atoi(optarg); break;
+            case '6': ip_config.v6_prefix = atoi(optarg); break;
+            case 'T': ip_config.capacity = (uint32_t) atoi(optarg); break;
+            case 'i': io_threads = atoi(optarg); break;
+            case 'p': pack_path = optarg; break;
+            case 'R': root_path = optarg; break;
+            case 'S':
+            case 'l':
+            case 'E': {
+                ListenerSpec spec;
+                std::string error;
+                if (!parse_listener(optarg, opt != 'l', &spec, &error)) {
+                    printf("bad listen address %s: %s\n", optarg, error.c_str());
+                    exit(-1);
+                }
+                (opt == 'l' ? listen_specs : tls_specs).push_back(spec);
+                break;
+            }
+            case 'C': tls_cert = optarg; break;
+            case 'K': tls_key = optarg; break;
+            case 'W': HTTPConnection::ws_prefix = optarg; break;
+            case 'P': proxy_routes.push_back(optarg); break;
+            case 'H': proxy_health = optarg; break;
+            case 'M': cache_policy.capacity = strtoull(optarg, nullptr, 10) << 20; break;
+            case 'L': cache_policy.ttl_ms = strtoull(optarg, nullptr, 10); break;
+            case 's': cache_policy.swr_ms = strtoull(optarg, nullptr, 10); break;
+            case 'V': cache_policy.vary.push_back(optarg); break;
+            case 'X': trace = true; break;
+            case 'F': trace_file = optarg; break;
+            case 'A': HTTPConnection::trace_path = optarg; break;
+            case 'D': codel_target_ms = strtoull(optarg, nullptr, 10); break;
+            case 'I': codel_interval_ms = strtoull(optarg, nullptr, 10); break;
+            case 'Q':
+                if (!parse_class_values(optarg, sched_weights)) {
+                    usage(basename(argv[0]));
+                    exit(-1);
+                }
+                break;
+            case 'U':
+                if (!parse_class_values(optarg, sched_caps)) {
+                    usage(basename(argv[0]));
+                    exit(-1);
+                }
+                break;
+            case 'G': HTTPConnection::large_body_bytes = strtoull(optarg, nullptr, 10) << 10; break;
+            case 'O': HTTPConnection::control_paths.push_back(optarg); break;
+            case 'Y': HTTPConnection::async_routes.push_back(AsyncRoute{optarg, delay_handler}); break;
+            case 'N': max_conns = atol(optarg); break;
+            case 'e': idle_high_water_pct = atoi(optarg); break;
+            case 'm': HTTPConnection::max_requests = atoi(optarg); break;
+            case 'z': busy_poll_us = (uint32_t) strtoul(optarg, nullptr, 10); break;
+            case 'Z': HTTPConnection::zerocopy_min_bytes = strtoull(optarg, nullptr, 10) << 10; break;
+            case 'u': HTTPConnection::upload_prefixes.push_back(optarg); break;
+            case 'k': upload_token_file = optarg; break;
+            default: usage(basename(argv[0])); exit(-1);
+        }
+    }
+    if (optind < argc) {
+        ListenerSpec spec;
+        std::string error;
+        if (!parse_listener(argv[optind], false, &spec, &error)) {
+            printf("bad listen address %s: %s\n", argv[optind], error.c_str());
+            exit(-1);
+        }
+        listen_specs.insert(listen_specs.begin(), spec);
+    }
+    if (listen_specs.empty()) {
+        usage(basename(argv[0]));
         exit(-1);
     }
 
@@ -68,43 +696,137 @@ int main(int argc, char* argv[]) {
     add_sig(SIGPIPE, SIG_IGN, false);
     add_sig(SIGALRM, sig_handler, true);
     add_sig(SIGTERM, sig_handler, true);
+    add_sig(SIGHUP, sig_handler, true);
+    add_sig(SIGUSR1, sig_handler, true);
+    if (trace) {
+        trace_enable();
+    }
+
+    WebSocketSession::handler = on_ws_message;
 
-    // 创建线程池
-    ThreadPool<HTTPConnection>* pool = nullptr;
+    if (pack_path != nullptr && !reload_pack(pack_path)) {
+        exit(-1);
+    }
+    if (pack_path == nullptr && !HTTPConnection::open_root(root_path)) {
+        printf("open document root %s failed: %s\n", root_path, strerror(errno));
+        exit(-1);
+    }
+    if (!HTTPConnection::upload_prefixes.empty()) {
+        // 上传写入文档根目录，资源包是只读的
+        if (pack_path != nullptr) {
+            printf("--upload needs a document root, not --pack\n");
+            exit(-1);
+        }
+        if (!load_upload_token(upload_token_file)) {
+            exit(-1);
+        }
+    }
+
+    // 创建线程池，调度类的顺序与HTTPConnection::RequestClass一致
+    static const char* class_names[HTTPConnection::CLASS_COUNT] = {
+        "control", "small_static", "large_static", "dynamic"};
+    std::vector<SchedClassConfig> sched_classes;
+    for (int i = 0; i < HTTPConnection::CLASS_COUNT; ++i) {
+        sched_classes.push_back(
+            SchedClassConfig{class_names[i], sched_weights[i], sched_caps[i], sched_queued[i]});
+    }
     try {
-        pool = new ThreadPool<HTTPConnection>(THREAD_NUM, MAX_REQUEST_NUM);
+        pool = new ThreadPool<HTTPConnection>(THREAD_NUM, MAX_REQUEST_NUM, sched_classes);
     }
     catch (...) {
         exit(-1);
     }
+    pool->set_codel(codel_target_ms * 1000, codel_interval_ms * 1000);
+    pool->set_done(work_done);
 
-    // 保存客户端连接信息
-    HTTPConnection* users = nullptr;
-    users = new HTTPConnection[MAX_FD];
+    // 连接数受描述符上限约束：软上限提到硬上限，留出FD_RESERVE个给其他用途
+    if (max_conns <= 0) {
+        rlimit limit;
+        getrlimit(RLIMIT_NOFILE, &limit);
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+        max_conns = limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > MAX_CONNECTIONS
+                        ? MAX_CONNECTIONS
+                        : (long) limit.rlim_cur;
+        max_conns = max_conns > 2 * FD_RESERVE ? max_conns - FD_RESERVE : max_conns / 2;
+    }
+    max_conns = std::min<long>(max_conns, MAX_CONNECTIONS);
+    idle_high_water_pct = std::max(1, std::min(idle_high_water_pct, 100));
+    idle_high_water = (uint32_t) (max_conns * idle_high_water_pct / 100);
 
-    int server_sockfd = socket(PF_INET, SOCK_STREAM, 0);
-    if (server_sockfd == -1) {
-        printf("socket error\n");
-        exit(-1);
+    // 保存客户端连接信息
+    try {
+        slab = new ConnectionSlab((uint32_t) max_conns);
     }
-    // 设置端口复用
-    int reuse = 1;
-    setsockopt(server_sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
-    // 绑定文件描述符、监听地址和端口号
-    struct sockaddr_in server_addr;
-    bzero(&server_addr, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(atoi(argv[1]));
-    if (bind(server_sockfd, (struct sockaddr*) &server_addr,
-             sizeof(server_addr)) == -1) {
-        perror("bind error");
+    catch (...) {
         exit(-1);
     }
+    BlockingIoPool* io_pool = nullptr;
+    if (io_threads > 0) {
+        try {
+            io_pool = new BlockingIoPool(io_threads, MAX_IO_JOBS);
+        }
+        catch (...) {
+            exit(-1);
+        }
+        HTTPConnection::io_pool = io_pool;
+    }
+    if (!proxy_routes.empty()) {
+        reverse_proxy = new ReverseProxy(MAX_PROXY_JOBS);
+        for (size_t i = 0; i < proxy_routes.size(); ++i) {
+            std::string error;
+            if (!reverse_proxy->add_route(proxy_routes[i], &error)) {
+                printf("bad proxy route %s: %s\n", proxy_routes[i], error.c_str());
+                exit(-1);
+            }
+        }
+        reverse_proxy->set_health_path(proxy_health);
+        HTTPConnection::proxy = reverse_proxy;
+        if (cache_policy.capacity > 0) {
+            response_cache = new ResponseCache(cache_policy);
+            reverse_proxy->set_cache(response_cache);
+            HTTPConnection::cache = response_cache;
+        }
+    }
+    if (!HTTPConnection::async_routes.empty()) {
+        try {
+            reactor = new Reactor();
+            offload = new OffloadPool(OFFLOAD_THREADS, MAX_OFFLOAD_JOBS);
+        }
+        catch (...) {
+            exit(-1);
+        }
+        HTTPConnection::reactor = reactor;
+        HTTPConnection::offload = offload;
+    }
+    IpLimiter* ip_limiter = nullptr;
+    if (ip_config.max_conns_per_ip > 0 || ip_config.requests_per_sec > 0) {
+        ip_limiter = new IpLimiter(ip_config);
+        HTTPConnection::ip_limiter = ip_limiter;
+    }
 
-    if (listen(server_sockfd, 5) == -1) {
-        perror("listen error");
-        exit(-1);
+    TlsContext* tls = nullptr;
+    if (!tls_specs.empty()) {
+        tls = new TlsContext();
+        std::string error;
+        if (!tls->init(tls_cert, tls_key, &error)) {
+            printf("tls init failed: %s\n", error.c_str());
+            exit(-1);
+        }
+        HTTPConnection::tls = tls;
+    }
+    listen_specs.insert(listen_specs.end(), tls_specs.begin(), tls_specs.end());
+    std::vector<Listener> listeners;
+    for (size_t i = 0; i < listen_specs.size(); ++i) {
+        std::string error;
+        int fd = open_listener(listen_specs[i], LISTEN_BACKLOG, &error);
+        if (fd == -1) {
+            printf("listen on %s failed: %s\n", listener_name(listen_specs[i]).c_str(),
+                   error.c_str());
+            exit(-1);
+        }
+        listeners.push_back(Listener{listen_specs[i], fd});
     }
 
     // 创建epoll对象,事件数组，添加删除修改文件描述符
@@ -113,56 +835,73 @@ int main(int argc, char* argv[]) {
 
     // 创建信号通知管道
     assert(socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd) != -1);
-    addfd(epoll_fd, pipefd[0], false, false);
+    addfd(epoll_fd, pipefd[0], pipefd[0], false, false);
     // 添加文件描述符
-    addfd(epoll_fd, server_sockfd, false, false);
+    for (size_t i = 0; i < listeners.size(); ++i) {
+        addfd(epoll_fd, listeners[i].fd, listeners[i].fd, false, false);
+    }
+    if (io_pool != nullptr) {
+        addfd(epoll_fd, io_pool->event_fd(), io_pool->event_fd(), false, false);
+    }
+    if (reverse_proxy != nullptr) {
+        reverse_proxy->set_epoll(epoll_fd);
+        addfd(epoll_fd, reverse_proxy->event_fd(), reverse_proxy->event_fd(), false, false);
+    }
+    if (reactor != nullptr) {
+        addfd(epoll_fd, reactor->fd(), reactor->fd(), false, false);
+    }
     HTTPConnection::epoll_fd = epoll_fd;
+    BusyPoller poller(epoll_fd, busy_poll_us);
+    if (busy_poll_us > 0) {
+        printf("busy poll: budget=%uus epoll_params=%s\n", busy_poll_us,
+               poller.set_epoll_busy_poll() ? "on" : "unsupported");
+        if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+            // 只有一个核时自旋占着的正是工作线程和对端需要的CPU
+            printf("busy poll: only one CPU online, spinning will add latency\n");
+        }
+        fflush(stdout);
+    }
 
     bool timeout = false;
     bool stop_server = false;
+    bool accept_paused = false;
     alarm(TIMESLOT);
     while (stop_server == false) {
-        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        // 暂停accept期间没有监听事件，定期醒来检查工作线程是否已追上
+        int count = poller.wait(events, MAX_EVENTS, accept_paused ? 10 : -1);
         if ((count == -1) && (errno != EINTR)) {
             printf("epoll failure\n");
             break;
         }
 
         for (int i = 0; i < count; ++i) {
-            int sock_fd = events[i].data.fd;
-            if (sock_fd == server_sockfd) {
+            uint64_t tag = events[i].data.u64;
+            // 监听只有几个，逐个比较
+            size_t l = 0;
+            while (l < listeners.size() && tag != (uint64_t) listeners[l].fd) {
+                ++l;
+            }
+            if (l < listeners.size()) {
                 // 有新客户端连接
-                sockaddr_in client_addr{};
-                socklen_t client_addr_len = sizeof(client_addr);
-                int client_fd =
-                    accept(server_sockfd, (struct sockaddr*) &client_addr,
-                           &client_addr_len);
-                if (client_fd == -1) {
-                    perror("accept error");
-                    continue;
-                }
-
-                if (HTTPConnection::user_count >= MAX_FD) {
-                    // 目前连接数满了
-                    // 回复相应的报文
-                    close(client_fd);
-                    continue;
-                }
-                // 新的客户初始化，放到数组中
-                UtilTimer* timer = new UtilTimer();
-                users[client_fd].init(client_fd, client_addr);
-                users[client_fd].timer = timer;
-                timer->init();
-                timer->http_connection_ = &users[client_fd];
-                timer->callback = callback;
-                timer_list.add_timer(timer);
+                accept_client(listeners[l]);
+            }
+            else if (io_pool != nullptr && tag == (uint64_t) io_pool->event_fd()) {
+                resume_io_clients(io_pool);
+            }
+            else if (reactor != nullptr && tag == (uint64_t) reactor->fd()) {
+                reactor->poll(0);
+                settle_async_clients();
             }
-            else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-                // 对方异常断开
-                timer_list.del_timer(users[sock_fd].timer);
-                users[sock_fd].close_connection();
+            else if (reverse_proxy != nullptr && tag == (uint64_t) reverse_proxy->event_fd()) {
+                reverse_proxy->drain();
             }
-            else if (events[i].events & EPOLLIN && sock_fd == pipefd[0]) {
+            else if (reverse_proxy != nullptr && is_proxy_tag(tag)) {
+                reverse_proxy->handle_event(tag, events[i].events);
+            }
+            else if (tag == (uint64_t) pipefd[0]) {
+                if (!(events[i].events & EPOLLIN)) {
+                    continue;
+                }
                 // 捕获到信号
                 int ret;
                 char signals[1024];
@@ -185,6 +924,28 @@ int main(int argc, char* argv[]) {
                                 stop_server = true;
                                 break;
                             }
+                            case SIGHUP: {
+                                // 重新加载资源包，失败则继续使用旧包
+                                if (pack_path != nullptr) {
+                                    reload_pack(pack_path);
+                                }
+                                break;
+                            }
+                            case SIGUSR1: {
+                                // 导出追踪记录，工作线程继续写各自的环
+                                size_t records = 0;
+                                if (!trace_enabled) {
+                                    printf("trace: not enabled, start with --trace\n");
+                                }
+                                else if (trace_dump_file(trace_file, &records)) {
+                                    printf("trace: wrote %zu records to %s\n", records, trace_file);
+                                }
+                                else {
+                                    printf("trace: write %s failed: %s\n", trace_file, strerror(errno));
+                                }
+                                fflush(stdout);
+                                break;
+                            }
                             default: {
                                 break;
                             }
@@ -192,45 +953,198 @@ int main(int argc, char* argv[]) {
                     }
                 }
             }
-            else if (events[i].events & EPOLLIN) {
-                // 读事件
-                if (users[sock_fd].read()) {
-                    // 一次性读完数据
-                    pool->append(users + sock_fd);
-                    time_t cur_time = time(nullptr);
-                    users[sock_fd].timer->expire_ = cur_time + 3 * TIMESLOT;
-                    printf("adjust time\n");
-                    timer_list.adjust_timer(users[sock_fd].timer);
-                }
-                else {
-                    timer_list.del_timer(users[sock_fd].timer);
-                    users[sock_fd].close_connection();
+            else {
+                HTTPConnection* user = slab->get(tag);
+                if (user == nullptr) {
+                    // 过期事件，连接已经关闭
+                    continue;
                 }
-            }
-            else if (events[i].events & EPOLLOUT) {
-                // 写事件
-                if (users[sock_fd].write()) {
-                    // 一次性写完
-                    time_t cur_time = time(nullptr);
-                    users[sock_fd].timer->expire_ = cur_time + 3 * TIMESLOT;
-                    printf("adjust time\n");
-                    timer_list.adjust_timer(users[sock_fd].timer);
+                if (!user->claim_events()) {
+                    // 连接正由其他线程处理，它结束时会重新注册
                     continue;
                 }
-                else {
-                    users[sock_fd].close_connection();
+                idle_list.remove(&user->idle_node);
+                if ((events[i].events & EPOLLERR) && user->zerocopy_pending()) {
+                    // 零拷贝的完成通知排在错误队列里，同样以EPOLLERR报告
+                    if (!user->reap_zerocopy()) {
+                        close_client(tag);
+                        continue;
+                    }
+                    events[i].events &= ~EPOLLERR;
+                    if (!(events[i].events & (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP))) {
+                        user->rearm();
+                        continue;
+                    }
+                }
+                if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    // 对方异常断开
+                    close_client(tag);
+                }
+                else if (user->tls_handshaking()) {
+                    // TLS握手读写都可能阻塞，交给工作线程推进
+                    dispatch(user, tag);
+                }
+                else if (events[i].events & EPOLLIN) {
+                    // 读事件
+                    if (user->read()) {
+                        HTTPConnection::EvictReason reason = user->check_slow(monotonic_ms());
+                        if (reason != HTTPConnection::EVICT_NONE) {
+                            evict_client(tag, reason);
+                            continue;
+                        }
+                        if (user->rate_limited()) {
+                            // 超过地址请求速率，主线程直接回复429
+                            user->reject_request();
+                            if (!user->write()) {
+                                close_client(tag);
+                            }
+                            continue;
+                        }
+                        if (user->upload_receiving()) {
+                            // 上传的请求体已直接写入文件，还没收完时只需重新注册
+                            user->rearm();
+                        }
+                        // 一次性读完数据
+                        else if (!dispatch(user, tag)) {
+                            continue;
+                        }
+                        time_t cur_time = time(nullptr);
+                        user->timer->expire_ = cur_time + 3 * TIMESLOT;
+                        LOG_DEBUG("adjust time\n");
+                        timer_list.adjust_timer(user->timer);
+                    }
+                    else {
+                        close_client(tag);
+                    }
+                }
+                else if (events[i].events & EPOLLOUT) {
+                    // 写事件
+                    write_client(tag, user);
                 }
             }
         }
+        if (reverse_proxy != nullptr) {
+            settle_proxy_clients();
+        }
         if (timeout) {
             timer_handler();
             timeout = false;
         }
+        throttle_accept(epoll_fd, listeners, &accept_paused);
+    }
+    printf("slow client evictions:");
+    for (int r = HTTPConnection::EVICT_HEADER_TIMEOUT; r < HTTPConnection::EVICT_REASON_COUNT; ++r) {
+        printf(" %s=%llu", HTTPConnection::evict_reason_name((HTTPConnection::EvictReason) r),
+               (unsigned long long) HTTPConnection::evictions[r].load());
+    }
+    printf("\n");
+    if (ip_limiter != nullptr) {
+        printf("ip limiter: rejected_connections=%llu rejected_requests=%llu untracked=%llu\n",
+               (unsigned long long) ip_limiter->rejected_connections.load(),
+               (unsigned long long) ip_limiter->rejected_requests.load(),
+               (unsigned long long) ip_limiter->untracked.load());
+    }
+    const BusyPollStats& loop = poller.stats();
+    printf("event loop: spin_ms=%llu work_ms=%llu sleep_ms=%llu empty_polls=%llu spin_hits=%llu "
+           "parks=%llu budget_us=%u\n",
+           (unsigned long long) (loop.spin_ns / 1000000), (unsigned long long) (loop.work_ns / 1000000),
+           (unsigned long long) (loop.sleep_ns / 1000000), (unsigned long long) loop.polls,
+           (unsigned long long) loop.spin_hits, (unsigned long long) loop.parks,
+           poller.current_us());
+    printf("keepalive: idle=%zu idle_evictions=%llu accept_emfile=%llu max_requests_closes=%llu\n",
+           idle_list.size(), (unsigned long long) idle_evictions,
+           (unsigned long long) accept_emfile,
+           (unsigned long long) HTTPConnection::max_requests_closes.load());
+    printf("overload: rejected=%llu shed=%llu accept_pauses=%llu\n",
+           (unsigned long long) overload_rejected, (unsigned long long) pool->shed.load(),
+           (unsigned long long) accept_pauses);
+    for (int i = 0; i < pool->class_count(); ++i) {
+        SchedClassStats st;
+        pool->stats(i, &st);
+        printf("sched %s: served=%llu shed=%llu rejected=%llu max_depth=%zu wait_avg_us=%llu "
+               "wait_p50_us<=%llu wait_p99_us<=%llu wait_max_us=%llu\n",
+               pool->class_name(i), (unsigned long long) st.served,
+               (unsigned long long) st.shed, (unsigned long long) st.rejected, st.max_depth,
+               (unsigned long long) (st.served > 0 ? st.wait_total_us / st.served : 0),
+               (unsigned long long) st.wait_p50_us, (unsigned long long) st.wait_p99_us,
+               (unsigned long long) st.wait_max_us);
+    }
+    printf("http2: sessions=%llu streams=%llu\n",
+           (unsigned long long) Http2Session::sessions.load(),
+           (unsigned long long) Http2Session::streams.load());
+    printf("websocket: sessions=%llu messages=%llu broadcasts=%llu shared_frames=%llu\n",
+           (unsigned long long) WebSocketSession::sessions.load(),
+           (unsigned long long) WebSocketSession::messages.load(),
+           (unsigned long long) WebSocketSession::broadcasts.load(),
+           (unsigned long long) WebSocketSession::shared_frames.load());
+    if (tls != nullptr) {
+        printf("tls: handshakes=%llu failures=%llu ktls_send=%llu ktls_recv=%llu\n",
+               (unsigned long long) tls->handshakes.load(),
+               (unsigned long long) tls->handshake_failures.load(),
+               (unsigned long long) tls->ktls_send.load(),
+               (unsigned long long) tls->ktls_recv.load());
+    }
+    if (reactor != nullptr) {
+        printf("coroutines: resumed=%llu\n", (unsigned long long) reactor->resumed.load());
+    }
+    if (reverse_proxy != nullptr) {
+        printf("proxy: requests=%llu reused=%llu spliced_bytes=%llu bad_gateway=%llu\n",
+               (unsigned long long) reverse_proxy->requests,
+               (unsigned long long) reverse_proxy->reused,
+               (unsigned long long) reverse_proxy->spliced_bytes,
+               (unsigned long long) reverse_proxy->bad_gateway);
+    }
+    if (response_cache != nullptr) {
+        printf("cache: hits=%llu stale_hits=%llu misses=%llu collapsed=%llu stores=%llu "
+               "evictions=%llu\n",
+               (unsigned long long) response_cache->hits.load(),
+               (unsigned long long) response_cache->stale_hits.load(),
+               (unsigned long long) response_cache->misses.load(),
+               (unsigned long long) reverse_proxy->collapsed,
+               (unsigned long long) response_cache->stores.load(),
+               (unsigned long long) response_cache->evictions.load());
+    }
+    if (HTTPConnection::zerocopy_min_bytes > 0) {
+        printf("zerocopy: sends=%llu bytes=%llu completions=%llu copied=%llu enobufs=%llu\n",
+               (unsigned long long) ZeroCopySender::sends.load(),
+               (unsigned long long) ZeroCopySender::bytes.load(),
+               (unsigned long long) ZeroCopySender::completions.load(),
+               (unsigned long long) ZeroCopySender::copied.load(),
+               (unsigned long long) ZeroCopySender::fallbacks.load());
+    }
+    if (!HTTPConnection::upload_prefixes.empty()) {
+        printf("upload: started=%llu completed=%llu aborted=%llu bytes=%llu spliced=%llu "
+               "deleted=%llu\n",
+               (unsigned long long) Upload::started.load(),
+               (unsigned long long) Upload::completed.load(),
+               (unsigned long long) Upload::aborted.load(),
+               (unsigned long long) Upload::bytes.load(),
+               (unsigned long long) Upload::spliced.load(),
+               (unsigned long long) Upload::deleted.load());
+    }
+    if (io_pool != nullptr) {
+        printf("io pool: deferred=%llu jobs=%llu bytes=%llu\n",
+               (unsigned long long) HTTPConnection::io_deferrals.load(),
+               (unsigned long long) io_pool->jobs.load(),
+               (unsigned long long) io_pool->bytes.load());
     }
     close(epoll_fd);
-    close(server_sockfd);
-    delete[] users;
+    // 文件系统中的Unix域套接字文件一并删除
+    for (size_t i = 0; i < listeners.size(); ++i) {
+        close_listener(listeners[i]);
+    }
+    // 先等工作线程退出，它们可能还在处理连接
     delete pool;
+    delete slab;
+    // 关闭的连接留下的零拷贝引用不再等通知
+    ZeroCopySender::release_abandoned(UINT64_MAX);
+    delete ip_limiter;
+    delete io_pool;
+    delete tls;
+    delete reverse_proxy;
+    delete response_cache;
+    delete offload;
+    delete reactor;
 
     return 0;
 }
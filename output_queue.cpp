@@ -0,0 +1,117 @@
+#include "output_queue.h"
+
+OutputSegment& OutputQueue::push(const char* data, size_t length) {
+    if (head_ > 0 && head_ * 2 >= segments_.size()) {
+        // 一直没有发完的队列，前面空出的段过半时整体前移
+        segments_.erase(segments_.begin(), segments_.begin() + head_);
+        head_ = 0;
+    }
+    segments_.emplace_back();
+    OutputSegment& segment = segments_.back();
+    segment.data = data;
+    segment.length = length;
+    bytes_ += length;
+    return segment;
+}
+
+void OutputQueue::append_borrowed(const char* data, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    push(data, length);
+}
+
+void OutputQueue::append_copy(const char* data, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    if (!empty() && !segments_.back().owned.empty()) {
+        // 追加可能使字符串重新分配，offset_是下标，仍然有效
+        OutputSegment& last = segments_.back();
+        last.owned.append(data, length);
+        last.length = last.owned.size();
+        bytes_ += length;
+        return;
+    }
+    OutputSegment& segment = push(nullptr, length);
+    segment.owned.assign(data, length);
+}
+
+void OutputQueue::append_owned(std::string* bytes) {
+    if (bytes->empty()) {
+        return;
+    }
+    OutputSegment& segment = push(nullptr, bytes->size());
+    segment.owned.swap(*bytes);
+}
+
+void OutputQueue::append_cached(const CachedResponsePtr& entry, size_t offset) {
+    if (offset >= entry->data.size()) {
+        return;
+    }
+    OutputSegment& segment = push(entry->data.data() + offset, entry->data.size() - offset);
+    segment.cached = entry;
+}
+
+void OutputQueue::append_file(const std::shared_ptr<StaticFile>& file, const char* data,
+                              size_t length) {
+    if (length == 0) {
+        return;
+    }
+    OutputSegment& segment = push(data, length);
+    segment.file = file;
+}
+
+int OutputQueue::gather(struct iovec* iov, const OutputSegment** segments, int max,
+                        size_t window) const {
+    int count = 0;
+    size_t offset = offset_;
+    for (std::vector<OutputSegment>::const_iterator it = segments_.begin() + head_;
+         it != segments_.end() && count < max; ++it) {
+        size_t length = it->length - offset;
+        bool capped = it->file && length > window;
+        if (capped) {
+            length = window;
+        }
+        iov[count].iov_base = (void*) (it->bytes() + offset);
+        iov[count].iov_len = length;
+        if (segments != nullptr) {
+            segments[count] = &*it;
+        }
+        ++count;
+        offset = 0;
+        if (capped) {
+            break;
+        }
+    }
+    return count;
+}
+
+void OutputQueue::consume(size_t n) {
+    bytes_ -= n;
+    while (n > 0) {
+        OutputSegment& front = segments_[head_];
+        size_t left = front.length - offset_;
+        if (n < left) {
+            offset_ += n;
+            return;
+        }
+        n -= left;
+        std::string().swap(front.owned);
+        front.cached.reset();
+        front.file.reset();
+        ++head_;
+        offset_ = 0;
+    }
+    if (empty()) {
+        segments_.clear();
+        head_ = 0;
+    }
+}
+
+void OutputQueue::clear() {
+    segments_.clear();
+    head_ = 0;
+    offset_ = 0;
+    bytes_ = 0;
+}
@@ -0,0 +1,70 @@
+#ifndef HTTP_SERVER_OUTPUT_QUEUE_H
+#define HTTP_SERVER_OUTPUT_QUEUE_H
+
+#include <limits.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "response_cache.h"
+
+struct StaticFile;
+
+// 一次writev最多聚集的段数
+#ifdef IOV_MAX
+#define OUTPUT_IOV_MAX IOV_MAX
+#else
+#define OUTPUT_IOV_MAX 1024
+#endif
+
+// 发送队列中的一段，按来源持有引用，保证发送完之前数据有效
+struct OutputSegment {
+    // 段在队列扩容时会被移动，自有字节的地址每次现取
+    const char* bytes() const { return owned.empty() ? data : owned.data(); }
+
+    const char* data;
+    size_t length;
+    std::string owned;                // 自有的字节，非空时忽略data
+    CachedResponsePtr cached;         // 缓存条目中的一段
+    std::shared_ptr<StaticFile> file; // 文件映射(或资源包)中的一段
+};
+
+// 每个连接的发送队列：段可以是自有缓冲、借用的字节、缓存条目或文件区间。
+// 游标跨段推进，部分写之后从断点继续；响应头、响应体和流水线上的多个响应
+// 排在同一个队列里，一次系统调用最多聚集OUTPUT_IOV_MAX段
+class OutputQueue {
+public:
+    OutputQueue() : head_(0), offset_(0), bytes_(0) {}
+
+    // 借用：调用者保证发送完之前数据有效(静态字节、连接自己的写缓冲)
+    void append_borrowed(const char* data, size_t length);
+    // 拷贝一份，与队尾的自有段合并
+    void append_copy(const char* data, size_t length);
+    // 接管整个字符串，不再拷贝
+    void append_owned(std::string* bytes);
+    void append_cached(const CachedResponsePtr& entry, size_t offset);
+    void append_file(const std::shared_ptr<StaticFile>& file, const char* data, size_t length);
+
+    bool empty() const { return head_ == segments_.size(); }
+    size_t bytes() const { return bytes_; }
+    // 从游标开始填充iovec；文件段一次最多window字节，被截断的段之后不再聚集。
+    // segments非空时给出每个iovec所属的段
+    int gather(struct iovec* iov, const OutputSegment** segments, int max, size_t window) const;
+    // 已发送n字节，发完的段释放其引用
+    void consume(size_t n);
+    void clear();
+
+private:
+    OutputSegment& push(const char* data, size_t length);
+
+    // 发完的段只清空引用，队列发完时整体清空，保留容量，稳定后不再分配
+    std::vector<OutputSegment> segments_;
+    size_t head_;   // 首个未发完的段
+    size_t offset_; // 首段中已发送的字节
+    size_t bytes_;
+};
+
+#endif
@@ -0,0 +1,380 @@
+// 把文档根目录编译成单个资源包文件，供服务器mmap后直接发送。
+// 同目录下存在xxx.gz时作为xxx的预压缩版本；目录下的index.html同时以"目录/"路径收录。
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "asset_pack.h"
+
+struct SourceFile {
+    std::string disk_path;
+    uint64_t size;
+    uint64_t etag;
+};
+
+struct Asset {
+    std::vector<std::string> urls;// 第一个为规范路径，其余为别名
+    std::string content_type;
+    SourceFile identity;
+    bool has_gzip;
+    SourceFile gzip;
+};
+
+static const char* content_type_of(const std::string& path) {
+    static const char* const types[][2] = {
+        {".html", "text/html; charset=utf-8"}, {".htm", "text/html; charset=utf-8"},
+        {".css", "text/css; charset=utf-8"},   {".js", "application/javascript"},
+        {".json", "application/json"},         {".txt", "text/plain; charset=utf-8"},
+        {".xml", "application/xml"},           {".svg", "image/svg+xml"},
+        {".png", "image/png"},                 {".jpg", "image/jpeg"},
+        {".jpeg", "image/jpeg"},               {".gif", "image/gif"},
+        {".webp", "image/webp"},               {".ico", "image/x-icon"},
+        {".wasm", "application/wasm"},         {".woff2", "font/woff2"},
+        {".pdf", "application/pdf"},
+    };
+    size_t dot = path.rfind('.');
+    if (dot != std::string::npos && path.find('/', dot) == std::string::npos) {
+        std::string ext = path.substr(dot);
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+            if (ext == types[i][0]) {
+                return types[i][1];
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+static bool hash_file(SourceFile& f) {
+    int fd = open(f.disk_path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    // 流式计算内容哈希作为ETag，避免把整个文件读进内存
+    uint64_t h = 0xcbf29ce484222325ull;
+    uint64_t total = 0;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; ++i) {
+            h ^= (unsigned char) buf[i];
+            h *= 0x100000001b3ull;
+        }
+        total += n;
+    }
+    close(fd);
+    if (n == -1) {
+        return false;
+    }
+    f.size = total;
+    f.etag = h;
+    return true;
+}
+
+static void walk(const std::string& root, const std::string& rel,
+                 std::map<std::string, std::string>& files) {
+    std::string dir_path = root + rel;
+    DIR* dir = opendir(dir_path.c_str());
+    if (dir == nullptr) {
+        fprintf(stderr, "opendir %s: %s\n", dir_path.c_str(), strerror(errno));
+        return;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != nullptr) {
+        std::string name = ent->d_name;
+        if (name == "." || name == "..") {
+            continue;
+        }
+        std::string child = rel + "/" + name;
+        struct stat st;
+        if (lstat((root + child).c_str(), &st) == -1) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            walk(root, child, files);
+        }
+        else if (S_ISREG(st.st_mode) && (st.st_mode & S_IROTH)) {
+            // 与服务器一致，只收录其他用户可读的文件
+            files[child] = root + child;
+        }
+    }
+    closedir(dir);
+}
+
+static std::string make_headers(const Asset& a, const SourceFile& f, bool gzip) {
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "Content-Length: %llu\r\nContent-Type: %s\r\nETag: \"%016llx%s\"\r\n%s%s",
+             (unsigned long long) f.size, a.content_type.c_str(),
+             (unsigned long long) a.identity.etag, gzip ? "-gz" : "",
+             gzip ? "Content-Encoding: gzip\r\n" : "",
+             a.has_gzip ? "Vary: Accept-Encoding\r\n" : "");
+    return buf;
+}
+
+struct KeyRef {
+    const std::string* url;
+    uint32_t entry;
+};
+
+// hash-and-displace：按桶从大到小依次为每个桶找一个位移，使桶内所有键落到空槽
+static bool build_index(const std::vector<KeyRef>& keys, uint32_t slot_count,
+                        uint32_t bucket_count, std::vector<uint32_t>& slots,
+                        std::vector<uint32_t>& displacements) {
+    std::vector<std::vector<uint32_t> > buckets(bucket_count);
+    for (uint32_t i = 0; i < keys.size(); ++i) {
+        const std::string& k = *keys[i].url;
+        buckets[pack_hash(k.data(), k.size(), 0) % bucket_count].push_back(i);
+    }
+    std::vector<uint32_t> order(bucket_count);
+    for (uint32_t i = 0; i < bucket_count; ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+    slots.assign(slot_count, PACK_EMPTY_SLOT);
+    displacements.assign(bucket_count, 1);
+    std::vector<uint32_t> chosen;
+    for (uint32_t b = 0; b < bucket_count; ++b) {
+        const std::vector<uint32_t>& bucket = buckets[order[b]];
+        if (bucket.empty()) {
+            break;
+        }
+        bool placed = false;
+        for (uint32_t d = 1; d < (1u << 20) && !placed; ++d) {
+            chosen.clear();
+            placed = true;
+            for (size_t i = 0; i < bucket.size(); ++i) {
+                const std::string& k = *keys[bucket[i]].url;
+                uint32_t slot = (uint32_t) (pack_hash(k.data(), k.size(), d) % slot_count);
+                if (slots[slot] != PACK_EMPTY_SLOT ||
+                    std::find(chosen.begin(), chosen.end(), slot) != chosen.end()) {
+                    placed = false;
+                    break;
+                }
+                chosen.push_back(slot);
+            }
+            if (placed) {
+                for (size_t i = 0; i < bucket.size(); ++i) {
+                    slots[chosen[i]] = keys[bucket[i]].entry;
+                }
+                displacements[order[b]] = d;
+            }
+        }
+        if (!placed) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void* data, size_t len) {
+    const char* p = (const char*) data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool copy_file(int out, const SourceFile& f) {
+    int fd = open(f.disk_path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    char buf[65536];
+    uint64_t left = f.size;
+    while (left > 0) {
+        ssize_t n = read(fd, buf, std::min<uint64_t>(sizeof(buf), left));
+        if (n <= 0) {
+            close(fd);
+            return false;
+        }
+        if (!write_all(out, buf, n)) {
+            close(fd);
+            return false;
+        }
+        left -= n;
+    }
+    close(fd);
+    return true;
+}
+
+static uint64_t align_up(uint64_t v, uint64_t a) {
+    return (v + a - 1) / a * a;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        printf("Usage: %s DocumentRoot Output.pack\n", basename(argv[0]));
+        return -1;
+    }
+    std::string root = argv[1];
+    while (root.size() > 1 && root[root.size() - 1] == '/') {
+        root.erase(root.size() - 1);
+    }
+    std::map<std::string, std::string> files;
+    walk(root, "", files);
+
+    std::vector<Asset> assets;
+    for (std::map<std::string, std::string>::iterator it = files.begin(); it != files.end();
+         ++it) {
+        const std::string& url = it->first;
+        if (url.size() > 3 && url.compare(url.size() - 3, 3, ".gz") == 0 &&
+            files.count(url.substr(0, url.size() - 3))) {
+            // 作为未压缩文件的预压缩版本收录
+            continue;
+        }
+        Asset a;
+        a.urls.push_back(url);
+        const std::string index = "/index.html";
+        if (url.size() >= index.size() &&
+            url.compare(url.size() - index.size(), index.size(), index) == 0) {
+            a.urls.push_back(url.substr(0, url.size() - index.size() + 1));
+        }
+        a.content_type = content_type_of(url);
+        a.identity.disk_path = it->second;
+        a.has_gzip = files.count(url + ".gz") > 0;
+        if (a.has_gzip) {
+            a.gzip.disk_path = files[url + ".gz"];
+        }
+        if (!hash_file(a.identity) || (a.has_gzip && !hash_file(a.gzip))) {
+            fprintf(stderr, "read %s: %s\n", it->second.c_str(), strerror(errno));
+            return -1;
+        }
+        assets.push_back(a);
+    }
+
+    // 字符串区：路径和预生成的响应头
+    std::string strings;
+    std::vector<PackEntry> entries;
+    std::vector<KeyRef> keys;
+    for (size_t i = 0; i < assets.size(); ++i) {
+        const Asset& a = assets[i];
+        PackEntry proto;
+        memset(&proto, 0, sizeof(proto));
+        std::string h = make_headers(a, a.identity, false);
+        proto.identity.header_offset = (uint32_t) strings.size();
+        proto.identity.header_length = (uint32_t) h.size();
+        proto.identity.body_length = a.identity.size;
+        strings += h;
+        if (a.has_gzip) {
+            h = make_headers(a, a.gzip, true);
+            proto.gzip.header_offset = (uint32_t) strings.size();
+            proto.gzip.header_length = (uint32_t) h.size();
+            proto.gzip.body_length = a.gzip.size;
+            strings += h;
+        }
+        for (size_t u = 0; u < a.urls.size(); ++u) {
+            PackEntry e = proto;
+            e.path_offset = (uint32_t) strings.size();
+            e.path_length = (uint32_t) a.urls[u].size();
+            strings += a.urls[u];
+            entries.push_back(e);
+        }
+    }
+    for (size_t i = 0, e = 0; i < assets.size(); ++i) {
+        for (size_t u = 0; u < assets[i].urls.size(); ++u, ++e) {
+            KeyRef k = {&assets[i].urls[u], (uint32_t) e};
+            keys.push_back(k);
+        }
+    }
+
+    uint32_t n = (uint32_t) entries.size();
+    uint32_t slot_count = n + n / 8 + 1;
+    uint32_t bucket_count = n / 4 + 1;
+    std::vector<uint32_t> slots, displacements;
+    while (!build_index(keys, slot_count, bucket_count, slots, displacements)) {
+        slot_count += slot_count / 4 + 1;
+    }
+
+    PackHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, 8);
+    header.version = PACK_VERSION;
+    header.entry_count = n;
+    header.slot_count = slot_count;
+    header.bucket_count = bucket_count;
+    header.entries_offset = align_up(sizeof(PackHeader), 8);
+    header.slots_offset = header.entries_offset + (uint64_t) n * sizeof(PackEntry);
+    header.displacements_offset = header.slots_offset + (uint64_t) slot_count * 4;
+    header.strings_offset = header.displacements_offset + (uint64_t) bucket_count * 4;
+
+    // 文件内容按页对齐排布，别名条目共享同一份内容
+    uint64_t offset = align_up(header.strings_offset + strings.size(), PACK_PAGE_SIZE);
+    for (size_t i = 0, e = 0; i < assets.size(); ++i) {
+        uint64_t identity_offset = offset;
+        offset = align_up(offset + assets[i].identity.size, PACK_PAGE_SIZE);
+        uint64_t gzip_offset = offset;
+        if (assets[i].has_gzip) {
+            offset = align_up(offset + assets[i].gzip.size, PACK_PAGE_SIZE);
+        }
+        for (size_t u = 0; u < assets[i].urls.size(); ++u, ++e) {
+            entries[e].identity.body_offset = identity_offset;
+            entries[e].gzip.body_offset = assets[i].has_gzip ? gzip_offset : 0;
+        }
+    }
+    header.file_size = offset;
+
+    std::string output = argv[2];
+    std::string tmp = output + ".tmp";
+    int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1) {
+        fprintf(stderr, "open %s: %s\n", tmp.c_str(), strerror(errno));
+        return -1;
+    }
+    std::string meta((size_t) header.strings_offset, '\0');
+    memcpy(&meta[0], &header, sizeof(header));
+    if (n > 0) {
+        memcpy(&meta[header.entries_offset], &entries[0], n * sizeof(PackEntry));
+    }
+    memcpy(&meta[header.slots_offset], &slots[0], slot_count * 4);
+    memcpy(&meta[header.displacements_offset], &displacements[0], bucket_count * 4);
+    bool ok = write_all(out, meta.data(), meta.size()) &&
+              write_all(out, strings.data(), strings.size());
+    uint64_t written = meta.size() + strings.size();
+    for (size_t i = 0; i < assets.size() && ok; ++i) {
+        const SourceFile* parts[2] = {&assets[i].identity, assets[i].has_gzip ? &assets[i].gzip : nullptr};
+        for (int p = 0; p < 2 && ok && parts[p] != nullptr; ++p) {
+            std::string pad(align_up(written, PACK_PAGE_SIZE) - written, '\0');
+            ok = write_all(out, pad.data(), pad.size()) && copy_file(out, *parts[p]);
+            written += pad.size() + parts[p]->size;
+        }
+    }
+    if (ok && written < header.file_size) {
+        ok = ftruncate(out, header.file_size) == 0;
+    }
+    if (!ok || fsync(out) != 0) {
+        fprintf(stderr, "write %s: %s\n", tmp.c_str(), strerror(errno));
+        close(out);
+        unlink(tmp.c_str());
+        return -1;
+    }
+    close(out);
+    // 原子替换，服务器收到SIGHUP时总能看到完整的包
+    if (rename(tmp.c_str(), output.c_str()) == -1) {
+        fprintf(stderr, "rename %s: %s\n", output.c_str(), strerror(errno));
+        return -1;
+    }
+    printf("packed %zu files (%u paths) into %s, %llu bytes\n", assets.size(), n,
+           output.c_str(), (unsigned long long) header.file_size);
+    return 0;
+}
@@ -0,0 +1,1091 @@
+#include "proxy.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+
+#include "log.h"
+
+extern void modfd(int epoll_fd, int fd, uint64_t data, uint32_t ev);
+uint64_t monotonic_ms();
+
+enum BodyMode {
+    BODY_NONE = 0,
+    BODY_LENGTH,      // Content-Length
+    BODY_CHUNKED,     // 分块原样转发，只跟踪边界
+    BODY_UNTIL_CLOSE  // 直到上游关闭连接
+};
+
+enum ChunkState {
+    CHUNK_SIZE_LINE = 0,
+    CHUNK_DATA,       // 块数据及其后的\r\n
+    CHUNK_TRAILER,
+    CHUNK_DONE
+};
+
+// 一次转发。响应头和少量已读入用户态的字节经out发送，其余响应体由splice经管道搬运
+struct ProxyExchange {
+    ProxyJob job;
+    int upstream;
+    int conn;
+    int attempts;
+    std::string request;
+    size_t request_sent;
+    std::string raw_head; // 正在接收的上游响应头
+    std::string out;
+    size_t out_sent;
+    bool head_ready;
+    bool upstream_reusable;
+    BodyMode mode;
+    uint64_t left;
+    ChunkState chunk_state;
+    std::string chunk_line;
+    bool upstream_eof;
+    int pipe_fds[2];
+    size_t in_pipe;
+    // 领头的可缓存转发：响应同时读入用户态，完成后存入缓存并回复等待者
+    bool caching;
+    std::string cache_head; // 状态行和响应头，不含Connection和空行
+    std::string cache_body;
+    size_t cache_status_length;
+    uint64_t cache_ttl_ms;
+    uint64_t cache_swr_ms;
+    std::vector<ProxyJob> waiters;
+};
+
+static ProxyExchange* new_exchange(ProxyJob& job) {
+    ProxyExchange* ex = new ProxyExchange();
+    ex->job = std::move(job);
+    ex->upstream = -1;
+    ex->conn = -1;
+    ex->attempts = 0;
+    ex->request_sent = 0;
+    ex->out_sent = 0;
+    ex->head_ready = false;
+    ex->upstream_reusable = false;
+    ex->mode = BODY_NONE;
+    ex->left = 0;
+    ex->chunk_state = CHUNK_SIZE_LINE;
+    ex->upstream_eof = false;
+    ex->pipe_fds[0] = ex->pipe_fds[1] = -1;
+    ex->in_pipe = 0;
+    ex->caching = false;
+    ex->cache_status_length = 0;
+    ex->cache_ttl_ms = 0;
+    ex->cache_swr_ms = 0;
+    return ex;
+}
+
+static bool body_complete(const ProxyExchange* ex) {
+    switch (ex->mode) {
+        case BODY_NONE: return true;
+        case BODY_LENGTH: return ex->left == 0;
+        case BODY_CHUNKED: return ex->chunk_state == CHUNK_DONE;
+        default: return ex->upstream_eof;
+    }
+}
+
+// 跟踪分块编码的边界，返回消费的字节数，格式错误返回-1
+static ssize_t track_chunks(ProxyExchange* ex, const char* p, size_t n) {
+    size_t i = 0;
+    while (i < n && ex->chunk_state != CHUNK_DONE) {
+        if (ex->chunk_state == CHUNK_DATA) {
+            size_t k = std::min<uint64_t>(ex->left, n - i);
+            ex->left -= k;
+            i += k;
+            if (ex->left == 0) {
+                ex->chunk_state = CHUNK_SIZE_LINE;
+            }
+            continue;
+        }
+        char c = p[i++];
+        ex->chunk_line.push_back(c);
+        if (ex->chunk_line.size() > 4096) {
+            return -1;
+        }
+        if (c != '\n') {
+            continue;
+        }
+        if (ex->chunk_state == CHUNK_SIZE_LINE) {
+            char* end = nullptr;
+            uint64_t size = strtoull(ex->chunk_line.c_str(), &end, 16);
+            if (end == ex->chunk_line.c_str()) {
+                return -1;
+            }
+            if (size == 0) {
+                ex->chunk_state = CHUNK_TRAILER;
+            }
+            else {
+                ex->left = size + 2;
+                ex->chunk_state = CHUNK_DATA;
+            }
+        }
+        else if (ex->chunk_line == "\r\n" || ex->chunk_line == "\n") {
+            // 尾部字段以空行结束
+            ex->chunk_state = CHUNK_DONE;
+        }
+        ex->chunk_line.clear();
+    }
+    return (ssize_t) i;
+}
+
+// 已读入用户态的响应体字节排入out；超出响应边界的字节说明上游连接不可再用
+static bool queue_body_bytes(ProxyExchange* ex, const char* p, size_t n) {
+    size_t take = n;
+    switch (ex->mode) {
+        case BODY_NONE: {
+            take = 0;
+            break;
+        }
+        case BODY_LENGTH: {
+            take = std::min<uint64_t>(n, ex->left);
+            ex->left -= take;
+            break;
+        }
+        case BODY_CHUNKED: {
+            ssize_t used = track_chunks(ex, p, n);
+            if (used < 0) {
+                return false;
+            }
+            take = used;
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+    if (take < n) {
+        ex->upstream_reusable = false;
+    }
+    ex->out.append(p, take);
+    if (ex->caching) {
+        ex->cache_body.append(p, take);
+    }
+    return true;
+}
+
+static bool header_is(const char* line, size_t name_length, const char* name) {
+    return strlen(name) == name_length && strncasecmp(line, name, name_length) == 0;
+}
+
+ReverseProxy::ReverseProxy(int max_jobs)
+    : requests(0), reused(0), spliced_bytes(0), bad_gateway(0), collapsed(0), epoll_fd_(-1),
+      event_fd_(-1), max_jobs_(max_jobs), cache_(nullptr) {
+    if (max_jobs <= 0) {
+        throw std::exception();
+    }
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd_ == -1) {
+        throw std::exception();
+    }
+}
+
+ReverseProxy::~ReverseProxy() {
+    for (std::unordered_map<ConnHandle, ProxyExchange*>::iterator it = exchanges_.begin();
+         it != exchanges_.end(); ++it) {
+        ProxyExchange* ex = it->second;
+        if (ex->pipe_fds[0] != -1) {
+            close(ex->pipe_fds[0]);
+            close(ex->pipe_fds[1]);
+        }
+        delete ex;
+    }
+    // 后台刷新的转发不在exchanges_中
+    for (std::unordered_map<std::string, ProxyExchange*>::iterator it = inflight_.begin();
+         it != inflight_.end(); ++it) {
+        if (it->second->job.background) {
+            delete it->second;
+        }
+    }
+    for (size_t i = 0; i < conns_.size(); ++i) {
+        if (conns_[i].state != CONN_FREE) {
+            close(conns_[i].fd);
+        }
+    }
+    for (size_t i = 0; i < pipes_.size(); ++i) {
+        close(pipes_[i].first);
+        close(pipes_[i].second);
+    }
+    close(event_fd_);
+}
+
+bool ReverseProxy::add_route(const char* spec, std::string* error) {
+    const char* eq = strchr(spec, '=');
+    if (eq == nullptr || spec[0] != '/') {
+        *error = "expected prefix=host:port[,host:port...]";
+        return false;
+    }
+    ProxyRoute route;
+    route.prefix.assign(spec, eq - spec);
+    route.next = 0;
+    std::string list(eq + 1);
+    size_t pos = 0;
+    while (pos <= list.size()) {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos) {
+            comma = list.size();
+        }
+        std::string name = list.substr(pos, comma - pos);
+        pos = comma + 1;
+        size_t colon = name.rfind(':');
+        if (colon == std::string::npos) {
+            *error = "upstream without port: " + name;
+            return false;
+        }
+        int index = -1;
+        for (size_t i = 0; i < upstreams_.size(); ++i) {
+            if (upstreams_[i].name == name) {
+                index = (int) i;
+            }
+        }
+        if (index == -1) {
+            // 启动时解析一次地址
+            addrinfo hints{};
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo* result = nullptr;
+            std::string host = name.substr(0, colon);
+            std::string port = name.substr(colon + 1);
+            if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 || result == nullptr) {
+                *error = "cannot resolve upstream " + name;
+                return false;
+            }
+            Upstream upstream;
+            memcpy(&upstream.addr, result->ai_addr, sizeof(upstream.addr));
+            freeaddrinfo(result);
+            upstream.name = name;
+            upstream.healthy = true;
+            upstream.outstanding = 0;
+            upstream.probe = -1;
+            upstream.requests = 0;
+            upstream.failures = 0;
+            index = (int) upstreams_.size();
+            upstreams_.push_back(upstream);
+        }
+        route.upstreams.push_back(index);
+    }
+    routes_.push_back(route);
+    return true;
+}
+
+int ReverseProxy::match(const char* url) const {
+    int best = -1;
+    size_t best_length = 0;
+    for (size_t i = 0; i < routes_.size(); ++i) {
+        const std::string& prefix = routes_[i].prefix;
+        if (prefix.size() >= best_length && strncmp(url, prefix.c_str(), prefix.size()) == 0) {
+            best = (int) i;
+            best_length = prefix.size();
+        }
+    }
+    return best;
+}
+
+bool ReverseProxy::submit(ProxyJob& job) {
+    queue_locker_.lock();
+    if ((int) queue_.size() >= max_jobs_) {
+        queue_locker_.unlock();
+        return false;
+    }
+    queue_.push_back(std::move(job));
+    queue_locker_.unlock();
+    uint64_t one = 1;
+    ssize_t ret = write(event_fd_, &one, sizeof(one));
+    (void) ret;
+    return true;
+}
+
+void ReverseProxy::drain() {
+    uint64_t value;
+    ssize_t ret = read(event_fd_, &value, sizeof(value));
+    (void) ret;
+    std::deque<ProxyJob> jobs;
+    queue_locker_.lock();
+    jobs.swap(queue_);
+    queue_locker_.unlock();
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        start(new_exchange(jobs[i]));
+    }
+}
+
+uint64_t ReverseProxy::tag_of(int slot) const {
+    return ((uint64_t) PROXY_TAG_GENERATION << 32) |
+           ((uint64_t) conns_[slot].generation << 16) | (uint64_t) slot;
+}
+
+int ReverseProxy::open_conn(int upstream, ConnState state) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (const sockaddr*) &upstreams_[upstream].addr, sizeof(sockaddr_in)) == -1 &&
+        errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    int slot;
+    if (!free_conns_.empty()) {
+        slot = free_conns_.back();
+        free_conns_.pop_back();
+    }
+    else {
+        if (conns_.size() >= PROXY_MAX_UPSTREAM_CONNS) {
+            close(fd);
+            return -1;
+        }
+        slot = (int) conns_.size();
+        UpstreamConn conn{};
+        conns_.push_back(conn);
+    }
+    UpstreamConn& conn = conns_[slot];
+    conn.fd = fd;
+    conn.upstream = upstream;
+    conn.state = state;
+    // 槽位复用后，同一批事件里旧fd的事件因代数不符被丢弃
+    ++conn.generation;
+    conn.registered = false;
+    conn.exchange = nullptr;
+    return slot;
+}
+
+void ReverseProxy::close_conn(int slot) {
+    UpstreamConn& conn = conns_[slot];
+    if (conn.registered) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, conn.fd, nullptr);
+    }
+    close(conn.fd);
+    conn.fd = -1;
+    conn.state = CONN_FREE;
+    conn.exchange = nullptr;
+    free_conns_.push_back(slot);
+}
+
+void ReverseProxy::arm(int slot, uint32_t events) {
+    UpstreamConn& conn = conns_[slot];
+    epoll_event event{};
+    event.data.u64 = tag_of(slot);
+    event.events = events | EPOLLONESHOT | EPOLLRDHUP;
+    epoll_ctl(epoll_fd_, conn.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn.fd, &event);
+    conn.registered = true;
+}
+
+int ReverseProxy::pick_upstream(int route) const {
+    // 健康的上游中正在处理请求最少的，并列时从轮转起点开始取第一个
+    const ProxyRoute& r = routes_[route];
+    int best = -1;
+    size_t count = r.upstreams.size();
+    for (size_t i = 0; i < count; ++i) {
+        int u = r.upstreams[(r.next + i) % count];
+        if (!upstreams_[u].healthy) {
+            continue;
+        }
+        if (best == -1 || upstreams_[u].outstanding < upstreams_[best].outstanding) {
+            best = u;
+        }
+    }
+    return best;
+}
+
+void ReverseProxy::start(ProxyExchange* ex) {
+    if (!ex->job.cache_key.empty()) {
+        std::unordered_map<std::string, ProxyExchange*>::iterator it =
+            inflight_.find(ex->job.cache_key);
+        if (it != inflight_.end()) {
+            if (ex->job.background) {
+                // 已经有请求在取这个键，取回后同样会刷新缓存
+                ex->job.stale->revalidating = false;
+            }
+            else {
+                // 合并到进行中的转发，等它的响应存入缓存
+                ++collapsed;
+                waiting_[ex->job.client] = it->second;
+                it->second->waiters.push_back(std::move(ex->job));
+            }
+            delete ex;
+            return;
+        }
+        inflight_[ex->job.cache_key] = ex;
+        ex->caching = true;
+    }
+    ++requests;
+    ++routes_[ex->job.route].next;
+    if (!ex->job.background) {
+        // 响应头和响应体分两次写出，关闭Nagle避免第二次写等待客户端的延迟确认
+        int one = 1;
+        setsockopt(ex->job.client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        exchanges_[ex->job.client] = ex;
+    }
+    attach(ex);
+}
+
+void ReverseProxy::attach(ProxyExchange* ex) {
+    int u = pick_upstream(ex->job.route);
+    if (u == -1) {
+        bad_gateway_response(ex);
+        return;
+    }
+    Upstream& upstream = upstreams_[u];
+    ex->upstream = u;
+    ++upstream.outstanding;
+    ++upstream.requests;
+    ex->request = "GET " + ex->job.target + " HTTP/1.1\r\nHost: " +
+                  (ex->job.host.empty() ? upstream.name : ex->job.host) + "\r\n" +
+                  ex->job.headers + "X-Forwarded-For: " + ex->job.client_ip +
+                  "\r\nConnection: keep-alive\r\n\r\n";
+    ex->request_sent = 0;
+    ex->raw_head.clear();
+    if (!upstream.idle.empty()) {
+        int slot = upstream.idle.back();
+        upstream.idle.pop_back();
+        ++reused;
+        conns_[slot].state = CONN_SENDING;
+        conns_[slot].exchange = ex;
+        ex->conn = slot;
+        send_request(ex);
+        return;
+    }
+    int slot = open_conn(u, CONN_CONNECTING);
+    if (slot == -1) {
+        upstream.healthy = false;
+        ++upstream.failures;
+        upstream_failed(ex);
+        return;
+    }
+    conns_[slot].exchange = ex;
+    ex->conn = slot;
+    arm(slot, EPOLLOUT);
+}
+
+void ReverseProxy::detach(ProxyExchange* ex, bool reusable) {
+    if (ex->conn != -1) {
+        int slot = ex->conn;
+        ex->conn = -1;
+        Upstream& upstream = upstreams_[conns_[slot].upstream];
+        if (reusable && upstream.idle.size() < PROXY_MAX_IDLE) {
+            // 空闲连接只监听可读：上游关闭它时及时回收
+            conns_[slot].state = CONN_IDLE;
+            conns_[slot].exchange = nullptr;
+            upstream.idle.push_back(slot);
+            arm(slot, EPOLLIN);
+        }
+        else {
+            close_conn(slot);
+        }
+    }
+    if (ex->upstream != -1) {
+        --upstreams_[ex->upstream].outstanding;
+        ex->upstream = -1;
+    }
+}
+
+void ReverseProxy::handle_event(uint64_t tag, uint32_t events) {
+    int slot = (int) (tag & 0xffff);
+    if (slot >= (int) conns_.size() || conns_[slot].state == CONN_FREE ||
+        conns_[slot].generation != (uint16_t) (tag >> 16)) {
+        return;
+    }
+    if (conns_[slot].state == CONN_PROBE_CONNECTING || conns_[slot].state == CONN_PROBE_READING) {
+        on_probe_event(slot, events);
+    }
+    else {
+        on_conn_event(slot, events);
+    }
+}
+
+void ReverseProxy::on_conn_event(int slot, uint32_t events) {
+    UpstreamConn& conn = conns_[slot];
+    ProxyExchange* ex = conn.exchange;
+    switch (conn.state) {
+        case CONN_IDLE: {
+            // 空闲连接可读：上游关闭了连接或发来了多余的数据
+            std::vector<int>& idle = upstreams_[conn.upstream].idle;
+            for (size_t i = 0; i < idle.size(); ++i) {
+                if (idle[i] == slot) {
+                    idle.erase(idle.begin() + i);
+                    break;
+                }
+            }
+            close_conn(slot);
+            break;
+        }
+        case CONN_CONNECTING: {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+                Upstream& upstream = upstreams_[conn.upstream];
+                if (upstream.healthy) {
+                    printf("upstream %s down: %s\n", upstream.name.c_str(), strerror(error));
+                }
+                upstream.healthy = false;
+                ++upstream.failures;
+                upstream_failed(ex);
+                break;
+            }
+            conn.state = CONN_SENDING;
+            send_request(ex);
+            break;
+        }
+        case CONN_SENDING: {
+            send_request(ex);
+            break;
+        }
+        case CONN_HEAD: {
+            read_head(ex);
+            break;
+        }
+        case CONN_BODY: {
+            pump(ex);
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
+
+void ReverseProxy::send_request(ProxyExchange* ex) {
+    int fd = conns_[ex->conn].fd;
+    while (ex->request_sent < ex->request.size()) {
+        ssize_t n = send(fd, ex->request.data() + ex->request_sent,
+                         ex->request.size() - ex->request_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                arm(ex->conn, EPOLLOUT);
+                return;
+            }
+            // 复用的空闲连接可能刚被上游关闭
+            upstream_failed(ex);
+            return;
+        }
+        ex->request_sent += n;
+    }
+    conns_[ex->conn].state = CONN_HEAD;
+    arm(ex->conn, EPOLLIN);
+}
+
+void ReverseProxy::read_head(ProxyExchange* ex) {
+    int fd = conns_[ex->conn].fd;
+    while (true) {
+        size_t end = ex->raw_head.find("\r\n\r\n");
+        if (end != std::string::npos) {
+            std::string rest = ex->raw_head.substr(end + 4);
+            ex->raw_head.resize(end + 4);
+            if (ex->raw_head.compare(0, 9, "HTTP/1.1 ") != 0 &&
+                ex->raw_head.compare(0, 9, "HTTP/1.0 ") != 0) {
+                detach(ex, false);
+                bad_gateway_response(ex);
+                return;
+            }
+            int status = atoi(ex->raw_head.c_str() + 9);
+            if (status >= 100 && status < 200 && status != 101) {
+                // 跳过临时响应
+                ex->raw_head = rest;
+                continue;
+            }
+            if (!parse_head(ex, ex->raw_head.data(), ex->raw_head.size()) ||
+                !queue_body_bytes(ex, rest.data(), rest.size())) {
+                detach(ex, false);
+                bad_gateway_response(ex);
+                return;
+            }
+            ex->raw_head.clear();
+            conns_[ex->conn].state = CONN_BODY;
+            pump(ex);
+            return;
+        }
+        if (ex->raw_head.size() > PROXY_MAX_HEAD) {
+            detach(ex, false);
+            bad_gateway_response(ex);
+            return;
+        }
+        char buf[4096];
+        ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n < 0 && errno == EAGAIN) {
+            arm(ex->conn, EPOLLIN);
+            return;
+        }
+        if (n <= 0) {
+            upstream_failed(ex);
+            return;
+        }
+        ex->raw_head.append(buf, n);
+    }
+}
+
+bool ReverseProxy::parse_head(ProxyExchange* ex, const char* head, size_t length) {
+    int status = atoi(head + 9);
+    if (status < 200 || status > 999) {
+        return false;
+    }
+    bool keep_alive = head[7] == '1';
+    bool chunked = false;
+    bool has_length = false;
+    uint64_t content_length = 0;
+    bool set_cookie = false;
+    std::string cache_control;
+    std::string vary;
+    const char* line = head;
+    const char* end = head + length;
+    const char* eol = (const char*) memmem(line, end - line, "\r\n", 2);
+    // 状态行原样转发
+    ex->out.assign(head, eol + 2 - head);
+    line = eol + 2;
+    while (line < end) {
+        eol = (const char*) memmem(line, end - line, "\r\n", 2);
+        if (eol == line) {
+            break;
+        }
+        const char* colon = (const char*) memchr(line, ':', eol - line);
+        if (colon == nullptr) {
+            return false;
+        }
+        size_t name_length = colon - line;
+        std::string value(colon + 1, eol);
+        if (header_is(line, name_length, "Connection")) {
+            if (strcasestr(value.c_str(), "close") != nullptr) {
+                keep_alive = false;
+            }
+            else if (strcasestr(value.c_str(), "keep-alive") != nullptr) {
+                keep_alive = true;
+            }
+        }
+        else if (header_is(line, name_length, "Keep-Alive") ||
+                 header_is(line, name_length, "Proxy-Connection") ||
+                 header_is(line, name_length, "Upgrade")) {
+            // 逐跳头部不转发
+        }
+        else {
+            if (header_is(line, name_length, "Transfer-Encoding")) {
+                chunked = strcasestr(value.c_str(), "chunked") != nullptr;
+            }
+            else if (header_is(line, name_length, "Content-Length")) {
+                has_length = true;
+                content_length = strtoull(value.c_str(), nullptr, 10);
+            }
+            else if (header_is(line, name_length, "Cache-Control")) {
+                cache_control += value;
+            }
+            else if (header_is(line, name_length, "Set-Cookie")) {
+                set_cookie = true;
+            }
+            else if (header_is(line, name_length, "Vary")) {
+                vary += vary.empty() ? value : "," + value;
+            }
+            ex->out.append(line, eol + 2 - line);
+        }
+        line = eol + 2;
+    }
+    ex->upstream_reusable = keep_alive;
+    if (status == 204 || status == 304) {
+        ex->mode = BODY_NONE;
+    }
+    else if (chunked) {
+        ex->mode = BODY_CHUNKED;
+        ex->chunk_state = CHUNK_SIZE_LINE;
+    }
+    else if (has_length) {
+        ex->mode = BODY_LENGTH;
+        ex->left = content_length;
+    }
+    else {
+        // 以关闭连接为结束，客户端连接也只能随之关闭
+        ex->mode = BODY_UNTIL_CLOSE;
+        ex->upstream_reusable = false;
+        ex->job.keep_alive = false;
+    }
+    if (ex->caching) {
+        uint64_t ttl_ms = 0;
+        uint64_t swr_ms = 0;
+        if ((ex->mode == BODY_LENGTH && content_length > CACHE_MAX_ENTRY) ||
+            !cache_->cacheable(status, cache_control, set_cookie, vary, &ttl_ms, &swr_ms)) {
+            stop_caching(ex, false);
+        }
+        else {
+            ex->cache_head = ex->out;
+            ex->cache_status_length = (const char*) memmem(head, length, "\r\n", 2) + 2 - head;
+            ex->cache_ttl_ms = ttl_ms;
+            ex->cache_swr_ms = swr_ms;
+        }
+    }
+    ex->out += ex->job.keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    ex->head_ready = true;
+    return true;
+}
+
+void ReverseProxy::upstream_failed(ProxyExchange* ex) {
+    detach(ex, false);
+    if (ex->head_ready) {
+        // 响应头已经确定，客户端只能看到被截断的响应
+        finish(ex, false);
+        return;
+    }
+    // 还没有向客户端发送任何内容，换一个连接(或上游)重试
+    if (++ex->attempts <= 2) {
+        attach(ex);
+        return;
+    }
+    bad_gateway_response(ex);
+}
+
+void ReverseProxy::bad_gateway_response(ProxyExchange* ex) {
+    ++bad_gateway;
+    stop_caching(ex, true);
+    ex->out = "HTTP/1.1 502 Bad Gateway\r\nContent-Type: text/plain\r\nContent-Length: 12\r\n";
+    ex->out += ex->job.keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    ex->out += "Bad Gateway\n";
+    ex->out_sent = 0;
+    ex->head_ready = true;
+    ex->mode = BODY_NONE;
+    pump(ex);
+}
+
+ssize_t ReverseProxy::next_read(ProxyExchange* ex) {
+    switch (ex->mode) {
+        case BODY_LENGTH: return (ssize_t) std::min<uint64_t>(ex->left, PROXY_PIPE_SIZE);
+        case BODY_CHUNKED: return (ssize_t) std::min<uint64_t>(ex->left, PROXY_PIPE_SIZE);
+        default: return PROXY_PIPE_SIZE;
+    }
+}
+
+void ReverseProxy::pump(ProxyExchange* ex) {
+    bool progress = false;
+    int client_fd = ex->job.client_fd;
+    while (true) {
+        if (ex->job.background && !ex->out.empty()) {
+            // 后台刷新没有客户端，响应只需要缓存里的那份
+            ex->out.clear();
+            ex->out_sent = 0;
+        }
+        if (ex->out_sent < ex->out.size()) {
+            ssize_t n = send(client_fd, ex->out.data() + ex->out_sent,
+                             ex->out.size() - ex->out_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0) {
+                if (errno == EAGAIN) {
+                    modfd(epoll_fd_, client_fd, ex->job.client, EPOLLOUT);
+                    break;
+                }
+                finish(ex, false);
+                return;
+            }
+            ex->out_sent += n;
+            progress = true;
+            if (ex->out_sent == ex->out.size()) {
+                ex->out.clear();
+                ex->out_sent = 0;
+            }
+            continue;
+        }
+        if (ex->in_pipe > 0) {
+            ssize_t n = splice(ex->pipe_fds[0], nullptr, client_fd, nullptr, ex->in_pipe,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EAGAIN) {
+                    modfd(epoll_fd_, client_fd, ex->job.client, EPOLLOUT);
+                    break;
+                }
+                finish(ex, false);
+                return;
+            }
+            ex->in_pipe -= n;
+            spliced_bytes += n;
+            progress = true;
+            continue;
+        }
+        if (body_complete(ex) || ex->conn == -1) {
+            finish(ex, body_complete(ex));
+            return;
+        }
+        if (ex->job.background && !ex->caching) {
+            // 不可缓存的后台刷新没有必要继续
+            finish(ex, false);
+            return;
+        }
+        int upstream_fd = conns_[ex->conn].fd;
+        if (ex->caching || (ex->mode == BODY_CHUNKED && ex->chunk_state != CHUNK_DATA)) {
+            // 块大小行和尾部字段很短，读入用户态解析后随out发送；
+            // 要缓存的响应体也读入用户态，不经过管道
+            static char buf[65536];
+            ssize_t n = recv(upstream_fd, buf, ex->caching ? sizeof(buf) : 256, MSG_DONTWAIT);
+            if (n < 0 && errno == EAGAIN) {
+                arm(ex->conn, EPOLLIN);
+                break;
+            }
+            if (n == 0 && ex->mode == BODY_UNTIL_CLOSE) {
+                ex->upstream_eof = true;
+                continue;
+            }
+            if (n <= 0 || !queue_body_bytes(ex, buf, n)) {
+                finish(ex, false);
+                return;
+            }
+            if (ex->caching && ex->cache_head.size() + ex->cache_body.size() > CACHE_MAX_ENTRY) {
+                stop_caching(ex, false);
+            }
+            continue;
+        }
+        if (ex->pipe_fds[0] == -1 && !get_pipe(ex->pipe_fds)) {
+            finish(ex, false);
+            return;
+        }
+        ssize_t n = splice(upstream_fd, nullptr, ex->pipe_fds[1], nullptr, next_read(ex),
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                arm(ex->conn, EPOLLIN);
+                break;
+            }
+            finish(ex, false);
+            return;
+        }
+        if (n == 0) {
+            if (ex->mode == BODY_UNTIL_CLOSE) {
+                ex->upstream_eof = true;
+                continue;
+            }
+            finish(ex, false);
+            return;
+        }
+        ex->in_pipe += n;
+        if (ex->mode == BODY_LENGTH || ex->mode == BODY_CHUNKED) {
+            ex->left -= n;
+            if (ex->mode == BODY_CHUNKED && ex->left == 0) {
+                ex->chunk_state = CHUNK_SIZE_LINE;
+            }
+        }
+    }
+    if (progress) {
+        progressed_.push_back(ex->job.client);
+    }
+}
+
+void ReverseProxy::finish(ProxyExchange* ex, bool ok) {
+    detach(ex, ok && ex->upstream_reusable && body_complete(ex));
+    if (ex->pipe_fds[0] != -1) {
+        put_pipe(ex->pipe_fds, ex->in_pipe == 0);
+    }
+    if (ex->caching) {
+        if (ok && body_complete(ex)) {
+            store(ex);
+        }
+        else {
+            stop_caching(ex, true);
+        }
+    }
+    if (ex->job.stale) {
+        ex->job.stale->revalidating = false;
+    }
+    if (!ex->job.background) {
+        exchanges_.erase(ex->job.client);
+        ProxyResult result;
+        result.client = ex->job.client;
+        result.keep_alive = ok && ex->job.keep_alive;
+        finished_.push_back(result);
+    }
+    delete ex;
+}
+
+void ReverseProxy::stop_caching(ProxyExchange* ex, bool keep_key) {
+    if (!ex->caching) {
+        return;
+    }
+    ex->caching = false;
+    inflight_.erase(ex->job.cache_key);
+    std::string().swap(ex->cache_head);
+    std::string().swap(ex->cache_body);
+    std::vector<ProxyJob> waiters;
+    waiters.swap(ex->waiters);
+    for (size_t i = 0; i < waiters.size(); ++i) {
+        waiting_.erase(waiters[i].client);
+        if (!keep_key) {
+            waiters[i].cache_key.clear();
+        }
+        start(new_exchange(waiters[i]));
+    }
+}
+
+void ReverseProxy::store(ProxyExchange* ex) {
+    std::shared_ptr<CachedResponse> entry = std::make_shared<CachedResponse>();
+    entry->data.reserve(ex->cache_head.size() + ex->cache_body.size() + 32);
+    entry->data = ex->cache_head;
+    if (ex->mode == BODY_UNTIL_CLOSE) {
+        // 缓存的响应要在长连接上发送，补上长度
+        entry->data += "Content-Length: " + std::to_string(ex->cache_body.size()) + "\r\n";
+    }
+    entry->data += "\r\n";
+    entry->data += ex->cache_body;
+    entry->status_length = ex->cache_status_length;
+    entry->stored_ms = monotonic_ms();
+    entry->fresh_until_ms = entry->stored_ms + ex->cache_ttl_ms;
+    entry->stale_until_ms = entry->fresh_until_ms + ex->cache_swr_ms;
+    entry->revalidating = false;
+    cache_->insert(ex->job.cache_key, entry);
+    inflight_.erase(ex->job.cache_key);
+    ex->caching = false;
+    for (size_t i = 0; i < ex->waiters.size(); ++i) {
+        waiting_.erase(ex->waiters[i].client);
+        ProxyResult result;
+        result.client = ex->waiters[i].client;
+        result.keep_alive = true;
+        result.cached = entry;
+        finished_.push_back(result);
+    }
+    ex->waiters.clear();
+}
+
+void ReverseProxy::client_writable(ConnHandle client) {
+    std::unordered_map<ConnHandle, ProxyExchange*>::iterator it = exchanges_.find(client);
+    if (it != exchanges_.end()) {
+        pump(it->second);
+    }
+}
+
+void ReverseProxy::abort(ConnHandle client) {
+    // 还没开始的任务直接丢弃，否则drain会在已关闭(fd可能已被复用)的连接上开始转发
+    queue_locker_.lock();
+    for (std::deque<ProxyJob>::iterator job = queue_.begin(); job != queue_.end(); ++job) {
+        if (job->client == client) {
+            queue_.erase(job);
+            queue_locker_.unlock();
+            return;
+        }
+    }
+    queue_locker_.unlock();
+    std::unordered_map<ConnHandle, ProxyExchange*>::iterator waiting = waiting_.find(client);
+    if (waiting != waiting_.end()) {
+        std::vector<ProxyJob>& waiters = waiting->second->waiters;
+        for (size_t i = 0; i < waiters.size(); ++i) {
+            if (waiters[i].client == client) {
+                waiters.erase(waiters.begin() + i);
+                break;
+            }
+        }
+        waiting_.erase(waiting);
+        return;
+    }
+    std::unordered_map<ConnHandle, ProxyExchange*>::iterator it = exchanges_.find(client);
+    if (it == exchanges_.end()) {
+        return;
+    }
+    ProxyExchange* ex = it->second;
+    exchanges_.erase(it);
+    stop_caching(ex, true);
+    detach(ex, false);
+    if (ex->pipe_fds[0] != -1) {
+        put_pipe(ex->pipe_fds, ex->in_pipe == 0);
+    }
+    delete ex;
+}
+
+void ReverseProxy::take_results(std::vector<ProxyResult>& finished,
+                                std::vector<ConnHandle>& progressed) {
+    finished.swap(finished_);
+    finished_.clear();
+    progressed.swap(progressed_);
+    progressed_.clear();
+}
+
+void ReverseProxy::health_check() {
+    for (size_t u = 0; u < upstreams_.size(); ++u) {
+        Upstream& upstream = upstreams_[u];
+        if (upstream.probe != -1) {
+            // 上一周期的探测还没有结果，视为失败
+            close_conn(upstream.probe);
+            upstream.probe = -1;
+            if (upstream.healthy) {
+                printf("upstream %s down: health check timed out\n", upstream.name.c_str());
+            }
+            upstream.healthy = false;
+        }
+        int slot = open_conn((int) u, CONN_PROBE_CONNECTING);
+        if (slot == -1) {
+            upstream.healthy = false;
+            continue;
+        }
+        upstream.probe = slot;
+        arm(slot, EPOLLOUT);
+    }
+}
+
+void ReverseProxy::on_probe_event(int slot, uint32_t events) {
+    UpstreamConn& conn = conns_[slot];
+    Upstream& upstream = upstreams_[conn.upstream];
+    bool healthy = false;
+    if (conn.state == CONN_PROBE_CONNECTING) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error == 0 && !(events & (EPOLLERR | EPOLLHUP))) {
+            if (health_path_.empty()) {
+                healthy = true;
+            }
+            else {
+                std::string request = "GET " + health_path_ + " HTTP/1.1\r\nHost: " +
+                                      upstream.name + "\r\nConnection: close\r\n\r\n";
+                if (send(conn.fd, request.data(), request.size(), MSG_NOSIGNAL | MSG_DONTWAIT) ==
+                    (ssize_t) request.size()) {
+                    conn.state = CONN_PROBE_READING;
+                    arm(slot, EPOLLIN);
+                    return;
+                }
+            }
+        }
+    }
+    else {
+        char buf[16];
+        ssize_t n = recv(conn.fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n < 0 && errno == EAGAIN) {
+            arm(slot, EPOLLIN);
+            return;
+        }
+        // 2xx和3xx视为健康
+        healthy = n >= 10 && memcmp(buf, "HTTP/1.", 7) == 0 && (buf[9] == '2' || buf[9] == '3');
+    }
+    if (healthy != upstream.healthy) {
+        printf("upstream %s %s\n", upstream.name.c_str(), healthy ? "up" : "down: health check failed");
+    }
+    upstream.healthy = healthy;
+    upstream.probe = -1;
+    close_conn(slot);
+}
+
+bool ReverseProxy::get_pipe(int pipe_fds[2]) {
+    if (!pipes_.empty()) {
+        pipe_fds[0] = pipes_.back().first;
+        pipe_fds[1] = pipes_.back().second;
+        pipes_.pop_back();
+        return true;
+    }
+    if (pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        pipe_fds[0] = pipe_fds[1] = -1;
+        return false;
+    }
+    // 扩大管道，一次splice搬运更多数据；受pipe-max-size限制时保持默认大小
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+    return true;
+}
+
+void ReverseProxy::put_pipe(int pipe_fds[2], bool clean) {
+    if (clean) {
+        pipes_.push_back(std::make_pair(pipe_fds[0], pipe_fds[1]));
+    }
+    else {
+        // 管道里还有残留数据，不能给下一次转发使用
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    pipe_fds[0] = pipe_fds[1] = -1;
+}
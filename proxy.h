@@ -0,0 +1,185 @@
+#ifndef HTTP_SERVER_PROXY_H
+#define HTTP_SERVER_PROXY_H
+
+#include <netinet/in.h>
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "connection_slab.h"
+#include "locker.h"
+#include "response_cache.h"
+
+// 上游连接在epoll中的标记：代数固定为2(偶数且非0，不会与连接句柄和裸fd混淆)，
+// 低32位为槽位代数(高16位)和槽位下标(低16位)
+#define PROXY_TAG_GENERATION 2
+#define PROXY_MAX_UPSTREAM_CONNS 65536
+// 上游响应头的上限
+#define PROXY_MAX_HEAD 16384
+// 响应体经由管道搬运，管道容量决定一次splice的最大长度
+#define PROXY_PIPE_SIZE (1 << 20)
+// 每个上游保留的空闲长连接数
+#define PROXY_MAX_IDLE 64
+
+inline bool is_proxy_tag(uint64_t tag) {
+    return handle_generation(tag) == PROXY_TAG_GENERATION;
+}
+
+// 工作线程解析完请求后交给主线程转发
+struct ProxyJob {
+    ConnHandle client;
+    int client_fd;
+    int route;
+    std::string target;  // 原始请求目标(含查询串)
+    std::string host;
+    std::string headers; // 已去掉逐跳头部的请求头，每行以\r\n结尾
+    std::string client_ip;
+    bool keep_alive;
+    std::string cache_key; // 为空表示不经过缓存
+    // 后台刷新过期缓存，没有客户端；失败时清除stale的刷新标志
+    bool background;
+    CachedResponsePtr stale;
+};
+
+// 结束的转发：cached非空时由主线程用缓存的响应回复(合并到同一次上游请求的客户端)
+struct ProxyResult {
+    ConnHandle client;
+    bool keep_alive;
+    CachedResponsePtr cached;
+};
+
+struct Upstream {
+    sockaddr_in addr;
+    std::string name;
+    bool healthy;
+    int outstanding;      // 正在进行的请求数，最少者优先
+    int probe;            // 进行中的健康检查连接槽位，-1表示没有
+    std::vector<int> idle;// 空闲长连接槽位
+    uint64_t requests;
+    uint64_t failures;
+};
+
+struct ProxyRoute {
+    std::string prefix;
+    std::vector<int> upstreams;
+    uint32_t next;        // 并列时轮转的起点
+};
+
+struct ProxyExchange;
+
+// 反向代理：上游连接池、请求转发和响应体的splice搬运都在主线程的事件循环中完成，
+// 上游fd用EPOLLONESHOT注册，需要时显式重新注册
+class ReverseProxy {
+public:
+    explicit ReverseProxy(int max_jobs);
+    ~ReverseProxy();
+
+    // prefix=host:port[,host:port...]
+    bool add_route(const char* spec, std::string* error);
+    // 健康检查请求的路径，为空时只检查TCP连接
+    void set_health_path(const char* path) { health_path_ = path; }
+    void set_epoll(int epoll_fd) { epoll_fd_ = epoll_fd; }
+    // 可缓存的响应同时读入用户态，同一缓存键的并发未命中合并为一次上游请求
+    void set_cache(ResponseCache* cache) { cache_ = cache; }
+
+    // 工作线程：按最长前缀匹配路由，没有匹配返回-1
+    int match(const char* url) const;
+    // 工作线程：队列满时返回false
+    bool submit(ProxyJob& job);
+    int event_fd() const { return event_fd_; }
+
+    // 主线程：开始排队的转发
+    void drain();
+    void handle_event(uint64_t tag, uint32_t events);
+    // 客户端可写，继续发送响应
+    void client_writable(ConnHandle client);
+    // 客户端连接关闭，放弃排队中或进行中的转发
+    void abort(ConnHandle client);
+    // 每个定时周期探测一次所有上游
+    void health_check();
+    // 取出结束的转发和有进展的客户端
+    void take_results(std::vector<ProxyResult>& finished, std::vector<ConnHandle>& progressed);
+
+    uint64_t requests;
+    uint64_t reused;
+    uint64_t spliced_bytes;
+    uint64_t bad_gateway;
+    uint64_t collapsed;
+
+private:
+    enum ConnState {
+        CONN_FREE = 0,
+        CONN_IDLE,
+        CONN_CONNECTING,
+        CONN_SENDING,
+        CONN_HEAD,
+        CONN_BODY,
+        CONN_PROBE_CONNECTING,
+        CONN_PROBE_READING
+    };
+    struct UpstreamConn {
+        int fd;
+        int upstream;
+        ConnState state;
+        uint16_t generation;
+        bool registered;
+        ProxyExchange* exchange;
+    };
+
+    uint64_t tag_of(int slot) const;
+    int open_conn(int upstream, ConnState state);
+    void close_conn(int slot);
+    void arm(int slot, uint32_t events);
+    int pick_upstream(int route) const;
+
+    void start(ProxyExchange* ex);
+    // 为转发选择上游并取得连接，失败时改为回复502
+    void attach(ProxyExchange* ex);
+    void detach(ProxyExchange* ex, bool reusable);
+    void on_conn_event(int slot, uint32_t events);
+    void on_probe_event(int slot, uint32_t events);
+    void send_request(ProxyExchange* ex);
+    void read_head(ProxyExchange* ex);
+    bool parse_head(ProxyExchange* ex, const char* head, size_t length);
+    // 上游出错：还没有向客户端发送任何字节时可以重试或回复502
+    void upstream_failed(ProxyExchange* ex);
+    void bad_gateway_response(ProxyExchange* ex);
+    // 按顺序推进：响应头、管道中的数据、从上游读入更多
+    void pump(ProxyExchange* ex);
+    // 下一次可以从上游读入的字节数，0表示需要等待数据，-1表示出错
+    ssize_t next_read(ProxyExchange* ex);
+    void finish(ProxyExchange* ex, bool ok);
+    // 上游响应不可缓存(或超过上限)时停止缓存，等待者各自转发；
+    // 领头的转发失败时等待者保留缓存键，第一个重新成为领头者
+    void stop_caching(ProxyExchange* ex, bool keep_key);
+    void store(ProxyExchange* ex);
+
+    bool get_pipe(int pipe_fds[2]);
+    void put_pipe(int pipe_fds[2], bool clean);
+
+    int epoll_fd_;
+    int event_fd_;
+    int max_jobs_;
+    std::string health_path_;
+    std::vector<Upstream> upstreams_;
+    std::vector<ProxyRoute> routes_;
+    std::vector<UpstreamConn> conns_;
+    std::vector<int> free_conns_;
+    std::vector<std::pair<int, int> > pipes_;
+    std::unordered_map<ConnHandle, ProxyExchange*> exchanges_;
+    std::vector<ProxyResult> finished_;
+    ResponseCache* cache_;
+    // 正在从上游取的缓存键，以及等待在某个转发上的客户端
+    std::unordered_map<std::string, ProxyExchange*> inflight_;
+    std::unordered_map<ConnHandle, ProxyExchange*> waiting_;
+    std::vector<ConnHandle> progressed_;
+
+    std::deque<ProxyJob> queue_;
+    Locker queue_locker_;
+};
+
+#endif
@@ -0,0 +1,252 @@
+#include "response_cache.h"
+
+#include <strings.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+
+// 在以\r\n分隔的头部行中查找字段值(去掉前导空白)
+static bool find_header(const std::string& headers, const std::string& name, std::string* value) {
+    size_t pos = 0;
+    while (pos < headers.size()) {
+        size_t eol = headers.find("\r\n", pos);
+        if (eol == std::string::npos) {
+            eol = headers.size();
+        }
+        size_t colon = headers.find(':', pos);
+        if (colon != std::string::npos && colon < eol && colon - pos == name.size() &&
+            strncasecmp(headers.c_str() + pos, name.c_str(), name.size()) == 0) {
+            size_t start = headers.find_first_not_of(" \t", colon + 1);
+            if (start == std::string::npos || start > eol) {
+                start = eol;
+            }
+            value->assign(headers, start, eol - start);
+            return true;
+        }
+        pos = eol + 2;
+    }
+    return false;
+}
+
+// Cache-Control中的name=秒数，返回毫秒
+static bool directive_ms(const std::string& cache_control, const char* name, uint64_t* ms) {
+    const char* p = strcasestr(cache_control.c_str(), name);
+    if (p == nullptr) {
+        return false;
+    }
+    p += strlen(name);
+    if (*p != '=') {
+        return false;
+    }
+    *ms = strtoull(p + 1, nullptr, 10) * 1000;
+    return true;
+}
+
+ResponseCache::ResponseCache(const CachePolicy& policy)
+    : hits(0), stale_hits(0), misses(0), stores(0), evictions(0), policy_(policy),
+      shard_capacity_(policy.capacity / CACHE_SHARDS) {
+    for (int i = 0; i < CACHE_SHARDS; ++i) {
+        shards_[i].small_bytes = 0;
+        shards_[i].bytes = 0;
+    }
+}
+
+ResponseCache::~ResponseCache() {
+    for (int i = 0; i < CACHE_SHARDS; ++i) {
+        for (std::unordered_map<std::string, Node*>::iterator it = shards_[i].map.begin();
+             it != shards_[i].map.end(); ++it) {
+            delete it->second;
+        }
+    }
+}
+
+bool ResponseCache::request_key(const std::string& host, const std::string& target,
+                                const std::string& headers, std::string* key) const {
+    std::string value;
+    if (find_header(headers, "Authorization", &value)) {
+        return false;
+    }
+    bool vary_cookie = false;
+    for (size_t i = 0; i < policy_.vary.size(); ++i) {
+        if (strcasecmp(policy_.vary[i].c_str(), "Cookie") == 0) {
+            vary_cookie = true;
+        }
+    }
+    if (!vary_cookie && find_header(headers, "Cookie", &value)) {
+        return false;
+    }
+    // 代理只转发GET，方法固定
+    *key = "GET ";
+    *key += host;
+    *key += target;
+    for (size_t i = 0; i < policy_.vary.size(); ++i) {
+        key->push_back('\n');
+        if (find_header(headers, policy_.vary[i], &value)) {
+            *key += value;
+        }
+    }
+    return true;
+}
+
+bool ResponseCache::cacheable(int status, const std::string& cache_control, bool set_cookie,
+                              const std::string& vary, uint64_t* ttl_ms, uint64_t* swr_ms) const {
+    if (status != 200 && status != 203 && status != 301 && status != 404 && status != 410) {
+        return false;
+    }
+    if (set_cookie || strcasestr(cache_control.c_str(), "no-store") != nullptr ||
+        strcasestr(cache_control.c_str(), "no-cache") != nullptr ||
+        strcasestr(cache_control.c_str(), "private") != nullptr) {
+        return false;
+    }
+    // 上游按某个请求头区分响应，而这个头不在缓存键里时不能缓存
+    size_t pos = 0;
+    while (pos < vary.size()) {
+        size_t comma = vary.find(',', pos);
+        if (comma == std::string::npos) {
+            comma = vary.size();
+        }
+        size_t start = vary.find_first_not_of(" \t", pos);
+        size_t end = vary.find_last_not_of(" \t", comma - 1);
+        if (start != std::string::npos && start < comma) {
+            std::string name = vary.substr(start, end - start + 1);
+            bool known = false;
+            for (size_t i = 0; i < policy_.vary.size(); ++i) {
+                if (strcasecmp(policy_.vary[i].c_str(), name.c_str()) == 0) {
+                    known = true;
+                }
+            }
+            if (!known) {
+                return false;
+            }
+        }
+        pos = comma + 1;
+    }
+    if (!directive_ms(cache_control, "s-maxage", ttl_ms) &&
+        !directive_ms(cache_control, "max-age", ttl_ms)) {
+        *ttl_ms = policy_.ttl_ms;
+    }
+    if (!directive_ms(cache_control, "stale-while-revalidate", swr_ms)) {
+        *swr_ms = policy_.swr_ms;
+    }
+    return *ttl_ms + *swr_ms > 0;
+}
+
+bool ResponseCache::get(const std::string& key, uint64_t now_ms, CachedResponsePtr* entry,
+                        bool* stale) {
+    Shard& shard = shard_of(std::hash<std::string>()(key));
+    shard.lock.rdlock();
+    std::unordered_map<std::string, Node*>::iterator it = shard.map.find(key);
+    if (it == shard.map.end() || now_ms >= it->second->value->stale_until_ms) {
+        shard.lock.unlock();
+        ++misses;
+        return false;
+    }
+    Node* node = it->second;
+    uint8_t freq = node->freq.load(std::memory_order_relaxed);
+    if (freq < CACHE_MAX_FREQ) {
+        // 并发的命中可能丢失一次计数，对淘汰决策没有影响
+        node->freq.store(freq + 1, std::memory_order_relaxed);
+    }
+    *entry = node->value;
+    shard.lock.unlock();
+    *stale = now_ms >= (*entry)->fresh_until_ms;
+    if (*stale) {
+        ++stale_hits;
+    }
+    else {
+        ++hits;
+    }
+    return true;
+}
+
+void ResponseCache::insert(const std::string& key, const CachedResponsePtr& entry) {
+    size_t hash = std::hash<std::string>()(key);
+    Shard& shard = shard_of(hash);
+    size_t charge = key.size() + entry->data.size() + sizeof(Node) + sizeof(CachedResponse);
+    if (charge > shard_capacity_) {
+        return;
+    }
+    shard.lock.wrlock();
+    std::unordered_map<std::string, Node*>::iterator it = shard.map.find(key);
+    if (it != shard.map.end()) {
+        // 刷新：原位替换，正在发送旧响应的连接仍持有旧缓冲
+        Node* node = it->second;
+        shard.bytes += charge - node->charge;
+        if (!node->in_main) {
+            shard.small_bytes += charge - node->charge;
+        }
+        node->charge = charge;
+        node->value = entry;
+    }
+    else {
+        Node* node = new Node();
+        node->key = key;
+        node->value = entry;
+        node->charge = charge;
+        node->freq.store(0, std::memory_order_relaxed);
+        // 幽灵队列中有记录，说明不久前因为只访问一次而被淘汰，直接进入主队列
+        node->in_main = shard.ghost_set.erase(hash) > 0;
+        if (node->in_main) {
+            shard.main.push_back(node);
+        }
+        else {
+            shard.small.push_back(node);
+            shard.small_bytes += charge;
+        }
+        shard.bytes += charge;
+        shard.map[key] = node;
+    }
+    ++stores;
+    evict(shard, entry->stored_ms);
+    shard.lock.unlock();
+}
+
+void ResponseCache::evict(Shard& shard, uint64_t now_ms) {
+    while (shard.bytes > shard_capacity_) {
+        bool from_small = !shard.small.empty() &&
+                          (shard.small_bytes * 100 > shard_capacity_ * CACHE_SMALL_PERCENT ||
+                           shard.main.empty());
+        if (from_small) {
+            Node* node = shard.small.front();
+            shard.small.pop_front();
+            shard.small_bytes -= node->charge;
+            if (node->freq.load(std::memory_order_relaxed) > 0 &&
+                now_ms < node->value->stale_until_ms) {
+                // 在小队列期间被再次访问，晋升
+                node->freq.store(0, std::memory_order_relaxed);
+                node->in_main = true;
+                shard.main.push_back(node);
+                continue;
+            }
+            // 只访问过一次的条目记入幽灵队列，长度与主队列相当
+            size_t hash = std::hash<std::string>()(node->key);
+            if (shard.ghost_set.insert(hash).second) {
+                shard.ghost.push_back(hash);
+            }
+            while (shard.ghost.size() > shard.main.size() + 1) {
+                shard.ghost_set.erase(shard.ghost.front());
+                shard.ghost.pop_front();
+            }
+            evict_node(shard, node);
+            continue;
+        }
+        Node* node = shard.main.front();
+        shard.main.pop_front();
+        uint8_t freq = node->freq.load(std::memory_order_relaxed);
+        if (freq > 0 && now_ms < node->value->stale_until_ms) {
+            // CLOCK：访问过的条目减一后放回队尾
+            node->freq.store(freq - 1, std::memory_order_relaxed);
+            shard.main.push_back(node);
+            continue;
+        }
+        evict_node(shard, node);
+    }
+}
+
+void ResponseCache::evict_node(Shard& shard, Node* node) {
+    shard.bytes -= node->charge;
+    shard.map.erase(node->key);
+    ++evictions;
+    delete node;
+}
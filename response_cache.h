@@ -0,0 +1,103 @@
+#ifndef HTTP_SERVER_RESPONSE_CACHE_H
+#define HTTP_SERVER_RESPONSE_CACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "locker.h"
+
+// 分片数，每片一把读写锁，命中只加读锁
+#define CACHE_SHARDS 16
+// 单个响应的上限，更大的响应不缓存(仍然splice转发)
+#define CACHE_MAX_ENTRY (1 << 20)
+// S3-FIFO：小队列占每片容量的比例(百分比)
+#define CACHE_SMALL_PERCENT 10
+// 访问计数的上限，主队列中每轮CLOCK扫描减一
+#define CACHE_MAX_FREQ 3
+
+// 序列化好的响应，插入后不再修改，发送期间由引用计数保证有效。
+// data为状态行+其余响应头(不含Connection)+空行+响应体；
+// 发送时在状态行之后插入Age、X-Cache和Connection，两段iovec一次writev
+struct CachedResponse {
+    std::string data;
+    size_t status_length;
+    uint64_t stored_ms;
+    uint64_t fresh_until_ms;
+    uint64_t stale_until_ms;
+    // 过期后只由第一个看到它的请求发起后台刷新
+    mutable std::atomic<bool> revalidating;
+};
+
+typedef std::shared_ptr<const CachedResponse> CachedResponsePtr;
+
+struct CachePolicy {
+    uint64_t capacity;      // 字节
+    uint64_t ttl_ms;        // 上游没有给出max-age时的新鲜期
+    uint64_t swr_ms;        // 上游没有给出stale-while-revalidate时的可陈旧期
+    std::vector<std::string> vary;// 参与缓存键的请求头
+};
+
+// 反向代理响应的微缓存：按方法、Host、请求目标和配置的Vary请求头分键。
+// 每个分片用S3-FIFO淘汰：新条目进入小队列，在其中被再次访问过才晋升到主队列，
+// 否则淘汰并记入幽灵队列；主队列按CLOCK给访问过的条目第二次机会。
+// 命中只在读锁下原子地增加访问计数，不移动链表，工作线程可以并发查找。
+class ResponseCache {
+public:
+    explicit ResponseCache(const CachePolicy& policy);
+    ~ResponseCache();
+
+    // 生成缓存键，请求带Authorization(或未配置Vary的Cookie)时返回false
+    bool request_key(const std::string& host, const std::string& target,
+                     const std::string& headers, std::string* key) const;
+    // 按上游响应头判断能否缓存，给出新鲜期和可陈旧期
+    bool cacheable(int status, const std::string& cache_control, bool set_cookie,
+                   const std::string& vary, uint64_t* ttl_ms, uint64_t* swr_ms) const;
+
+    // 命中返回true；stale为true表示已过新鲜期但仍可先返回旧响应
+    bool get(const std::string& key, uint64_t now_ms, CachedResponsePtr* entry, bool* stale);
+    void insert(const std::string& key, const CachedResponsePtr& entry);
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> stale_hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> stores;
+    std::atomic<uint64_t> evictions;
+
+private:
+    struct Node {
+        std::string key;
+        CachedResponsePtr value;
+        size_t charge;
+        std::atomic<uint8_t> freq;
+        bool in_main;
+    };
+    struct Shard {
+        RwLocker lock;
+        std::unordered_map<std::string, Node*> map;
+        std::deque<Node*> small;
+        std::deque<Node*> main;
+        // 幽灵队列只记键的哈希
+        std::deque<size_t> ghost;
+        std::unordered_set<size_t> ghost_set;
+        uint64_t small_bytes;
+        uint64_t bytes;
+    };
+
+    Shard& shard_of(size_t hash) { return shards_[hash % CACHE_SHARDS]; }
+    // 写锁下淘汰到容量以内
+    void evict(Shard& shard, uint64_t now_ms);
+    void evict_node(Shard& shard, Node* node);
+
+    CachePolicy policy_;
+    uint64_t shard_capacity_;
+    Shard shards_[CACHE_SHARDS];
+};
+
+#endif
@@ -3,11 +3,46 @@
 
 #include <pthread.h>
 
-#include <list>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <vector>
 
+#include "codel.h"
 #include "locker.h"
+#include "log.h"
 
-// 线程池
+// 步长调度的基数，权重w的类每出队一次虚拟时间前进SCHED_STRIDE/w
+#define SCHED_STRIDE (1u << 20)
+// 排队时间直方图的桶数，第i个桶是[2^(i-1), 2^i)微秒
+#define SCHED_WAIT_BUCKETS 32
+
+// 一个调度类的配置
+struct SchedClassConfig {
+    const char* name;
+    int weight;      // 都有积压时按权重比例出队
+    int max_running; // 同时处理的上限，0表示不限
+    int max_queued;  // 排队上限，0表示只受线程池总上限约束
+};
+
+// 一个调度类的统计，排队时间的分位数取直方图桶的上界
+struct SchedClassStats {
+    size_t depth;
+    size_t max_depth;
+    int running;
+    uint64_t served;
+    uint64_t shed;
+    uint64_t rejected;
+    uint64_t wait_total_us;
+    uint64_t wait_max_us;
+    uint64_t wait_p50_us;
+    uint64_t wait_p99_us;
+};
+
+// 线程池；T需要提供process(tag)，以及按排队时延被丢弃时的shed(tag)
+// (返回false表示不能丢弃，照常处理)。
+// 请求按类排队：有积压的类之间按权重做步长调度(stride scheduling)，
+// 各类可以限制同时占用的工作线程数，排队时延控制和统计也按类进行
 template <class T>
 class ThreadPool {
 private:
@@ -15,26 +50,77 @@ private:
     int thread_num;
     // 线程池数组
     pthread_t* m_threads;
-    // 请求队列的最大数量
+    // 请求队列的最大数量(所有类合计)
     int max_request_num;
-    // 请求队列
-    std::list<T*> work_queue;
+    // 请求，附带入队时的标签(处理时交给请求自身校验是否过期)和入队时刻
+    struct WorkItem {
+        T* request;
+        uint64_t tag;
+        uint64_t enqueue_us;
+    };
+    struct SchedClass {
+        SchedClassConfig config;
+        std::deque<WorkItem> queue;
+        uint64_t stride;
+        uint64_t pass;  // 虚拟时间，最小的有资格的类先出队
+        int running;    // 只对有并发上限的类计数
+        // 排队时延控制
+        CoDel codel;
+        size_t max_depth;
+        uint64_t served;
+        uint64_t shed;
+        uint64_t rejected;
+        uint64_t wait_total_us;
+        uint64_t wait_max_us;
+        uint64_t wait_hist[SCHED_WAIT_BUCKETS];
+    };
+    // 以下都在队列锁下访问
+    std::vector<SchedClass> classes;
+    // 全局虚拟时间：最近出队的类的pass，重新有积压的类从这里开始，不能攒下额度
+    uint64_t vtime;
+    size_t total_queued;
+    // 主线程每轮事件循环都要看，不加锁的副本
+    std::atomic<size_t> queued;
+    std::atomic<uint32_t> dropping_mask;
     // 互斥锁
     Locker queue_locker;
-    // 信号量，判断是否有任务需要处理
-    Sema queue_stat;
-    // 是否结束线程
+    // 有请求入队，或有上限的类腾出了名额
+    Condition queue_cond;
+    // 是否结束线程，在队列锁下修改
     bool stop;
+    // 请求处理完(或被丢弃)后以其标签回调，在投递任何请求之前设置
+    void (*done)(uint64_t tag);
 
 private:
     static void* worker(void* arg);
     void run();
+    // 选出下一个出队的类，都没有资格时返回-1
+    int pick() const;
+    // 让工作线程处理完手上的请求后退出，队列中剩下的丢弃
+    void shutdown();
 
 public:
-    ThreadPool(int _thread_num, int _max_request_num);
+    // 不给出调度类时只有一个不限并发的类，即普通的FIFO
+    ThreadPool(int _thread_num, int _max_request_num,
+               const std::vector<SchedClassConfig>& _classes = std::vector<SchedClassConfig>());
     ~ThreadPool();
 
-    bool append(T* request);
+    // 队列满时返回false，调用者负责回应
+    bool append(T* request, uint64_t tag = 0, int cls = 0);
+    // 在投递任何请求之前设置，各类共用同一组参数，target为0时不丢弃
+    void set_codel(uint64_t target_us, uint64_t interval_us);
+    // 工作线程不再访问请求对象时调用done，调用者借此归还入队时持有的引用
+    void set_done(void (*_done)(uint64_t tag)) { done = _done; }
+    // 工作线程跟不上：有类正在按排队时延丢弃，或者队列超过一半
+    bool behind();
+    // 已经追上：没有类在丢弃状态且队列不超过四分之一
+    bool caught_up();
+    int class_count() const { return (int) classes.size(); }
+    const char* class_name(int cls) const { return classes[cls].config.name; }
+    void stats(int cls, SchedClassStats* out);
+
+    // 因排队过久被丢弃的请求数(所有类合计)
+    std::atomic<uint64_t> shed;
 };
 
 #include <cstdio>
@@ -42,14 +128,48 @@ public:
 #include "thread_pool.h"
 
 template <typename T>
-ThreadPool<T>::ThreadPool(int _thread_num, int _max_request_num)
+ThreadPool<T>::ThreadPool(int _thread_num, int _max_request_num,
+                          const std::vector<SchedClassConfig>& _classes)
     : thread_num(_thread_num)
     , m_threads(nullptr)
     , max_request_num(_max_request_num)
-    , stop(false) {
-    if (thread_num <= 0 || max_request_num <= 0) {
+    , vtime(0)
+    , total_queued(0)
+    , queued(0)
+    , dropping_mask(0)
+    , stop(false)
+    , done(nullptr)
+    , shed(0) {
+    if (thread_num <= 0 || max_request_num <= 0 || _classes.size() > 32) {
         throw std::exception();
     }
+    std::vector<SchedClassConfig> configs = _classes;
+    if (configs.empty()) {
+        configs.push_back(SchedClassConfig{"default", 1, 0, 0});
+    }
+    classes.resize(configs.size());
+    for (size_t i = 0; i < configs.size(); ++i) {
+        SchedClass& c = classes[i];
+        if (configs[i].weight <= 0 || configs[i].max_running < 0 || configs[i].max_queued < 0) {
+            throw std::exception();
+        }
+        c.config = configs[i];
+        if (c.config.max_queued == 0 || c.config.max_queued > max_request_num) {
+            c.config.max_queued = max_request_num;
+        }
+        c.stride = SCHED_STRIDE / c.config.weight;
+        c.pass = 0;
+        c.running = 0;
+        c.max_depth = 0;
+        c.served = 0;
+        c.shed = 0;
+        c.rejected = 0;
+        c.wait_total_us = 0;
+        c.wait_max_us = 0;
+        for (int b = 0; b < SCHED_WAIT_BUCKETS; ++b) {
+            c.wait_hist[b] = 0;
+        }
+    }
 
     m_threads = new pthread_t[_thread_num];
     if (m_threads == nullptr) {
@@ -58,13 +178,10 @@ ThreadPool<T>::ThreadPool(int _thread_num, int _max_request_num)
 
     // 创建线程
     for (int i = 0; i < thread_num; ++i) {
-        printf("create the %dth thread\n", i);
+        LOG_DEBUG("create the %dth thread\n", i);
         if (pthread_create(&m_threads[i], nullptr, worker, this) != 0) {
-            delete[] m_threads;
-            throw std::exception();
-        }
-        if (pthread_detach(m_threads[i]) != 0) {
-            delete[] m_threads;
+            thread_num = i;
+            shutdown();
             throw std::exception();
         }
     }
@@ -72,23 +189,112 @@ ThreadPool<T>::ThreadPool(int _thread_num, int _max_request_num)
 
 template <typename T>
 ThreadPool<T>::~ThreadPool() {
-    delete[] m_threads;
+    shutdown();
+}
+
+template <typename T>
+void ThreadPool<T>::shutdown() {
+    // 等待中的线程还在使用条件变量时不能销毁它，叫醒后等所有线程退出
+    queue_locker.lock();
     stop = true;
+    queue_locker.unlock();
+    queue_cond.broadcast();
+    for (int i = 0; i < thread_num; ++i) {
+        pthread_join(m_threads[i], nullptr);
+    }
+    delete[] m_threads;
+    m_threads = nullptr;
 }
 
 template <typename T>
-bool ThreadPool<T>::append(T* request) {
+void ThreadPool<T>::set_codel(uint64_t target_us, uint64_t interval_us) {
+    for (size_t i = 0; i < classes.size(); ++i) {
+        classes[i].codel.configure(target_us, interval_us);
+    }
+}
+
+template <typename T>
+bool ThreadPool<T>::append(T* request, uint64_t tag, int cls) {
+    if (cls < 0 || cls >= (int) classes.size()) {
+        cls = 0;
+    }
     queue_locker.lock();
-    if (work_queue.size() >= max_request_num) {
+    SchedClass& c = classes[cls];
+    if (total_queued >= (size_t) max_request_num || c.queue.size() >= (size_t) c.config.max_queued) {
+        ++c.rejected;
         queue_locker.unlock();
         return false;
     }
-    work_queue.push_back(request);
+    if (c.queue.empty() && c.pass < vtime) {
+        c.pass = vtime;
+    }
+    c.queue.push_back(WorkItem{request, tag, CoDel::now_us()});
+    if (c.queue.size() > c.max_depth) {
+        c.max_depth = c.queue.size();
+    }
+    ++total_queued;
+    queued.store(total_queued, std::memory_order_relaxed);
     queue_locker.unlock();
-    queue_stat.post();
+    queue_cond.signal();
     return true;
 }
 
+template <typename T>
+int ThreadPool<T>::pick() const {
+    int best = -1;
+    for (size_t i = 0; i < classes.size(); ++i) {
+        const SchedClass& c = classes[i];
+        if (c.queue.empty() || (c.config.max_running > 0 && c.running >= c.config.max_running)) {
+            continue;
+        }
+        if (best == -1 || c.pass < classes[best].pass) {
+            best = (int) i;
+        }
+    }
+    return best;
+}
+
+template <typename T>
+bool ThreadPool<T>::behind() {
+    return dropping_mask.load(std::memory_order_relaxed) != 0 ||
+           queued.load(std::memory_order_relaxed) * 2 >= (size_t) max_request_num;
+}
+
+template <typename T>
+bool ThreadPool<T>::caught_up() {
+    return dropping_mask.load(std::memory_order_relaxed) == 0 &&
+           queued.load(std::memory_order_relaxed) * 4 <= (size_t) max_request_num;
+}
+
+template <typename T>
+void ThreadPool<T>::stats(int cls, SchedClassStats* out) {
+    queue_locker.lock();
+    const SchedClass& c = classes[cls];
+    out->depth = c.queue.size();
+    out->max_depth = c.max_depth;
+    out->running = c.running;
+    out->served = c.served;
+    out->shed = c.shed;
+    out->rejected = c.rejected;
+    out->wait_total_us = c.wait_total_us;
+    out->wait_max_us = c.wait_max_us;
+    out->wait_p50_us = 0;
+    out->wait_p99_us = 0;
+    uint64_t seen = 0;
+    for (int b = 0; b < SCHED_WAIT_BUCKETS && c.served > 0; ++b) {
+        seen += c.wait_hist[b];
+        uint64_t upper = b == 0 ? 1 : 1ull << b;
+        if (out->wait_p50_us == 0 && seen * 2 >= c.served) {
+            out->wait_p50_us = upper;
+        }
+        if (seen * 100 >= c.served * 99) {
+            out->wait_p99_us = upper;
+            break;
+        }
+    }
+    queue_locker.unlock();
+}
+
 template <typename T>
 void* ThreadPool<T>::worker(void* arg) {
     auto* thread_pool = (ThreadPool<T>*) arg;
@@ -99,23 +305,69 @@ void* ThreadPool<T>::worker(void* arg) {
 
 template <typename T>
 void ThreadPool<T>::run() {
-    while (!stop) {
-        // 如果有信号量则正常执行，没有则阻塞
-        // 不用信号量的话需要一直询问工作队列，造成资源浪费
-        queue_stat.wait();
+    for (;;) {
         queue_locker.lock();
-        if (work_queue.empty()) {
+        int cls = pick();
+        while (cls == -1 && !stop) {
+            // 没有请求，或者有积压的类都到了并发上限
+            queue_cond.wait(queue_locker.get());
+            cls = pick();
+        }
+        if (stop) {
             queue_locker.unlock();
-            continue;
+            break;
+        }
+        SchedClass& c = classes[cls];
+        WorkItem item = c.queue.front();
+        c.queue.pop_front();
+        --total_queued;
+        queued.store(total_queued, std::memory_order_relaxed);
+        vtime = c.pass;
+        c.pass += c.stride;
+        bool capped = c.config.max_running > 0;
+        if (capped) {
+            ++c.running;
+        }
+        uint64_t now = CoDel::now_us();
+        uint64_t wait = now - item.enqueue_us;
+        bool drop = c.codel.should_drop(wait, now, c.queue.size());
+        uint32_t bit = 1u << cls;
+        if (c.codel.dropping() != ((dropping_mask.load(std::memory_order_relaxed) & bit) != 0)) {
+            dropping_mask.fetch_xor(bit, std::memory_order_relaxed);
+        }
+        ++c.served;
+        c.wait_total_us += wait;
+        if (wait > c.wait_max_us) {
+            c.wait_max_us = wait;
         }
-        T* request = work_queue.front();
-        work_queue.pop_front();
+        int bucket = wait == 0 ? 0 : 64 - __builtin_clzll(wait);
+        ++c.wait_hist[bucket < SCHED_WAIT_BUCKETS ? bucket : SCHED_WAIT_BUCKETS - 1];
         queue_locker.unlock();
 
-        if (request == nullptr) {
-            continue;
+        if (item.request != nullptr) {
+            if (drop && item.request->shed(item.tag)) {
+                ++shed;
+                queue_locker.lock();
+                ++c.shed;
+                queue_locker.unlock();
+            }
+            else {
+                item.request->process(item.tag);
+            }
+            if (done != nullptr) {
+                done(item.tag);
+            }
+        }
+        if (capped) {
+            // 腾出名额，这个类还有积压时叫醒一个线程
+            queue_locker.lock();
+            --c.running;
+            bool more = !c.queue.empty();
+            queue_locker.unlock();
+            if (more) {
+                queue_cond.signal();
+            }
         }
-        request->process();
     }
 }
 
@@ -101,7 +101,7 @@ void SortTimerList::put(UtilTimer* timer) {
 }
 
 void SortTimerList::tick() {
-    printf("time tick\n");
+    LOG_DEBUG("time tick\n");
     if (head == nullptr) {
         return ;
     }
@@ -112,7 +112,7 @@ void SortTimerList::tick() {
             // 如果当前没有超时，那么后面的也不会超时
             break;
         }
-        tmp->callback(tmp->http_connection_);
+        tmp->callback(tmp->handle_);
         head = tmp->next;
         if (head != nullptr) {
             head->prev = nullptr;
@@ -0,0 +1,68 @@
+#include "tls.h"
+
+#include <openssl/err.h>
+
+#include <cstring>
+
+TlsContext::TlsContext()
+    : handshakes(0), handshake_failures(0), ktls_send(0), ktls_recv(0), ctx_(nullptr) {}
+
+TlsContext::~TlsContext() {
+    if (ctx_ != nullptr) {
+        SSL_CTX_free(ctx_);
+    }
+}
+
+// ALPN：客户端支持h2时优先HTTP/2，否则HTTP/1.1
+static int select_alpn(SSL*, const unsigned char** out, unsigned char* out_len,
+                       const unsigned char* in, unsigned int in_len, void*) {
+    static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+    unsigned char* selected;
+    if (SSL_select_next_proto(&selected, out_len, protocols, sizeof(protocols) - 1, in, in_len) !=
+        OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+static std::string last_ssl_error() {
+    char buf[256];
+    ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+    return buf;
+}
+
+bool TlsContext::init(const char* cert_path, const char* key_path, std::string* error) {
+    ctx_ = SSL_CTX_new(TLS_server_method());
+    if (ctx_ == nullptr) {
+        *error = last_ssl_error();
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(ctx_, TLS1_2_VERSION);
+    // 握手完成后OpenSSL尝试启用kTLS，失败时静默退回用户态
+    SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+    // 非阻塞写：允许部分写，重试时缓冲地址可以变化(聚集写每次重新组装iovec)
+    SSL_CTX_set_mode(ctx_, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                           SSL_MODE_RELEASE_BUFFERS);
+    if (SSL_CTX_use_certificate_chain_file(ctx_, cert_path) != 1) {
+        *error = std::string("certificate ") + cert_path + ": " + last_ssl_error();
+        return false;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx_, key_path, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx_) != 1) {
+        *error = std::string("private key ") + key_path + ": " + last_ssl_error();
+        return false;
+    }
+    SSL_CTX_set_alpn_select_cb(ctx_, select_alpn, nullptr);
+    return true;
+}
+
+SSL* TlsContext::create(int fd) const {
+    SSL* ssl = SSL_new(ctx_);
+    if (ssl == nullptr) {
+        return nullptr;
+    }
+    SSL_set_fd(ssl, fd);
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
@@ -0,0 +1,32 @@
+#ifndef HTTP_SERVER_TLS_H
+#define HTTP_SERVER_TLS_H
+
+#include <openssl/ssl.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// 服务端TLS配置：OpenSSL负责握手，握手后由OpenSSL通过TCP_ULP "tls"把记录加解密交给内核(kTLS)，
+// 内核不支持时退回到SSL_read/SSL_write在用户态加解密
+class TlsContext {
+public:
+    TlsContext();
+    ~TlsContext();
+
+    // 加载证书链和私钥，失败时error给出原因
+    bool init(const char* cert_path, const char* key_path, std::string* error);
+    // 每个连接一个SSL对象，处于服务端握手状态
+    SSL* create(int fd) const;
+
+    std::atomic<uint64_t> handshakes;
+    std::atomic<uint64_t> handshake_failures;
+    // 握手后发送/接收方向启用了kTLS的连接数
+    std::atomic<uint64_t> ktls_send;
+    std::atomic<uint64_t> ktls_recv;
+
+private:
+    SSL_CTX* ctx_;
+};
+
+#endif
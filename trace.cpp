@@ -0,0 +1,130 @@
+#include "trace.h"
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+#include "locker.h"
+
+bool trace_enabled = false;
+
+// 单写者环：本线程写完一条记录后再发布head
+struct TraceRing {
+    uint32_t tid;
+    std::atomic<uint64_t> head;
+    TraceRecord records[TRACE_RING_RECORDS];
+};
+
+// 线程第一次记录时登记自己的环，环随进程存在
+static Locker ring_lock;
+static std::vector<TraceRing*> rings;
+static thread_local TraceRing* local_ring = nullptr;
+static uint64_t start_tsc = 0;
+static uint64_t start_ns = 0;
+
+static uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void trace_enable() {
+    start_tsc = trace_clock();
+    start_ns = monotonic_ns();
+    trace_enabled = true;
+}
+
+void trace_record(TraceStage stage, uint64_t conn, uint32_t seq) {
+    TraceRing* ring = local_ring;
+    if (ring == nullptr) {
+        ring = new TraceRing();
+        ring->tid = (uint32_t) syscall(SYS_gettid);
+        ring->head.store(0, std::memory_order_relaxed);
+        ring_lock.lock();
+        rings.push_back(ring);
+        ring_lock.unlock();
+        local_ring = ring;
+    }
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    TraceRecord& record = ring->records[head & (TRACE_RING_RECORDS - 1)];
+    record.tsc = trace_clock();
+    record.conn = conn;
+    record.seq = seq;
+    record.stage = stage;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+size_t trace_dump(std::string* out) {
+    ring_lock.lock();
+    std::vector<TraceRing*> snapshot = rings;
+    ring_lock.unlock();
+
+    TraceFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.threads = (uint32_t) snapshot.size();
+    header.start_tsc = start_tsc;
+    header.start_ns = start_ns;
+    header.dump_tsc = trace_clock();
+    header.dump_ns = monotonic_ns();
+    out->assign((const char*) &header, sizeof(header));
+
+    size_t total = 0;
+    std::vector<TraceRecord> records;
+    for (size_t i = 0; i < snapshot.size(); ++i) {
+        TraceRing* ring = snapshot[i];
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head > TRACE_RING_RECORDS ? head - TRACE_RING_RECORDS : 0;
+        records.clear();
+        for (uint64_t j = first; j < head; ++j) {
+            records.push_back(ring->records[j & (TRACE_RING_RECORDS - 1)]);
+        }
+        // 拷贝期间写入线程可能绕回覆盖了最旧的几条(包括正在写、尚未发布的一条)，丢弃
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t now = ring->head.load(std::memory_order_relaxed);
+        size_t skip = 0;
+        if (now + 1 > first + TRACE_RING_RECORDS) {
+            skip = std::min<uint64_t>(now + 1 - TRACE_RING_RECORDS - first, records.size());
+        }
+        TraceThreadHeader thread;
+        thread.tid = ring->tid;
+        thread.count = (uint32_t) (records.size() - skip);
+        out->append((const char*) &thread, sizeof(thread));
+        out->append((const char*) (records.data() + skip), thread.count * sizeof(TraceRecord));
+        total += thread.count;
+    }
+    return total;
+}
+
+bool trace_dump_file(const char* path, size_t* records) {
+    std::string data;
+    *records = trace_dump(&data);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n <= 0) {
+            close(fd);
+            return false;
+        }
+        written += n;
+    }
+    close(fd);
+    return true;
+}
+
+const char* trace_stage_name(int stage) {
+    static const char* names[TRACE_STAGE_COUNT] = {
+        "accept", "first_byte", "enqueue", "dequeue",
+        "parsed", "handled", "first_write", "last_write"};
+    return stage >= 0 && stage < TRACE_STAGE_COUNT ? names[stage] : "unknown";
+}
@@ -0,0 +1,84 @@
+#ifndef HTTP_SERVER_TRACE_H
+#define HTTP_SERVER_TRACE_H
+
+#include <time.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// 每个线程环形缓冲的记录数(2的幂)，写满后覆盖最旧的记录
+#define TRACE_RING_RECORDS (1 << 16)
+#define TRACE_MAGIC "HTTPTRC1"
+#define TRACE_VERSION 1
+
+// 一个请求依次经过的阶段
+enum TraceStage {
+    TRACE_ACCEPT = 0,  // 主线程accept，记在连接的第一个请求上
+    TRACE_FIRST_BYTE,  // 读入请求的首字节
+    TRACE_ENQUEUE,     // 交给线程池
+    TRACE_DEQUEUE,     // 工作线程取出
+    TRACE_PARSED,      // parse_process解析完整个请求
+    TRACE_HANDLED,     // do_request完成
+    TRACE_FIRST_WRITE, // 第一次write()
+    TRACE_LAST_WRITE,  // 发送队列发完
+    TRACE_STAGE_COUNT
+};
+
+// 导出文件按主机字节序原样存放：TraceFileHeader，随后每个线程一个
+// TraceThreadHeader加count条TraceRecord
+struct TraceRecord {
+    uint64_t tsc;
+    uint64_t conn;  // 连接句柄
+    uint32_t seq;   // 连接上的请求序号
+    uint32_t stage;
+};
+
+struct TraceFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t threads;
+    // 开启时与导出时各取一次(时钟读数, CLOCK_MONOTONIC纳秒)，离线换算成时间
+    uint64_t start_tsc;
+    uint64_t start_ns;
+    uint64_t dump_tsc;
+    uint64_t dump_ns;
+};
+
+struct TraceThreadHeader {
+    uint32_t tid;
+    uint32_t count;
+};
+
+// 启动时由--trace打开，之后只读
+extern bool trace_enabled;
+
+// 时间戳计数器；依赖恒定速率且各核同步的TSC，其他架构退回单调时钟纳秒
+inline uint64_t trace_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+void trace_enable();
+// 写入当前线程的环，只有本线程写，不加锁
+void trace_record(TraceStage stage, uint64_t conn, uint32_t seq);
+inline void trace_stage(TraceStage stage, uint64_t conn, uint32_t seq) {
+    if (trace_enabled) {
+        trace_record(stage, conn, seq);
+    }
+}
+// 导出所有线程环中的记录，返回记录数；导出期间写入线程不停
+size_t trace_dump(std::string* out);
+bool trace_dump_file(const char* path, size_t* records);
+const char* trace_stage_name(int stage);
+
+#endif
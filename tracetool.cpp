@@ -0,0 +1,176 @@
+// 把服务器导出的阶段追踪记录(--trace，经SIGUSR1或--trace-path导出)转换成Chrome trace JSON，
+// 可在chrome://tracing或Perfetto中打开：每个请求一条异步轨道，相邻两个阶段之间为一段，
+// 各线程上另有每个阶段的瞬时事件。标准错误上打印耗时最长的几个请求。
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "trace.h"
+
+// 最慢请求的打印个数
+#define SLOWEST_REQUESTS 5
+
+struct StageEvent {
+    double us;
+    uint32_t tid;
+    uint32_t stage;
+
+    bool operator<(const StageEvent& other) const { return us < other.us; }
+};
+
+typedef std::pair<uint64_t, uint32_t> RequestKey;
+
+static bool read_file(const char* path, std::string* data) {
+    FILE* f = fopen(path, "rb");
+    if (f == nullptr) {
+        return false;
+    }
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        data->append(buf, n);
+    }
+    bool ok = ferror(f) == 0;
+    fclose(f);
+    return ok;
+}
+
+static void print_event(FILE* out, bool* first, const char* name, const char* ph, uint64_t id,
+                        uint32_t tid, double us, const RequestKey& key) {
+    fprintf(out,
+            "%s\n{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"%s\",\"id\":%llu,\"pid\":1,"
+            "\"tid\":%u,\"ts\":%.3f,\"args\":{\"conn\":\"0x%llx\",\"seq\":%u}}",
+            *first ? "" : ",", name, ph, (unsigned long long) id, tid, us,
+            (unsigned long long) key.first, key.second);
+    *first = false;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2 && argc != 3) {
+        printf("Usage: %s trace.bin [trace.json]\n", basename(argv[0]));
+        return -1;
+    }
+    std::string data;
+    if (!read_file(argv[1], &data)) {
+        printf("read %s failed\n", argv[1]);
+        return -1;
+    }
+    TraceFileHeader header;
+    if (data.size() < sizeof(header)) {
+        printf("%s: truncated header\n", argv[1]);
+        return -1;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_VERSION) {
+        printf("%s: not a trace dump (or unsupported version)\n", argv[1]);
+        return -1;
+    }
+    // 用开启和导出两个时刻的读数把时钟换算成微秒
+    double ns_per_tick = 1.0;
+    if (header.dump_tsc > header.start_tsc && header.dump_ns > header.start_ns) {
+        ns_per_tick = (double) (header.dump_ns - header.start_ns) /
+                      (double) (header.dump_tsc - header.start_tsc);
+    }
+
+    std::map<RequestKey, std::vector<StageEvent> > requests;
+    std::vector<uint32_t> tids;
+    size_t pos = sizeof(header);
+    size_t records = 0;
+    for (uint32_t t = 0; t < header.threads; ++t) {
+        TraceThreadHeader thread;
+        if (data.size() - pos < sizeof(thread)) {
+            printf("%s: truncated thread header\n", argv[1]);
+            return -1;
+        }
+        memcpy(&thread, data.data() + pos, sizeof(thread));
+        pos += sizeof(thread);
+        if ((data.size() - pos) / sizeof(TraceRecord) < thread.count) {
+            printf("%s: truncated records\n", argv[1]);
+            return -1;
+        }
+        tids.push_back(thread.tid);
+        for (uint32_t i = 0; i < thread.count; ++i) {
+            TraceRecord record;
+            memcpy(&record, data.data() + pos, sizeof(record));
+            pos += sizeof(record);
+            StageEvent event;
+            event.us = (double) (int64_t) (record.tsc - header.start_tsc) * ns_per_tick / 1000;
+            event.tid = thread.tid;
+            event.stage = record.stage;
+            requests[RequestKey(record.conn, record.seq)].push_back(event);
+        }
+        records += thread.count;
+    }
+
+    FILE* out = stdout;
+    if (argc == 3) {
+        out = fopen(argv[2], "w");
+        if (out == nullptr) {
+            printf("open %s failed\n", argv[2]);
+            return -1;
+        }
+    }
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    bool first = true;
+    for (size_t i = 0; i < tids.size(); ++i) {
+        fprintf(out,
+                "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                "\"args\":{\"name\":\"thread %u\"}}",
+                first ? "" : ",", tids[i], tids[i]);
+        first = false;
+    }
+    std::vector<std::pair<double, RequestKey> > durations;
+    uint64_t id = 0;
+    for (std::map<RequestKey, std::vector<StageEvent> >::iterator it = requests.begin();
+         it != requests.end(); ++it) {
+        const RequestKey& key = it->first;
+        std::vector<StageEvent>& events = it->second;
+        std::stable_sort(events.begin(), events.end());
+        ++id;
+        print_event(out, &first, "request", "b", id, events.front().tid, events.front().us, key);
+        for (size_t i = 1; i < events.size(); ++i) {
+            std::string name = std::string(trace_stage_name(events[i - 1].stage)) + "->" +
+                               trace_stage_name(events[i].stage);
+            print_event(out, &first, name.c_str(), "b", id, events[i - 1].tid, events[i - 1].us,
+                        key);
+            print_event(out, &first, name.c_str(), "e", id, events[i].tid, events[i].us, key);
+        }
+        print_event(out, &first, "request", "e", id, events.back().tid, events.back().us, key);
+        for (size_t i = 0; i < events.size(); ++i) {
+            fprintf(out,
+                    ",\n{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,"
+                    "\"tid\":%u,\"ts\":%.3f,\"args\":{\"conn\":\"0x%llx\",\"seq\":%u}}",
+                    trace_stage_name(events[i].stage), events[i].tid, events[i].us,
+                    (unsigned long long) key.first, key.second);
+        }
+        durations.push_back(std::make_pair(events.back().us - events.front().us, key));
+    }
+    fprintf(out, "\n]}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    fprintf(stderr, "%zu records, %zu requests, %zu threads\n", records, requests.size(),
+            tids.size());
+    size_t slowest = std::min<size_t>(SLOWEST_REQUESTS, durations.size());
+    std::partial_sort(durations.begin(), durations.begin() + slowest, durations.end(),
+                      [](const std::pair<double, RequestKey>& a,
+                         const std::pair<double, RequestKey>& b) { return a.first > b.first; });
+    for (size_t i = 0; i < slowest; ++i) {
+        const std::vector<StageEvent>& events = requests[durations[i].second];
+        fprintf(stderr, "conn 0x%llx seq %u: %.1f us\n",
+                (unsigned long long) durations[i].second.first, durations[i].second.second,
+                durations[i].first);
+        for (size_t k = 1; k < events.size(); ++k) {
+            fprintf(stderr, "  %-12s -> %-12s %10.1f us\n", trace_stage_name(events[k - 1].stage),
+                    trace_stage_name(events[k].stage), events[k].us - events[k - 1].us);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include "transport.h"
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "http_connection.h"
+
+extern void addfd(int epoll_fd, int fd, uint64_t data, bool one_shot, bool ET);
+extern void delfd(int epoll_fd, int fd);
+extern void modfd(int epoll_fd, int fd, uint64_t data, uint32_t ev);
+
+SocketTransport* SocketTransport::instance() {
+    static SocketTransport transport;
+    return &transport;
+}
+
+void SocketTransport::attach(int fd, ConnHandle handle) {
+    // 端口复用
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    addfd(HTTPConnection::epoll_fd, fd, handle, true, true);
+}
+
+ssize_t SocketTransport::recv(int fd, char* buf, size_t length) {
+    return ::recv(fd, buf, length, 0);
+}
+
+ssize_t SocketTransport::send(int fd, const struct iovec* iov, int count, int flags) {
+    if (flags == 0) {
+        return writev(fd, iov, count);
+    }
+    msghdr msg{};
+    msg.msg_iov = const_cast<struct iovec*>(iov);
+    msg.msg_iovlen = count;
+    return sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+}
+
+void SocketTransport::arm(int fd, ConnHandle handle, uint32_t events) {
+    modfd(HTTPConnection::epoll_fd, fd, handle, events);
+}
+
+void SocketTransport::detach(int fd) {
+    delfd(HTTPConnection::epoll_fd, fd);
+}
+
+void LoopbackTransport::attach(int, ConnHandle) {
+    attached_ = true;
+    armed_ = EPOLLIN;
+}
+
+ssize_t LoopbackTransport::recv(int, char* buf, size_t length) {
+    size_t left = input_.size() - input_offset_;
+    if (left == 0) {
+        if (input_closed_) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t n = std::min(left, length);
+    if (max_read_ > 0) {
+        n = std::min(n, max_read_);
+    }
+    memcpy(buf, input_.data() + input_offset_, n);
+    input_offset_ += n;
+    if (input_offset_ == input_.size()) {
+        // 读完后从头复用，脚本反复喂入时不增长
+        input_.clear();
+        input_offset_ = 0;
+    }
+    return (ssize_t) n;
+}
+
+ssize_t LoopbackTransport::send(int, const struct iovec* iov, int count, int) {
+    size_t limit = max_write_ > 0 ? max_write_ : SIZE_MAX;
+    size_t total = 0;
+    for (int i = 0; i < count && total < limit; ++i) {
+        size_t n = std::min(iov[i].iov_len, limit - total);
+        if (capture_) {
+            output_.append((const char*) iov[i].iov_base, n);
+        }
+        total += n;
+    }
+    sent_bytes_ += total;
+    return (ssize_t) total;
+}
+
+void LoopbackTransport::arm(int, ConnHandle, uint32_t events) {
+    armed_ = events;
+}
+
+void LoopbackTransport::detach(int) {
+    attached_ = false;
+    armed_ = 0;
+}
+
+void LoopbackTransport::feed(const char* data, size_t length) {
+    input_.append(data, length);
+}
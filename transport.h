@@ -0,0 +1,90 @@
+#ifndef HTTP_SERVER_TRANSPORT_H
+#define HTTP_SERVER_TRANSPORT_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <string>
+
+#include "connection_slab.h"
+
+// 连接底层的字节收发与事件注册。HTTPConnection的明文读写都经过它：
+// 默认是socket加epoll，基准测试换成内存中的回环，请求处理的代码完全相同
+class Transport {
+public:
+    virtual ~Transport() {}
+
+    // 连接建立，开始关注读事件(EPOLLONESHOT)
+    virtual void attach(int fd, ConnHandle handle) = 0;
+    // 语义同recv/writev：暂时不可读写时返回-1且errno为EAGAIN，对方关闭时recv返回0
+    virtual ssize_t recv(int fd, char* buf, size_t length) = 0;
+    // flags为MSG_MORE等sendmsg标志，0时同writev
+    virtual ssize_t send(int fd, const struct iovec* iov, int count, int flags) = 0;
+    // 重新注册下一次关心的事件(EPOLLIN、EPOLLOUT)
+    virtual void arm(int fd, ConnHandle handle, uint32_t events) = 0;
+    // 连接关闭
+    virtual void detach(int fd) = 0;
+};
+
+// 非阻塞socket，注册到HTTPConnection::epoll_fd
+class SocketTransport : public Transport {
+public:
+    static SocketTransport* instance();
+
+    void attach(int fd, ConnHandle handle) override;
+    ssize_t recv(int fd, char* buf, size_t length) override;
+    ssize_t send(int fd, const struct iovec* iov, int count, int flags) override;
+    void arm(int fd, ConnHandle handle, uint32_t events) override;
+    void detach(int fd) override;
+};
+
+// 内存中的回环，不经过内核：请求字节由调用者喂入，响应追加到捕获缓冲，
+// 事件注册只记录下来，由驱动者按记录调用read()/process()/write()。
+// 每个连接一个，只在一个线程上使用；fd只是标识，不会传给任何系统调用
+class LoopbackTransport : public Transport {
+public:
+    LoopbackTransport()
+        : input_offset_(0), input_closed_(false), max_read_(0), max_write_(0), armed_(0),
+          attached_(false), sent_bytes_(0), capture_(true) {}
+
+    void attach(int fd, ConnHandle handle) override;
+    ssize_t recv(int fd, char* buf, size_t length) override;
+    ssize_t send(int fd, const struct iovec* iov, int count, int flags) override;
+    void arm(int fd, ConnHandle handle, uint32_t events) override;
+    void detach(int fd) override;
+
+    // 追加待读的字节
+    void feed(const char* data, size_t length);
+    // 对方关闭写方向：缓冲读完后recv返回0
+    void close_input() { input_closed_ = true; }
+    // 每次recv/send最多传输的字节数，0表示不限；用来模拟分片到达和短写
+    void set_max_read(size_t n) { max_read_ = n; }
+    void set_max_write(size_t n) { max_write_ = n; }
+    // 关闭后只计数不保存响应，测吞吐时避免拷贝
+    void set_capture(bool capture) { capture_ = capture; }
+    size_t input_left() const { return input_.size() - input_offset_; }
+    // 取走最近一次注册的事件，与EPOLLONESHOT一样取走后清零
+    uint32_t take_armed() {
+        uint32_t events = armed_;
+        armed_ = 0;
+        return events;
+    }
+    bool attached() const { return attached_; }
+    std::string& output() { return output_; }
+    uint64_t sent_bytes() const { return sent_bytes_; }
+
+private:
+    std::string input_;
+    size_t input_offset_;
+    bool input_closed_;
+    size_t max_read_;
+    size_t max_write_;
+    uint32_t armed_;
+    bool attached_;
+    std::string output_;
+    uint64_t sent_bytes_;
+    bool capture_;
+};
+
+#endif
@@ -0,0 +1,240 @@
+#include "upload.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+std::atomic<uint64_t> Upload::started(0);
+std::atomic<uint64_t> Upload::completed(0);
+std::atomic<uint64_t> Upload::aborted(0);
+std::atomic<uint64_t> Upload::bytes(0);
+std::atomic<uint64_t> Upload::spliced(0);
+std::atomic<uint64_t> Upload::deleted(0);
+
+// 临时文件名中的序号，同一目录下并发的上传互不冲突
+static std::atomic<uint64_t> temp_seq(0);
+
+Upload::~Upload() {
+    if (!committed_ && (fd_ != -1 || !temp_name_.empty())) {
+        ++aborted;
+    }
+    // 匿名临时文件随最后一个fd关闭而消失，有名字的要删除
+    if (fd_ != -1) {
+        close(fd_);
+    }
+    if (!temp_name_.empty() && !committed_) {
+        unlinkat(dir_fd_, temp_name_.c_str(), 0);
+    }
+    if (dir_fd_ != -1) {
+        close(dir_fd_);
+    }
+    if (pipe_[0] != -1) {
+        close(pipe_[0]);
+        close(pipe_[1]);
+    }
+}
+
+int Upload::open_parent(int root_fd, const char* relative, bool create, const char** name) {
+    // 路径已规范化，不含.和..；每次只解析一段且不跟随符号链接，不会越出根目录
+    int dir = dup(root_fd);
+    if (dir == -1) {
+        return -1;
+    }
+    const char* p = relative;
+    const char* slash;
+    while ((slash = strchr(p, '/')) != nullptr) {
+        std::string component(p, slash - p);
+        if (create && mkdirat(dir, component.c_str(), 0755) == -1 && errno != EEXIST) {
+            close(dir);
+            return -1;
+        }
+        int next = openat(dir, component.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        close(dir);
+        if (next == -1) {
+            return -1;
+        }
+        dir = next;
+        p = slash + 1;
+    }
+    *name = p;
+    return dir;
+}
+
+Upload::Status Upload::begin(int root_fd, const char* relative, uint64_t length) {
+    const char* name;
+    dir_fd_ = open_parent(root_fd, relative, true, &name);
+    if (dir_fd_ == -1) {
+        return errno == ENOSPC ? UPLOAD_NO_SPACE : UPLOAD_FORBIDDEN;
+    }
+    if (name[0] == '\0') {
+        return UPLOAD_FORBIDDEN;
+    }
+    if (is_temp_name(name)) {
+        return UPLOAD_FORBIDDEN;
+    }
+    name_ = name;
+    // 放在目标所在目录，链接和改名不会跨文件系统
+    fd_ = openat(dir_fd_, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd_ == -1 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+        // 文件系统不支持O_TMPFILE(内核不认识这个标志时是EISDIR)
+        std::string temp = make_temp_name();
+        fd_ = openat(dir_fd_, temp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd_ != -1) {
+            temp_name_ = temp;
+        }
+    }
+    if (fd_ == -1) {
+        return errno == ENOSPC ? UPLOAD_NO_SPACE : UPLOAD_ERROR;
+    }
+    ++started;
+    // 不受umask影响，静态文件要求其他用户可读才响应
+    fchmod(fd_, 0644);
+    if (length > 0 && fallocate(fd_, 0, 0, (off_t) length) == -1 && errno != EOPNOTSUPP) {
+        return UPLOAD_NO_SPACE;
+    }
+    length_ = length;
+    offset_ = 0;
+    return UPLOAD_OK;
+}
+
+bool Upload::write(const char* data, size_t length) {
+    length = std::min<uint64_t>(length, remaining());
+    while (length > 0) {
+        ssize_t n = pwrite(fd_, data, length, (off_t) offset_);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        length -= n;
+        offset_ += n;
+        bytes += n;
+    }
+    return true;
+}
+
+Upload::Progress Upload::splice_from(int sock_fd) {
+    if (pipe_[0] == -1) {
+        if (pipe2(pipe_, O_NONBLOCK | O_CLOEXEC) == -1) {
+            pipe_[0] = pipe_[1] = -1;
+            return UPLOAD_FAILED;
+        }
+        // 管道越大每次搬运的页越多，设置失败时保持默认的64KB
+        fcntl(pipe_[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+    }
+    while (remaining() > 0) {
+        size_t want = (size_t) std::min<uint64_t>(remaining(), UPLOAD_PIPE_SIZE);
+        ssize_t n = splice(sock_fd, nullptr, pipe_[1], nullptr, want,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0) {
+            return UPLOAD_CLOSED;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                return UPLOAD_AGAIN;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return UPLOAD_FAILED;
+        }
+        // 管道中的页全部落到文件，下一轮从空管道开始
+        while (n > 0) {
+            loff_t offset = (loff_t) offset_;
+            ssize_t m = splice(pipe_[0], nullptr, fd_, &offset, n, SPLICE_F_MOVE);
+            if (m <= 0) {
+                if (m < 0 && errno == EINTR) {
+                    continue;
+                }
+                return UPLOAD_FAILED;
+            }
+            n -= m;
+            offset_ += m;
+            bytes += m;
+            spliced += m;
+        }
+    }
+    return UPLOAD_DONE;
+}
+
+Upload::Status Upload::commit(bool* replaced) {
+    if (remaining() > 0) {
+        return UPLOAD_ERROR;
+    }
+    struct stat st;
+    *replaced = fstatat(dir_fd_, name_.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0;
+    if (*replaced && S_ISDIR(st.st_mode)) {
+        return UPLOAD_FORBIDDEN;
+    }
+    // linkat不能覆盖已有文件，先链接到临时名字再改名；此时内容已经完整
+    if (temp_name_.empty() && !link_temp()) {
+        return UPLOAD_ERROR;
+    }
+    // 预分配按Content-Length，不需要截断
+    close(fd_);
+    fd_ = -1;
+    // 同一目录内改名是原子的，读者看到的要么是旧文件要么是完整的新文件
+    if (renameat(dir_fd_, temp_name_.c_str(), dir_fd_, name_.c_str()) == -1) {
+        return UPLOAD_ERROR;
+    }
+    committed_ = true;
+    ++completed;
+    return UPLOAD_OK;
+}
+
+std::string Upload::make_temp_name() {
+    char temp[64];
+    snprintf(temp, sizeof(temp), UPLOAD_TEMP_PREFIX "%d.%llu", (int) getpid(),
+             (unsigned long long) temp_seq++);
+    return temp;
+}
+
+bool Upload::link_temp() {
+    std::string temp = make_temp_name();
+    // AT_EMPTY_PATH需要CAP_DAC_READ_SEARCH，没有时经/proc按路径链接
+    if (linkat(fd_, "", dir_fd_, temp.c_str(), AT_EMPTY_PATH) == -1) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd_);
+        if (linkat(AT_FDCWD, path, dir_fd_, temp.c_str(), AT_SYMLINK_FOLLOW) == -1) {
+            return false;
+        }
+    }
+    temp_name_ = temp;
+    return true;
+}
+
+bool Upload::is_temp_name(const char* relative) {
+    const char* name = strrchr(relative, '/');
+    name = name != nullptr ? name + 1 : relative;
+    return strncmp(name, UPLOAD_TEMP_PREFIX, sizeof(UPLOAD_TEMP_PREFIX) - 1) == 0;
+}
+
+Upload::Status Upload::remove(int root_fd, const char* relative, bool* missing) {
+    *missing = false;
+    const char* name;
+    int dir = open_parent(root_fd, relative, false, &name);
+    if (dir == -1) {
+        *missing = errno == ENOENT;
+        return *missing ? UPLOAD_OK : UPLOAD_FORBIDDEN;
+    }
+    // 别的连接正在提交的临时文件不能删除
+    if (is_temp_name(name)) {
+        close(dir);
+        return UPLOAD_FORBIDDEN;
+    }
+    if (name[0] == '\0' || unlinkat(dir, name, 0) == -1) {
+        *missing = name[0] != '\0' && errno == ENOENT;
+        close(dir);
+        return *missing ? UPLOAD_OK : UPLOAD_FORBIDDEN;
+    }
+    close(dir);
+    ++deleted;
+    return UPLOAD_OK;
+}
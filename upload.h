@@ -0,0 +1,92 @@
+#ifndef HTTP_SERVER_UPLOAD_H
+#define HTTP_SERVER_UPLOAD_H
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// 每次从socket经管道搬到文件的最大字节数，也是拷贝路径的缓冲大小
+#define UPLOAD_CHUNK (64 << 10)
+// 管道容量，超过/proc/sys/fs/pipe-max-size时保持默认
+#define UPLOAD_PIPE_SIZE (1 << 20)
+// 具名临时文件的前缀，静态文件和上传都不接受以它开头的文件名
+#define UPLOAD_TEMP_PREFIX ".upload."
+
+// 一个PUT请求体：写入目标所在目录下的匿名临时文件(O_TMPFILE)，收完后链接进目录
+// 并原子地改名为目标，收齐之前在文件系统中没有名字，GET不可能读到部分内容。
+// 文件系统不支持O_TMPFILE时退回具名临时文件，其名字对GET和PUT都不可见。
+// 明文socket上请求体经splice(socket→管道→文件)直接在内核中搬运，不进入用户态；
+// TLS连接上只能解密后拷贝写入。改名前不做fsync，断电后的持久性交给文件系统。
+// 同一时刻只由持有连接的线程使用
+class Upload {
+public:
+    enum Status {
+        UPLOAD_OK = 0,        // 准备好或已提交
+        UPLOAD_FORBIDDEN,     // 路径越出根目录、经过符号链接，或目标是目录
+        UPLOAD_NO_SPACE,      // 按长度预分配失败
+        UPLOAD_ERROR
+    };
+    // receive的结果
+    enum Progress {
+        UPLOAD_AGAIN = 0,     // socket暂时没有数据
+        UPLOAD_DONE,          // 请求体收齐
+        UPLOAD_CLOSED,        // 对方在请求体收齐前关闭
+        UPLOAD_FAILED         // socket或文件出错
+    };
+
+    Upload() : dir_fd_(-1), fd_(-1), length_(0), offset_(0), committed_(false) {
+        pipe_[0] = pipe_[1] = -1;
+    }
+    // 没有提交的上传删除临时文件
+    ~Upload();
+
+    // 在root_fd下为relative(不以/开头、已规范化)准备临时文件：缺少的上级目录逐级创建，
+    // 再按length预分配空间
+    Status begin(int root_fd, const char* relative, uint64_t length);
+    // 写入已经读进缓冲的请求体
+    bool write(const char* data, size_t length);
+    // 从非阻塞socket上接收剩余的请求体，直到暂时没有数据或收齐
+    Progress splice_from(int sock_fd);
+    uint64_t remaining() const { return length_ - offset_; }
+    // 收齐后改名为目标，*replaced表示覆盖了已有文件
+    Status commit(bool* replaced);
+
+    // DELETE：删除root_fd下的文件，不存在时*missing为true
+    static Status remove(int root_fd, const char* relative, bool* missing);
+    // relative的最后一段是临时文件名
+    static bool is_temp_name(const char* relative);
+
+    static std::atomic<uint64_t> started;
+    static std::atomic<uint64_t> completed;
+    static std::atomic<uint64_t> aborted;
+    static std::atomic<uint64_t> bytes;
+    // 经splice搬运、没有经过用户态的字节数
+    static std::atomic<uint64_t> spliced;
+    static std::atomic<uint64_t> deleted;
+
+private:
+    // 打开目标的上级目录(O_PATH)，create时逐级创建缺少的目录；*name指向最后一段
+    static int open_parent(int root_fd, const char* relative, bool create, const char** name);
+    // 生成目录内唯一的临时文件名
+    static std::string make_temp_name();
+    // 把匿名临时文件链接为目录下的temp_name_
+    bool link_temp();
+
+    int dir_fd_;
+    int fd_;
+    int pipe_[2];
+    std::string name_;
+    // 具名临时文件，或提交时匿名文件链接到的名字；为空表示文件还没有名字
+    std::string temp_name_;
+    uint64_t length_;
+    uint64_t offset_;
+    bool committed_;
+
+    Upload(const Upload&) = delete;
+    Upload& operator=(const Upload&) = delete;
+};
+
+#endif
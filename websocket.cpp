@@ -0,0 +1,441 @@
+#include "websocket.h"
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <sys/epoll.h>
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+extern void modfd(int epoll_fd, int fd, uint64_t data, uint32_t ev);
+
+WsMessageHandler WebSocketSession::handler = nullptr;
+std::atomic<uint64_t> WebSocketSession::sessions(0);
+std::atomic<uint64_t> WebSocketSession::messages(0);
+std::atomic<uint64_t> WebSocketSession::broadcasts(0);
+std::atomic<uint64_t> WebSocketSession::shared_frames(0);
+
+// 频道 -> 订阅连接；会话析构时先退订，广播持有该锁期间会话不会被释放
+static Locker channels_locker;
+static std::map<std::string, std::set<WebSocketSession*> > channels;
+
+void ws_unmask(char* data, size_t length, uint32_t mask) {
+    size_t i = 0;
+    // 每轮处理的字节数都是4的倍数，掩码相位保持不变
+#if defined(__AVX2__)
+    __m256i mask256 = _mm256_set1_epi32((int) mask);
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (data + i));
+        _mm256_storeu_si256((__m256i*) (data + i), _mm256_xor_si256(v, mask256));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i mask128 = _mm_set1_epi32((int) mask);
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (data + i));
+        _mm_storeu_si128((__m128i*) (data + i), _mm_xor_si128(v, mask128));
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t mask128 = vreinterpretq_u8_u32(vdupq_n_u32(mask));
+    for (; i + 16 <= length; i += 16) {
+        uint8_t* p = (uint8_t*) data + i;
+        vst1q_u8(p, veorq_u8(vld1q_u8(p), mask128));
+    }
+#endif
+    uint64_t mask64 = ((uint64_t) mask << 32) | mask;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        v ^= mask64;
+        memcpy(data + i, &v, 8);
+    }
+    const uint8_t* key = (const uint8_t*) &mask;
+    for (; i < length; ++i) {
+        data[i] ^= key[i & 3];
+    }
+}
+
+// 文本消息和关闭原因必须是合法的UTF-8(拒绝过长编码和代理区)
+static bool valid_utf8(const uint8_t* s, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        // ASCII一次检查8字节
+        if (i + 8 <= n) {
+            uint64_t v;
+            memcpy(&v, s + i, 8);
+            if ((v & 0x8080808080808080ULL) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+        uint8_t c = s[i];
+        if (c < 0x80) {
+            ++i;
+            continue;
+        }
+        size_t len;
+        uint32_t cp;
+        if ((c & 0xe0) == 0xc0) {
+            len = 2;
+            cp = c & 0x1f;
+        }
+        else if ((c & 0xf0) == 0xe0) {
+            len = 3;
+            cp = c & 0x0f;
+        }
+        else if ((c & 0xf8) == 0xf0) {
+            len = 4;
+            cp = c & 0x07;
+        }
+        else {
+            return false;
+        }
+        if (i + len > n) {
+            return false;
+        }
+        for (size_t j = 1; j < len; ++j) {
+            if ((s[i + j] & 0xc0) != 0x80) {
+                return false;
+            }
+            cp = (cp << 6) | (s[i + j] & 0x3f);
+        }
+        if ((len == 2 && cp < 0x80) || (len == 3 && cp < 0x800) ||
+            (len == 4 && (cp < 0x10000 || cp > 0x10ffff)) || (cp >= 0xd800 && cp <= 0xdfff)) {
+            return false;
+        }
+        i += len;
+    }
+    return true;
+}
+
+static bool valid_close_code(uint16_t code) {
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) ||
+           (code >= 3000 && code <= 4999);
+}
+
+WebSocketSession::WebSocketSession(const std::string& channel, int epoll_fd, int fd,
+                                   ConnHandle handle)
+    : channel_(channel), epoll_fd_(epoll_fd), fd_(fd), handle_(handle),
+      message_opcode_(WS_CONTINUATION), close_sent_(false), ping_outstanding_(false),
+      out_sent_(0), out_bytes_(0), overflow_(false), parked_(false) {
+    ++sessions;
+}
+
+WebSocketSession::~WebSocketSession() {
+    channels_locker.lock();
+    std::map<std::string, std::set<WebSocketSession*> >::iterator it = channels.find(channel_);
+    if (it != channels.end()) {
+        it->second.erase(this);
+        if (it->second.empty()) {
+            channels.erase(it);
+        }
+    }
+    channels_locker.unlock();
+}
+
+bool WebSocketSession::accept_key(const std::string& key, std::string* accept) {
+    // 16字节随机数的base64编码
+    if (key.size() != 24) {
+        return false;
+    }
+    std::string text = key + WS_GUID;
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1((const unsigned char*) text.data(), text.size(), digest);
+    unsigned char encoded[32];
+    int n = EVP_EncodeBlock(encoded, digest, SHA_DIGEST_LENGTH);
+    accept->assign((const char*) encoded, n);
+    return true;
+}
+
+WsFrame WebSocketSession::make_frame(WsOpcode opcode, const char* data, size_t length) {
+    // 服务端的帧不加掩码
+    std::shared_ptr<std::string> frame = std::make_shared<std::string>();
+    frame->reserve(length + 10);
+    frame->push_back((char) (0x80 | opcode));
+    if (length < 126) {
+        frame->push_back((char) length);
+    }
+    else if (length <= 0xffff) {
+        frame->push_back((char) 126);
+        frame->push_back((char) (length >> 8));
+        frame->push_back((char) length);
+    }
+    else {
+        frame->push_back((char) 127);
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            frame->push_back((char) (length >> shift));
+        }
+    }
+    frame->append(data, length);
+    return frame;
+}
+
+size_t WebSocketSession::broadcast(const std::string& channel, const WsFrame& frame) {
+    size_t count = 0;
+    channels_locker.lock();
+    std::map<std::string, std::set<WebSocketSession*> >::iterator it = channels.find(channel);
+    if (it != channels.end()) {
+        for (std::set<WebSocketSession*>::iterator s = it->second.begin(); s != it->second.end();
+             ++s) {
+            (*s)->post(frame);
+            ++count;
+        }
+    }
+    channels_locker.unlock();
+    ++broadcasts;
+    shared_frames += count;
+    return count;
+}
+
+void WebSocketSession::start(const std::string& accept) {
+    std::shared_ptr<std::string> response = std::make_shared<std::string>(
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: " + accept + "\r\n\r\n");
+    post(response);
+    channels_locker.lock();
+    channels[channel_].insert(this);
+    channels_locker.unlock();
+}
+
+bool WebSocketSession::append_input(const char* data, size_t length) {
+    if (in_.size() + length > WS_MAX_INPUT) {
+        return false;
+    }
+    in_.append(data, length);
+    return true;
+}
+
+bool WebSocketSession::process_input() {
+    size_t pos = 0;
+    bool ok = true;
+    while (!close_sent_) {
+        size_t available = in_.size() - pos;
+        if (available < 2) {
+            break;
+        }
+        const uint8_t* p = (const uint8_t*) in_.data() + pos;
+        bool fin = (p[0] & 0x80) != 0;
+        uint8_t opcode = p[0] & 0x0f;
+        uint64_t length = p[1] & 0x7f;
+        size_t header = 2;
+        // 没有协商扩展，RSV位必须为0；客户端的帧必须加掩码
+        if ((p[0] & 0x70) != 0 || (p[1] & 0x80) == 0) {
+            ok = fail(1002);
+            break;
+        }
+        if (length == 126) {
+            if (available < 4) {
+                break;
+            }
+            length = ((uint64_t) p[2] << 8) | p[3];
+            header = 4;
+        }
+        else if (length == 127) {
+            if (available < 10) {
+                break;
+            }
+            length = 0;
+            for (int i = 2; i < 10; ++i) {
+                length = (length << 8) | p[i];
+            }
+            header = 10;
+        }
+        if (length > WS_MAX_MESSAGE) {
+            ok = fail(1009);
+            break;
+        }
+        if (available < header + 4 + length) {
+            break;
+        }
+        uint32_t mask;
+        memcpy(&mask, p + header, 4);
+        char* payload = &in_[pos + header + 4];
+        ws_unmask(payload, length, mask);
+        pos += header + 4 + length;
+        ping_outstanding_ = false;
+        if (!handle_frame(opcode, fin, payload, length)) {
+            ok = false;
+            break;
+        }
+    }
+    if (close_sent_) {
+        in_.clear();
+    }
+    else {
+        in_.erase(0, pos);
+    }
+    return ok;
+}
+
+bool WebSocketSession::handle_frame(uint8_t opcode, bool fin, char* payload, size_t length) {
+    if (opcode & 0x8) {
+        // 控制帧可以插在分片之间，但自身不能分片
+        if (!fin || length > 125) {
+            return fail(1002);
+        }
+        switch (opcode) {
+            case WS_PING: {
+                post(make_frame(WS_PONG, payload, length));
+                return true;
+            }
+            case WS_PONG: {
+                return true;
+            }
+            case WS_CLOSE: {
+                if (length == 1) {
+                    return fail(1002);
+                }
+                if (length >= 2) {
+                    uint16_t code = (uint16_t) (((uint8_t) payload[0] << 8) | (uint8_t) payload[1]);
+                    if (!valid_close_code(code)) {
+                        return fail(1002);
+                    }
+                    if (!valid_utf8((const uint8_t*) payload + 2, length - 2)) {
+                        return fail(1007);
+                    }
+                }
+                // 回送对端的状态码，之后关闭连接
+                send_close(payload, length >= 2 ? 2 : 0);
+                return true;
+            }
+            default: {
+                return fail(1002);
+            }
+        }
+    }
+    if (opcode == WS_CONTINUATION) {
+        if (message_opcode_ == WS_CONTINUATION) {
+            return fail(1002);
+        }
+        if (message_.size() + length > WS_MAX_MESSAGE) {
+            return fail(1009);
+        }
+        message_.append(payload, length);
+        if (!fin) {
+            return true;
+        }
+        bool ok = deliver(message_opcode_, message_.data(), message_.size());
+        message_.clear();
+        message_opcode_ = WS_CONTINUATION;
+        return ok;
+    }
+    if ((opcode != WS_TEXT && opcode != WS_BINARY) || message_opcode_ != WS_CONTINUATION) {
+        return fail(1002);
+    }
+    if (!fin) {
+        message_opcode_ = opcode;
+        message_.assign(payload, length);
+        return true;
+    }
+    return deliver(opcode, payload, length);
+}
+
+bool WebSocketSession::deliver(uint8_t opcode, const char* data, size_t length) {
+    if (opcode == WS_TEXT && !valid_utf8((const uint8_t*) data, length)) {
+        return fail(1007);
+    }
+    ++messages;
+    if (handler != nullptr) {
+        handler(this, opcode == WS_BINARY, data, length);
+    }
+    return true;
+}
+
+bool WebSocketSession::fail(uint16_t code) {
+    char payload[2] = {(char) (code >> 8), (char) code};
+    send_close(payload, 2);
+    return false;
+}
+
+void WebSocketSession::send_close(const char* payload, size_t length) {
+    post(make_frame(WS_CLOSE, payload, length));
+    close_sent_ = true;
+}
+
+void WebSocketSession::post(const WsFrame& frame) {
+    lock_.lock();
+    if (out_bytes_ + frame->size() > WS_MAX_OUTPUT) {
+        overflow_ = true;
+    }
+    else {
+        out_.push_back(frame);
+        out_bytes_ += frame->size();
+    }
+    if (parked_) {
+        // 连接在epoll中等待，改为同时监听可写；ONESHOT保证只会触发一次
+        modfd(epoll_fd_, fd_, handle_, EPOLLIN | EPOLLOUT);
+    }
+    lock_.unlock();
+}
+
+bool WebSocketSession::keepalive_ping() {
+    if (ping_outstanding_.exchange(true)) {
+        return false;
+    }
+    post(make_frame(WS_PING, nullptr, 0));
+    return true;
+}
+
+int WebSocketSession::gather(struct iovec* iov, int max) {
+    int count = 0;
+    lock_.lock();
+    size_t offset = out_sent_;
+    // 队列中的帧只由持有连接的线程弹出，解锁后这些指针仍然有效
+    for (std::deque<WsFrame>::iterator it = out_.begin(); it != out_.end() && count < max; ++it) {
+        iov[count].iov_base = (void*) ((*it)->data() + offset);
+        iov[count].iov_len = (*it)->size() - offset;
+        offset = 0;
+        ++count;
+    }
+    lock_.unlock();
+    return count;
+}
+
+void WebSocketSession::consume(size_t n) {
+    lock_.lock();
+    out_bytes_ -= n;
+    while (n > 0) {
+        size_t left = out_.front()->size() - out_sent_;
+        if (n < left) {
+            out_sent_ += n;
+            break;
+        }
+        n -= left;
+        out_.pop_front();
+        out_sent_ = 0;
+    }
+    lock_.unlock();
+}
+
+bool WebSocketSession::finished() {
+    lock_.lock();
+    bool done = overflow_ || (close_sent_ && out_.empty());
+    lock_.unlock();
+    return done;
+}
+
+void WebSocketSession::park() {
+    lock_.lock();
+    parked_ = true;
+    modfd(epoll_fd_, fd_, handle_, out_.empty() && !overflow_ ? EPOLLIN : EPOLLIN | EPOLLOUT);
+    lock_.unlock();
+}
+
+bool WebSocketSession::claim() {
+    lock_.lock();
+    bool parked = parked_;
+    parked_ = false;
+    lock_.unlock();
+    return parked;
+}
@@ -0,0 +1,117 @@
+#ifndef HTTP_SERVER_WEBSOCKET_H
+#define HTTP_SERVER_WEBSOCKET_H
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+
+#include "connection_slab.h"
+#include "locker.h"
+
+// RFC 6455握手中拼接在Sec-WebSocket-Key之后的固定串
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+// 单条消息(含所有分片)的上限，超过以1009关闭
+#define WS_MAX_MESSAGE (1 << 20)
+// 未处理输入的上限
+#define WS_MAX_INPUT (WS_MAX_MESSAGE + 16 * 1024)
+// 待发送数据超过它说明订阅者跟不上广播，断开该连接
+#define WS_MAX_OUTPUT (4 << 20)
+// 一次writev最多聚集的帧数
+#define WS_IOV_MAX 64
+
+enum WsOpcode {
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xa
+};
+
+// 序列化好的服务端帧，广播时所有订阅连接共享同一份
+typedef std::shared_ptr<const std::string> WsFrame;
+
+class WebSocketSession;
+// 收到一条完整的数据消息，在处理该连接的工作线程中调用
+typedef void (*WsMessageHandler)(WebSocketSession* session, bool binary, const char* data,
+                                 size_t length);
+
+// 按掩码键异或负载，一次处理一个向量寄存器宽度；mask为按网络字节序读入内存的4字节
+void ws_unmask(char* data, size_t length, uint32_t mask);
+
+// 一个WebSocket连接的帧引擎。输入由主线程读入、工作线程处理(EPOLLONESHOT保证独占)；
+// 输出队列可能被其他连接的广播写入，由lock_保护
+class WebSocketSession {
+public:
+    // channel为升级请求的目标，同一目标的连接互相接收广播
+    WebSocketSession(const std::string& channel, int epoll_fd, int fd, ConnHandle handle);
+    ~WebSocketSession();
+
+    // 由Sec-WebSocket-Key计算Sec-WebSocket-Accept，key格式不对返回false
+    static bool accept_key(const std::string& key, std::string* accept);
+    static WsFrame make_frame(WsOpcode opcode, const char* data, size_t length);
+    // 向同一频道的所有连接发送同一帧，返回接收的连接数
+    static size_t broadcast(const std::string& channel, const WsFrame& frame);
+
+    // 排入101响应并加入频道
+    void start(const std::string& accept);
+    bool append_input(const char* data, size_t length);
+    // 工作线程：处理所有完整的帧，出错时排入关闭帧并返回false
+    bool process_input();
+    // 任意线程：排入一帧，连接空闲时唤醒它发送
+    void post(const WsFrame& frame);
+    // 空闲超时时发送一次ping，上次的ping之后仍无任何输入返回false
+    bool keepalive_ping();
+
+    // 聚集待发送的帧，返回iovec个数
+    int gather(struct iovec* iov, int max);
+    void consume(size_t n);
+    // 连接可以关闭：已发出关闭帧，或订阅者积压过多
+    bool finished();
+    // 处理结束，重新注册事件；有待发送数据时同时监听可写
+    void park();
+    // 主线程取到该连接的事件；重复的事件(广播唤醒与事件同时发生)返回false
+    bool claim();
+
+    const std::string& channel() const { return channel_; }
+
+    static WsMessageHandler handler;
+    static std::atomic<uint64_t> sessions;
+    static std::atomic<uint64_t> messages;
+    static std::atomic<uint64_t> broadcasts;
+    // 广播共享帧被排入的次数
+    static std::atomic<uint64_t> shared_frames;
+
+private:
+    bool handle_frame(uint8_t opcode, bool fin, char* payload, size_t length);
+    bool deliver(uint8_t opcode, const char* data, size_t length);
+    // 发送关闭帧后不再处理输入
+    bool fail(uint16_t code);
+    void send_close(const char* payload, size_t length);
+
+    std::string channel_;
+    int epoll_fd_;
+    int fd_;
+    ConnHandle handle_;
+    std::string in_;
+    // 正在接收的分片消息
+    std::string message_;
+    uint8_t message_opcode_;
+    bool close_sent_;
+    std::atomic<bool> ping_outstanding_;
+
+    Locker lock_;
+    std::deque<WsFrame> out_;
+    size_t out_sent_;   // 队首帧已发送的字节数
+    size_t out_bytes_;
+    bool overflow_;
+    bool parked_;
+};
+
+#endif
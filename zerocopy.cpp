@@ -0,0 +1,136 @@
+#include "zerocopy.h"
+
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <utility>
+#include <vector>
+
+#include "locker.h"
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+std::atomic<uint64_t> ZeroCopySender::sends(0);
+std::atomic<uint64_t> ZeroCopySender::bytes(0);
+std::atomic<uint64_t> ZeroCopySender::completions(0);
+std::atomic<uint64_t> ZeroCopySender::copied(0);
+std::atomic<uint64_t> ZeroCopySender::fallbacks(0);
+
+// 已关闭连接留下的引用，按放入顺序排列
+struct AbandonedPins {
+    Locker locker;
+    std::deque<std::pair<uint64_t, std::shared_ptr<const void> > > pins;
+};
+
+static AbandonedPins abandoned;
+
+uint64_t monotonic_ms();
+
+bool ZeroCopySender::usable(int fd) {
+    if (state_ == ZC_UNKNOWN) {
+        int one = 1;
+        state_ = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0 ? ZC_ON : ZC_OFF;
+    }
+    return state_ == ZC_ON;
+}
+
+ssize_t ZeroCopySender::send(int fd, const struct iovec* iov, const OutputSegment* const* segments,
+                             int count) {
+    msghdr msg{};
+    msg.msg_iov = const_cast<struct iovec*>(iov);
+    msg.msg_iovlen = count;
+    ssize_t n = sendmsg(fd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+    if (n < 0) {
+        if (errno != ENOBUFS) {
+            return n;
+        }
+        // 钉住的页超过了socket的optmem上限，这一次拷贝发送
+        ++fallbacks;
+        return sendmsg(fd, &msg, MSG_NOSIGNAL);
+    }
+    // 发出了字节的段都可能被内核引用
+    uint32_t seq = next_seq_++;
+    size_t left = (size_t) n;
+    for (int i = 0; i < count && left > 0; ++i) {
+        pins_.push_back(Pin{seq, segments[i]->cached, segments[i]->file});
+        left -= std::min(left, iov[i].iov_len);
+    }
+    ++sends;
+    bytes += n;
+    return n;
+}
+
+bool ZeroCopySender::reap(int fd) {
+    for (;;) {
+        char control[128];
+        msghdr msg{};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            return errno == EAGAIN;
+        }
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            const sock_extended_err* err = (const sock_extended_err*) CMSG_DATA(cm);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+                return false;
+            }
+            // 通知覆盖序号区间[lo, hi]，序号会回绕
+            uint32_t lo = err->ee_info;
+            uint32_t hi = err->ee_data;
+            ++completions;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // 内核还是拷贝了，零拷贝只多了通知的开销
+                ++copied;
+                state_ = ZC_OFF;
+            }
+            for (std::deque<Pin>::iterator it = pins_.begin(); it != pins_.end();) {
+                if (it->seq - lo <= hi - lo) {
+                    it = pins_.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+        }
+    }
+}
+
+void ZeroCopySender::abandon() {
+    if (pins_.empty()) {
+        return;
+    }
+    uint64_t deadline = monotonic_ms() + ZEROCOPY_LINGER_MS;
+    abandoned.locker.lock();
+    for (size_t i = 0; i < pins_.size(); ++i) {
+        if (pins_[i].cached) {
+            abandoned.pins.push_back(std::make_pair(deadline, std::shared_ptr<const void>(pins_[i].cached)));
+        }
+        if (pins_[i].file) {
+            abandoned.pins.push_back(std::make_pair(deadline, std::shared_ptr<const void>(pins_[i].file)));
+        }
+    }
+    abandoned.locker.unlock();
+    pins_.clear();
+}
+
+void ZeroCopySender::release_abandoned(uint64_t now_ms) {
+    // 在锁外析构，释放文件映射可能较慢
+    std::vector<std::shared_ptr<const void> > expired;
+    abandoned.locker.lock();
+    while (!abandoned.pins.empty() && abandoned.pins.front().first <= now_ms) {
+        expired.push_back(std::move(abandoned.pins.front().second));
+        abandoned.pins.pop_front();
+    }
+    abandoned.locker.unlock();
+}
@@ -0,0 +1,58 @@
+#ifndef HTTP_SERVER_ZEROCOPY_H
+#define HTTP_SERVER_ZEROCOPY_H
+
+#include <sys/uio.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+
+#include "output_queue.h"
+
+// 连接关闭时还没收到完成通知的引用，再保留这么久才释放：
+// 关闭后内核仍会把发送队列发完，通知却再也收不到了
+#define ZEROCOPY_LINGER_MS 60000
+
+// 一条连接的MSG_ZEROCOPY发送：内核直接引用用户页，发送返回后数据仍不能改动或释放，
+// 所以每次发送覆盖到的段的引用(缓存条目、文件映射)按发送序号钉住，
+// 错误队列中的完成通知到达后才放开。只在持有连接的线程上使用
+class ZeroCopySender {
+public:
+    ZeroCopySender() : state_(ZC_UNKNOWN), next_seq_(0) {}
+
+    // 这条连接还能零拷贝发送：第一次调用时打开SO_ZEROCOPY，失败或内核改为拷贝后不再使用
+    bool usable(int fd);
+    // 以MSG_ZEROCOPY发送，语义同writev；segments给出每个iovec所属的段。
+    // 内核缓冲不足(ENOBUFS)时退回普通发送
+    ssize_t send(int fd, const struct iovec* iov, const OutputSegment* const* segments, int count);
+    // 取出错误队列中的完成通知并放开引用；遇到真正的socket错误返回false
+    bool reap(int fd);
+    bool pending() const { return !pins_.empty(); }
+    // 连接关闭：还钉着的引用交给全局表，ZEROCOPY_LINGER_MS后释放
+    void abandon();
+    // 主线程定时调用
+    static void release_abandoned(uint64_t now_ms);
+
+    static std::atomic<uint64_t> sends;
+    static std::atomic<uint64_t> bytes;
+    static std::atomic<uint64_t> completions;
+    // 内核实际做了拷贝(例如回环或不支持的网卡)的完成通知数，之后该连接改回普通发送
+    static std::atomic<uint64_t> copied;
+    static std::atomic<uint64_t> fallbacks;
+
+private:
+    enum State { ZC_UNKNOWN, ZC_ON, ZC_OFF };
+    struct Pin {
+        uint32_t seq;
+        CachedResponsePtr cached;
+        std::shared_ptr<StaticFile> file;
+    };
+
+    State state_;
+    // 下一次零拷贝发送的序号，与内核对这个socket的计数一致
+    uint32_t next_seq_;
+    std::deque<Pin> pins_;
+};
+
+#endif